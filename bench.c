@@ -0,0 +1,525 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * End-to-end benchmark in one process, without a network: synthetic
+ * frames from the pattern capture backend are converted, encoded and
+ * framed as sc_vaapi_encode does, written to a pipe, and read back,
+ * decoded and copied out as vaapi_decode does on a second thread. Each
+ * combination of codec, resolution, frame rate and encoder backend runs
+ * for a fixed number of frames; the results go out as a JSON array, one
+ * object per run, and a summary goes to stderr.
+ */
+
+#define _GNU_SOURCE                 // F_SETPIPE_SZ
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "ll_capture.h"
+#include "ll_convert.h"
+#include "ll_encoder.h"
+#include "ll_latency.h"
+#include "ll_pool.h"
+#include "ll_wire.h"
+
+#define STAMP_RING  16
+#define MAX_RUNS    64
+
+typedef struct BenchRun {
+    enum AVCodecID codec_id;
+    const char *encoder;
+    int width, height, fps;
+    int64_t bitrate;            // 0 for constant quality
+    int64_t frames;
+    int warmup;                 // frames left out of the latency figures
+    int hwdec;
+
+    // receiver
+    FILE *rx;
+    pthread_t thread;
+    AVBufferRef *hw_device_ctx;
+    int64_t stamps[STAMP_RING][LL_STAGE_NB];
+    LLLatencyStats latency;
+    int64_t frames_out;
+    int64_t wire_bytes;
+    int rx_ret;
+} BenchRun;
+
+static int64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int parse_list(char *s, int *list, int max)
+{
+    int n = 0;
+
+    for (char *tok = strtok(s, ","); tok && n < max; tok = strtok(NULL, ","))
+        list[n++] = atoi(tok);
+    return n;
+}
+
+static int open_decoder(BenchRun *b, AVCodecContext **pctx, int codec)
+{
+    AVCodec *decoder;
+    int ret;
+
+    if (!(decoder = avcodec_find_decoder(ll_wire_codec_id(codec)))) {
+        fprintf(stderr, "Unsupported codec %d in stream\n", codec);
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+    if (!(*pctx = avcodec_alloc_context3(decoder)))
+        return AVERROR(ENOMEM);
+    if (b->hwdec) {
+        if (!b->hw_device_ctx &&
+            (ret = av_hwdevice_ctx_create(&b->hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0)) < 0) {
+            fprintf(stderr, "Failed to create a VAAPI device.\n");
+            return ret;
+        }
+        (*pctx)->hw_device_ctx = av_buffer_ref(b->hw_device_ctx);
+    }
+    (*pctx)->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    if ((ret = avcodec_open2(*pctx, decoder, NULL)) < 0) {
+        fprintf(stderr, "Failed to open codec %s\n", decoder->name);
+        return ret;
+    }
+    return 0;
+}
+
+// Decode, download and copy out, as vaapi_decode does without the file
+static int decode_frames(BenchRun *b, AVCodecContext *avctx, AVPacket *pkt, AVFrame *frame,
+                         AVFrame *sw_frame, uint8_t **out_buf, unsigned int *out_size)
+{
+    AVFrame *out;
+    int64_t *stamps;
+    int ret, size;
+
+    if ((ret = avcodec_send_packet(avctx, pkt)) < 0)
+        return ret;
+    while (!(ret = avcodec_receive_frame(avctx, frame))) {
+        stamps = b->stamps[frame->best_effort_timestamp & (STAMP_RING - 1)];
+        ll_stamp(stamps, LL_STAGE_DECODE);
+        out = frame;
+        if (frame->format == AV_PIX_FMT_VAAPI) {
+            if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0)
+                return ret;
+            ll_stamp(stamps, LL_STAGE_DOWNLOAD);
+            out = sw_frame;
+        }
+        size = av_image_get_buffer_size(out->format, out->width, out->height, 1);
+        av_fast_malloc(out_buf, out_size, size);
+        if (!*out_buf)
+            return AVERROR(ENOMEM);
+        if ((ret = av_image_copy_to_buffer(*out_buf, size, (const uint8_t * const *)out->data,
+                                           out->linesize, out->format, out->width, out->height, 1)) < 0)
+            return ret;
+        ll_stamp(stamps, LL_STAGE_OUTPUT);
+        if (frame->best_effort_timestamp >= b->warmup)
+            ll_latency_record(&b->latency, stamps);
+        memset(stamps, 0, sizeof(b->stamps[0]));
+        b->frames_out++;
+        av_frame_unref(frame);
+        av_frame_unref(sw_frame);
+    }
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static void *receive_thread(void *arg)
+{
+    BenchRun *b = arg;
+    AVCodecContext *avctx = NULL;
+    AVFrame *frame = av_frame_alloc(), *sw_frame = av_frame_alloc();
+    AVPacket pkt;
+    LLWireHeader hdr;
+    uint8_t *buf = NULL, *pkt_buf = NULL, *params = NULL, *out_buf = NULL;
+    unsigned int buf_size = 0, pkt_buf_size = 0, params_alloc = 0, out_size = 0;
+    int params_size = 0;
+    int ret = AVERROR(ENOMEM);
+
+    if (!frame || !sw_frame)
+        goto end;
+    while ((ret = ll_wire_read(b->rx, &hdr, &buf, &buf_size)) >= 0) {
+        ll_stamp(hdr.stamps, LL_STAGE_RECEIVE);
+        b->wire_bytes += hdr.header_size + hdr.size;
+        // Parameter sets go in front of the frame that follows them; AV1
+        // keyframes carry their own
+        if (hdr.type == LL_WIRE_PARAMS) {
+            if (hdr.codec == LL_WIRE_CODEC_AV1)
+                continue;
+            av_fast_malloc(&params, &params_alloc, hdr.size);
+            if (!params) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            memcpy(params, buf, hdr.size);
+            params_size = hdr.size;
+            continue;
+        }
+        if (hdr.type != LL_WIRE_FRAME)
+            continue;
+        if (!avctx && (ret = open_decoder(b, &avctx, hdr.codec)) < 0)
+            break;
+
+        av_init_packet(&pkt);
+        if (params_size) {
+            av_fast_padded_malloc(&pkt_buf, &pkt_buf_size, params_size + hdr.size);
+            if (!pkt_buf) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            memcpy(pkt_buf, params, params_size);
+            memcpy(pkt_buf + params_size, buf, hdr.size);
+            pkt.data = pkt_buf;
+            pkt.size = params_size + hdr.size;
+            params_size = 0;
+        } else {
+            pkt.data = buf;
+            pkt.size = hdr.size;
+        }
+        pkt.pts = pkt.dts = hdr.pts;
+        memcpy(b->stamps[hdr.pts & (STAMP_RING - 1)], hdr.stamps, sizeof(hdr.stamps));
+        if ((ret = decode_frames(b, avctx, &pkt, frame, sw_frame, &out_buf, &out_size)) < 0) {
+            fprintf(stderr, "Error while decoding: %s\n", av_err2str(ret));
+            break;
+        }
+    }
+    if (avctx)
+        decode_frames(b, avctx, NULL, frame, sw_frame, &out_buf, &out_size);
+
+end:
+    b->rx_ret = ret == AVERROR_EOF ? 0 : ret;
+    // Keep the sender from blocking on a pipe nobody reads any more
+    while (fread(buf ? buf : (uint8_t *)&hdr, 1, buf ? buf_size : sizeof(hdr), b->rx) > 0)
+        ;
+    avcodec_free_context(&avctx);
+    av_frame_free(&frame);
+    av_frame_free(&sw_frame);
+    av_free(buf);
+    av_free(pkt_buf);
+    av_free(params);
+    av_free(out_buf);
+    return NULL;
+}
+
+// At the configured frame rate, whatever the pace of the run
+static double kbps(const BenchRun *b, const LLEncoder *enc)
+{
+    return enc->n_bytes * 8.0 * b->fps / FFMAX(enc->n_packets, 1) / 1e3;
+}
+
+static void write_result(FILE *f, const BenchRun *b, const LLEncoder *enc,
+                         double seconds, double cpu_seconds, const char *error)
+{
+    fprintf(f, "{\"codec\":\"%s\",\"encoder\":\"%s\",\"width\":%d,\"height\":%d,\"fps\":%d,"
+               "\"target_kbps\":%lld,",
+            avcodec_get_name(b->codec_id), enc ? enc->backend->name : b->encoder,
+            b->width, b->height, b->fps, (long long)(b->bitrate / 1000));
+    if (error) {
+        fprintf(f, "\"error\":\"%s\"}", error);
+        return;
+    }
+    fprintf(f, "\"frames_in\":%lld,\"frames_out\":%lld,\"seconds\":%.3f,\"throughput_fps\":%.2f,"
+               "\"cpu_seconds\":%.3f,\"cpu_ms_per_frame\":%.3f,\"cpu_load\":%.3f,"
+               "\"bytes_per_frame\":%.0f,\"kbps\":%.0f,\"wire_bytes_per_frame\":%.0f,"
+               "\"max_frame_bytes\":%lld,\"keyframes\":%lld,\"latency\":",
+            (long long)b->frames, (long long)b->frames_out, seconds, b->frames_out / seconds,
+            cpu_seconds, cpu_seconds * 1e3 / FFMAX(b->frames_out, 1), cpu_seconds / seconds,
+            (double)enc->n_bytes / FFMAX(enc->n_packets, 1), kbps(b, enc),
+            (double)b->wire_bytes / FFMAX(b->frames_out, 1), (long long)enc->max_bytes,
+            (long long)enc->n_keyframes);
+    ll_latency_export(&b->latency, f);
+    fprintf(f, "}");
+}
+
+static void print_summary(const BenchRun *b, const LLEncoder *enc, double seconds, double cpu_seconds)
+{
+    fprintf(stderr, "%-4s %-8s %4dx%-4d @%3d: %6.1f fps, %6.2f ms CPU/frame, %7.1f kB/frame, "
+                    "%6.0f kbps, latency p50 %6.2f p99 %6.2f ms\n",
+            avcodec_get_name(b->codec_id), enc->backend->name, b->width, b->height, b->fps,
+            b->frames_out / seconds, cpu_seconds * 1e3 / FFMAX(b->frames_out, 1),
+            enc->n_bytes / 1e3 / FFMAX(enc->n_packets, 1), kbps(b, enc),
+            ll_histogram_percentile(&b->latency.total, 50) / 1e3,
+            ll_histogram_percentile(&b->latency.total, 99) / 1e3);
+}
+
+static int run(BenchRun *b, FILE *json)
+{
+    LLCaptureConfig capture = { .backend = "pattern", .format = AV_PIX_FMT_NONE };
+    LLEncoderConfig cfg = { 0 };
+    LLCapture *cap = NULL;
+    LLEncoder *enc = NULL;
+    LLConvert convert = { 0 };
+    LLFramePool pool = { 0 };
+    LLWireWriter writer = { 0 };
+    struct SwsContext *sws = NULL;
+    AVFrame *src = av_frame_alloc(), *dst = av_frame_alloc();
+    FILE *tx = NULL;
+    int fds[2] = { -1, -1 }, started = 0, skip = 0;
+    int64_t t0, cpu0;
+    const char *error = NULL;
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    int ret;
+
+    capture.width  = cfg.width  = b->width;
+    capture.height = cfg.height = b->height;
+    capture.fps    = cfg.fps    = b->fps;
+    cfg.codec_id = b->codec_id;
+    cfg.backend  = b->encoder;
+    cfg.gop_size = 1;
+    cfg.bitrate  = b->bitrate;
+    ll_latency_init(&b->latency, 0);
+    b->frames_out = b->wire_bytes = 0;
+
+    if (!src || !dst) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = ll_capture_open(&cap, &capture)) < 0) {
+        error = "capture";
+        goto end;
+    }
+    if ((ret = ll_encoder_open(&enc, &cfg)) < 0) {
+        // Reported, but not a failure: hosts without a GPU or the library
+        error = "encoder unavailable";
+        skip = 1;
+        goto end;
+    }
+    if (enc->backend->sw_format != AV_PIX_FMT_NV12 ||
+        ll_convert_init(&convert, cap->format, b->width, b->height, AVCOL_SPC_SMPTE170M, 4) < 0) {
+        if (!(sws = sws_getContext(b->width, b->height, cap->format, b->width, b->height,
+                                   enc->backend->sw_format, 0, NULL, NULL, NULL))) {
+            ret = AVERROR(ENOSYS);
+            goto end;
+        }
+    }
+    if ((ret = ll_frame_pool_init(&pool, enc->backend->sw_format, b->width, b->height,
+                                  2 + LL_ENCODER_MAX_DELAY)) < 0)
+        goto end;
+
+    // The pipe stands in for the network, deep enough for a whole 4K frame
+    if (pipe(fds) < 0 || !(tx = fdopen(fds[1], "wb"))) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    fds[1] = -1;
+    if (!(b->rx = fdopen(fds[0], "rb"))) {
+        ret = AVERROR(errno);
+        goto end;
+    }
+    fds[0] = -1;
+    fcntl(fileno(tx), F_SETPIPE_SZ, 1 << 20);
+    ll_wire_writer_init(&writer, tx, ll_wire_codec_from_id(b->codec_id));
+    if ((ret = pthread_create(&b->thread, NULL, receive_thread, b))) {
+        ret = AVERROR(ret);
+        goto end;
+    }
+    started = 1;
+
+    t0   = ll_time_ns();
+    cpu0 = cpu_ns();
+    for (int64_t n = 0; n < b->frames; n++) {
+        LLFrameInfo info = { { 0 } };
+
+        if ((ret = ll_capture_read(cap, src)) < 0)
+            break;
+        ll_stamp(info.stamps, LL_STAGE_CAPTURE);
+        if ((ret = ll_frame_pool_get_buffer(&pool, dst)) < 0)
+            break;
+        if (sws)
+            sws_scale(sws, (const uint8_t * const *)src->data, src->linesize, 0, b->height,
+                      dst->data, dst->linesize);
+        else if ((ret = ll_convert_frame(&convert, src, dst)) < 0)
+            break;
+        ll_stamp(info.stamps, LL_STAGE_CONVERT);
+        av_frame_unref(src);
+
+        dst->pts = n;
+        ret = ll_encoder_encode(enc, dst, &info, ll_wire_write_packet, &writer);
+        av_frame_unref(dst);
+        if (ret < 0)
+            break;
+    }
+    if (ret >= 0)
+        ret = ll_encoder_encode(enc, NULL, NULL, ll_wire_write_packet, &writer);
+    fclose(tx);
+    tx = NULL;
+    pthread_join(b->thread, NULL);
+    started = 0;
+
+    if (ret >= 0 && (ret = b->rx_ret) >= 0) {
+        double seconds = (ll_time_ns() - t0) / 1e9, cpu_seconds = (cpu_ns() - cpu0) / 1e9;
+        print_summary(b, enc, seconds, cpu_seconds);
+        write_result(json, b, enc, seconds, cpu_seconds, NULL);
+    }
+
+end:
+    if (tx)
+        fclose(tx);
+    if (started)
+        pthread_join(b->thread, NULL);
+    if (b->rx)
+        fclose(b->rx);
+    b->rx = NULL;
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    if (ret < 0 && !error)
+        error = av_make_error_string(errbuf, sizeof(errbuf), ret);
+    if (error) {
+        fprintf(stderr, "%s %s %dx%d @%d: %s\n", avcodec_get_name(b->codec_id), b->encoder,
+                b->width, b->height, b->fps, error);
+        write_result(json, b, enc, 0, 0, error);
+    }
+    ll_wire_writer_free(&writer);
+    ll_frame_pool_uninit(&pool);
+    ll_convert_free(&convert);
+    sws_freeContext(sws);
+    ll_encoder_close(&enc);
+    ll_capture_close(&cap);
+    av_buffer_unref(&b->hw_device_ctx);
+    av_frame_free(&src);
+    av_frame_free(&dst);
+    return skip ? 0 : ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char sizes_arg[256] = "1280x720,1920x1080", fps_arg[64] = "30,60";
+    char encoders_arg[64] = "vaapi,x264,openh264,x265,svtav1", codecs_arg[64] = "h264";
+    const char *output = "-";
+    int widths[16], heights[16], fps[16], nb_sizes = 0, nb_fps, nb_encoders = 0, nb_codecs = 0;
+    const char *encoders[8];
+    enum AVCodecID codecs[4];
+    const AVCodecDescriptor *desc;
+    int64_t frames = 300, bitrate = 0;
+    int warmup = 10, hwdec = 0, nb_runs = 0, failed = 0;
+    FILE *json;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:s:f:e:b:n:w:o:D")) != -1) {
+        switch (opt) {
+        case 'c':
+            snprintf(codecs_arg, sizeof(codecs_arg), "%s", optarg);
+            break;
+        case 's':
+            snprintf(sizes_arg, sizeof(sizes_arg), "%s", optarg);
+            break;
+        case 'f':
+            snprintf(fps_arg, sizeof(fps_arg), "%s", optarg);
+            break;
+        case 'e':
+            snprintf(encoders_arg, sizeof(encoders_arg), "%s", optarg);
+            break;
+        case 'b':
+            bitrate = atoll(optarg) * 1000;
+            break;
+        case 'n':
+            frames = atoll(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'D':
+            hwdec = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c h264|hevc|av1,...] [-s WxH,...] [-f fps,...] [-e encoder,...] [-b kbps] [-n frames] "
+                            "[-w warmup frames] [-D] [-o results.json]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    for (char *tok = strtok(sizes_arg, ","); tok && nb_sizes < 16; tok = strtok(NULL, ","))
+        if (sscanf(tok, "%dx%d", &widths[nb_sizes], &heights[nb_sizes]) == 2)
+            nb_sizes++;
+    nb_fps = parse_list(fps_arg, fps, 16);
+    for (char *tok = strtok(encoders_arg, ","); tok && nb_encoders < 8; tok = strtok(NULL, ","))
+        encoders[nb_encoders++] = tok;
+    for (char *tok = strtok(codecs_arg, ","); tok && nb_codecs < 4; tok = strtok(NULL, ",")) {
+        if (!(desc = avcodec_descriptor_get_by_name(tok)) || !ll_wire_codec_from_id(desc->id)) {
+            fprintf(stderr, "Unsupported codec: %s\n", tok);
+            return -1;
+        }
+        codecs[nb_codecs++] = desc->id;
+    }
+    if (!nb_sizes || !nb_fps || !nb_encoders || !nb_codecs || frames <= 0) {
+        fprintf(stderr, "Nothing to run\n");
+        return -1;
+    }
+    if (!(json = strcmp(output, "-") ? fopen(output, "w") : stdout)) {
+        fprintf(stderr, "Cannot open '%s'\n", output);
+        return -1;
+    }
+
+    fprintf(json, "[\n");
+    for (int c = 0; c < nb_codecs; c++) {
+        for (int e = 0; e < nb_encoders; e++) {
+            // The backends listed that have no encoder for this codec sit it out
+            if (strcmp(encoders[e], "auto") && !ll_encoder_find_backend(encoders[e], codecs[c]))
+                continue;
+            for (int s = 0; s < nb_sizes; s++) {
+                for (int r = 0; r < nb_fps && nb_runs < MAX_RUNS; r++) {
+                    BenchRun b = {
+                        .codec_id = codecs[c],
+                        .encoder  = encoders[e],
+                        .width    = widths[s],
+                        .height   = heights[s],
+                        .fps      = fps[r],
+                        .bitrate  = bitrate,
+                        .frames   = frames,
+                        .warmup   = warmup,
+                        .hwdec    = hwdec,
+                    };
+                    if (nb_runs++)
+                        fprintf(json, ",\n");
+                    failed += run(&b, json) < 0;
+                }
+            }
+        }
+    }
+    fprintf(json, "\n]\n");
+    if (json != stdout)
+        fclose(json);
+    return failed ? 1 : 0;
+}
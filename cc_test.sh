@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Congestion control test on one machine. The stream goes through
+# loss_shim, which halves the link capacity after 10 seconds. With -b the
+# sender follows the receiver's reports, so the latency vaapi_decode prints
+# every second should settle back down after the drop instead of growing
+# until the shim's queue overflows. Leave out -b to compare.
+
+height=1280
+width=720
+fps=60
+capacity=8000   # kbps
+bitrate=6000    # kbps, the encoder's ceiling
+
+./vaapi_decode -r 1 rtp://:9000 /dev/null &
+decoder=$!
+./loss_shim -r 1 -c ${capacity} -C 10:$((capacity / 2)) rtp://:9500 rtp://127.0.0.1:9000 &
+shim=$!
+sleep 0.5
+
+./sc_vaapi_encode -b ${bitrate} -n $((fps * 30)) -o rtp://127.0.0.1:9500 ${height} ${width} ${fps}
+
+wait ${decoder}
+kill -INT ${shim}
+wait ${shim}
@@ -0,0 +1,201 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Benchmark for the BGR0 to NV12 conversion on the push path: sws_scale
+ * as sc_vaapi_encode used to call it (flags 0, one thread) against the
+ * kernels in ll_convert.c, on one thread and on a band per thread.
+ *
+ * The source is a synthetic desktop: flat areas, gradients and noise.
+ * Every kernel must produce the same output as the scalar one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
+
+#include "ll_common.h"
+#include "ll_convert.h"
+
+typedef struct Size {
+    const char *name;
+    int width, height;
+} Size;
+
+static const char *impls[] = { "scalar", "sse4", "avx2" };
+
+static AVFrame *alloc_frame(enum AVPixelFormat format, int width, int height)
+{
+    AVFrame *frame = av_frame_alloc();
+
+    if (!frame)
+        return NULL;
+    frame->format = format;
+    frame->width  = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+        av_frame_free(&frame);
+    return frame;
+}
+
+static void fill_desktop(AVFrame *frame)
+{
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t *row = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++) {
+            int region = (x * 4 / frame->width) + 4 * (y * 2 / frame->height);
+            uint8_t *p = row + 4 * x;
+            switch (region & 3) {
+            case 0:                 // window background
+                p[0] = 0xf0; p[1] = 0xf0; p[2] = 0xf0;
+                break;
+            case 1:                 // gradient
+                p[0] = x; p[1] = y; p[2] = x + y;
+                break;
+            case 2:                 // photo-like noise
+                p[0] = rand(); p[1] = rand(); p[2] = rand();
+                break;
+            default:                // text-like stripes
+                p[0] = p[1] = p[2] = (y & 7) < 2 || (x % 9) < 2 ? 0x10 : 0xe0;
+                break;
+            }
+            p[3] = 0;
+        }
+    }
+}
+
+static int same_nv12(const AVFrame *a, const AVFrame *b)
+{
+    for (int y = 0; y < a->height; y++)
+        if (memcmp(a->data[0] + (ptrdiff_t)y * a->linesize[0],
+                   b->data[0] + (ptrdiff_t)y * b->linesize[0], a->width))
+            return 0;
+    for (int y = 0; y < (a->height + 1) / 2; y++)
+        if (memcmp(a->data[1] + (ptrdiff_t)y * a->linesize[1],
+                   b->data[1] + (ptrdiff_t)y * b->linesize[1], (a->width + 1) & ~1))
+            return 0;
+    return 1;
+}
+
+static void report(const Size *size, const char *impl, int threads, double ns, double sws_ns)
+{
+    printf("%-6s %-7s %2d threads %8.3f ms/frame %7.1f Mpixel/s %6.2fx sws_scale\n",
+           size->name, impl, threads, ns / 1e6, size->width * size->height / ns * 1e3,
+           sws_ns / ns);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, iterations = 100, threads = sysconf(_SC_NPROCESSORS_ONLN);
+    Size sizes[] = {
+        { "720p",  1280,  720 },
+        { "1080p", 1920, 1080 },
+        { "4K",    3840, 2160 },
+    };
+
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-t threads]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    srand(1);
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        Size *size = &sizes[i];
+        AVFrame *src = alloc_frame(AV_PIX_FMT_BGR0, size->width, size->height);
+        AVFrame *ref = alloc_frame(AV_PIX_FMT_NV12, size->width, size->height);
+        AVFrame *dst = alloc_frame(AV_PIX_FMT_NV12, size->width, size->height);
+        struct SwsContext *sws;
+        double sws_ns;
+        int64_t t0;
+
+        if (!src || !ref || !dst || !(sws = sws_getContext(size->width, size->height, AV_PIX_FMT_BGR0,
+                                                           size->width, size->height, AV_PIX_FMT_NV12,
+                                                           0, NULL, NULL, NULL))) {
+            fprintf(stderr, "Cannot set up %s\n", size->name);
+            return 1;
+        }
+        fill_desktop(src);
+
+        t0 = ll_time_ns();
+        for (int k = 0; k < iterations; k++)
+            sws_scale(sws, (const uint8_t * const *)src->data, src->linesize, 0, size->height,
+                      dst->data, dst->linesize);
+        sws_ns = (double)(ll_time_ns() - t0) / iterations;
+        report(size, "sws", 1, sws_ns, sws_ns);
+        sws_freeContext(sws);
+
+        for (int j = 0; j < (int)(sizeof(impls) / sizeof(impls[0])); j++) {
+            LLConvertFn fn = ll_convert_impl(impls[j]);
+
+            if (!fn) {
+                printf("%-6s %-7s unsupported on this CPU\n", size->name, impls[j]);
+                continue;
+            }
+            for (int n = 1; n <= threads; n = n < threads && n * 2 > threads ? threads : n * 2) {
+                LLConvert c;
+                double ns;
+                int used;
+
+                if (ll_convert_init(&c, AV_PIX_FMT_BGR0, size->width, size->height,
+                                    AVCOL_SPC_SMPTE170M, n) < 0) {
+                    fprintf(stderr, "Cannot set up the converter\n");
+                    return 1;
+                }
+                c.fn = fn;
+                t0 = ll_time_ns();
+                for (int k = 0; k < iterations; k++)
+                    ll_convert_frame(&c, src, j ? dst : ref);
+                ns = (double)(ll_time_ns() - t0) / iterations;
+                used = c.nb_threads;
+                ll_convert_free(&c);
+
+                if (j && !same_nv12(ref, dst)) {
+                    fprintf(stderr, "%s: %s disagrees with scalar\n", size->name, impls[j]);
+                    return 1;
+                }
+                report(size, impls[j], used, ns, sws_ns);
+                if (n == threads)
+                    break;
+            }
+        }
+        av_frame_free(&src);
+        av_frame_free(&ref);
+        av_frame_free(&dst);
+    }
+    return 0;
+}
@@ -0,0 +1,655 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavdevice/avdevice.h>
+#include <libavformat/avformat.h>
+#include <libavutil/common.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "ll_capture.h"
+#include "ll_common.h"
+#include "ll_pool.h"
+
+#define XSHM_MAX_SEGMENTS   32
+#define FILE_POOL_SIZE      8
+
+/*
+ * XShm: the X server copies the screen straight into shared memory that
+ * is also the frame's buffer. Each pooled buffer is a segment of its own,
+ * attached to the server once and reused for as long as the pool lives.
+ *
+ * Frames may outlive the capture, so the Display and the segments belong
+ * to an XShmDisplay that every segment's buffer holds a reference to:
+ * whichever of ll_capture_close and the last frame's unref comes last
+ * detaches the segments and closes the Display.
+ */
+typedef struct XShmSegment {
+    XShmSegmentInfo info;
+    XImage *image;
+    AVBufferRef *owner;         // the XShmDisplay
+} XShmSegment;
+
+typedef struct XShmDisplay {
+    Display *dpy;
+    XShmSegment segments[XSHM_MAX_SEGMENTS];
+    int nb_segments;
+} XShmDisplay;
+
+typedef struct XShmCapture {
+    AVBufferRef *display;
+    XShmDisplay *d;
+    Window root;
+    int x, y;
+    AVBufferPool *pool;
+    int size;
+} XShmCapture;
+
+#if LIBAVUTIL_VERSION_MAJOR < 57
+typedef int LLPoolSize;
+#else
+typedef size_t LLPoolSize;
+#endif
+
+static void xshm_free_display(void *opaque, uint8_t *data)
+{
+    XShmDisplay *d = (XShmDisplay *)data;
+
+    if (d->dpy)
+        XCloseDisplay(d->dpy);
+    av_free(d);
+}
+
+static void xshm_free_segment(void *opaque, uint8_t *data)
+{
+    XShmSegment *seg = opaque;
+    XShmDisplay *d = (XShmDisplay *)seg->owner->data;
+
+    XShmDetach(d->dpy, &seg->info);
+    shmdt(seg->info.shmaddr);
+    seg->image->data = NULL;
+    XDestroyImage(seg->image);
+    seg->image = NULL;
+    // May close the Display, so last
+    av_buffer_unref(&seg->owner);
+}
+
+static AVBufferRef *xshm_alloc_segment(void *opaque, LLPoolSize size)
+{
+    LLCapture *cap = opaque;
+    XShmCapture *x = cap->priv;
+    XShmDisplay *d = x->d;
+    XShmSegment *seg;
+    AVBufferRef *buf;
+    int screen = DefaultScreen(d->dpy);
+
+    if (d->nb_segments == XSHM_MAX_SEGMENTS)
+        return NULL;
+    seg = &d->segments[d->nb_segments];
+    if (!(seg->image = XShmCreateImage(d->dpy, DefaultVisual(d->dpy, screen),
+                                       DefaultDepth(d->dpy, screen), ZPixmap, NULL,
+                                       &seg->info, cap->width, cap->height)))
+        return NULL;
+    if ((seg->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600)) < 0) {
+        XDestroyImage(seg->image);
+        return NULL;
+    }
+    seg->info.shmaddr  = seg->image->data = shmat(seg->info.shmid, NULL, 0);
+    seg->info.readOnly = False;
+    // Marked for removal now, so it goes away with us whatever happens
+    shmctl(seg->info.shmid, IPC_RMID, NULL);
+    if (seg->info.shmaddr == (char *)-1 || !XShmAttach(d->dpy, &seg->info)) {
+        if (seg->info.shmaddr != (char *)-1)
+            shmdt(seg->info.shmaddr);
+        seg->image->data = NULL;
+        XDestroyImage(seg->image);
+        return NULL;
+    }
+    XSync(d->dpy, False);
+    if (!(seg->owner = av_buffer_ref(x->display))) {
+        XShmDetach(d->dpy, &seg->info);
+        shmdt(seg->info.shmaddr);
+        seg->image->data = NULL;
+        XDestroyImage(seg->image);
+        return NULL;
+    }
+    if (!(buf = av_buffer_create((uint8_t *)seg->info.shmaddr, size, xshm_free_segment, seg, 0))) {
+        xshm_free_segment(seg, NULL);
+        return NULL;
+    }
+    d->nb_segments++;
+    return buf;
+}
+
+static int xshm_open(LLCapture *cap, const LLCaptureConfig *cfg)
+{
+    XShmCapture *x;
+    XShmDisplay *d;
+    Display *dpy;
+    XImage *probe;
+    XShmSegmentInfo info;
+    int screen;
+
+    if (!(x = cap->priv = av_mallocz(sizeof(*x))))
+        return AVERROR(ENOMEM);
+    if (!(d = av_mallocz(sizeof(*d))))
+        return AVERROR(ENOMEM);
+    if (!(x->display = av_buffer_create((uint8_t *)d, sizeof(*d), xshm_free_display, NULL, 0))) {
+        av_free(d);
+        return AVERROR(ENOMEM);
+    }
+    x->d = d;
+    if (!(dpy = d->dpy = XOpenDisplay(cfg->source))) {
+        fprintf(stderr, "Cannot open X display %s\n", cfg->source ? cfg->source : "");
+        return AVERROR(EIO);
+    }
+    if (!XShmQueryExtension(dpy)) {
+        fprintf(stderr, "X server has no MIT-SHM extension\n");
+        return AVERROR(ENOSYS);
+    }
+    screen  = DefaultScreen(dpy);
+    x->root = RootWindow(dpy, screen);
+    x->x    = cfg->x;
+    x->y    = cfg->y;
+    cap->width  = cfg->width  ? cfg->width  : DisplayWidth(dpy, screen) - cfg->x;
+    cap->height = cfg->height ? cfg->height : DisplayHeight(dpy, screen) - cfg->y;
+
+    // Only the common little-endian 32-bit visuals map to one pixel format
+    if (!(probe = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
+                                  ZPixmap, NULL, &info, cap->width, cap->height)))
+        return AVERROR(ENOMEM);
+    x->size = probe->bytes_per_line * probe->height;
+    if (probe->bits_per_pixel != 32 || probe->byte_order != LSBFirst ||
+        probe->red_mask != 0xff0000 || probe->green_mask != 0xff00 || probe->blue_mask != 0xff) {
+        fprintf(stderr, "Unsupported X visual: %d bpp\n", probe->bits_per_pixel);
+        XDestroyImage(probe);
+        return AVERROR(ENOSYS);
+    }
+    XDestroyImage(probe);
+    cap->format = AV_PIX_FMT_BGR0;
+
+    if (!(x->pool = av_buffer_pool_init2(x->size, cap, xshm_alloc_segment, NULL)))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+static int xshm_read(LLCapture *cap, AVFrame *frame)
+{
+    XShmCapture *x = cap->priv;
+    XShmDisplay *d = x->d;
+    XShmSegment *seg = NULL;
+
+    if (!(frame->buf[0] = av_buffer_pool_get(x->pool)))
+        return AVERROR(ENOMEM);
+    for (int i = 0; i < d->nb_segments && !seg; i++)
+        if ((uint8_t *)d->segments[i].info.shmaddr == frame->buf[0]->data)
+            seg = &d->segments[i];
+    if (!seg || !XShmGetImage(d->dpy, x->root, seg->image, x->x, x->y, AllPlanes)) {
+        av_buffer_unref(&frame->buf[0]);
+        return AVERROR(EIO);
+    }
+    frame->format      = cap->format;
+    frame->width       = cap->width;
+    frame->height      = cap->height;
+    frame->data[0]     = frame->buf[0]->data;
+    frame->linesize[0] = seg->image->bytes_per_line;
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+static void xshm_close(LLCapture *cap)
+{
+    XShmCapture *x = cap->priv;
+
+    if (!x)
+        return;
+    /* The pool frees the segments as their frames come back, and the last
+     * one to go, or this, closes the Display */
+    av_buffer_pool_uninit(&x->pool);
+    av_buffer_unref(&x->display);
+}
+
+/*
+ * x11grab through libavdevice, for servers without MIT-SHM. The grabbed
+ * image arrives as a rawvideo packet, unwrapped by a decoder.
+ */
+typedef struct X11GrabCapture {
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *dec_ctx;
+    AVPacket *packet;
+    int stream;
+} X11GrabCapture;
+
+static int x11grab_open(LLCapture *cap, const LLCaptureConfig *cfg)
+{
+    X11GrabCapture *g;
+    AVDictionary *options = NULL;
+    AVCodec *codec;
+    const char *display = cfg->source ? cfg->source : getenv("DISPLAY");
+    char buf[64];
+    int ret;
+
+    if (!(g = cap->priv = av_mallocz(sizeof(*g))) || !(g->packet = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+    avdevice_register_all();
+
+    snprintf(buf, sizeof(buf), "%d", cfg->fps);
+    av_dict_set(&options, "framerate", buf, 0);
+    if (cfg->width && cfg->height) {
+        snprintf(buf, sizeof(buf), "%dx%d", cfg->width, cfg->height);
+        av_dict_set(&options, "video_size", buf, 0);
+    }
+    snprintf(buf, sizeof(buf), "%s+%d,%d", display ? display : ":0.0", cfg->x, cfg->y);
+    ret = avformat_open_input(&g->fmt_ctx, buf, av_find_input_format("x11grab"), &options);
+    av_dict_free(&options);
+    if (ret < 0) {
+        fprintf(stderr, "Couldn't open input stream.\n");
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(g->fmt_ctx, NULL)) < 0) {
+        fprintf(stderr, "Couldn't find stream information.\n");
+        return ret;
+    }
+    if ((g->stream = av_find_best_stream(g->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0)) < 0) {
+        fprintf(stderr, "Didn't find a video stream.\n");
+        return g->stream;
+    }
+    if (!(g->dec_ctx = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+    avcodec_parameters_to_context(g->dec_ctx, g->fmt_ctx->streams[g->stream]->codecpar);
+    if ((ret = avcodec_open2(g->dec_ctx, codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open codec.\n");
+        return ret;
+    }
+    cap->format = g->dec_ctx->pix_fmt;
+    cap->width  = g->dec_ctx->width;
+    cap->height = g->dec_ctx->height;
+    return 0;
+}
+
+static int x11grab_read(LLCapture *cap, AVFrame *frame)
+{
+    X11GrabCapture *g = cap->priv;
+    int ret;
+
+    do {
+        if ((ret = av_read_frame(g->fmt_ctx, g->packet)) < 0)
+            return ret;
+        ret = g->packet->stream_index == g->stream ? avcodec_send_packet(g->dec_ctx, g->packet) : 0;
+        av_packet_unref(g->packet);
+        if (ret < 0)
+            return ret;
+    } while ((ret = avcodec_receive_frame(g->dec_ctx, frame)) == AVERROR(EAGAIN));
+    return ret;
+}
+
+static void x11grab_close(LLCapture *cap)
+{
+    X11GrabCapture *g = cap->priv;
+
+    if (!g)
+        return;
+    avcodec_free_context(&g->dec_ctx);
+    avformat_close_input(&g->fmt_ctx);
+    av_packet_free(&g->packet);
+}
+
+/*
+ * Raw or Y4M file replay. Y4M files carry their size and chroma format;
+ * raw files take them from the configuration.
+ */
+typedef struct FileCapture {
+    FILE *f;
+    int y4m;
+    int loop;
+    long start;                 // first frame
+    LLFramePool pool;
+} FileCapture;
+
+static enum AVPixelFormat y4m_format(const char *c)
+{
+    // The 8-bit 4:2:0 tags differ only in chroma siting
+    if (!strcmp(c, "420") || !strcmp(c, "420jpeg") || !strcmp(c, "420paldv") ||
+        !strcmp(c, "420mpeg2"))
+        return AV_PIX_FMT_YUV420P;
+    // Higher bit depths take two little-endian bytes per sample
+    if (!strcmp(c, "420p10"))
+        return AV_PIX_FMT_YUV420P10LE;
+    if (!strcmp(c, "420p12"))
+        return AV_PIX_FMT_YUV420P12LE;
+    if (!strcmp(c, "422"))
+        return AV_PIX_FMT_YUV422P;
+    if (!strcmp(c, "444"))
+        return AV_PIX_FMT_YUV444P;
+    if (!strcmp(c, "mono"))
+        return AV_PIX_FMT_GRAY8;
+    return AV_PIX_FMT_NONE;
+}
+
+static int parse_y4m_header(LLCapture *cap, FileCapture *fc)
+{
+    char line[256], *tok, *save;
+
+    if (!fgets(line, sizeof(line), fc->f) || !strchr(line, '\n'))
+        return AVERROR_INVALIDDATA;
+    cap->format = AV_PIX_FMT_YUV420P;
+    for (tok = strtok_r(line + 9, " \n", &save); tok; tok = strtok_r(NULL, " \n", &save)) {
+        switch (tok[0]) {
+        case 'W':
+            cap->width = atoi(tok + 1);
+            break;
+        case 'H':
+            cap->height = atoi(tok + 1);
+            break;
+        case 'F': {
+            int num, den;
+            if (sscanf(tok + 1, "%d:%d", &num, &den) == 2 && num > 0 && den > 0 && !cap->fps)
+                cap->fps = (num + den / 2) / den;
+            break;
+        }
+        case 'C':
+            cap->format = y4m_format(tok + 1);
+            break;
+        }
+    }
+    if (cap->width <= 0 || cap->height <= 0 || cap->format == AV_PIX_FMT_NONE)
+        return AVERROR_INVALIDDATA;
+    return 0;
+}
+
+static int file_open(LLCapture *cap, const LLCaptureConfig *cfg)
+{
+    FileCapture *fc;
+    char magic[10];
+    int ret;
+
+    if (!(fc = cap->priv = av_mallocz(sizeof(*fc))))
+        return AVERROR(ENOMEM);
+    if (!cfg->source || !(fc->f = fopen(cfg->source, "rb"))) {
+        fprintf(stderr, "Cannot open capture file %s\n", cfg->source ? cfg->source : "");
+        return AVERROR(ENOENT);
+    }
+    fc->loop = cfg->loop;
+    fc->y4m  = fread(magic, 1, sizeof(magic), fc->f) == sizeof(magic) &&
+               !memcmp(magic, "YUV4MPEG2 ", sizeof(magic));
+    rewind(fc->f);
+    if (fc->y4m && (ret = parse_y4m_header(cap, fc)) < 0) {
+        fprintf(stderr, "Bad Y4M header in %s\n", cfg->source);
+        return ret;
+    }
+    if (!fc->y4m) {
+        cap->format = cfg->format != AV_PIX_FMT_NONE ? cfg->format : AV_PIX_FMT_NV12;
+        cap->width  = cfg->width;
+        cap->height = cfg->height;
+    }
+    fc->start = ftell(fc->f);
+    return ll_frame_pool_init(&fc->pool, cap->format, cap->width, cap->height, FILE_POOL_SIZE);
+}
+
+static int file_read_frame(LLCapture *cap, FileCapture *fc, AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(cap->format);
+    char line[64];
+
+    if (fc->y4m && (!fgets(line, sizeof(line), fc->f) || strncmp(line, "FRAME", 5)))
+        return AVERROR_EOF;
+    for (int i = 0; i < av_pix_fmt_count_planes(cap->format); i++) {
+        int h = i == 1 || i == 2 ? AV_CEIL_RSHIFT(cap->height, desc->log2_chroma_h) : cap->height;
+        int bytes = av_image_get_linesize(cap->format, cap->width, i);
+        for (int y = 0; y < h; y++)
+            if (fread(frame->data[i] + (ptrdiff_t)y * frame->linesize[i], 1, bytes, fc->f) != (size_t)bytes)
+                return AVERROR_EOF;
+    }
+    return 0;
+}
+
+static int file_read(LLCapture *cap, AVFrame *frame)
+{
+    FileCapture *fc = cap->priv;
+    int ret;
+
+    if ((ret = ll_frame_pool_get_buffer(&fc->pool, frame)) < 0)
+        return ret;
+    if ((ret = file_read_frame(cap, fc, frame)) == AVERROR_EOF && fc->loop) {
+        fseek(fc->f, fc->start, SEEK_SET);
+        ret = file_read_frame(cap, fc, frame);
+    }
+    if (ret < 0)
+        av_frame_unref(frame);
+    return ret;
+}
+
+static void file_close(LLCapture *cap)
+{
+    FileCapture *fc = cap->priv;
+
+    if (!fc)
+        return;
+    if (fc->f)
+        fclose(fc->f);
+    ll_frame_pool_uninit(&fc->pool);
+}
+
+/*
+ * Synthetic screen: a static backdrop with a box moving across it and a
+ * bar counting the frames, so damage stays small as on a real desktop.
+ */
+#define PATTERN_BOX 128
+
+typedef struct PatternCapture {
+    uint8_t *backdrop;
+    int linesize;
+    int64_t n;
+    LLFramePool pool;
+} PatternCapture;
+
+static int pattern_open(LLCapture *cap, const LLCaptureConfig *cfg)
+{
+    PatternCapture *p;
+
+    if (!(p = cap->priv = av_mallocz(sizeof(*p))))
+        return AVERROR(ENOMEM);
+    cap->format = AV_PIX_FMT_BGR0;
+    cap->width  = cfg->width;
+    cap->height = cfg->height;
+    if (cap->width < PATTERN_BOX || cap->height < PATTERN_BOX)
+        return AVERROR(EINVAL);
+    p->linesize = cap->width * 4;
+    if (!(p->backdrop = av_malloc((size_t)p->linesize * cap->height)))
+        return AVERROR(ENOMEM);
+    for (int y = 0; y < cap->height; y++) {
+        uint8_t *row = p->backdrop + (ptrdiff_t)y * p->linesize;
+        for (int x = 0; x < cap->width; x++) {
+            int grid = !(x & 63) || !(y & 63);
+            row[4 * x + 0] = grid ? 0xff : x * 255 / cap->width;
+            row[4 * x + 1] = grid ? 0xff : y * 255 / cap->height;
+            row[4 * x + 2] = grid ? 0xff : 0x40;
+            row[4 * x + 3] = 0;
+        }
+    }
+    return ll_frame_pool_init(&p->pool, cap->format, cap->width, cap->height, FILE_POOL_SIZE);
+}
+
+static int pattern_read(LLCapture *cap, AVFrame *frame)
+{
+    PatternCapture *p = cap->priv;
+    // A box as wide or tall as the frame still fits, at the edge
+    int box_x = cap->width > PATTERN_BOX ? (p->n * 8) % (cap->width - PATTERN_BOX) : 0;
+    int box_y = FFMIN(cap->height / 3, cap->height - PATTERN_BOX);
+    int bar = (p->n % FFMAX(cap->fps, 1) + 1) * cap->width / FFMAX(cap->fps, 1);
+    int ret;
+
+    if ((ret = ll_frame_pool_get_buffer(&p->pool, frame)) < 0)
+        return ret;
+    for (int y = 0; y < cap->height; y++)
+        memcpy(frame->data[0] + (ptrdiff_t)y * frame->linesize[0],
+               p->backdrop + (ptrdiff_t)y * p->linesize, p->linesize);
+    for (int y = box_y; y < box_y + PATTERN_BOX; y++)
+        memset(frame->data[0] + (ptrdiff_t)y * frame->linesize[0] + box_x * 4,
+               (p->n & 1) ? 0xe0 : 0x20, PATTERN_BOX * 4);
+    for (int y = cap->height - 8; y < cap->height; y++)
+        memset(frame->data[0] + (ptrdiff_t)y * frame->linesize[0], 0xff, bar * 4);
+    p->n++;
+    return 0;
+}
+
+static void pattern_close(LLCapture *cap)
+{
+    PatternCapture *p = cap->priv;
+
+    if (!p)
+        return;
+    av_freep(&p->backdrop);
+    ll_frame_pool_uninit(&p->pool);
+}
+
+static const LLCaptureBackend backends[] = {
+    { "xshm",    0, xshm_open,    xshm_read,    xshm_close },
+    { "x11grab", 1, x11grab_open, x11grab_read, x11grab_close },
+    { "file",    0, file_open,    file_read,    file_close },
+    { "pattern", 0, pattern_open, pattern_read, pattern_close },
+};
+
+#define NB_BACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
+const LLCaptureBackend *ll_capture_find_backend(const char *name)
+{
+    for (int i = 0; i < NB_BACKENDS; i++)
+        if (!strcmp(backends[i].name, name))
+            return &backends[i];
+    return NULL;
+}
+
+static int open_backend(LLCapture *cap, const LLCaptureBackend *backend,
+                        const LLCaptureConfig *cfg)
+{
+    int ret;
+
+    cap->backend = backend;
+    cap->fps     = cfg->fps;
+    if ((ret = backend->open(cap, cfg)) < 0) {
+        backend->close(cap);
+        av_freep(&cap->priv);
+    }
+    return ret;
+}
+
+int ll_capture_open(LLCapture **pcap, const LLCaptureConfig *cfg)
+{
+    LLCapture *cap;
+    int ret = AVERROR(ENOSYS);
+
+    if (!(cap = av_mallocz(sizeof(*cap))))
+        return AVERROR(ENOMEM);
+
+    if (cfg->backend && strcmp(cfg->backend, "auto")) {
+        const LLCaptureBackend *backend = ll_capture_find_backend(cfg->backend);
+        if (!backend) {
+            fprintf(stderr, "Unknown capture backend: %s\n", cfg->backend);
+            ret = AVERROR(EINVAL);
+        } else
+            ret = open_backend(cap, backend, cfg);
+    } else {
+        // The screen, straight into shared memory if the server lets us
+        for (int i = 0; i < 2; i++) {
+            if ((ret = open_backend(cap, &backends[i], cfg)) >= 0)
+                break;
+            fprintf(stderr, "Capture backend %s unavailable.\n", backends[i].name);
+        }
+    }
+
+    if (ret < 0) {
+        av_free(cap);
+        return ret;
+    }
+    if (cap->fps <= 0)
+        cap->fps = 30;
+    cap->clock.fd = -1;
+    if (!cap->backend->paced && (ret = ll_clock_init(&cap->clock, cap->fps)) < 0) {
+        fprintf(stderr, "Cannot create the frame clock: %s\n", av_err2str(ret));
+        cap->backend->close(cap);
+        av_freep(&cap->priv);
+        av_free(cap);
+        return ret;
+    }
+    cap->next_ns = cap->clock.tick_ns + cap->clock.interval_ns;
+    fprintf(stderr, "Using capture backend: %s (%s %dx%d)\n", cap->backend->name,
+            av_get_pix_fmt_name(cap->format), cap->width, cap->height);
+    *pcap = cap;
+    return 0;
+}
+
+int ll_capture_read(LLCapture *cap, AVFrame *frame)
+{
+    int64_t t0;
+    int ret;
+
+    if (!cap->backend->paced) {
+        if ((ret = ll_clock_wait(&cap->clock, NULL)) < 0)
+            return ret;
+        cap->n_late += ret;
+        cap->next_ns = cap->clock.tick_ns + cap->clock.interval_ns;
+    }
+    t0 = ll_time_ns();
+    if ((ret = cap->backend->read(cap, frame)) < 0)
+        return ret;
+    cap->n_frames++;
+    cap->read_ns += ll_time_ns() - t0;
+    return 0;
+}
+
+void ll_capture_print_stats(const LLCapture *cap, FILE *f)
+{
+    double n = cap->n_frames ? cap->n_frames : 1;
+
+    fprintf(f, "Capture %s: %lld frames, %lld late, read %.3f ms/frame\n",
+            cap->backend->name, (long long)cap->n_frames, (long long)cap->n_late,
+            cap->read_ns / n / 1e6);
+    if (!cap->backend->paced)
+        ll_clock_print_stats(&cap->clock, "Capture", f);
+}
+
+void ll_capture_close(LLCapture **pcap)
+{
+    LLCapture *cap = *pcap;
+
+    if (!cap)
+        return;
+    ll_clock_free(&cap->clock);
+    cap->backend->close(cap);
+    av_freep(&cap->priv);
+    av_freep(pcap);
+}
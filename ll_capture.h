@@ -0,0 +1,90 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_CAPTURE_H
+#define LL_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+#include "ll_clock.h"
+
+typedef struct LLCapture LLCapture;
+
+typedef struct LLCaptureConfig {
+    const char *backend;        // "xshm", "x11grab", "file", "pattern", or NULL/"auto"
+    const char *source;         // X display (default $DISPLAY) or file name
+    int width, height, fps;
+    int x, y;                   // top left corner of the grabbed area
+    enum AVPixelFormat format;  // of raw files, AV_PIX_FMT_NONE for NV12
+    int loop;                   // replay files from the start at the end
+} LLCaptureConfig;
+
+/*
+ * A capture backend produces frames in cap->format. The frames it hands
+ * out come from buffers it recycles, so callers drop them as soon as they
+ * are done. Backends that are not paced by their source are paced at the
+ * configured frame rate by ll_capture_read.
+ */
+typedef struct LLCaptureBackend {
+    const char *name;
+    int paced;                  // the source keeps its own frame rate
+    int (*open)(LLCapture *cap, const LLCaptureConfig *cfg);
+    int (*read)(LLCapture *cap, AVFrame *frame);
+    void (*close)(LLCapture *cap);
+} LLCaptureBackend;
+
+struct LLCapture {
+    const LLCaptureBackend *backend;
+    void *priv;
+    enum AVPixelFormat format;
+    int width, height, fps;
+    LLFrameClock clock;         // paces the backends that are not paced by their source
+    int64_t next_ns;            // when the next frame is due
+
+    int64_t n_frames;
+    int64_t n_late;             // frame slots skipped because a read came too late
+    int64_t read_ns;
+};
+
+const LLCaptureBackend *ll_capture_find_backend(const char *name);
+
+int ll_capture_open(LLCapture **pcap, const LLCaptureConfig *cfg);
+
+/*
+ * Wait for the next tick of the frame clock, then fill the blank frame.
+ * A call that comes after its tick captures at once, for the latest tick
+ * missed. Returns AVERROR_EOF at the end of a file.
+ */
+int ll_capture_read(LLCapture *cap, AVFrame *frame);
+
+void ll_capture_print_stats(const LLCapture *cap, FILE *f);
+
+// Frames still referenced may outlive the capture; they free their buffers when unref'd
+void ll_capture_close(LLCapture **pcap);
+
+#endif
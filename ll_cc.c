@@ -0,0 +1,228 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+
+#include "ll_cc.h"
+
+#define TREND_SMOOTHING     0.9
+#define THRESHOLD_GAIN      4.0
+#define MAX_DELTAS          60
+#define OVERUSE_TIME_MS     10
+#define K_UP                0.0087
+#define K_DOWN              0.039
+#define BETA                0.85
+#define PACKET_BITS         (1200 * 8)
+
+void ll_delay_trend_update(LLDelayTrend *t, int64_t send_ns, int64_t arrival_ns)
+{
+    double delta, sum_x = 0, sum_y = 0, num = 0, den = 0;
+    int n, i;
+
+    if (!t->have_prev) {
+        t->have_prev        = 1;
+        t->first_arrival_ns = arrival_ns;
+        t->prev_send_ns     = send_ns;
+        t->prev_arrival_ns  = arrival_ns;
+        return;
+    }
+    // Reordered frames say nothing about the queue
+    if (send_ns <= t->prev_send_ns)
+        return;
+    delta = ((arrival_ns - t->prev_arrival_ns) - (send_ns - t->prev_send_ns)) / 1e6;
+    t->prev_send_ns    = send_ns;
+    t->prev_arrival_ns = arrival_ns;
+    t->nb_deltas       = FFMIN(t->nb_deltas + 1, 1000);
+    t->accumulated    += delta;
+    t->smoothed        = TREND_SMOOTHING * t->smoothed + (1 - TREND_SMOOTHING) * t->accumulated;
+
+    i = t->nb_samples++ % LL_CC_TREND_WINDOW;
+    t->time[i]  = (arrival_ns - t->first_arrival_ns) / 1e6;
+    t->delay[i] = t->smoothed;
+    if (t->nb_samples < LL_CC_TREND_WINDOW)
+        return;
+
+    // Least squares slope over the window
+    n = LL_CC_TREND_WINDOW;
+    for (i = 0; i < n; i++) {
+        sum_x += t->time[i];
+        sum_y += t->delay[i];
+    }
+    for (i = 0; i < n; i++) {
+        num += (t->time[i] - sum_x / n) * (t->delay[i] - sum_y / n);
+        den += (t->time[i] - sum_x / n) * (t->time[i] - sum_x / n);
+    }
+    if (den > 0)
+        t->slope = num / den;
+}
+
+void ll_cc_init(LLCongestionControl *cc, int64_t start, int64_t min_rate, int64_t max_rate)
+{
+    memset(cc, 0, sizeof(*cc));
+    cc->min_rate     = min_rate;
+    cc->max_rate     = max_rate;
+    cc->target       = av_clip64(start, min_rate, max_rate);
+    cc->delay_rate   = cc->target;
+    cc->loss_rate    = max_rate;
+    cc->threshold    = 12.5;
+    cc->overuse_ms   = -1;
+    cc->avg_max_kbps = -1;
+    cc->var_max_kbps = 0.4;
+    cc->lowest       = cc->target;
+    cc->highest      = cc->target;
+}
+
+static void detect(LLCongestionControl *cc, const LLCcFeedback *fb, double dt_ms)
+{
+    double trend = FFMIN(fb->nb_deltas, MAX_DELTAS) * fb->trend * THRESHOLD_GAIN;
+    double k;
+
+    if (trend > cc->threshold) {
+        cc->overuse_ms = cc->overuse_ms < 0 ? dt_ms / 2 : cc->overuse_ms + dt_ms;
+        cc->overuse_count++;
+        if (cc->overuse_ms > OVERUSE_TIME_MS && cc->overuse_count > 1 && trend >= cc->prev_trend) {
+            cc->overuse_ms    = 0;
+            cc->overuse_count = 0;
+            cc->signal        = LL_CC_OVERUSE;
+        }
+    } else if (trend < -cc->threshold) {
+        cc->overuse_ms    = -1;
+        cc->overuse_count = 0;
+        cc->signal        = LL_CC_UNDERUSE;
+    } else {
+        cc->overuse_ms    = -1;
+        cc->overuse_count = 0;
+        cc->signal        = LL_CC_NORMAL;
+    }
+    cc->prev_trend = trend;
+
+    // The threshold follows the trend, slowly upwards and faster back down,
+    // so it neither starves against competing flows nor misses a queue
+    if (fabs(trend) > cc->threshold + 15)
+        return;
+    k = fabs(trend) < cc->threshold ? K_DOWN : K_UP;
+    cc->threshold += k * (fabs(trend) - cc->threshold) * dt_ms;
+    cc->threshold  = av_clipd(cc->threshold, 6, 600);
+}
+
+static void update_max(LLCongestionControl *cc, double kbps)
+{
+    double norm;
+
+    if (cc->avg_max_kbps < 0)
+        cc->avg_max_kbps = kbps;
+    else
+        cc->avg_max_kbps = 0.95 * cc->avg_max_kbps + 0.05 * kbps;
+    norm = FFMAX(cc->avg_max_kbps, 1.0);
+    cc->var_max_kbps = 0.95 * cc->var_max_kbps +
+                       0.05 * (cc->avg_max_kbps - kbps) * (cc->avg_max_kbps - kbps) / norm;
+    cc->var_max_kbps = av_clipd(cc->var_max_kbps, 0.4, 2.5);
+}
+
+static void control(LLCongestionControl *cc, const LLCcFeedback *fb, double dt_ms)
+{
+    double kbps = fb->receive_rate / 1e3;
+    double rate = cc->delay_rate;
+
+    switch (cc->signal) {
+    case LL_CC_OVERUSE:
+        cc->state = LL_CC_DECREASE;
+        break;
+    case LL_CC_UNDERUSE:
+        cc->state = LL_CC_HOLD;
+        break;
+    case LL_CC_NORMAL:
+        if (cc->state == LL_CC_HOLD || cc->state == LL_CC_DECREASE)
+            cc->state = LL_CC_INCREASE;
+        break;
+    }
+
+    switch (cc->state) {
+    case LL_CC_INCREASE: {
+        double std = sqrt(cc->var_max_kbps * cc->avg_max_kbps);
+
+        // Well above the capacity seen last time: the link has changed
+        if (cc->avg_max_kbps >= 0 && kbps > cc->avg_max_kbps + 3 * std)
+            cc->avg_max_kbps = -1;
+        if (cc->avg_max_kbps >= 0)
+            rate += FFMAX(1000, PACKET_BITS / 2 * dt_ms / 100);
+        else
+            rate *= pow(1.08, dt_ms / 1000);
+        // Do not run far ahead of what actually gets through
+        if (fb->receive_rate > 0)
+            rate = FFMIN(rate, 1.5 * fb->receive_rate + 10000);
+        break;
+    }
+    case LL_CC_DECREASE:
+        if (fb->receive_rate > 0) {
+            rate = FFMIN(rate, BETA * fb->receive_rate);
+            update_max(cc, kbps);
+        } else
+            rate *= BETA;
+        cc->overuses++;
+        cc->state = LL_CC_HOLD;
+        break;
+    case LL_CC_HOLD:
+        break;
+    }
+    cc->delay_rate = av_clip64(llrint(rate), cc->min_rate, cc->max_rate);
+}
+
+int ll_cc_update(LLCongestionControl *cc, const LLCcFeedback *fb, int64_t now_ns)
+{
+    int64_t prev = cc->target;
+    double elapsed_ms = cc->last_ns ? (now_ns - cc->last_ns) / 1e6 : 0;
+
+    cc->last_ns = now_ns;
+    cc->updates++;
+    detect(cc, fb, FFMIN(elapsed_ms, 100));
+    control(cc, fb, FFMIN(elapsed_ms, 1000));
+
+    // Loss: back off past 10%, creep up below 2%, a few times a second
+    if (fb->loss >= 0 && now_ns - cc->last_loss_ns >= 300000000) {
+        if (fb->loss > 0.1)
+            cc->loss_rate = cc->target * (1 - 0.5 * fb->loss);
+        else if (fb->loss < 0.02)
+            cc->loss_rate = cc->loss_rate * 1.05;
+        cc->loss_rate    = av_clip64(cc->loss_rate, cc->min_rate, cc->max_rate);
+        cc->last_loss_ns = now_ns;
+    }
+
+    cc->target  = FFMIN(cc->delay_rate, cc->loss_rate);
+    cc->lowest  = FFMIN(cc->lowest, cc->target);
+    cc->highest = FFMAX(cc->highest, cc->target);
+    return cc->target != prev;
+}
+
+void ll_cc_print_stats(const LLCongestionControl *cc, FILE *f)
+{
+    fprintf(f, "Rate control: target %.0f kbps (%.0f..%.0f seen, %.0f..%.0f allowed), "
+               "%llu reports, %llu overuses, threshold %.1f ms\n",
+            cc->target / 1e3, cc->lowest / 1e3, cc->highest / 1e3,
+            cc->min_rate / 1e3, cc->max_rate / 1e3, (unsigned long long)cc->updates,
+            (unsigned long long)cc->overuses, cc->threshold);
+}
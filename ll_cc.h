@@ -0,0 +1,119 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_CC_H
+#define LL_CC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Delay-based congestion control in the style of GCC
+ * (draft-ietf-rmcat-gcc). The receiver tracks how the one-way delay of
+ * frames drifts: a trend line over the smoothed, accumulated difference
+ * between arrival and send spacing. A positive slope means a queue is
+ * building somewhere on the path. It reports that slope, its receive
+ * rate and the loss fraction back to the sender.
+ *
+ * The sender compares the scaled slope with an adaptive threshold to
+ * detect overuse, and moves its target bitrate accordingly: down to 85%
+ * of what the receiver gets on overuse, up otherwise, multiplicatively
+ * while the link capacity is unknown and additively near the capacity
+ * seen at the last overuse. A loss-based estimate caps the result when
+ * loss goes beyond what FEC is there for.
+ */
+
+#define LL_CC_TREND_WINDOW      20
+
+typedef struct LLDelayTrend {
+    int have_prev;
+    int64_t prev_send_ns;
+    int64_t prev_arrival_ns;
+    int64_t first_arrival_ns;
+    double accumulated;         // ms
+    double smoothed;
+    double time[LL_CC_TREND_WINDOW];
+    double delay[LL_CC_TREND_WINDOW];
+    int nb_samples;
+    int nb_deltas;
+    double slope;               // ms of delay gained per ms
+} LLDelayTrend;
+
+// Receiver: a frame sent at send_ns (sender clock) arrived at arrival_ns
+void ll_delay_trend_update(LLDelayTrend *t, int64_t send_ns, int64_t arrival_ns);
+
+typedef struct LLCcFeedback {
+    int64_t receive_rate;       // bits/s since the previous report
+    double trend;               // LLDelayTrend.slope
+    int nb_deltas;
+    double loss;                // fraction lost before FEC, < 0 if not reported
+} LLCcFeedback;
+
+enum LLCcSignal {
+    LL_CC_NORMAL,
+    LL_CC_OVERUSE,
+    LL_CC_UNDERUSE,
+};
+
+enum LLCcState {
+    LL_CC_HOLD,
+    LL_CC_INCREASE,
+    LL_CC_DECREASE,
+};
+
+typedef struct LLCongestionControl {
+    int64_t min_rate;
+    int64_t max_rate;
+    int64_t target;             // bits/s the encoder should produce
+    int64_t delay_rate;         // delay-based estimate
+    int64_t loss_rate;          // loss-based estimate
+
+    // Overuse detector
+    double threshold;           // ms, adapts to the trend's usual range
+    double prev_trend;
+    double overuse_ms;
+    int overuse_count;
+    enum LLCcSignal signal;
+
+    // Rate controller
+    enum LLCcState state;
+    double avg_max_kbps;        // receive rate at overuse, < 0 if unknown
+    double var_max_kbps;
+    int64_t last_ns;
+    int64_t last_loss_ns;
+
+    uint64_t updates;
+    uint64_t overuses;
+    int64_t lowest;
+    int64_t highest;
+} LLCongestionControl;
+
+void ll_cc_init(LLCongestionControl *cc, int64_t start, int64_t min_rate, int64_t max_rate);
+
+// Sender: take a receiver report; 1 if the target changed
+int ll_cc_update(LLCongestionControl *cc, const LLCcFeedback *fb, int64_t now_ns);
+
+void ll_cc_print_stats(const LLCongestionControl *cc, FILE *f);
+
+#endif
@@ -0,0 +1,107 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+
+#include "ll_clock.h"
+#include "ll_common.h"
+
+int ll_clock_init(LLFrameClock *c, int fps)
+{
+    struct itimerspec its = { 0 };
+    int64_t start;
+
+    memset(c, 0, sizeof(*c));
+    c->interval_ns = 1000000000 / FFMAX(fps, 1);
+    ll_histogram_reset(&c->late);
+    ll_histogram_reset(&c->jitter);
+    if ((c->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)
+        return AVERROR(errno);
+
+    // First tick on the next multiple of the interval
+    start = (ll_time_ns() / c->interval_ns + 1) * c->interval_ns;
+    its.it_value.tv_sec     = start / 1000000000;
+    its.it_value.tv_nsec    = start % 1000000000;
+    its.it_interval.tv_sec  = c->interval_ns / 1000000000;
+    its.it_interval.tv_nsec = c->interval_ns % 1000000000;
+    if (timerfd_settime(c->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        int ret = AVERROR(errno);
+        ll_clock_free(c);
+        return ret;
+    }
+    c->tick_ns = start - c->interval_ns;
+    return 0;
+}
+
+int ll_clock_wait(LLFrameClock *c, int64_t *tick_ns)
+{
+    uint64_t expirations;
+    int64_t now;
+    ssize_t n;
+
+    while ((n = read(c->fd, &expirations, sizeof(expirations))) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(expirations))
+        return AVERROR(n < 0 ? errno : EIO);
+    now = ll_time_ns();
+
+    // The latest of the ticks that expired; the ones before it are gone
+    c->tick_ns += expirations * c->interval_ns;
+    // Before the first call, the caller was still setting up
+    if (c->ticks)
+        c->missed += expirations - 1;
+    ll_histogram_record(&c->late, (now - c->tick_ns) / 1000);
+    if (c->ticks)
+        ll_histogram_record(&c->jitter,
+                            FFABS(now - c->wake_ns - (int64_t)expirations * c->interval_ns) / 1000);
+    c->wake_ns = now;
+    c->ticks++;
+    if (tick_ns)
+        *tick_ns = c->tick_ns;
+    return c->ticks > 1 ? expirations - 1 : 0;
+}
+
+void ll_clock_print_stats(const LLFrameClock *c, const char *name, FILE *f)
+{
+    fprintf(f, "%s clock: %llu ticks, %llu missed, wakeup late p50 %.3f p99 %.3f ms, "
+               "interval jitter p50 %.3f p99 %.3f ms\n", name,
+            (unsigned long long)c->ticks, (unsigned long long)c->missed,
+            ll_histogram_percentile(&c->late, 50) / 1e3,
+            ll_histogram_percentile(&c->late, 99) / 1e3,
+            ll_histogram_percentile(&c->jitter, 50) / 1e3,
+            ll_histogram_percentile(&c->jitter, 99) / 1e3);
+}
+
+void ll_clock_free(LLFrameClock *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
@@ -0,0 +1,66 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_CLOCK_H
+#define LL_CLOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ll_latency.h"
+
+/*
+ * Frame clock: a periodic CLOCK_MONOTONIC timerfd ticking at the frame
+ * rate, its ticks on multiples of the frame interval. ll_clock_wait
+ * returns at the next tick, so work started there happens just in time
+ * for it. A caller that overran its budget and missed ticks gets the
+ * latest one at once and the others are skipped, rather than run late
+ * one after another: the schedule never drifts.
+ */
+typedef struct LLFrameClock {
+    int fd;
+    int64_t interval_ns;
+    int64_t tick_ns;            // of the last tick returned
+    int64_t wake_ns;            // when it was returned
+
+    uint64_t ticks;
+    uint64_t missed;            // skipped because the caller was late
+    LLHistogram late;           // wakeup after the tick, us
+    LLHistogram jitter;         // interval between wakeups off the frame interval, us
+} LLFrameClock;
+
+int ll_clock_init(LLFrameClock *c, int fps);
+
+/*
+ * Wait for the next tick. Returns the number of ticks missed since the
+ * previous call (0 when on time) or an AVERROR; *tick_ns, if not NULL,
+ * is set to the time of the tick.
+ */
+int ll_clock_wait(LLFrameClock *c, int64_t *tick_ns);
+
+void ll_clock_print_stats(const LLFrameClock *c, const char *name, FILE *f);
+
+void ll_clock_free(LLFrameClock *c);
+
+#endif
@@ -0,0 +1,405 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_X86 0
+#endif
+
+#include <libavutil/common.h>
+#include <libavutil/pixdesc.h>
+
+#include "ll_common.h"
+#include "ll_convert.h"
+
+/*
+ * Y  = 16  + (sum of y[i] * p[i]) / 2^15 over a pixel
+ * Cb = 128 + (sum of u[i] * p[i]) / 2^17 over a 2x2 block, Cr likewise
+ */
+#define Y_OFFSET ((16 << 15) + (1 << 14))
+#define C_OFFSET ((128 << 17) + (1 << 16))
+
+static void convert_tail(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                         uint8_t *uv, int x, int width, const LLConvertCoeffs *k)
+{
+    for (; x < width; x += 2) {
+        // An odd width repeats the last column into the chroma block
+        const uint8_t *p[4] = { src0 + 4 * x, src0 + 4 * FFMIN(x + 1, width - 1),
+                                src1 + 4 * x, src1 + 4 * FFMIN(x + 1, width - 1) };
+        int u = C_OFFSET, v = C_OFFSET;
+
+        for (int j = 0; j < 4; j++) {
+            int y = Y_OFFSET;
+            for (int i = 0; i < 4; i++) {
+                y += k->y[i] * p[j][i];
+                u += k->u[i] * p[j][i];
+                v += k->v[i] * p[j][i];
+            }
+            if ((j & 1) && x + 1 == width)
+                continue;
+            (j < 2 ? y0 : y1)[x + (j & 1)] = av_clip_uint8(y >> 15);
+        }
+        uv[x]     = av_clip_uint8(u >> 17);
+        uv[x + 1] = av_clip_uint8(v >> 17);
+    }
+}
+
+static void convert_scalar(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                           uint8_t *uv, int width, const LLConvertCoeffs *k)
+{
+    convert_tail(src0, src1, y0, y1, uv, 0, width, k);
+}
+
+#if HAVE_X86
+/*
+ * Pixels are widened to 16 bits and weighted with pmaddwd, which leaves
+ * two partial sums per pixel for phaddd to finish. Chroma weights the sum
+ * of the two rows the same way, and one more phaddd adds the columns of
+ * each block.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i weigh_sse4(__m128i px, __m128i zero, __m128i k)
+{
+    return _mm_hadd_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), k),
+                          _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), k));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i weigh_sum_sse4(__m128i a, __m128i b, __m128i zero, __m128i k)
+{
+    return _mm_hadd_epi32(
+        _mm_madd_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)), k),
+        _mm_madd_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)), k));
+}
+
+__attribute__((target("sse4.1")))
+static void convert_sse4(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                         uint8_t *uv, int width, const LLConvertCoeffs *k)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ky   = _mm_shuffle_epi32(_mm_loadl_epi64((const __m128i *)k->y), 0x44);
+    const __m128i ku   = _mm_shuffle_epi32(_mm_loadl_epi64((const __m128i *)k->u), 0x44);
+    const __m128i kv   = _mm_shuffle_epi32(_mm_loadl_epi64((const __m128i *)k->v), 0x44);
+    const __m128i yoff = _mm_set1_epi32(Y_OFFSET), coff = _mm_set1_epi32(C_OFFSET);
+    int x;
+
+    // 8 pixels, 2 rows at a time
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(src0 + 4 * x));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(src0 + 4 * x + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(src1 + 4 * x));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(src1 + 4 * x + 16));
+        __m128i ya, yb, u, v, w;
+
+        ya = _mm_srai_epi32(_mm_add_epi32(weigh_sse4(a0, zero, ky), yoff), 15);
+        yb = _mm_srai_epi32(_mm_add_epi32(weigh_sse4(b0, zero, ky), yoff), 15);
+        w  = _mm_packs_epi32(ya, yb);
+        _mm_storel_epi64((__m128i *)(y0 + x), _mm_packus_epi16(w, w));
+        ya = _mm_srai_epi32(_mm_add_epi32(weigh_sse4(a1, zero, ky), yoff), 15);
+        yb = _mm_srai_epi32(_mm_add_epi32(weigh_sse4(b1, zero, ky), yoff), 15);
+        w  = _mm_packs_epi32(ya, yb);
+        _mm_storel_epi64((__m128i *)(y1 + x), _mm_packus_epi16(w, w));
+
+        u = _mm_hadd_epi32(weigh_sum_sse4(a0, a1, zero, ku), weigh_sum_sse4(b0, b1, zero, ku));
+        v = _mm_hadd_epi32(weigh_sum_sse4(a0, a1, zero, kv), weigh_sum_sse4(b0, b1, zero, kv));
+        u = _mm_srai_epi32(_mm_add_epi32(u, coff), 17);
+        v = _mm_srai_epi32(_mm_add_epi32(v, coff), 17);
+        w = _mm_packs_epi32(_mm_unpacklo_epi32(u, v), _mm_unpackhi_epi32(u, v));
+        _mm_storel_epi64((__m128i *)(uv + x), _mm_packus_epi16(w, w));
+    }
+    convert_tail(src0, src1, y0, y1, uv, x, width, k);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i weigh_avx2(__m256i px, __m256i zero, __m256i k)
+{
+    return _mm256_hadd_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), k),
+                             _mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), k));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i weigh_sum_avx2(__m256i a, __m256i b, __m256i zero, __m256i k)
+{
+    return _mm256_hadd_epi32(
+        _mm256_madd_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero)), k),
+        _mm256_madd_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero)), k));
+}
+
+// Words of two 8-lane dword vectors, packed to 16 bytes in order
+__attribute__((target("avx2")))
+static inline __m128i pack_avx2(__m256i a, __m256i b)
+{
+    __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+}
+
+__attribute__((target("avx2")))
+static void convert_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                         uint8_t *uv, int width, const LLConvertCoeffs *k)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ky   = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)k->y));
+    const __m256i ku   = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)k->u));
+    const __m256i kv   = _mm256_broadcastq_epi64(_mm_loadl_epi64((const __m128i *)k->v));
+    const __m256i yoff = _mm256_set1_epi32(Y_OFFSET), coff = _mm256_set1_epi32(C_OFFSET);
+    int x;
+
+    // 16 pixels, 2 rows at a time; lanes keep pixels 0-3 | 4-7 of each load
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(src0 + 4 * x));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src0 + 4 * x + 32));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(src1 + 4 * x));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src1 + 4 * x + 32));
+        __m256i u, v;
+
+        _mm_storeu_si128((__m128i *)(y0 + x),
+                         pack_avx2(_mm256_srai_epi32(_mm256_add_epi32(weigh_avx2(a0, zero, ky), yoff), 15),
+                                   _mm256_srai_epi32(_mm256_add_epi32(weigh_avx2(b0, zero, ky), yoff), 15)));
+        _mm_storeu_si128((__m128i *)(y1 + x),
+                         pack_avx2(_mm256_srai_epi32(_mm256_add_epi32(weigh_avx2(a1, zero, ky), yoff), 15),
+                                   _mm256_srai_epi32(_mm256_add_epi32(weigh_avx2(b1, zero, ky), yoff), 15)));
+
+        // Blocks come out as 0 1 4 5 | 2 3 6 7; interleaving Cb and Cr by
+        // dword pairs and packing puts them back in order
+        u = _mm256_hadd_epi32(weigh_sum_avx2(a0, a1, zero, ku), weigh_sum_avx2(b0, b1, zero, ku));
+        v = _mm256_hadd_epi32(weigh_sum_avx2(a0, a1, zero, kv), weigh_sum_avx2(b0, b1, zero, kv));
+        u = _mm256_srai_epi32(_mm256_add_epi32(u, coff), 17);
+        v = _mm256_srai_epi32(_mm256_add_epi32(v, coff), 17);
+        _mm_storeu_si128((__m128i *)(uv + x),
+                         pack_avx2(_mm256_unpacklo_epi32(u, v), _mm256_unpackhi_epi32(u, v)));
+    }
+    convert_tail(src0, src1, y0, y1, uv, x, width, k);
+}
+#endif
+
+LLConvertFn ll_convert_impl(const char *name)
+{
+#if HAVE_X86
+    int sse4, avx2;
+
+    __builtin_cpu_init();
+    sse4 = __builtin_cpu_supports("sse4.1");
+    avx2 = __builtin_cpu_supports("avx2");
+
+    if (!name)
+        return avx2 ? convert_avx2 : sse4 ? convert_sse4 : convert_scalar;
+    if (!strcmp(name, "avx2"))
+        return avx2 ? convert_avx2 : NULL;
+    if (!strcmp(name, "sse4"))
+        return sse4 ? convert_sse4 : NULL;
+#else
+    if (!name)
+        return convert_scalar;
+#endif
+    if (!strcmp(name, "scalar"))
+        return convert_scalar;
+    return NULL;
+}
+
+// Byte offsets of R, G and B in a pixel
+static int rgb_offsets(enum AVPixelFormat format, int *r, int *g, int *b)
+{
+    switch (format) {
+    case AV_PIX_FMT_BGRA:
+    case AV_PIX_FMT_BGR0:
+        *b = 0; *g = 1; *r = 2;
+        return 0;
+    case AV_PIX_FMT_RGBA:
+    case AV_PIX_FMT_RGB0:
+        *r = 0; *g = 1; *b = 2;
+        return 0;
+    case AV_PIX_FMT_ARGB:
+    case AV_PIX_FMT_0RGB:
+        *r = 1; *g = 2; *b = 3;
+        return 0;
+    case AV_PIX_FMT_ABGR:
+    case AV_PIX_FMT_0BGR:
+        *b = 1; *g = 2; *r = 3;
+        return 0;
+    default:
+        return AVERROR(ENOSYS);
+    }
+}
+
+static void init_coeffs(LLConvertCoeffs *k, int r, int g, int b, enum AVColorSpace colorspace)
+{
+    double kr = colorspace == AVCOL_SPC_BT709 ? 0.2126 : 0.299;
+    double kb = colorspace == AVCOL_SPC_BT709 ? 0.0722 : 0.114;
+    double sy = 219.0 / 255 * (1 << 15), sc = 224.0 / 255 * (1 << 15) / 2;
+
+    memset(k, 0, sizeof(*k));
+    // Green takes the rounding so that greys come out exact
+    k->y[r] = lrint(kr * sy);
+    k->y[b] = lrint(kb * sy);
+    k->y[g] = lrint(sy) - k->y[r] - k->y[b];
+    k->u[b] = lrint(sc);
+    k->u[r] = lrint(-kr / (1 - kb) * sc);
+    k->u[g] = -k->u[b] - k->u[r];
+    k->v[r] = lrint(sc);
+    k->v[b] = lrint(-kb / (1 - kr) * sc);
+    k->v[g] = -k->v[r] - k->v[b];
+}
+
+static void convert_band(LLConvert *c, int band)
+{
+    const AVFrame *src = c->src;
+    AVFrame *dst = c->dst;
+    int rows = (c->height + 1) / 2;
+    int start = 2 * (rows * band / c->nb_threads), end = 2 * (rows * (band + 1) / c->nb_threads);
+
+    for (int y = start; y < end; y += 2) {
+        const uint8_t *s0 = src->data[0] + (ptrdiff_t)y * src->linesize[0];
+        uint8_t *y0 = dst->data[0] + (ptrdiff_t)y * dst->linesize[0];
+        int last = y + 1 == c->height;
+
+        c->fn(s0, last ? s0 : s0 + src->linesize[0], y0, last ? y0 : y0 + dst->linesize[0],
+              dst->data[1] + (ptrdiff_t)(y / 2) * dst->linesize[1], c->width, &c->coeffs);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    LLConvertWorker *w = arg;
+    LLConvert *c = w->c;
+    uint64_t job = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&c->lock);
+        while (!c->quit && c->job == job)
+            pthread_cond_wait(&c->cond, &c->lock);
+        if (c->quit) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        job = c->job;
+        pthread_mutex_unlock(&c->lock);
+
+        convert_band(c, w->band);
+
+        pthread_mutex_lock(&c->lock);
+        if (!--c->pending)
+            pthread_cond_signal(&c->done);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+int ll_convert_init(LLConvert *c, enum AVPixelFormat format, int width, int height,
+                    enum AVColorSpace colorspace, int nb_threads)
+{
+    int r, g, b, ret;
+
+    memset(c, 0, sizeof(*c));
+    if ((ret = rgb_offsets(format, &r, &g, &b)) < 0)
+        return ret;
+    c->format     = format;
+    c->width      = width;
+    c->height     = height;
+    c->colorspace = colorspace == AVCOL_SPC_BT709 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+    c->fn         = ll_convert_impl(NULL);
+    // No band thinner than 16 rows, where waking a thread costs more than it saves
+    c->nb_threads = av_clip(FFMIN(nb_threads, height / 16), 1, LL_CONVERT_MAX_THREADS);
+    init_coeffs(&c->coeffs, r, g, b, c->colorspace);
+
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    pthread_cond_init(&c->done, NULL);
+    // Band 0 is the caller's
+    for (int i = 1; i < c->nb_threads; i++) {
+        LLConvertWorker *w = &c->workers[c->nb_workers];
+        w->c    = c;
+        w->band = i;
+        if ((ret = pthread_create(&w->thread, NULL, worker_thread, w))) {
+            ll_convert_free(c);
+            return AVERROR(ret);
+        }
+        c->nb_workers++;
+    }
+    return 0;
+}
+
+int ll_convert_frame(LLConvert *c, const AVFrame *src, AVFrame *dst)
+{
+    int64_t t0 = ll_time_ns();
+
+    if (src->format != c->format || src->width != c->width || src->height != c->height ||
+        dst->format != AV_PIX_FMT_NV12 || dst->width != c->width || dst->height != c->height)
+        return AVERROR(EINVAL);
+
+    c->src = src;
+    c->dst = dst;
+    if (c->nb_workers) {
+        pthread_mutex_lock(&c->lock);
+        c->job++;
+        c->pending = c->nb_workers;
+        pthread_cond_broadcast(&c->cond);
+        pthread_mutex_unlock(&c->lock);
+    }
+    convert_band(c, 0);
+    if (c->nb_workers) {
+        pthread_mutex_lock(&c->lock);
+        while (c->pending)
+            pthread_cond_wait(&c->done, &c->lock);
+        pthread_mutex_unlock(&c->lock);
+    }
+    c->src = NULL;
+    c->dst = NULL;
+
+    dst->colorspace  = c->colorspace;
+    dst->color_range = AVCOL_RANGE_MPEG;
+    c->frames++;
+    c->convert_ns += ll_time_ns() - t0;
+    return 0;
+}
+
+void ll_convert_print_stats(const LLConvert *c, FILE *f)
+{
+    double n = c->frames ? c->frames : 1;
+
+    fprintf(f, "Convert %s to nv12 (%s, %d threads): %llu frames, %.3f ms/frame\n",
+            av_get_pix_fmt_name(c->format), c->colorspace == AVCOL_SPC_BT709 ? "BT.709" : "BT.601",
+            c->nb_threads, (unsigned long long)c->frames, c->convert_ns / n / 1e6);
+}
+
+void ll_convert_free(LLConvert *c)
+{
+    if (!c->nb_threads)
+        return;
+    pthread_mutex_lock(&c->lock);
+    c->quit = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    for (int i = 0; i < c->nb_workers; i++)
+        pthread_join(c->workers[i].thread, NULL);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->cond);
+    pthread_cond_destroy(&c->done);
+    c->nb_workers = 0;
+    c->nb_threads = 0;
+}
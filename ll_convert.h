@@ -0,0 +1,111 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_CONVERT_H
+#define LL_CONVERT_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+/*
+ * Packed RGB (BGRA, BGR0 and the other 32-bit orders) to NV12, limited
+ * range, BT.601 or BT.709: the one conversion the push path needs, without
+ * sws_scale's generic filter chain. Chroma is the average of each 2x2
+ * block. The frame is cut into bands of rows, converted in parallel by a
+ * small pool of threads and the caller.
+ */
+
+#define LL_CONVERT_MAX_THREADS 16
+
+// Q15 weights per byte of a source pixel, so that byte order is just data
+typedef struct LLConvertCoeffs {
+    int16_t y[4], u[4], v[4];
+} LLConvertCoeffs;
+
+/*
+ * Convert two source rows into two luma rows and the interleaved chroma
+ * row between them. For the last row of an odd height src1 == src0 and
+ * y1 == y0.
+ */
+typedef void (*LLConvertFn)(const uint8_t *src0, const uint8_t *src1,
+                            uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                            int width, const LLConvertCoeffs *k);
+
+typedef struct LLConvert LLConvert;
+
+typedef struct LLConvertWorker {
+    LLConvert *c;
+    pthread_t thread;
+    int band;
+} LLConvertWorker;
+
+struct LLConvert {
+    enum AVPixelFormat format;  // of the source
+    int width, height;
+    enum AVColorSpace colorspace;
+    LLConvertCoeffs coeffs;
+    LLConvertFn fn;             // may be swapped for another ll_convert_impl()
+
+    int nb_threads;             // bands, including the caller's
+    LLConvertWorker workers[LL_CONVERT_MAX_THREADS];
+    int nb_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // a new frame, or quit
+    pthread_cond_t done;        // the last band is finished
+    uint64_t job;
+    int pending;
+    int quit;
+    const AVFrame *src;
+    AVFrame *dst;
+
+    uint64_t frames;
+    int64_t convert_ns;
+};
+
+/*
+ * Returns the kernel for name ("avx2", "sse4", "scalar"), the fastest one
+ * the CPU supports for NULL, or NULL if it is unknown or unsupported. All
+ * of them give the same output.
+ */
+LLConvertFn ll_convert_impl(const char *name);
+
+/*
+ * colorspace is AVCOL_SPC_BT709 or BT.601 for anything else. Returns
+ * AVERROR(ENOSYS) for sources other than 32-bit packed RGB.
+ */
+int ll_convert_init(LLConvert *c, enum AVPixelFormat format, int width, int height,
+                    enum AVColorSpace colorspace, int nb_threads);
+
+// dst is an NV12 frame of the same size with its buffers allocated
+int ll_convert_frame(LLConvert *c, const AVFrame *src, AVFrame *dst);
+
+void ll_convert_print_stats(const LLConvert *c, FILE *f);
+
+void ll_convert_free(LLConvert *c);
+
+#endif
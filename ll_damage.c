@@ -0,0 +1,263 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_X86 0
+#endif
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/pixdesc.h>
+
+#include "ll_common.h"
+#include "ll_damage.h"
+
+static int diff_scalar(const uint8_t *a, const uint8_t *b, int size)
+{
+    return memcmp(a, b, size) != 0;
+}
+
+#if HAVE_X86
+// OR together the XOR of the whole span and test once: tile rows are short
+__attribute__((target("sse2")))
+static int diff_sse2(const uint8_t *a, const uint8_t *b, int size)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i + 16 <= size; i += 16)
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+        return 1;
+    return i < size && diff_scalar(a + i, b + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int diff_avx2(const uint8_t *a, const uint8_t *b, int size)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int i;
+
+    for (i = 0; i + 32 <= size; i += 32)
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                     _mm256_loadu_si256((const __m256i *)(b + i))));
+    if (!_mm256_testz_si256(acc, acc))
+        return 1;
+    return i < size && diff_sse2(a + i, b + i, size - i);
+}
+#endif
+
+LLDiffFn ll_damage_diff_impl(const char *name)
+{
+#if HAVE_X86
+    int sse2, avx2;
+
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+
+    if (!name)
+        return avx2 ? diff_avx2 : sse2 ? diff_sse2 : diff_scalar;
+    if (!strcmp(name, "avx2"))
+        return avx2 ? diff_avx2 : NULL;
+    if (!strcmp(name, "sse2"))
+        return sse2 ? diff_sse2 : NULL;
+#else
+    if (!name)
+        return diff_scalar;
+#endif
+    if (!strcmp(name, "scalar"))
+        return diff_scalar;
+    return NULL;
+}
+
+static LLDiffFn diff = diff_scalar;
+
+__attribute__((constructor))
+static void damage_init(void)
+{
+    diff = ll_damage_diff_impl(NULL);
+}
+
+int ll_damage_init(LLDamage *d, enum AVPixelFormat format, int width, int height)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+
+    memset(d, 0, sizeof(*d));
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PLANAR | AV_PIX_FMT_FLAG_HWACCEL |
+                                 AV_PIX_FMT_FLAG_BITSTREAM)) ||
+        desc->log2_chroma_w || desc->log2_chroma_h)
+        return AVERROR(ENOSYS);
+
+    d->width        = width;
+    d->height       = height;
+    d->bpp          = av_get_padded_bits_per_pixel(desc) / 8;
+    d->cols         = (width  + LL_DAMAGE_TILE - 1) / LL_DAMAGE_TILE;
+    d->rows         = (height + LL_DAMAGE_TILE - 1) / LL_DAMAGE_TILE;
+    d->ref_linesize = FFALIGN(width * d->bpp, 32);
+    if (!(d->ref = av_malloc((size_t)d->ref_linesize * height)) ||
+        !(d->dirty = av_mallocz(d->cols * d->rows))) {
+        ll_damage_free(d);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+static void add_rect(LLDamage *d, int x, int y, int w, int h)
+{
+    if (d->nb_rects < LL_DAMAGE_MAX_RECTS)
+        d->rects[d->nb_rects] = (LLDamageRect){ x, y, w, h };
+    d->nb_rects++;
+}
+
+/*
+ * Runs of changed tiles in a row become rectangles, and a run spanning the
+ * same columns as one ending just above extends that one downwards.
+ */
+static void find_rects(LLDamage *d)
+{
+    int x0 = d->width, y0 = d->height, x1 = 0, y1 = 0;
+
+    d->nb_rects = 0;
+    for (int ty = 0; ty < d->rows; ty++) {
+        const uint8_t *dirty = d->dirty + ty * d->cols;
+        int y = ty * LL_DAMAGE_TILE, h = FFMIN(LL_DAMAGE_TILE, d->height - y);
+
+        for (int tx = 0; tx < d->cols; ) {
+            int start = tx, x, w, i;
+
+            if (!dirty[tx]) {
+                tx++;
+                continue;
+            }
+            while (tx < d->cols && dirty[tx])
+                tx++;
+            x = start * LL_DAMAGE_TILE;
+            w = FFMIN(tx * LL_DAMAGE_TILE, d->width) - x;
+            for (i = 0; i < FFMIN(d->nb_rects, LL_DAMAGE_MAX_RECTS); i++) {
+                LLDamageRect *r = &d->rects[i];
+                if (r->x == x && r->w == w && r->y + r->h == y) {
+                    r->h += h;
+                    break;
+                }
+            }
+            if (i == FFMIN(d->nb_rects, LL_DAMAGE_MAX_RECTS))
+                add_rect(d, x, y, w, h);
+            x0 = FFMIN(x0, x);
+            x1 = FFMAX(x1, x + w);
+            y0 = FFMIN(y0, y);
+            y1 = FFMAX(y1, y + h);
+        }
+    }
+    d->bounds = x1 > x0 ? (LLDamageRect){ x0, y0, x1 - x0, y1 - y0 } : (LLDamageRect){ 0 };
+    if (d->nb_rects > LL_DAMAGE_MAX_RECTS) {
+        d->rects[0] = d->bounds;
+        d->nb_rects = 1;
+    }
+}
+
+int ll_damage_update(LLDamage *d, const uint8_t *data, int linesize)
+{
+    int64_t t0 = ll_time_ns();
+    int tile_bytes = LL_DAMAGE_TILE * d->bpp, row_bytes = d->width * d->bpp;
+
+    d->nb_dirty = 0;
+    for (int ty = 0; ty < d->rows; ty++) {
+        uint8_t *dirty = d->dirty + ty * d->cols;
+        int y0 = ty * LL_DAMAGE_TILE, y1 = FFMIN(y0 + LL_DAMAGE_TILE, d->height);
+
+        // Once a tile differs in one row its other rows need no comparing
+        memset(dirty, !d->have_ref, d->cols);
+        for (int y = y0; d->have_ref && y < y1; y++) {
+            const uint8_t *src = data + (ptrdiff_t)y * linesize;
+            const uint8_t *ref = d->ref + (ptrdiff_t)y * d->ref_linesize;
+            for (int tx = 0, x = 0; tx < d->cols; tx++, x += tile_bytes)
+                if (!dirty[tx])
+                    dirty[tx] = diff(src + x, ref + x, FFMIN(tile_bytes, row_bytes - x));
+        }
+        for (int tx = 0, x = 0; tx < d->cols; tx++, x += tile_bytes) {
+            if (!dirty[tx])
+                continue;
+            d->nb_dirty++;
+            for (int y = y0; y < y1; y++)
+                memcpy(d->ref + (ptrdiff_t)y * d->ref_linesize + x,
+                       data + (ptrdiff_t)y * linesize + x, FFMIN(tile_bytes, row_bytes - x));
+        }
+    }
+    d->have_ref = 1;
+    find_rects(d);
+
+    d->frames++;
+    d->unchanged   += !d->nb_dirty;
+    d->dirty_tiles += d->nb_dirty;
+    d->diff_ns     += ll_time_ns() - t0;
+    return d->nb_dirty;
+}
+
+int ll_damage_set_roi(const LLDamage *d, AVFrame *frame, AVRational qoffset)
+{
+    AVFrameSideData *sd;
+    AVRegionOfInterest *roi;
+
+    if (!d->nb_rects || d->nb_dirty == d->cols * d->rows)
+        return 0;
+    if (!(sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                      d->nb_rects * sizeof(*roi))))
+        return AVERROR(ENOMEM);
+    roi = (AVRegionOfInterest *)sd->data;
+    for (int i = 0; i < d->nb_rects; i++) {
+        const LLDamageRect *r = &d->rects[i];
+        roi[i] = (AVRegionOfInterest){
+            .self_size = sizeof(*roi),
+            .top       = r->y,
+            .bottom    = r->y + r->h,
+            .left      = r->x,
+            .right     = r->x + r->w,
+            .qoffset   = qoffset,
+        };
+    }
+    return 0;
+}
+
+void ll_damage_print_stats(const LLDamage *d, FILE *f)
+{
+    double n = d->frames ? d->frames : 1;
+
+    fprintf(f, "Damage: %llu frames, %llu unchanged (%.1f%%), %.1f%% of tiles changed, diff %.3f ms/frame\n",
+            (unsigned long long)d->frames, (unsigned long long)d->unchanged,
+            100.0 * d->unchanged / n, 100.0 * d->dirty_tiles / n / FFMAX(d->cols * d->rows, 1),
+            d->diff_ns / n / 1e6);
+}
+
+void ll_damage_free(LLDamage *d)
+{
+    av_freep(&d->ref);
+    av_freep(&d->dirty);
+}
@@ -0,0 +1,97 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_DAMAGE_H
+#define LL_DAMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+/*
+ * Damage detection for screen capture: each capture is compared with the
+ * previous one in tiles, and only the tiles that changed are copied into
+ * the reference. A frame without damage need not be converted, uploaded
+ * or encoded at all; one with a little damage can tell the encoder where
+ * the change is, as AVRegionOfInterest side data.
+ */
+
+#define LL_DAMAGE_TILE      64      // pixels, square
+#define LL_DAMAGE_MAX_RECTS 32      // ROI entries before falling back to the bounding box
+
+typedef struct LLDamageRect {
+    int x, y, w, h;             // pixels
+} LLDamageRect;
+
+// Nonzero if the size bytes at a and b differ
+typedef int (*LLDiffFn)(const uint8_t *a, const uint8_t *b, int size);
+
+typedef struct LLDamage {
+    int width, height;
+    int bpp;                    // bytes per pixel, packed formats only
+    int cols, rows;             // tiles
+    uint8_t *ref;               // the previous capture
+    int ref_linesize;
+    uint8_t *dirty;             // per tile, from the last update
+    int nb_dirty;
+    int have_ref;
+    LLDamageRect rects[LL_DAMAGE_MAX_RECTS];
+    int nb_rects;
+    LLDamageRect bounds;
+
+    uint64_t frames;
+    uint64_t unchanged;
+    uint64_t dirty_tiles;
+    int64_t diff_ns;
+} LLDamage;
+
+/*
+ * Returns the differ for name ("avx2", "sse2", "scalar"), the fastest one
+ * the CPU supports for NULL, or NULL if it is unknown or unsupported.
+ */
+LLDiffFn ll_damage_diff_impl(const char *name);
+
+// AVERROR(ENOSYS) for formats with more than one plane
+int ll_damage_init(LLDamage *d, enum AVPixelFormat format, int width, int height);
+
+/*
+ * Compare the image with the previous one and take it as the new
+ * reference. Returns the number of changed tiles; the first image is all
+ * damage. d->rects then covers the changed tiles.
+ */
+int ll_damage_update(LLDamage *d, const uint8_t *data, int linesize);
+
+/*
+ * Attach the changed area to frame as AV_FRAME_DATA_REGIONS_OF_INTEREST,
+ * asking for qoffset there. Nothing is attached if the whole frame changed.
+ */
+int ll_damage_set_roi(const LLDamage *d, AVFrame *frame, AVRational qoffset);
+
+void ll_damage_print_stats(const LLDamage *d, FILE *f);
+
+void ll_damage_free(LLDamage *d);
+
+#endif
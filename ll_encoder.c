@@ -0,0 +1,545 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/opt.h>
+
+#include "ll_encoder.h"
+
+static int set_hwframe_ctx(AVCodecContext *ctx, AVBufferRef *hw_device_ctx, int pool_size)
+{
+    AVBufferRef *hw_frames_ref;
+    AVHWFramesContext *frames_ctx = NULL;
+    int err = 0;
+
+    if (!(hw_frames_ref = av_hwframe_ctx_alloc(hw_device_ctx))) {
+        fprintf(stderr, "Failed to create VAAPI frame context.\n");
+        return -1;
+    }
+    frames_ctx = (AVHWFramesContext *)(hw_frames_ref->data);
+    frames_ctx->format    = AV_PIX_FMT_VAAPI;
+    frames_ctx->sw_format = AV_PIX_FMT_NV12;
+    frames_ctx->width     = ctx->width;
+    frames_ctx->height    = ctx->height;
+    frames_ctx->initial_pool_size = pool_size;
+    if ((err = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
+        fprintf(stderr, "Failed to initialize VAAPI frame context."
+                "Error code: %s\n",av_err2str(err));
+        av_buffer_unref(&hw_frames_ref);
+        return err;
+    }
+    ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref);
+    if (!ctx->hw_frames_ctx)
+        err = AVERROR(ENOMEM);
+
+    av_buffer_unref(&hw_frames_ref);
+    return err;
+}
+
+// Low-delay rate control: a buffer of about one frame keeps frames near the average size
+static void set_rate_control(AVCodecContext *avctx, int64_t bitrate, int fps)
+{
+    avctx->bit_rate       = bitrate;
+    avctx->rc_max_rate    = bitrate;
+    avctx->rc_buffer_size = bitrate / fps;
+}
+
+static int vaapi_setup(LLEncoder *enc, const LLEncoderConfig *cfg)
+{
+    AVCodecContext *avctx = enc->avctx;
+    int err;
+
+    // On a reopen the device and the surfaces are still there
+    if (!enc->hw_device_ctx && cfg->hw_device_ctx) {
+        if (!(enc->hw_device_ctx = av_buffer_ref(cfg->hw_device_ctx)))
+            return AVERROR(ENOMEM);
+    } else if (!enc->hw_device_ctx) {
+        err = av_hwdevice_ctx_create(&enc->hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI,
+                                     NULL, NULL, 0);
+        if (err < 0) {
+            fprintf(stderr, "Failed to create a VAAPI device. Error code: %s\n", av_err2str(err));
+            return err;
+        }
+    }
+
+    avctx->pix_fmt   = AV_PIX_FMT_VAAPI;
+    if (enc->backend->codec_id == AV_CODEC_ID_AV1) {
+        // A quantizer index out of 255, about QP 30 of H.264
+        if (!enc->bitrate)
+            avctx->global_quality = 120;
+    } else {
+        if (enc->backend->codec_id == AV_CODEC_ID_H264)
+            avctx->level = 20;
+        avctx->qmin = 10;
+        avctx->qmax = 30;
+        if (!enc->bitrate)
+            avctx->global_quality = 35;
+    }
+    if (enc->bitrate)
+        set_rate_control(avctx, enc->bitrate, cfg->fps);
+
+    if (enc->hw_frames_ctx) {
+        if (!(avctx->hw_frames_ctx = av_buffer_ref(enc->hw_frames_ctx)))
+            return AVERROR(ENOMEM);
+        return 0;
+    }
+    /* set hw_frames_ctx for encoder's AVCodecContext; the VAAPI surface
+     * pool is fixed, so uploads never allocate once it is set up */
+    if ((err = set_hwframe_ctx(avctx, enc->hw_device_ctx,
+                               cfg->pool_size > 0 ? cfg->pool_size : 20)) < 0) {
+        fprintf(stderr, "Failed to set hwframe context.\n");
+        return err;
+    }
+    if (!(enc->hw_frames_ctx = av_buffer_ref(avctx->hw_frames_ctx)))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+static int vaapi_upload(LLEncoder *enc, AVFrame *sw_frame, AVFrame *frame)
+{
+    int err;
+
+    // Not avctx's: uploads run on their own thread and avctx may be reopened
+    if ((err = av_hwframe_get_buffer(enc->hw_frames_ctx, frame, 0)) < 0) {
+        fprintf(stderr, "Error code: %s.\n", av_err2str(err));
+        return err;
+    }
+    if (!frame->hw_frames_ctx)
+        return AVERROR(ENOMEM);
+    if ((err = av_hwframe_transfer_data(frame, sw_frame, 0)) < 0) {
+        fprintf(stderr, "Error while transferring frame data to surface."
+                "Error code: %s.\n", av_err2str(err));
+        return err;
+    }
+    // Surfaces have the configured size; smaller pictures fill the top left
+    frame->width  = sw_frame->width;
+    frame->height = sw_frame->height;
+    return 0;
+}
+
+static int x264_setup(LLEncoder *enc, const LLEncoderConfig *cfg)
+{
+    AVCodecContext *avctx = enc->avctx;
+
+    avctx->pix_fmt = AV_PIX_FMT_NV12;
+    av_opt_set(avctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(avctx->priv_data, "tune", "zerolatency", 0);
+    // Requested keyframes are IDRs, so a receiver can start over on them
+    av_opt_set(avctx->priv_data, "forced-idr", "1", 0);
+    /* A column of intra blocks sweeps the picture every gop_size frames in
+     * place of periodic IDRs, so no frame is much larger than the others */
+    if (cfg->intra_refresh && cfg->gop_size > 1)
+        av_opt_set(avctx->priv_data, "intra-refresh", "1", 0);
+    // libx264 applies ROI through adaptive quantization, which ultrafast turns off
+    if (cfg->roi)
+        av_opt_set_int(avctx->priv_data, "aq-mode", 1, 0);
+    if (enc->bitrate)
+        set_rate_control(avctx, enc->bitrate, cfg->fps);
+    else
+        av_opt_set(avctx->priv_data, "crf", "23", 0);
+    return 0;
+}
+
+// libx264 compares these with its parameters on every frame and reconfigures
+static int x264_reconfigure(LLEncoder *enc)
+{
+    set_rate_control(enc->avctx, enc->bitrate, enc->cfg.fps);
+    return 0;
+}
+
+static int openh264_setup(LLEncoder *enc, const LLEncoderConfig *cfg)
+{
+    AVCodecContext *avctx = enc->avctx;
+
+    // openh264 is rate controlled only; aim for ~0.1 bits per pixel
+    avctx->pix_fmt  = AV_PIX_FMT_YUV420P;
+    avctx->bit_rate = enc->bitrate ? enc->bitrate : (int64_t)cfg->width * cfg->height * cfg->fps / 10;
+    av_opt_set_int(avctx->priv_data, "allow_skip_frames", 0, 0);
+    return 0;
+}
+
+static int x265_setup(LLEncoder *enc, const LLEncoderConfig *cfg)
+{
+    AVCodecContext *avctx = enc->avctx;
+
+    avctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    av_opt_set(avctx->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(avctx->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(avctx->priv_data, "forced-idr", "1", 0);
+    if (cfg->intra_refresh && cfg->gop_size > 1)
+        av_opt_set(avctx->priv_data, "x265-params", "intra-refresh=1", 0);
+    if (enc->bitrate)
+        set_rate_control(avctx, enc->bitrate, cfg->fps);
+    else
+        av_opt_set(avctx->priv_data, "crf", "28", 0);
+    return 0;
+}
+
+static int svtav1_setup(LLEncoder *enc, const LLEncoderConfig *cfg)
+{
+    AVCodecContext *avctx = enc->avctx;
+    char params[64];
+
+    avctx->pix_fmt = AV_PIX_FMT_YUV420P;
+    // The fastest preset; wrappers before FFmpeg 5 stop at 8
+    if (av_opt_set_int(avctx->priv_data, "preset", 12, 0) < 0)
+        av_opt_set_int(avctx->priv_data, "preset", 8, 0);
+    /* Low-delay prediction without lookahead, so every frame comes out as
+     * soon as it is encoded; CBR needs the low-delay structure too */
+    snprintf(params, sizeof(params), "pred-struct=1:lookahead=0%s", enc->bitrate ? ":rc=2" : "");
+    if (av_opt_set(avctx->priv_data, "svtav1-params", params, 0) < 0)
+        av_opt_set_int(avctx->priv_data, "la_depth", 0, 0);
+    if (enc->bitrate)
+        set_rate_control(avctx, enc->bitrate, cfg->fps);
+    else
+        av_opt_set_int(avctx->priv_data, "crf", 35, 0);
+    return 0;
+}
+
+// In the order "auto" tries them for each codec: the GPU first
+static const LLEncoderBackend backends[] = {
+    { "vaapi",    "h264_vaapi",  AV_CODEC_ID_H264, AV_PIX_FMT_NV12,    vaapi_setup,    vaapi_upload, NULL },
+    { "x264",     "libx264",     AV_CODEC_ID_H264, AV_PIX_FMT_NV12,    x264_setup,     NULL,         x264_reconfigure },
+    { "openh264", "libopenh264", AV_CODEC_ID_H264, AV_PIX_FMT_YUV420P, openh264_setup, NULL,         NULL },
+    { "vaapi",    "hevc_vaapi",  AV_CODEC_ID_HEVC, AV_PIX_FMT_NV12,    vaapi_setup,    vaapi_upload, NULL },
+    { "x265",     "libx265",     AV_CODEC_ID_HEVC, AV_PIX_FMT_YUV420P, x265_setup,     NULL,         NULL },
+    { "vaapi",    "av1_vaapi",   AV_CODEC_ID_AV1,  AV_PIX_FMT_NV12,    vaapi_setup,    vaapi_upload, NULL },
+    { "svtav1",   "libsvtav1",   AV_CODEC_ID_AV1,  AV_PIX_FMT_YUV420P, svtav1_setup,   NULL,         NULL },
+};
+
+#define NB_BACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
+const LLEncoderBackend *ll_encoder_find_backend(const char *name, enum AVCodecID codec_id)
+{
+    for (int i = 0; i < NB_BACKENDS; i++)
+        if (!strcmp(backends[i].name, name) && backends[i].codec_id == codec_id)
+            return &backends[i];
+    return NULL;
+}
+
+static int open_context(LLEncoder *enc, const LLEncoderBackend *backend,
+                        const LLEncoderConfig *cfg)
+{
+    int err;
+
+    if (!(enc->avctx = avcodec_alloc_context3(enc->codec)))
+        return AVERROR(ENOMEM);
+
+    enc->avctx->width     = cfg->width;
+    enc->avctx->height    = cfg->height;
+    enc->avctx->time_base = (AVRational){1, cfg->fps};
+    enc->avctx->framerate = (AVRational){cfg->fps, 1};
+    enc->avctx->sample_aspect_ratio = (AVRational){1, 1};
+    enc->avctx->max_b_frames = 0;
+    enc->avctx->gop_size = cfg->gop_size;
+    enc->avctx->slices   = cfg->slices;
+    // What ll_convert and sws_scale produce: limited range, BT.601 unless asked
+    enc->avctx->color_range = AVCOL_RANGE_MPEG;
+    if (cfg->colorspace == AVCOL_SPC_BT709) {
+        enc->avctx->colorspace      = AVCOL_SPC_BT709;
+        enc->avctx->color_primaries = AVCOL_PRI_BT709;
+        enc->avctx->color_trc       = AVCOL_TRC_BT709;
+    } else {
+        enc->avctx->colorspace      = AVCOL_SPC_SMPTE170M;
+        enc->avctx->color_primaries = AVCOL_PRI_SMPTE170M;
+        enc->avctx->color_trc       = AVCOL_TRC_SMPTE170M;
+    }
+
+    if ((err = backend->setup(enc, cfg)) < 0)
+        return err;
+
+    if ((err = avcodec_open2(enc->avctx, enc->codec, NULL)) < 0) {
+        fprintf(stderr, "Cannot open video encoder codec. Error code: %s\n", av_err2str(err));
+        return err;
+    }
+    return 0;
+}
+
+static int open_backend(LLEncoder *enc, const LLEncoderBackend *backend,
+                        const LLEncoderConfig *cfg)
+{
+    enc->backend = backend;
+    if (!(enc->codec = avcodec_find_encoder_by_name(backend->codec_name))) {
+        fprintf(stderr, "Could not find encoder %s.\n", backend->codec_name);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    return open_context(enc, backend, cfg);
+}
+
+static void close_backend(LLEncoder *enc)
+{
+    avcodec_free_context(&enc->avctx);
+    av_buffer_unref(&enc->hw_frames_ctx);
+    av_buffer_unref(&enc->hw_device_ctx);
+    enc->backend = NULL;
+    enc->codec = NULL;
+}
+
+int ll_encoder_open(LLEncoder **penc, const LLEncoderConfig *cfg)
+{
+    LLEncoder *enc;
+    int err = AVERROR_ENCODER_NOT_FOUND;
+
+    if (!(enc = av_mallocz(sizeof(*enc))))
+        return AVERROR(ENOMEM);
+    if (!(enc->hw_frame = av_frame_alloc())) {
+        av_free(enc);
+        return AVERROR(ENOMEM);
+    }
+    enc->cfg     = *cfg;
+    enc->bitrate = cfg->bitrate;
+    if (enc->cfg.codec_id == AV_CODEC_ID_NONE)
+        enc->cfg.codec_id = AV_CODEC_ID_H264;
+
+    if (cfg->backend && strcmp(cfg->backend, "auto")) {
+        const LLEncoderBackend *backend = ll_encoder_find_backend(cfg->backend, enc->cfg.codec_id);
+        if (!backend) {
+            fprintf(stderr, "No encoder backend %s for %s\n", cfg->backend,
+                    avcodec_get_name(enc->cfg.codec_id));
+            err = AVERROR(EINVAL);
+        } else
+            err = open_backend(enc, backend, cfg);
+    } else {
+        // Prefer the GPU, fall back to the CPU encoders on hosts without one
+        for (int i = 0; i < NB_BACKENDS; i++) {
+            if (backends[i].codec_id != enc->cfg.codec_id)
+                continue;
+            if ((err = open_backend(enc, &backends[i], cfg)) >= 0)
+                break;
+            close_backend(enc);
+            fprintf(stderr, "Encoder backend %s unavailable, trying next.\n", backends[i].name);
+        }
+    }
+
+    if (err < 0) {
+        ll_encoder_close(&enc);
+        return err;
+    }
+    fprintf(stderr, "Using encoder backend: %s (%s)\n", enc->backend->name, enc->backend->codec_name);
+    *penc = enc;
+    return 0;
+}
+
+int ll_encoder_upload(LLEncoder *enc, AVFrame *sw_frame, AVFrame *frame)
+{
+    int64_t t0 = ll_time_ns();
+    int ret;
+
+    if (!enc->backend->upload)
+        return av_frame_ref(frame, sw_frame);
+    if ((ret = enc->backend->upload(enc, sw_frame, frame)) < 0) {
+        av_frame_unref(frame);
+        return ret;
+    }
+    // pts and side data such as ROI hints
+    if ((ret = av_frame_copy_props(frame, sw_frame)) < 0) {
+        av_frame_unref(frame);
+        return ret;
+    }
+    enc->upload_ns += ll_time_ns() - t0;
+    return 0;
+}
+
+static int deliver_packet(LLEncoder *enc, AVPacket *pkt, LLPacketCallback cb, void *opaque)
+{
+    LLFrameInfo *frame_info = &enc->info[pkt->pts & (LL_ENCODER_MAX_DELAY - 1)];
+    int ret;
+
+    pkt->stream_index = 0;
+    enc->n_packets++;
+    enc->n_bytes += pkt->size;
+    enc->sq_bytes += (double)pkt->size * pkt->size;
+    enc->max_bytes = FFMAX(enc->max_bytes, pkt->size);
+    enc->n_keyframes += !!(pkt->flags & AV_PKT_FLAG_KEY);
+    ll_stamp(frame_info->stamps, LL_STAGE_ENCODE);
+    ret = cb(opaque, pkt, frame_info);
+    av_packet_unref(pkt);
+    return ret;
+}
+
+int ll_encoder_set_bitrate(LLEncoder *enc, int64_t bitrate)
+{
+    if (!enc->bitrate)
+        return AVERROR(EINVAL);     // constant quality
+    enc->pending_bitrate = bitrate != enc->bitrate ? bitrate : 0;
+    return 0;
+}
+
+void ll_encoder_request_keyframe(LLEncoder *enc)
+{
+    enc->force_keyframe = 1;
+}
+
+// Drain what the old context still holds, then start over with enc->cfg
+static int reopen(LLEncoder *enc, LLPacketCallback cb, void *opaque)
+{
+    AVPacket pkt;
+    int ret;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+    if ((ret = avcodec_send_frame(enc->avctx, NULL)) < 0)
+        return ret;
+    while (!(ret = avcodec_receive_packet(enc->avctx, &pkt)))
+        if ((ret = deliver_packet(enc, &pkt, cb, opaque)) < 0)
+            return ret;
+    if (ret != AVERROR_EOF)
+        return ret;
+    avcodec_free_context(&enc->avctx);
+    return open_context(enc, enc->backend, &enc->cfg);
+}
+
+static int apply_bitrate(LLEncoder *enc, LLPacketCallback cb, void *opaque)
+{
+    int64_t rate = enc->pending_bitrate, now = ll_time_ns();
+
+    if (!enc->backend->reconfigure &&
+        (FFABS(rate - enc->bitrate) < enc->bitrate / 10 ||
+         (rate > enc->bitrate && now - enc->reconfig_ns < 1000000000)))
+        return 0;
+    enc->pending_bitrate = 0;
+    enc->bitrate         = rate;
+    enc->reconfig_ns     = now;
+    enc->n_reconfigs++;
+    if (enc->backend->reconfigure)
+        return enc->backend->reconfigure(enc);
+    return reopen(enc, cb, opaque);
+}
+
+// A new context starts the stream over at the new size, with an IDR
+static int apply_size(LLEncoder *enc, int width, int height, LLPacketCallback cb, void *opaque)
+{
+    int ret;
+
+    enc->cfg.width  = width;
+    enc->cfg.height = height;
+    enc->n_resizes++;
+    if ((ret = reopen(enc, cb, opaque)) < 0)
+        fprintf(stderr, "Failed to resize the encoder to %dx%d\n", width, height);
+    return ret;
+}
+
+int ll_encoder_encode(LLEncoder *enc, AVFrame *frame, const LLFrameInfo *info,
+                      LLPacketCallback cb, void *opaque)
+{
+    int ret = 0;
+    int64_t t1;
+    LLFrameInfo *frame_info = NULL;
+    AVPacket enc_pkt;
+
+    av_init_packet(&enc_pkt);
+    enc_pkt.data = NULL;
+    enc_pkt.size = 0;
+
+    if (frame && enc->pending_bitrate && (ret = apply_bitrate(enc, cb, opaque)) < 0) {
+        fprintf(stderr, "Failed to change bitrate. Error code: %s\n", av_err2str(ret));
+        return ret;
+    }
+    if (frame && (frame->width != enc->cfg.width || frame->height != enc->cfg.height) &&
+        (ret = apply_size(enc, frame->width, frame->height, cb, opaque)) < 0)
+        return ret;
+    if (frame) {
+        if (frame->pts == AV_NOPTS_VALUE)
+            frame->pts = enc->n_frames;
+        frame_info = &enc->info[frame->pts & (LL_ENCODER_MAX_DELAY - 1)];
+        if (info)
+            *frame_info = *info;
+        else
+            memset(frame_info, 0, sizeof(*frame_info));
+        if (frame->format != enc->avctx->pix_fmt) {
+            av_frame_unref(enc->hw_frame);
+            if ((ret = ll_encoder_upload(enc, frame, enc->hw_frame)) < 0)
+                return ret;
+            frame = enc->hw_frame;
+            ll_stamp(frame_info->stamps, LL_STAGE_UPLOAD);
+        }
+        // Always set: captured and recycled frames may still say I
+        frame->pict_type = enc->force_keyframe ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+        enc->force_keyframe = 0;
+    }
+    t1 = ll_time_ns();
+
+    if ((ret = avcodec_send_frame(enc->avctx, frame)) < 0) {
+        fprintf(stderr, "Error code: %s\n", av_err2str(ret));
+        goto end;
+    }
+    while (1) {
+        ret = avcodec_receive_packet(enc->avctx, &enc_pkt);
+        if (ret)
+            break;
+        if ((ret = deliver_packet(enc, &enc_pkt, cb, opaque)) < 0)
+            return ret;
+    }
+
+end:
+    if (frame) {
+        enc->n_frames++;
+        enc->encode_ns += ll_time_ns() - t1;
+    }
+    if (ret == AVERROR_EOF)
+        return AVERROR_EOF;
+    ret = ((ret == AVERROR(EAGAIN)) ? 0 : -1);
+    return ret;
+}
+
+void ll_encoder_print_stats(const LLEncoder *enc, FILE *f)
+{
+    double n = enc->n_frames ? enc->n_frames : 1;
+
+    fprintf(f, "Encoder %s: %lld frames, upload %.3f ms/frame, encode %.3f ms/frame, %.1f kB/frame\n",
+            enc->backend->name, (long long)enc->n_frames,
+            enc->upload_ns / n / 1e6, enc->encode_ns / n / 1e6,
+            enc->n_bytes / n / 1e3);
+    if (enc->n_packets) {
+        double mean = (double)enc->n_bytes / enc->n_packets;
+        double var  = FFMAX(enc->sq_bytes / enc->n_packets - mean * mean, 0);
+
+        fprintf(f, "Encoder %s: %lld keyframes, frame size %.1f kB (stddev %.1f kB, max %.1f kB), %.0f kbps average\n",
+                enc->backend->name, (long long)enc->n_keyframes, mean / 1e3, sqrt(var) / 1e3,
+                enc->max_bytes / 1e3, mean * 8 * enc->cfg.fps / 1e3);
+    }
+    if (enc->cfg.bitrate)
+        fprintf(f, "Encoder %s: rate controlled, %.0f kbps now, %lld changes\n",
+                enc->backend->name, enc->bitrate / 1e3, (long long)enc->n_reconfigs);
+    if (enc->n_resizes)
+        fprintf(f, "Encoder %s: %lld size changes, %dx%d now\n", enc->backend->name,
+                (long long)enc->n_resizes, enc->cfg.width, enc->cfg.height);
+}
+
+void ll_encoder_close(LLEncoder **penc)
+{
+    LLEncoder *enc = *penc;
+
+    if (!enc)
+        return;
+    close_backend(enc);
+    av_frame_free(&enc->hw_frame);
+    av_freep(penc);
+}
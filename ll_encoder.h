@@ -0,0 +1,149 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_ENCODER_H
+#define LL_ENCODER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+
+#include "ll_common.h"
+#include "ll_latency.h"
+
+#define LL_ENCODER_MAX_DELAY 16
+
+typedef struct LLEncoder LLEncoder;
+
+// Per-frame data carried from ll_encoder_encode to the packet callback
+typedef struct LLFrameInfo {
+    int64_t stamps[LL_STAGE_NB];
+} LLFrameInfo;
+
+typedef struct LLEncoderConfig {
+    enum AVCodecID codec_id;    // H.264 (also for AV_CODEC_ID_NONE), HEVC or AV1
+    const char *backend;        // "vaapi", "x264", "openh264", "x265", "svtav1",
+                                // or NULL/"auto"; the codec narrows the choice
+    int width, height, fps;
+    int gop_size;               // 1 for all-intra
+    int intra_refresh;          // P-frames only, refreshing the picture over gop_size
+                                // frames (x264, x265; the others send an IDR every gop_size)
+    int slices;                 // per frame, 0 for the encoder's default
+    int roi;                    // frames may carry AV_FRAME_DATA_REGIONS_OF_INTEREST
+    int pool_size;              // hardware input surfaces, 0 for the default
+    int64_t bitrate;            // bits/s, 0 for constant quality
+    enum AVColorSpace colorspace; // of the input, signalled in the VUI; 0 for BT.601
+    AVBufferRef *hw_device_ctx; // VAAPI device shared with other encoders, NULL for one of its own
+} LLEncoderConfig;
+
+/*
+ * An encoder backend wraps one libavcodec encoder. Callers hand it software
+ * frames in backend->sw_format; hardware backends upload them themselves
+ * (upload is NULL for the others), so callers share one code path.
+ * reconfigure applies enc->bitrate to the running encoder; without it the
+ * encoder is drained and reopened.
+ */
+typedef struct LLEncoderBackend {
+    const char *name;
+    const char *codec_name;
+    enum AVCodecID codec_id;
+    enum AVPixelFormat sw_format;
+    int (*setup)(LLEncoder *enc, const LLEncoderConfig *cfg);
+    int (*upload)(LLEncoder *enc, AVFrame *sw_frame, AVFrame *frame);
+    int (*reconfigure)(LLEncoder *enc);
+} LLEncoderBackend;
+
+struct LLEncoder {
+    const LLEncoderBackend *backend;
+    AVCodecContext *avctx;
+    AVCodec *codec;
+    AVBufferRef *hw_device_ctx;
+    AVBufferRef *hw_frames_ctx;     // outlives avctx across reopens
+    AVFrame *hw_frame;
+    LLFrameInfo info[LL_ENCODER_MAX_DELAY];     // indexed by pts
+    LLEncoderConfig cfg;
+
+    int64_t bitrate;            // current target, 0 for constant quality
+    int64_t pending_bitrate;    // to apply before the next frame
+    int64_t reconfig_ns;
+    int force_keyframe;         // make the next frame an IDR
+
+    // Per-frame cost, so CPU and GPU backends can be compared on one path
+    int64_t n_frames;
+    int64_t n_packets;
+    int64_t n_bytes;
+    int64_t upload_ns;
+    int64_t encode_ns;
+    int64_t n_reconfigs;
+    int64_t n_resizes;
+    int64_t n_keyframes;
+    int64_t max_bytes;          // largest frame
+    double sq_bytes;            // sum of squared frame sizes, for the variance
+};
+
+// Called for every packet the encoder produces. The packet is unref'd after
+typedef int (*LLPacketCallback)(void *opaque, AVPacket *pkt, const LLFrameInfo *info);
+
+const LLEncoderBackend *ll_encoder_find_backend(const char *name, enum AVCodecID codec_id);
+
+int ll_encoder_open(LLEncoder **penc, const LLEncoderConfig *cfg);
+
+/*
+ * Turn a software frame into one the encoder accepts, e.g. a VAAPI surface,
+ * so that uploads can run ahead of encoding. frame must be blank.
+ */
+int ll_encoder_upload(LLEncoder *enc, AVFrame *sw_frame, AVFrame *frame);
+
+/*
+ * Encode one frame (NULL to flush) and pass every resulting packet to cb,
+ * along with the info given for the frame it came from. The frame is
+ * either a software frame or one returned by ll_encoder_upload. Frames
+ * may be smaller than configured: a change of size drains the encoder
+ * and restarts the stream at the new size with a keyframe.
+ */
+int ll_encoder_encode(LLEncoder *enc, AVFrame *frame, const LLFrameInfo *info,
+                      LLPacketCallback cb, void *opaque);
+
+/*
+ * Retarget a rate-controlled encoder; takes effect before the next frame
+ * is encoded. Backends that have to reopen (all but x264) restart the
+ * stream with a keyframe, so they take changes under 10% or increases
+ * within a second of the last change later. Call from the thread that
+ * encodes.
+ */
+int ll_encoder_set_bitrate(LLEncoder *enc, int64_t bitrate);
+
+/*
+ * Make the next frame encoded an IDR, e.g. when a receiver lost sync or
+ * joined late. Call from the thread that encodes.
+ */
+void ll_encoder_request_keyframe(LLEncoder *enc);
+
+void ll_encoder_print_stats(const LLEncoder *enc, FILE *f);
+
+void ll_encoder_close(LLEncoder **penc);
+
+#endif
@@ -0,0 +1,143 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+
+#include "ll_fec.h"
+
+void ll_fec_encoder_init(LLFecEncoder *f, int overhead, int adaptive)
+{
+    memset(f, 0, sizeof(*f));
+    f->adaptive = adaptive;
+    if (overhead > 0 || adaptive)
+        f->group_size = av_clip(overhead > 0 ? lrint(100.0 / overhead) : LL_FEC_MAX_GROUP,
+                                LL_FEC_MIN_GROUP, LL_FEC_MAX_GROUP);
+    f->first = 1;
+}
+
+void ll_fec_xor(uint8_t *dst, const uint8_t *src, int size)
+{
+    // Plain loop; the compiler vectorises it
+    for (int i = 0; i < size; i++)
+        dst[i] ^= src[i];
+}
+
+int ll_fec_add(LLFecEncoder *f, uint16_t seq, const uint8_t *hdr, int hdr_size,
+               const uint8_t *payload, int size)
+{
+    int len = hdr_size + size;
+
+    if (len > LL_FEC_MAX_PACKET)
+        return 0;
+    if (!f->count) {
+        f->base_seq = seq;
+        f->size = 0;
+    }
+    if (len > f->size) {
+        memset(f->parity + f->size, 0, len - f->size);
+        f->size = len;
+    }
+    ll_fec_xor(f->parity, hdr, hdr_size);
+    ll_fec_xor(f->parity + hdr_size, payload, size);
+    f->length_xor ^= len;
+    return ++f->count >= f->group_size;
+}
+
+int ll_fec_finish(LLFecEncoder *f, uint8_t *buf, int last)
+{
+    if (!f->count)
+        return 0;
+    AV_WB16(buf, f->base_seq);
+    buf[2] = f->count;
+    buf[3] = (f->first ? LL_FEC_FLAG_FIRST : 0) | (last ? LL_FEC_FLAG_LAST : 0);
+    AV_WB16(buf + 4, f->length_xor);
+    AV_WB16(buf + 6, 0);
+
+    f->packets++;
+    f->bytes += LL_FEC_HEADER_SIZE + f->size;
+    f->first = last;
+    f->count = 0;
+    f->length_xor = 0;
+    // The caller sends f->parity before the next ll_fec_add clears it
+    return LL_FEC_HEADER_SIZE;
+}
+
+void ll_fec_update_loss(LLFecEncoder *f, double loss)
+{
+    int k;
+
+    f->loss = 0.75 * f->loss + 0.25 * loss;
+    if (!f->adaptive)
+        return;
+    /*
+     * A group of k media packets and its parity fails when two of the
+     * k + 1 are lost, with probability about (k + 1) * k / 2 * p^2. Keep
+     * that near 1%: k ~ sqrt(0.02) / p.
+     */
+    k = f->loss > 0 ? lrint(0.14 / f->loss) : LL_FEC_MAX_GROUP;
+    f->group_size = av_clip(k, LL_FEC_MIN_GROUP, LL_FEC_MAX_GROUP);
+}
+
+void ll_fec_print_stats(const LLFecEncoder *f, uint64_t media_packets, FILE *out)
+{
+    if (!ll_fec_enabled(f))
+        return;
+    fprintf(out, "FEC: %llu parity packets, %.1f MB, %.1f%% overhead, group %d%s, reported loss %.2f%%\n",
+            (unsigned long long)f->packets, f->bytes / 1e6,
+            media_packets ? 100.0 * f->packets / media_packets : 0.0,
+            f->group_size, f->adaptive ? " (adaptive)" : "", 100 * f->loss);
+}
+
+int ll_fec_parse_header(const uint8_t *buf, int size, LLFecHeader *hdr)
+{
+    if (size <= LL_FEC_HEADER_SIZE)
+        return AVERROR_INVALIDDATA;
+    hdr->base_seq   = AV_RB16(buf);
+    hdr->count      = buf[2];
+    hdr->flags      = buf[3];
+    hdr->length_xor = AV_RB16(buf + 4);
+    return hdr->count ? LL_FEC_HEADER_SIZE : AVERROR_INVALIDDATA;
+}
+
+int ll_fec_recover(const LLFecHeader *hdr, const uint8_t *parity, int parity_size,
+                   const uint8_t * const *pkts, const int *sizes, int nb, uint8_t *out)
+{
+    int len = hdr->length_xor;
+
+    if (parity_size > LL_FEC_MAX_PACKET)
+        return AVERROR_INVALIDDATA;
+    memcpy(out, parity, parity_size);
+    for (int i = 0; i < nb; i++) {
+        if (sizes[i] > parity_size)
+            return AVERROR_INVALIDDATA;
+        ll_fec_xor(out, pkts[i], sizes[i]);
+        len ^= sizes[i];
+    }
+    return len > 0 && len <= parity_size ? len : AVERROR_INVALIDDATA;
+}
@@ -0,0 +1,124 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_FEC_H
+#define LL_FEC_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * XOR forward error correction for the RTP transport. Media packets are
+ * taken in groups of group_size consecutive sequence numbers and each
+ * group gets one parity packet: the XOR of the whole datagrams, zero
+ * padded to the longest, and of their lengths. Any single loss in a
+ * group can be rebuilt from the rest, without waiting a round trip.
+ *
+ * Groups never span frames, so the last group of a frame is closed, and
+ * its parity sent, right after the frame's last packet. Parity packets
+ * carry their frame's RTP timestamp and say whether they cover its first
+ * and last packet, which gives the receiver the frame's boundaries even
+ * when the packets that mark them are lost.
+ *
+ * Parity payload:
+ *
+ *   0  u16 base_seq         first media sequence number covered
+ *   2  u8  count            consecutive packets covered
+ *   3  u8  flags            LL_FEC_FLAG_*
+ *   4  u16 length_xor       XOR of the covered datagram lengths
+ *   6  u16 reserved
+ *   8  parity bytes
+ */
+
+#define LL_FEC_MAX_PACKET       9216
+#define LL_FEC_HEADER_SIZE      8
+#define LL_FEC_FLAG_FIRST       0x01    // group starts its frame
+#define LL_FEC_FLAG_LAST        0x02    // group ends its frame
+
+#define LL_FEC_MIN_GROUP        2       // 50% overhead
+#define LL_FEC_MAX_GROUP        20      // 5% overhead
+
+typedef struct LLFecEncoder {
+    int group_size;             // media packets per parity packet, 0 when off
+    int adaptive;               // pick group_size from the reported loss
+    double loss;                // smoothed loss fraction from receiver reports
+
+    // Group being built
+    int count;
+    uint16_t base_seq;
+    uint16_t length_xor;
+    int size;
+    int first;
+    uint8_t parity[LL_FEC_MAX_PACKET];
+
+    uint64_t packets;           // parity packets sent
+    uint64_t bytes;
+} LLFecEncoder;
+
+typedef struct LLFecHeader {
+    uint16_t base_seq;
+    int count;
+    int flags;
+    uint16_t length_xor;
+} LLFecHeader;
+
+// overhead in percent of media packets; adaptive starts there and follows the loss
+void ll_fec_encoder_init(LLFecEncoder *f, int overhead, int adaptive);
+
+static inline int ll_fec_enabled(const LLFecEncoder *f)
+{
+    return f->group_size > 0;
+}
+
+// Add a media datagram given in two pieces; 1 when the group is full
+int ll_fec_add(LLFecEncoder *f, uint16_t seq, const uint8_t *hdr, int hdr_size,
+               const uint8_t *payload, int size);
+
+/*
+ * Close the current group: writes the parity header to buf and returns
+ * its size (0 if the group is empty); the parity bytes are f->parity,
+ * f->size long. last marks the final group of the frame.
+ */
+int ll_fec_finish(LLFecEncoder *f, uint8_t *buf, int last);
+
+// Feed the loss fraction (0..1) a receiver report measured before recovery
+void ll_fec_update_loss(LLFecEncoder *f, double loss);
+
+int ll_fec_parse_header(const uint8_t *buf, int size, LLFecHeader *hdr);
+
+// media_packets is what the parity protected, for the overhead
+void ll_fec_print_stats(const LLFecEncoder *f, uint64_t media_packets, FILE *out);
+
+// dst ^= src
+void ll_fec_xor(uint8_t *dst, const uint8_t *src, int size);
+
+/*
+ * Rebuild the one missing datagram of a group into out (LL_FEC_MAX_PACKET
+ * bytes) from the parity payload and the nb present datagrams. Returns its
+ * size, or AVERROR_INVALIDDATA.
+ */
+int ll_fec_recover(const LLFecHeader *hdr, const uint8_t *parity, int parity_size,
+                   const uint8_t * const *pkts, const int *sizes, int nb, uint8_t *out);
+
+#endif
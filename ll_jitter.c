@@ -0,0 +1,180 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "ll_jitter.h"
+
+#define JITTER_MARGIN   1000000     // ns on top of the peak, for scheduling
+#define BASE_DRIFT      10          // the base creeps up by 2^-BASE_DRIFT of the excess
+#define PEAK_DECAY      6           // the peak falls by 2^-PEAK_DECAY of the gap per frame
+
+void ll_jitter_init(LLJitterBuffer *jb, int64_t budget_ns)
+{
+    memset(jb, 0, sizeof(*jb));
+    jb->budget_ns = budget_ns;
+    ll_histogram_reset(&jb->held);
+}
+
+static LLJitterFrame *frame_at(LLJitterBuffer *jb, int i)
+{
+    return &jb->frames[(jb->head + i) % LL_JITTER_MAX_FRAMES];
+}
+
+static int64_t capture_ns(const LLJitterFrame *f)
+{
+    // Without the sender's stamps there is nothing to measure against
+    return f->hdr.stamps[LL_STAGE_CAPTURE] ? f->hdr.stamps[LL_STAGE_CAPTURE] : f->arrival_ns;
+}
+
+static void drop(LLJitterBuffer *jb, int n)
+{
+    jb->head = (jb->head + n) % LL_JITTER_MAX_FRAMES;
+    jb->count -= n;
+    jb->dropped += n;
+}
+
+// Drop everything before the newest keyframe; 0 if there is none to go to
+static int skip_to_keyframe(LLJitterBuffer *jb)
+{
+    for (int i = jb->count - 1; i > 0; i--) {
+        if (frame_at(jb, i)->hdr.flags & LL_WIRE_FLAG_KEYFRAME) {
+            drop(jb, i);
+            jb->skips++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void update_target(LLJitterBuffer *jb, int64_t transit)
+{
+    int64_t extra;
+
+    if (!jb->have_base || transit < jb->base_transit) {
+        jb->base_transit = transit;
+        jb->have_base = 1;
+    } else {
+        // Follow a sender clock that runs slow, without chasing spikes
+        jb->base_transit += (transit - jb->base_transit) >> BASE_DRIFT;
+    }
+    extra = transit - jb->base_transit;
+    // A stall longer than the budget is caught up by skipping, not absorbed
+    if (extra > jb->budget_ns)
+        return;
+    if (extra > jb->peak_ns)
+        jb->peak_ns = extra;
+    else
+        jb->peak_ns -= (jb->peak_ns - extra) >> PEAK_DECAY;
+    jb->target_ns = FFMIN(jb->peak_ns + JITTER_MARGIN, jb->budget_ns);
+}
+
+int ll_jitter_put(LLJitterBuffer *jb, const LLWireHeader *hdr, const uint8_t *data, int size,
+                  int64_t arrival_ns)
+{
+    LLJitterFrame *f;
+
+    // Full: the output has stalled, catch up as when falling behind
+    if (jb->count == LL_JITTER_MAX_FRAMES && !skip_to_keyframe(jb)) {
+        drop(jb, 1);
+        jb->need_keyframe = 1;
+    }
+    f = frame_at(jb, jb->count);
+    av_fast_padded_malloc(&f->data, &f->alloc, size);
+    if (!f->data)
+        return AVERROR(ENOMEM);
+    memcpy(f->data, data, size);
+    f->size       = size;
+    f->hdr        = *hdr;
+    f->arrival_ns = arrival_ns;
+    jb->count++;
+    jb->frames_in++;
+
+    update_target(jb, arrival_ns - capture_ns(f));
+    f->due_ns = capture_ns(f) + jb->base_transit + jb->target_ns;
+    return 0;
+}
+
+static LLJitterFrame *release(LLJitterBuffer *jb, int64_t now)
+{
+    LLJitterFrame *f = frame_at(jb, 0);
+
+    jb->depth_sum += jb->count;
+    jb->max_depth  = FFMAX(jb->max_depth, jb->count);
+    ll_histogram_record(&jb->held, (now - f->arrival_ns) / 1000);
+    jb->head = (jb->head + 1) % LL_JITTER_MAX_FRAMES;
+    jb->count--;
+    jb->frames_out++;
+    return f;
+}
+
+LLJitterFrame *ll_jitter_get(LLJitterBuffer *jb, int64_t now, int64_t *wait_ns)
+{
+    LLJitterFrame *f;
+
+    *wait_ns = -1;
+    if (!jb->count)
+        return NULL;
+    f = frame_at(jb, 0);
+    // How far behind the fastest path the output would be
+    if (now - (capture_ns(f) + jb->base_transit) > jb->budget_ns) {
+        if (skip_to_keyframe(jb))
+            f = frame_at(jb, 0);
+        else if (!(f->hdr.flags & LL_WIRE_FLAG_KEYFRAME))
+            jb->need_keyframe = 1;
+    }
+    if (f->due_ns > now) {
+        *wait_ns = f->due_ns - now;
+        return NULL;
+    }
+    return release(jb, now);
+}
+
+LLJitterFrame *ll_jitter_pop(LLJitterBuffer *jb)
+{
+    return jb->count ? release(jb, ll_realtime_ns()) : NULL;
+}
+
+void ll_jitter_print_stats(const LLJitterBuffer *jb, FILE *f)
+{
+    fprintf(f, "Jitter buffer: %llu frames in, %llu out, %llu dropped in %llu skips, "
+               "depth %.1f average %d max, held p50 %.2f p99 %.2f ms, target %.2f ms\n",
+            (unsigned long long)jb->frames_in, (unsigned long long)jb->frames_out,
+            (unsigned long long)jb->dropped, (unsigned long long)jb->skips,
+            (double)jb->depth_sum / FFMAX(jb->frames_out, 1), jb->max_depth,
+            ll_histogram_percentile(&jb->held, 50) / 1e3,
+            ll_histogram_percentile(&jb->held, 99) / 1e3, jb->target_ns / 1e6);
+}
+
+void ll_jitter_free(LLJitterBuffer *jb)
+{
+    for (int i = 0; i < LL_JITTER_MAX_FRAMES; i++)
+        av_freep(&jb->frames[i].data);
+    jb->count = 0;
+}
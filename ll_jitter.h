@@ -0,0 +1,100 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_JITTER_H
+#define LL_JITTER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ll_latency.h"
+#include "ll_wire.h"
+
+/*
+ * Receiver-side jitter buffer. Frames are held until their capture time
+ * plus the smallest transit seen lately plus a target delay, so that a
+ * frame delayed by the network up to the target still comes out on time
+ * and the output keeps the sender's pace. The target follows the recent
+ * peak of the extra transit: it grows at once when a frame is late and
+ * shrinks slowly while the network is calm.
+ *
+ * Sender and receiver clocks need not agree, only run at the same rate.
+ * When the oldest frame is more than the latency budget behind, the
+ * buffer skips ahead to the newest keyframe it holds, dropping what came
+ * before; without one, it asks for a keyframe through need_keyframe.
+ */
+
+#define LL_JITTER_MAX_FRAMES 64
+
+typedef struct LLJitterFrame {
+    LLWireHeader hdr;
+    uint8_t *data;              // padded for libavcodec
+    unsigned int alloc;
+    int size;
+    int64_t arrival_ns;         // CLOCK_REALTIME, as the stamps
+    int64_t due_ns;             // when it is to come out
+} LLJitterFrame;
+
+typedef struct LLJitterBuffer {
+    LLJitterFrame frames[LL_JITTER_MAX_FRAMES];
+    int head, count;
+    int64_t budget_ns;          // at most this much behind the fastest transit
+    int need_keyframe;          // behind with no keyframe to skip to; cleared by the caller
+
+    int have_base;
+    int64_t base_transit;       // smallest arrival - capture lately
+    int64_t peak_ns;            // recent peak of the transit above the base
+    int64_t target_ns;          // delay added to the fastest frames
+
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t dropped;           // skipped over to catch up, or overflowed
+    uint64_t skips;
+    uint64_t depth_sum;         // frames held, summed at every release
+    int max_depth;
+    LLHistogram held;           // time in the buffer, us
+} LLJitterBuffer;
+
+void ll_jitter_init(LLJitterBuffer *jb, int64_t budget_ns);
+
+// Queue a copy of a frame that arrived at arrival_ns
+int ll_jitter_put(LLJitterBuffer *jb, const LLWireHeader *hdr, const uint8_t *data, int size,
+                  int64_t arrival_ns);
+
+/*
+ * The oldest frame if it is due at now, after skipping ahead if the
+ * buffer fell behind; else NULL, with *wait_ns set to the time until the
+ * next one is due (-1 if empty). The frame stays valid until the next
+ * ll_jitter_put.
+ */
+LLJitterFrame *ll_jitter_get(LLJitterBuffer *jb, int64_t now, int64_t *wait_ns);
+
+// The oldest frame whether due or not, to drain the buffer at the end
+LLJitterFrame *ll_jitter_pop(LLJitterBuffer *jb);
+
+void ll_jitter_print_stats(const LLJitterBuffer *jb, FILE *f);
+
+void ll_jitter_free(LLJitterBuffer *jb);
+
+#endif
@@ -0,0 +1,139 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <libavutil/common.h>
+
+#include "ll_ladder.h"
+
+#define SMOOTHING       8           // frames the encode time is averaged over
+#define BUSY_HIGH       0.85        // of the frame interval: encoding falls behind
+#define BUSY_LOW        0.5         // predicted for the rung above: room to step up
+#define QUEUE_HIGH      2           // frames waiting to be sent
+#define BPP_LOW         0.04        // bits per pixel too few for the rung
+#define BPP_HIGH        0.1         // enough for the rung above
+#define DOWN_FRAMES     4           // in a row under pressure
+#define MIN_HOLD        1000000000LL    // ns between switches
+#define UP_HOLD         2000000000LL    // calm before stepping up
+#define MAX_UP_HOLD     32000000000LL
+#define UNDO_WINDOW     5000000000LL    // a step down this soon after a step up undoes it
+
+void ll_ladder_init(LLLadder *l, int width, int height, int fps, int nb_rungs)
+{
+    memset(l, 0, sizeof(*l));
+    l->nb_rungs    = av_clip(nb_rungs, 1, LL_LADDER_MAX_RUNGS);
+    l->fps         = fps;
+    l->interval_ns = 1000000000LL / fps;
+    l->up_hold_ns  = UP_HOLD;
+    for (int i = 0; i < l->nb_rungs; i++) {
+        // Even sizes for 4:2:0
+        l->rungs[i].width  = FFMAX((width  * (4 - i) / 4) & ~1, 2);
+        l->rungs[i].height = FFMAX((height * (4 - i) / 4) & ~1, 2);
+    }
+}
+
+static double area(const LLLadder *l, int rung)
+{
+    return (double)l->rungs[rung].width * l->rungs[rung].height;
+}
+
+static void step(LLLadder *l, int rung, const char *reason, int queued, double bpp, int64_t now)
+{
+    fprintf(stderr, "Ladder: %dx%d -> %dx%d (%s; encode %.2f ms, %d queued, %.3f bits/pixel)\n",
+            l->rungs[l->rung].width, l->rungs[l->rung].height,
+            l->rungs[rung].width, l->rungs[rung].height,
+            reason, l->encode_ns / 1e6, queued, bpp);
+    // The old rung's times say little about the new one but for its area
+    l->encode_ns *= area(l, rung) / area(l, l->rung);
+    l->last_up   = rung < l->rung;
+    l->rung      = rung;
+    l->switch_ns = now;
+    l->pressure  = 0;
+    l->calm_ns   = 0;
+}
+
+int ll_ladder_update(LLLadder *l, int64_t encode_ns, int queued, int64_t bitrate, int64_t now)
+{
+    const char *reason = NULL;
+    double bpp = bitrate ? bitrate / (area(l, l->rung) * l->fps) : 0;
+
+    l->frames[l->rung]++;
+    l->encode_ns += (encode_ns - l->encode_ns) / SMOOTHING;
+    if (l->nb_rungs < 2)
+        return 0;
+
+    if (l->encode_ns > BUSY_HIGH * l->interval_ns)
+        reason = "encode time";
+    else if (queued >= QUEUE_HIGH)
+        reason = "send queue";
+    else if (bitrate && bpp < BPP_LOW)
+        reason = "bitrate";
+    l->pressure = reason ? l->pressure + 1 : 0;
+
+    if (reason && l->pressure >= DOWN_FRAMES && l->rung < l->nb_rungs - 1 &&
+        now - l->switch_ns >= MIN_HOLD) {
+        // Hysteresis: a step up that did not hold waits longer next time
+        if (l->last_up && now - l->switch_ns < UNDO_WINDOW) {
+            l->up_hold_ns = FFMIN(l->up_hold_ns * 2, MAX_UP_HOLD);
+            fprintf(stderr, "Ladder: %dx%d did not hold, %.0f s of calm before trying again\n",
+                    l->rungs[l->rung].width, l->rungs[l->rung].height, l->up_hold_ns / 1e9);
+        } else
+            l->up_hold_ns = UP_HOLD;
+        step(l, l->rung + 1, reason, queued, bpp, now);
+        l->downs++;
+        return 1;
+    }
+
+    if (l->rung > 0) {
+        double ratio = area(l, l->rung - 1) / area(l, l->rung);
+        int room = !reason && !queued && l->encode_ns * ratio < BUSY_LOW * l->interval_ns &&
+                   (!bitrate || bpp / ratio >= BPP_HIGH);
+
+        if (!room)
+            l->calm_ns = 0;
+        else if (!l->calm_ns)
+            l->calm_ns = now;
+        if (room && now - l->calm_ns >= l->up_hold_ns && now - l->switch_ns >= MIN_HOLD) {
+            step(l, l->rung - 1, "room", queued, bpp, now);
+            l->ups++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void ll_ladder_print_stats(const LLLadder *l, FILE *f)
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i < l->nb_rungs; i++)
+        total += l->frames[i];
+    fprintf(f, "Ladder: %llu steps down, %llu up, now %dx%d;", (unsigned long long)l->downs,
+            (unsigned long long)l->ups, l->rungs[l->rung].width, l->rungs[l->rung].height);
+    for (int i = 0; i < l->nb_rungs; i++)
+        fprintf(f, " %dx%d %.1f%%", l->rungs[i].width, l->rungs[i].height,
+                100.0 * l->frames[i] / FFMAX(total, 1));
+    fprintf(f, "\n");
+}
@@ -0,0 +1,83 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_LADDER_H
+#define LL_LADDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Resolution ladder for the sender: when encoding or sending cannot keep
+ * up, step down to a smaller picture rather than let frames queue up,
+ * and back up once there is room again. Rungs are 4/4, 3/4, 2/4 and 1/4
+ * of the configured size.
+ *
+ * Pressure is any of: the smoothed encode time near the frame interval,
+ * frames waiting to be sent, or (when rate controlled) too few bits per
+ * pixel at the current rung. A few frames of it in a row step down. A
+ * step up needs the rung above to look affordable (encode time scaled by
+ * area, nothing queued, enough bits per pixel) for a while; when a step
+ * up does not hold, that while doubles. Switches are at least a second
+ * apart.
+ */
+
+#define LL_LADDER_MAX_RUNGS 4
+
+typedef struct LLLadderRung {
+    int width, height;
+} LLLadderRung;
+
+typedef struct LLLadder {
+    LLLadderRung rungs[LL_LADDER_MAX_RUNGS];    // largest first
+    int nb_rungs;
+    int rung;                   // current
+    int fps;
+    int64_t interval_ns;
+
+    double encode_ns;           // smoothed per frame
+    int pressure;               // frames in a row under pressure
+    int64_t calm_ns;            // since when the rung above looked affordable, 0 if not
+    int64_t switch_ns;
+    int last_up;                // the last switch was a step up
+    int64_t up_hold_ns;         // calm needed before stepping up
+
+    uint64_t downs, ups;
+    uint64_t frames[LL_LADDER_MAX_RUNGS];
+} LLLadder;
+
+// nb_rungs 1 keeps the size fixed
+void ll_ladder_init(LLLadder *l, int width, int height, int fps, int nb_rungs);
+
+/*
+ * Account for one frame: the time it took to encode and send, the frames
+ * still waiting to be sent, and the target bitrate (0 if not rate
+ * controlled). Returns 1 when the rung changed; switches are logged to
+ * stderr.
+ */
+int ll_ladder_update(LLLadder *l, int64_t encode_ns, int queued, int64_t bitrate, int64_t now);
+
+void ll_ladder_print_stats(const LLLadder *l, FILE *f);
+
+#endif
@@ -0,0 +1,181 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "ll_latency.h"
+
+#define SUB_COUNT   (1 << LL_HIST_SUB_BITS)
+#define HALF_COUNT  (SUB_COUNT >> 1)
+
+static const char *stage_names[LL_STAGE_NB] = {
+    "capture", "convert", "upload", "encode", "send",
+    "receive", "decode", "download", "output",
+};
+
+const char *ll_stage_name(int stage)
+{
+    return stage >= 0 && stage < LL_STAGE_NB ? stage_names[stage] : "total";
+}
+
+void ll_histogram_reset(LLHistogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+static int bucket_index(uint64_t v)
+{
+    int shift;
+
+    if (v < SUB_COUNT)
+        return v;
+    shift = 63 - __builtin_clzll(v) - (LL_HIST_SUB_BITS - 1);
+    if (shift > LL_HIST_MAX_SHIFT)
+        return LL_HIST_BUCKETS - 1;
+    return shift * HALF_COUNT + (v >> shift);
+}
+
+static int64_t bucket_highest(int idx)
+{
+    int shift;
+
+    if (idx < SUB_COUNT)
+        return idx;
+    shift = idx / HALF_COUNT - 1;
+    return ((int64_t)(idx % HALF_COUNT + HALF_COUNT + 1) << shift) - 1;
+}
+
+void ll_histogram_record(LLHistogram *h, int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    if (!h->count || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->count++;
+    h->sum += value;
+    h->buckets[bucket_index(value)]++;
+}
+
+int64_t ll_histogram_percentile(const LLHistogram *h, double p)
+{
+    uint64_t target, seen = 0;
+
+    if (!h->count)
+        return 0;
+    target = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if (target < 1)
+        target = 1;
+    for (int i = 0; i < LL_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target)
+            return bucket_highest(i) < h->max ? bucket_highest(i) : h->max;
+    }
+    return h->max;
+}
+
+void ll_latency_init(LLLatencyStats *s, int64_t interval_ns)
+{
+    memset(s, 0, sizeof(*s));
+    s->interval_ns = interval_ns;
+    s->last_report_ns = ll_time_ns();
+    s->report = stderr;
+}
+
+void ll_latency_record(LLLatencyStats *s, const int64_t *stamps)
+{
+    int prev = -1, last = -1;
+
+    if (!stamps[LL_STAGE_CAPTURE])
+        return;
+    for (int i = 0; i < LL_STAGE_NB; i++) {
+        if (!stamps[i])
+            continue;
+        if (prev >= 0)
+            ll_histogram_record(&s->stage[i], (stamps[i] - stamps[prev]) / 1000);
+        prev = last = i;
+    }
+    if (last > LL_STAGE_CAPTURE)
+        ll_histogram_record(&s->total, (stamps[last] - stamps[LL_STAGE_CAPTURE]) / 1000);
+}
+
+static void print_histogram(FILE *f, const char *name, const LLHistogram *h)
+{
+    fprintf(f, "  %-9s %8llu frames  p50 %8.2f  p99 %8.2f  p99.9 %8.2f  max %8.2f ms\n",
+            name, (unsigned long long)h->count,
+            ll_histogram_percentile(h, 50) / 1e3,
+            ll_histogram_percentile(h, 99) / 1e3,
+            ll_histogram_percentile(h, 99.9) / 1e3,
+            h->max / 1e3);
+}
+
+void ll_latency_print(const LLLatencyStats *s, FILE *f)
+{
+    fprintf(f, "Latency per stage:\n");
+    for (int i = 0; i < LL_STAGE_NB; i++)
+        if (s->stage[i].count)
+            print_histogram(f, stage_names[i], &s->stage[i]);
+    print_histogram(f, "total", &s->total);
+}
+
+static void export_histogram(FILE *f, const char *name, const LLHistogram *h)
+{
+    fprintf(f, "\"%s\":{\"count\":%llu,\"p50_us\":%lld,\"p99_us\":%lld,\"p999_us\":%lld,\"max_us\":%lld}",
+            name, (unsigned long long)h->count,
+            (long long)ll_histogram_percentile(h, 50),
+            (long long)ll_histogram_percentile(h, 99),
+            (long long)ll_histogram_percentile(h, 99.9),
+            (long long)h->max);
+}
+
+void ll_latency_export(const LLLatencyStats *s, FILE *f)
+{
+    fprintf(f, "{\"time_ns\":%lld,", (long long)ll_realtime_ns());
+    for (int i = 0; i < LL_STAGE_NB; i++) {
+        if (!s->stage[i].count)
+            continue;
+        export_histogram(f, stage_names[i], &s->stage[i]);
+        fputc(',', f);
+    }
+    export_histogram(f, "total", &s->total);
+    fprintf(f, "}\n");
+    fflush(f);
+}
+
+void ll_latency_tick(LLLatencyStats *s)
+{
+    int64_t now = ll_time_ns();
+
+    if (!s->interval_ns || now - s->last_report_ns < s->interval_ns)
+        return;
+    s->last_report_ns = now;
+    if (s->report)
+        ll_latency_print(s, s->report);
+    if (s->export)
+        ll_latency_export(s, s->export);
+    for (int i = 0; i < LL_STAGE_NB; i++)
+        ll_histogram_reset(&s->stage[i]);
+    ll_histogram_reset(&s->total);
+}
@@ -0,0 +1,100 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_LATENCY_H
+#define LL_LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ll_common.h"
+
+/*
+ * Every frame is stamped (CLOCK_REALTIME, ns) at the end of each stage.
+ * Sender stamps travel in the wire header, so the receiver sees the whole
+ * path; comparing them across hosts assumes the clocks are synchronised.
+ */
+enum LLStage {
+    LL_STAGE_CAPTURE,
+    LL_STAGE_CONVERT,
+    LL_STAGE_UPLOAD,
+    LL_STAGE_ENCODE,
+    LL_STAGE_SEND,
+    LL_STAGE_RECEIVE,
+    LL_STAGE_DECODE,
+    LL_STAGE_DOWNLOAD,
+    LL_STAGE_OUTPUT,
+    LL_STAGE_NB
+};
+
+static inline void ll_stamp(int64_t *stamps, enum LLStage stage)
+{
+    stamps[stage] = ll_realtime_ns();
+}
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: values below 128 get
+ * their own bucket, above that each power of two is split in 64, so every
+ * recorded value keeps two significant digits. Values are microseconds.
+ */
+#define LL_HIST_SUB_BITS    7
+#define LL_HIST_MAX_SHIFT   36
+#define LL_HIST_BUCKETS     ((LL_HIST_MAX_SHIFT + 2) << (LL_HIST_SUB_BITS - 1))
+
+typedef struct LLHistogram {
+    uint64_t count;
+    int64_t min, max;
+    double sum;
+    uint32_t buckets[LL_HIST_BUCKETS];
+} LLHistogram;
+
+void ll_histogram_reset(LLHistogram *h);
+void ll_histogram_record(LLHistogram *h, int64_t value);
+
+// Highest value equivalent to the p-th percentile, p in [0, 100]
+int64_t ll_histogram_percentile(const LLHistogram *h, double p);
+
+typedef struct LLLatencyStats {
+    LLHistogram stage[LL_STAGE_NB];     // time spent in each stage
+    LLHistogram total;                  // capture to the last stamped stage
+    int64_t interval_ns;                // 0 disables periodic reports
+    int64_t last_report_ns;
+    FILE *report;                       // human readable, e.g. stderr
+    FILE *export;                       // one JSON object per report
+} LLLatencyStats;
+
+const char *ll_stage_name(int stage);
+
+void ll_latency_init(LLLatencyStats *s, int64_t interval_ns);
+
+// Record one frame; stages with a zero stamp were skipped
+void ll_latency_record(LLLatencyStats *s, const int64_t *stamps);
+
+// Report and reset if the interval has elapsed
+void ll_latency_tick(LLLatencyStats *s);
+
+void ll_latency_print(const LLLatencyStats *s, FILE *f);
+void ll_latency_export(const LLLatencyStats *s, FILE *f);
+
+#endif
@@ -0,0 +1,118 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/mem.h>
+
+#include "ll_mailbox.h"
+
+int ll_mailbox_init(LLMailbox *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->back  = 0;
+    m->ready = 1;
+    m->front = 2;
+    if (pthread_mutex_init(&m->lock, NULL))
+        return AVERROR(ENOMEM);
+    if (pthread_cond_init(&m->cond, NULL)) {
+        pthread_mutex_destroy(&m->lock);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+LLMailboxSlot *ll_mailbox_back(LLMailbox *m, int size)
+{
+    // Only the producer touches the back slot, no lock needed
+    LLMailboxSlot *s = &m->slots[m->back];
+
+    av_fast_malloc(&s->data, &s->alloc, size);
+    if (!s->data)
+        return NULL;
+    s->size = size;
+    return s;
+}
+
+void ll_mailbox_post(LLMailbox *m)
+{
+    int tmp;
+
+    pthread_mutex_lock(&m->lock);
+    tmp      = m->ready;
+    m->ready = m->back;
+    m->back  = tmp;
+    if (m->fresh)
+        m->overwritten++;
+    m->fresh = 1;
+    m->posted++;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+}
+
+LLMailboxSlot *ll_mailbox_take(LLMailbox *m)
+{
+    LLMailboxSlot *s = NULL;
+    int tmp;
+
+    pthread_mutex_lock(&m->lock);
+    while (!m->fresh && !m->closed)
+        pthread_cond_wait(&m->cond, &m->lock);
+    if (m->fresh) {
+        tmp      = m->front;
+        m->front = m->ready;
+        m->ready = tmp;
+        m->fresh = 0;
+        m->taken++;
+        s = &m->slots[m->front];
+    }
+    pthread_mutex_unlock(&m->lock);
+    return s;
+}
+
+void ll_mailbox_close(LLMailbox *m)
+{
+    pthread_mutex_lock(&m->lock);
+    m->closed = 1;
+    pthread_cond_signal(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+}
+
+void ll_mailbox_print_stats(const LLMailbox *m, const char *name, FILE *f)
+{
+    fprintf(f, "%s: %llu frames posted, %llu taken, %llu overwritten (%.1f%%)\n", name,
+            (unsigned long long)m->posted, (unsigned long long)m->taken,
+            (unsigned long long)m->overwritten,
+            m->posted ? 100.0 * m->overwritten / m->posted : 0.0);
+}
+
+void ll_mailbox_free(LLMailbox *m)
+{
+    for (int i = 0; i < LL_MAILBOX_SLOTS; i++)
+        av_freep(&m->slots[i].data);
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+}
@@ -0,0 +1,90 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_MAILBOX_H
+#define LL_MAILBOX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ll_latency.h"
+
+/*
+ * Latest-frame-wins handoff between a producer that must never wait and
+ * a consumer that may be slow, as a triple buffer: the producer fills the
+ * back slot and swaps it with the ready one, the consumer swaps the ready
+ * slot with the one it reads from. A frame posted while the previous one
+ * is still unread replaces it and is counted as overwritten, so the
+ * consumer always gets the newest frame and is at most one behind.
+ */
+
+#define LL_MAILBOX_SLOTS 3
+
+typedef struct LLMailboxSlot {
+    uint8_t *data;
+    unsigned int alloc;
+    int size;
+    int64_t pts;
+    int64_t stamps[LL_STAGE_NB];
+} LLMailboxSlot;
+
+typedef struct LLMailbox {
+    LLMailboxSlot slots[LL_MAILBOX_SLOTS];
+    int back;                   // being filled by the producer
+    int ready;                  // newest posted frame, unread if fresh
+    int front;                  // being read by the consumer
+    int fresh;
+    int closed;
+
+    uint64_t posted;
+    uint64_t taken;
+    uint64_t overwritten;       // replaced before the consumer got to them
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} LLMailbox;
+
+int ll_mailbox_init(LLMailbox *m);
+
+// Producer side: the slot to fill, grown to hold size bytes; NULL on ENOMEM
+LLMailboxSlot *ll_mailbox_back(LLMailbox *m, int size);
+
+// Make the back slot the newest frame, replacing an unread one
+void ll_mailbox_post(LLMailbox *m);
+
+/*
+ * Consumer side: wait for a frame newer than the last one taken. The slot
+ * is the consumer's until the next call; NULL once the mailbox is closed
+ * and the last frame was taken.
+ */
+LLMailboxSlot *ll_mailbox_take(LLMailbox *m);
+
+// No more posts; wakes the consumer
+void ll_mailbox_close(LLMailbox *m);
+
+void ll_mailbox_print_stats(const LLMailbox *m, const char *name, FILE *f);
+
+void ll_mailbox_free(LLMailbox *m);
+
+#endif
@@ -0,0 +1,278 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86 1
+#include <immintrin.h>
+#else
+#define HAVE_X86 0
+#endif
+
+#include "ll_nal.h"
+
+static const uint8_t *find_start_code_scalar(const uint8_t *p, const uint8_t *end)
+{
+    // p[2] decides how far we may skip: a start code at p, p+1 or p+2
+    // needs p[2] to be 1, 0 or 0 respectively
+    while (end - p >= 3) {
+        if (p[2] > 1)
+            p += 3;
+        else if (p[1])
+            p += 2;
+        else if (p[0] || p[2] != 1)
+            p++;
+        else
+            return p;
+    }
+    return end;
+}
+
+#if HAVE_X86
+/*
+ * Compare three overlapping loads against 00, 00 and 01 so that every
+ * offset in the block is tested at once; the only branch is the hit test.
+ */
+__attribute__((target("sse2")))
+static const uint8_t *find_start_code_sse2(const uint8_t *p, const uint8_t *end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one  = _mm_set1_epi8(1);
+
+    while (end - p >= 16 + 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero),
+                                                _mm_cmpeq_epi8(b, zero)),
+                                  _mm_cmpeq_epi8(c, one));
+        unsigned mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return find_start_code_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *find_start_code_avx2(const uint8_t *p, const uint8_t *end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one  = _mm256_set1_epi8(1);
+
+    while (end - p >= 32 + 2) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + 2));
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero),
+                                                      _mm256_cmpeq_epi8(b, zero)),
+                                     _mm256_cmpeq_epi8(c, one));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    return find_start_code_sse2(p, end);
+}
+#endif
+
+LLStartCodeFn ll_start_code_impl(const char *name)
+{
+#if HAVE_X86
+    int sse2, avx2;
+
+    __builtin_cpu_init();
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2");
+
+    if (!name)
+        return avx2 ? find_start_code_avx2 :
+               sse2 ? find_start_code_sse2 : find_start_code_scalar;
+    if (!strcmp(name, "avx2"))
+        return avx2 ? find_start_code_avx2 : NULL;
+    if (!strcmp(name, "sse2"))
+        return sse2 ? find_start_code_sse2 : NULL;
+#else
+    if (!name)
+        return find_start_code_scalar;
+#endif
+    if (!strcmp(name, "scalar"))
+        return find_start_code_scalar;
+    return NULL;
+}
+
+static LLStartCodeFn find_start_code = find_start_code_scalar;
+
+__attribute__((constructor))
+static void nal_init(void)
+{
+    find_start_code = ll_start_code_impl(NULL);
+}
+
+const uint8_t *ll_find_start_code(const uint8_t *p, const uint8_t *end)
+{
+    return find_start_code(p, end);
+}
+
+void ll_nal_iter_init(LLNalIterator *it, const uint8_t *buf, size_t size)
+{
+    it->buf  = buf;
+    it->end  = buf + size;
+    it->next = find_start_code(buf, it->end);
+}
+
+int ll_nal_iter_next(LLNalIterator *it, LLNalUnit *nal)
+{
+    const uint8_t *sc = it->next, *start, *stop;
+
+    if (sc == it->end)
+        return 0;
+
+    start = sc + 3;
+    stop = it->next = find_start_code(start, it->end);
+    // The leading zero of a 4-byte start code and any trailing_zero_8bits
+    // belong to neither unit
+    while (stop > start && stop[-1] == 0)
+        stop--;
+
+    nal->start_code_size = (sc > it->buf && sc[-1] == 0) ? 4 : 3;
+    nal->offset = sc - it->buf - (nal->start_code_size - 3);
+    nal->data = start;
+    nal->size = stop - start;
+    nal->type = nal->size ? start[0] & 0x1f : 0;
+    return 1;
+}
+
+static const uint8_t start_code[4] = {0x00, 0x00, 0x00, 0x01};
+
+int ll_nal_is_param_set(enum AVCodecID codec, const LLNalUnit *nal)
+{
+    int type;
+
+    if (codec != AV_CODEC_ID_HEVC)
+        return nal->type == LL_NAL_SPS || nal->type == LL_NAL_PPS;
+    if (nal->size < 2)
+        return 0;
+    type = LL_HEVC_NAL_TYPE(nal->data[0]);
+    return type >= LL_HEVC_NAL_VPS && type <= LL_HEVC_NAL_PPS;
+}
+
+typedef struct Obu {
+    const uint8_t *data;        // OBU header byte
+    size_t size;                // header, size field and payload
+    int type;
+} Obu;
+
+// Returns 1 and fills obu for the next OBU in [*p, end), 0 at the end or on a bad size
+static int next_obu(const uint8_t **p, const uint8_t *end, Obu *obu)
+{
+    const uint8_t *q = *p;
+    uint64_t payload_size = 0;
+    size_t header_size;
+    int i;
+
+    if (q == end)
+        return 0;
+    // obu_header, then obu_extension_header if obu_extension_flag is set
+    header_size = 1 + !!(q[0] & 0x04);
+    if ((size_t)(end - q) < header_size)
+        return 0;
+    q += header_size;
+    if ((*p)[0] & 0x02) {
+        // obu_size, leb128
+        for (i = 0; ; i++) {
+            if (q == end || i == 8)
+                return 0;
+            payload_size |= (uint64_t)(*q & 0x7f) << (7 * i);
+            if (!(*q++ & 0x80))
+                break;
+        }
+        if (payload_size > (uint64_t)(end - q))
+            return 0;
+    } else
+        payload_size = end - q;     // without obu_has_size_field it runs to the end
+
+    obu->data = *p;
+    obu->type = ((*p)[0] >> 3) & 0x0f;
+    obu->size = q + payload_size - *p;
+    *p = q + payload_size;
+    return 1;
+}
+
+static int get_sequence_headers(const uint8_t *data, size_t size, unsigned char **metadata)
+{
+    const uint8_t *p, *end = data + size;
+    Obu obu;
+    size_t length = 0;
+    unsigned char *out;
+
+    for (p = data; next_obu(&p, end, &obu); )
+        if (obu.type == LL_AV1_OBU_SEQUENCE_HEADER)
+            length += obu.size;
+    if (!length)
+        return -1;
+
+    if (!(out = *metadata = malloc(length)))
+        return -1;
+    for (p = data; next_obu(&p, end, &obu); ) {
+        if (obu.type != LL_AV1_OBU_SEQUENCE_HEADER)
+            continue;
+        memcpy(out, obu.data, obu.size);
+        out += obu.size;
+    }
+    return length;
+}
+
+int ll_get_param_sets(enum AVCodecID codec, const uint8_t *data, size_t size,
+                      unsigned char **metadata)
+{
+    LLNalIterator it;
+    LLNalUnit nal;
+    size_t length = 0;
+    unsigned char *p;
+
+    if (codec == AV_CODEC_ID_AV1)
+        return get_sequence_headers(data, size, metadata);
+
+    ll_nal_iter_init(&it, data, size);
+    while (ll_nal_iter_next(&it, &nal))
+        if (ll_nal_is_param_set(codec, &nal))
+            length += sizeof(start_code) + nal.size;
+    if (!length)
+        return -1;
+
+    if (!(p = *metadata = malloc(length)))
+        return -1;
+    ll_nal_iter_init(&it, data, size);
+    while (ll_nal_iter_next(&it, &nal)) {
+        if (!ll_nal_is_param_set(codec, &nal))
+            continue;
+        memcpy(p, start_code, sizeof(start_code));
+        memcpy(p + sizeof(start_code), nal.data, nal.size);
+        p += sizeof(start_code) + nal.size;
+    }
+    return length;
+}
@@ -0,0 +1,107 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_NAL_H
+#define LL_NAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+/*
+ * Bounded Annex-B NAL unit iterator. Start codes may be 3 or 4 bytes; the
+ * scanner never reads past buf + size.
+ */
+typedef struct LLNalUnit {
+    const uint8_t *data;        // NAL header byte, right after the start code
+    size_t size;                // NAL size without start code and trailing zeros
+    size_t offset;              // offset of the start code in the packet
+    int start_code_size;        // 3 or 4
+    int type;                   // H.264 nal_unit_type; for HEVC see LL_HEVC_NAL_TYPE
+} LLNalUnit;
+
+typedef struct LLNalIterator {
+    const uint8_t *buf;
+    const uint8_t *end;
+    const uint8_t *next;        // next start code, or end
+} LLNalIterator;
+
+enum {
+    LL_NAL_SLICE    = 1,
+    LL_NAL_IDR      = 5,
+    LL_NAL_SEI      = 6,
+    LL_NAL_SPS      = 7,
+    LL_NAL_PPS      = 8,
+    LL_NAL_AUD      = 9,
+};
+
+// HEVC nal_unit_type: six bits of the first of two NAL header bytes
+#define LL_HEVC_NAL_TYPE(b) (((b) >> 1) & 0x3f)
+
+enum {
+    LL_HEVC_NAL_IDR_W_RADL  = 19,
+    LL_HEVC_NAL_IDR_N_LP    = 20,
+    LL_HEVC_NAL_CRA         = 21,
+    LL_HEVC_NAL_VPS         = 32,
+    LL_HEVC_NAL_SPS         = 33,
+    LL_HEVC_NAL_PPS         = 34,
+    LL_HEVC_NAL_AUD         = 35,
+};
+
+// AV1 obu_type. AV1 has no start codes: temporal units are a run of
+// OBUs, each with its size (the low overhead format libavcodec produces)
+enum {
+    LL_AV1_OBU_SEQUENCE_HEADER      = 1,
+    LL_AV1_OBU_TEMPORAL_DELIMITER   = 2,
+};
+
+// Returns a pointer to the first 00 00 01 in [p, end), or end
+typedef const uint8_t *(*LLStartCodeFn)(const uint8_t *p, const uint8_t *end);
+
+/*
+ * Look up a start code scanner by name ("scalar", "sse2", "avx2"), or the
+ * best one for this CPU when name is NULL. Returns NULL if unsupported.
+ */
+LLStartCodeFn ll_start_code_impl(const char *name);
+
+const uint8_t *ll_find_start_code(const uint8_t *p, const uint8_t *end);
+
+void ll_nal_iter_init(LLNalIterator *it, const uint8_t *buf, size_t size);
+
+// Returns 1 and fills nal for the next unit, 0 at the end of the packet
+int ll_nal_iter_next(LLNalIterator *it, LLNalUnit *nal);
+
+// 1 if nal is a parameter set: SPS or PPS for H.264, VPS, SPS or PPS for HEVC
+int ll_nal_is_param_set(enum AVCodecID codec, const LLNalUnit *nal);
+
+/*
+ * Copy the parameter sets in the packet into a newly malloc'ed *metadata:
+ * for H.264 and HEVC every one of them, with its start code, for AV1 the
+ * sequence header OBUs. Returns its length, or -1 if there is none.
+ */
+int ll_get_param_sets(enum AVCodecID codec, const uint8_t *data, size_t size,
+                      unsigned char **metadata);
+
+#endif
@@ -0,0 +1,293 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/avutil.h>
+
+#include "ll_common.h"
+#include "ll_pipeline.h"
+
+static LLPipeItem *item_new(LLPipeline *p)
+{
+    LLPipeItem *item = av_mallocz(sizeof(*item));
+
+    if (item && !(item->frame = av_frame_alloc()))
+        av_freep(&item);
+    if (item) {
+        item->pipe = p;
+        p->item_allocs++;
+    }
+    return item;
+}
+
+static void item_delete(LLPipeItem **item)
+{
+    av_frame_free(&(*item)->frame);
+    av_freep(item);
+}
+
+LLPipeItem *ll_pipe_item_alloc(LLPipeline *p)
+{
+    LLPipeItem *item;
+
+    pthread_mutex_lock(&p->lock);
+    if ((item = p->free_items))
+        p->free_items = item->next;
+    else
+        item = item_new(p);
+    pthread_mutex_unlock(&p->lock);
+    if (item)
+        item->next = NULL;
+    return item;
+}
+
+void ll_pipe_item_free(LLPipeItem **pitem)
+{
+    LLPipeItem *item = *pitem;
+    LLPipeline *p;
+
+    if (!item)
+        return;
+    *pitem = NULL;
+    p = item->pipe;
+    av_frame_unref(item->frame);
+    memset(&item->info, 0, sizeof(item->info));
+
+    pthread_mutex_lock(&p->lock);
+    item->next = p->free_items;
+    p->free_items = item;
+    pthread_mutex_unlock(&p->lock);
+}
+
+int ll_pipeline_init(LLPipeline *p, int depth)
+{
+    memset(p, 0, sizeof(*p));
+    p->depth = 1;
+    while (p->depth < depth)
+        p->depth <<= 1;
+    atomic_init(&p->stop, 0);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    return 0;
+}
+
+int ll_pipeline_add_stage(LLPipeline *p, const char *name, LLStageFunc process, void *opaque)
+{
+    LLPipeStage *st;
+    int ret;
+
+    if (p->nb_stages == LL_PIPE_MAX_STAGES)
+        return AVERROR(EINVAL);
+    st = &p->stages[p->nb_stages];
+    st->name    = name;
+    st->process = process;
+    st->opaque  = opaque;
+    st->pipe    = p;
+    if (p->nb_stages) {
+        LLRing *ring = &p->rings[p->nb_stages - 1];
+        if ((ret = ll_ring_init(ring, p->depth)) < 0)
+            return AVERROR(-ret);
+        p->stages[p->nb_stages - 1].out = ring;
+        st->in = ring;
+    }
+    p->nb_stages++;
+    return 0;
+}
+
+static void pipeline_abort(LLPipeline *p, int err)
+{
+    pthread_mutex_lock(&p->lock);
+    if (!p->error)
+        p->error = err;
+    pthread_mutex_unlock(&p->lock);
+    ll_pipeline_stop(p);
+}
+
+static void *stage_thread(void *arg)
+{
+    LLPipeStage *st = arg;
+    LLPipeline *p = st->pipe;
+    int ret = 0;
+
+    while (!atomic_load(&p->stop)) {
+        LLPipeItem *in = NULL, *out = NULL;
+        int flush = 0;
+        int64_t t0;
+
+        if (st->in && !(in = ll_ring_pop_wait(st->in, -1))) {
+            if (!ll_ring_closed(st->in))
+                continue;
+            flush = 1;
+        }
+
+        t0 = ll_time_ns();
+        ret = st->process(st->opaque, in, &out);
+        atomic_fetch_add(&st->busy_ns, ll_time_ns() - t0);
+
+        if (out) {
+            atomic_fetch_add(&st->frames, 1);
+            if (st->out) {
+                LLPipeItem *dropped = ll_ring_push(st->out, out);
+                if (dropped) {
+                    atomic_fetch_add(&st->dropped, 1);
+                    ll_pipe_item_free(&dropped);
+                }
+            } else
+                ll_pipe_item_free(&out);
+        }
+        if (ret < 0 || flush)
+            break;
+    }
+
+    if (ret < 0 && ret != AVERROR_EOF) {
+        fprintf(stderr, "Pipeline stage %s failed: %s\n", st->name, av_err2str(ret));
+        pipeline_abort(p, ret);
+    }
+    if (st->out)
+        ll_ring_close(st->out);
+
+    pthread_mutex_lock(&p->lock);
+    p->running--;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int ll_pipeline_start(LLPipeline *p)
+{
+    // Enough items for full queues plus one in and one out per stage
+    int nb_items = (p->nb_stages - 1) * p->depth + 2 * p->nb_stages;
+
+    for (int i = 0; i < nb_items; i++) {
+        LLPipeItem *item = item_new(p);
+        if (!item)
+            break;              // ll_pipe_item_alloc will retry
+        item->next = p->free_items;
+        p->free_items = item;
+    }
+    p->item_prealloc = p->item_allocs;
+
+    p->last_stats_ns = ll_time_ns();
+    for (int i = 0; i < p->nb_stages; i++) {
+        int ret;
+
+        pthread_mutex_lock(&p->lock);
+        p->running++;
+        pthread_mutex_unlock(&p->lock);
+        if ((ret = pthread_create(&p->stages[i].thread, NULL, stage_thread, &p->stages[i]))) {
+            pthread_mutex_lock(&p->lock);
+            p->running--;
+            pthread_mutex_unlock(&p->lock);
+            p->nb_stages = i;
+            ll_pipeline_stop(p);
+            return AVERROR(ret);
+        }
+    }
+    return 0;
+}
+
+void ll_pipeline_stop(LLPipeline *p)
+{
+    atomic_store(&p->stop, 1);
+    for (int i = 0; i + 1 < p->nb_stages; i++)
+        ll_ring_close(&p->rings[i]);
+}
+
+int ll_pipeline_wait(LLPipeline *p, int timeout_ms)
+{
+    struct timespec ts;
+    int done;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    while (p->running && pthread_cond_timedwait(&p->cond, &p->lock, &ts) != ETIMEDOUT)
+        ;
+    done = !p->running;
+    pthread_mutex_unlock(&p->lock);
+    return done;
+}
+
+int ll_pipeline_join(LLPipeline *p)
+{
+    for (int i = 0; i < p->nb_stages; i++)
+        pthread_join(p->stages[i].thread, NULL);
+    return p->error;
+}
+
+void ll_pipeline_free(LLPipeline *p)
+{
+    for (int i = 0; i + 1 < p->nb_stages; i++) {
+        LLPipeItem *item;
+        while ((item = ll_ring_pop(&p->rings[i])))
+            item_delete(&item);
+        ll_ring_free(&p->rings[i]);
+    }
+    while (p->free_items) {
+        LLPipeItem *item = p->free_items;
+        p->free_items = item->next;
+        item_delete(&item);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+}
+
+void ll_pipeline_print_stats(LLPipeline *p, FILE *f)
+{
+    int64_t now = ll_time_ns();
+    double secs = (now - p->last_stats_ns) / 1e9;
+
+    p->last_stats_ns = now;
+    if (secs <= 0)
+        return;
+    for (int i = 0; i < p->nb_stages; i++) {
+        LLPipeStage *st = &p->stages[i];
+        uint64_t frames  = atomic_load(&st->frames);
+        uint64_t dropped = atomic_load(&st->dropped);
+        int64_t busy_ns  = atomic_load(&st->busy_ns);
+        uint64_t n = frames - st->last_frames;
+
+        fprintf(f, "  %-8s %7.1f fps  %5llu dropped  %6.2f ms/frame busy  queue %d\n",
+                st->name, n / secs, (unsigned long long)(dropped - st->last_dropped),
+                n ? (busy_ns - st->last_busy_ns) / 1e6 / n : 0.0,
+                st->out ? ll_ring_count(st->out) : 0);
+        st->last_frames  = frames;
+        st->last_dropped = dropped;
+        st->last_busy_ns = busy_ns;
+    }
+    pthread_mutex_lock(&p->lock);
+    fprintf(f, "  items    %llu preallocated, %llu allocated since\n",
+            (unsigned long long)p->item_prealloc,
+            (unsigned long long)(p->item_allocs - p->item_prealloc));
+    pthread_mutex_unlock(&p->lock);
+}
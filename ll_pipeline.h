@@ -0,0 +1,120 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_PIPELINE_H
+#define LL_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <libavutil/frame.h>
+
+#include "ll_encoder.h"
+#include "ll_ring.h"
+
+#define LL_PIPE_MAX_STAGES 8
+
+typedef struct LLPipeline LLPipeline;
+
+// What travels between stages: the frame and its stamps
+typedef struct LLPipeItem {
+    AVFrame *frame;
+    LLFrameInfo info;
+    LLPipeline *pipe;           // owner of the free list it returns to
+    struct LLPipeItem *next;
+} LLPipeItem;
+
+/*
+ * A stage owns the item it is given: it either passes it on through *out
+ * (possibly with a different frame) or frees it. Stages should move new
+ * frames into item->frame (av_frame_move_ref) rather than swap the AVFrame
+ * itself, so recycled items keep their frame. The first stage is called
+ * with in == NULL and produces items until it returns AVERROR_EOF; the
+ * others get in == NULL once, to flush, after their input ends.
+ */
+typedef int (*LLStageFunc)(void *opaque, LLPipeItem *in, LLPipeItem **out);
+
+typedef struct LLPipeStage {
+    const char *name;
+    LLStageFunc process;
+    void *opaque;
+    LLRing *in, *out;
+    LLPipeline *pipe;
+    pthread_t thread;
+
+    _Atomic uint64_t frames;    // items passed on
+    _Atomic uint64_t dropped;   // items dropped from the output queue
+    _Atomic int64_t busy_ns;    // time spent in process
+    uint64_t last_frames;       // for the rates in ll_pipeline_print_stats
+    uint64_t last_dropped;
+    int64_t last_busy_ns;
+} LLPipeStage;
+
+struct LLPipeline {
+    LLPipeStage stages[LL_PIPE_MAX_STAGES];
+    LLRing rings[LL_PIPE_MAX_STAGES - 1];
+    int nb_stages;
+    int depth;                  // queue capacity, a power of two
+
+    // Recycled items; allocations past the preallocated ones are misses
+    LLPipeItem *free_items;
+    uint64_t item_allocs;
+    uint64_t item_prealloc;
+
+    _Atomic int stop;
+    int error;
+    int running;
+    int64_t last_stats_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Items come from a free list on the pipeline; freeing one unrefs its frame
+// and puts it back
+LLPipeItem *ll_pipe_item_alloc(LLPipeline *p);
+void ll_pipe_item_free(LLPipeItem **item);
+
+// depth is the capacity of each queue, rounded up to a power of two; a full
+// queue drops its oldest item
+int ll_pipeline_init(LLPipeline *p, int depth);
+int ll_pipeline_add_stage(LLPipeline *p, const char *name, LLStageFunc process, void *opaque);
+int ll_pipeline_start(LLPipeline *p);
+
+// Ask all stages to stop without draining
+void ll_pipeline_stop(LLPipeline *p);
+
+// Wait up to timeout_ms for every stage to finish; 1 when done
+int ll_pipeline_wait(LLPipeline *p, int timeout_ms);
+
+// Join the threads; returns the first stage error, if any
+int ll_pipeline_join(LLPipeline *p);
+void ll_pipeline_free(LLPipeline *p);
+
+// Per-stage fps, drops and busy time since the previous call, and item
+// allocations since start
+void ll_pipeline_print_stats(LLPipeline *p, FILE *f);
+
+#endif
@@ -0,0 +1,131 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "ll_pool.h"
+
+#define POOL_ALIGN   32
+#define POOL_PADDING 64         // for SIMD readers running past the last row
+
+#if LIBAVUTIL_VERSION_MAJOR < 57
+typedef int LLPoolSize;
+#else
+typedef size_t LLPoolSize;
+#endif
+
+static AVBufferRef *pool_alloc(void *opaque, LLPoolSize size)
+{
+    LLFramePool *pool = opaque;
+
+    atomic_fetch_add(&pool->allocs, 1);
+    return av_buffer_alloc(size);
+}
+
+int ll_frame_pool_init(LLFramePool *pool, enum AVPixelFormat format,
+                       int width, int height, int nb_buffers)
+{
+    uint8_t *data[4] = { NULL };
+    AVBufferRef **bufs;
+    int ret, size;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->format = format;
+    pool->width  = width;
+    pool->height = height;
+
+    // Same layout av_frame_get_buffer(frame, 32) would pick
+    if ((ret = av_image_fill_linesizes(pool->linesize, format, FFALIGN(width, POOL_ALIGN))) < 0)
+        return ret;
+    for (int i = 0; i < 4; i++)
+        pool->linesize[i] = FFALIGN(pool->linesize[i], POOL_ALIGN);
+    if ((size = av_image_fill_pointers(data, format, FFALIGN(height, POOL_ALIGN), NULL, pool->linesize)) < 0)
+        return size;
+    for (int i = 0; i < 4; i++)
+        pool->offset[i] = data[i] ? (int)(data[i] - data[0]) : 0;
+    pool->size = size + POOL_PADDING;
+
+    if (!(pool->pool = av_buffer_pool_init2(pool->size, pool, pool_alloc, NULL)))
+        return AVERROR(ENOMEM);
+
+    // Fill the pool now so the first frames don't pay for it
+    if (nb_buffers > 0) {
+        if (!(bufs = av_calloc(nb_buffers, sizeof(*bufs))))
+            return AVERROR(ENOMEM);
+        for (int i = 0; i < nb_buffers; i++)
+            bufs[i] = av_buffer_pool_get(pool->pool);
+        for (int i = 0; i < nb_buffers; i++) {
+            if (!bufs[i])
+                ret = AVERROR(ENOMEM);
+            av_buffer_unref(&bufs[i]);
+        }
+        av_free(bufs);
+        if (ret < 0) {
+            ll_frame_pool_uninit(pool);
+            return ret;
+        }
+    }
+    pool->prealloc = atomic_load(&pool->allocs);
+    return 0;
+}
+
+int ll_frame_pool_get_buffer(LLFramePool *pool, AVFrame *frame)
+{
+    if (frame->buf[0])
+        return AVERROR(EINVAL);
+    if (!(frame->buf[0] = av_buffer_pool_get(pool->pool)))
+        return AVERROR(ENOMEM);
+    atomic_fetch_add(&pool->gets, 1);
+
+    frame->format = pool->format;
+    frame->width  = pool->width;
+    frame->height = pool->height;
+    for (int i = 0; i < 4 && pool->linesize[i]; i++) {
+        frame->data[i]     = frame->buf[0]->data + pool->offset[i];
+        frame->linesize[i] = pool->linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+void ll_frame_pool_print_stats(LLFramePool *pool, const char *name, FILE *f)
+{
+    if (!pool->pool)
+        return;
+    fprintf(f, "%s pool (%s %dx%d): %llu frames, %d buffers preallocated, %llu allocated since\n",
+            name, av_get_pix_fmt_name(pool->format), pool->width, pool->height,
+            (unsigned long long)atomic_load(&pool->gets), pool->prealloc,
+            (unsigned long long)ll_frame_pool_misses(pool));
+}
+
+void ll_frame_pool_uninit(LLFramePool *pool)
+{
+    av_buffer_pool_uninit(&pool->pool);
+}
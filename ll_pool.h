@@ -0,0 +1,75 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_POOL_H
+#define LL_POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+/*
+ * Recycled image buffers for the per-frame paths. Buffers come from an
+ * AVBufferPool, so one is only handed out again after every reference to
+ * it, including the ones an encoder keeps while a frame is in flight, has
+ * been dropped. The pool is filled up front; misses count the buffers it
+ * had to allocate after that, which stays at zero once it is sized right.
+ */
+typedef struct LLFramePool {
+    AVBufferPool *pool;
+    enum AVPixelFormat format;
+    int width, height;
+    int linesize[4];
+    int offset[4];
+    int size;                   // bytes per buffer
+    int prealloc;
+
+    _Atomic uint64_t gets;      // buffers handed out
+    _Atomic uint64_t allocs;    // buffers allocated from the heap
+} LLFramePool;
+
+// Preallocates nb_buffers buffers for width x height images in format
+int ll_frame_pool_init(LLFramePool *pool, enum AVPixelFormat format,
+                       int width, int height, int nb_buffers);
+
+// Like av_frame_get_buffer(); frame must have no buffers attached
+int ll_frame_pool_get_buffer(LLFramePool *pool, AVFrame *frame);
+
+// Heap allocations made after the pool was filled
+static inline uint64_t ll_frame_pool_misses(LLFramePool *pool)
+{
+    uint64_t allocs = atomic_load(&pool->allocs);
+    return allocs > pool->prealloc ? allocs - pool->prealloc : 0;
+}
+
+void ll_frame_pool_print_stats(LLFramePool *pool, const char *name, FILE *f);
+
+// Buffers still referenced elsewhere are freed when their last user drops them
+void ll_frame_pool_uninit(LLFramePool *pool);
+
+#endif
@@ -0,0 +1,498 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE                 // accept4
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+
+#include "ll_common.h"
+#include "ll_relay.h"
+
+#define FRAME_QUEUE     64          // encoder to relay thread
+#define DRAIN_TIMEOUT   1000        // ms for the viewers to take the last frames
+
+// epoll tags besides the clients
+static char listen_tag, event_tag;
+
+static void drop_queue(LLRelayClient *c, int keep_head)
+{
+    // A partly sent chunk must go out whole, or the framing breaks
+    int keep = keep_head && c->offset > 0 ? 1 : 0;
+
+    for (int i = keep; i < c->count; i++)
+        av_buffer_unref(&c->queue[(c->head + i) % LL_RELAY_QUEUE].buf);
+    c->count = FFMIN(c->count, keep);
+    if (!keep)
+        c->offset = 0;
+}
+
+static void close_client(LLRelay *r, LLRelayClient *c)
+{
+    fprintf(stderr, "Relay: viewer %s left after %llu frames, %llu dropped\n", c->name,
+            (unsigned long long)c->frames, (unsigned long long)c->dropped);
+    drop_queue(c, 0);
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void set_want_write(LLRelay *r, LLRelayClient *c, int want)
+{
+    struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = c };
+
+    if (c->want_write != want && !epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev))
+        c->want_write = want;
+}
+
+// Send as much as the socket takes; < 0 when the viewer is gone
+static int flush_client(LLRelay *r, LLRelayClient *c)
+{
+    struct iovec iov[LL_RELAY_QUEUE];
+    struct msghdr msg = { .msg_iov = iov };
+    ssize_t n;
+    int i;
+
+    while (c->count) {
+        for (i = 0; i < c->count; i++) {
+            LLRelayChunk *ch = &c->queue[(c->head + i) % LL_RELAY_QUEUE];
+            iov[i].iov_base = ch->buf->data + (i ? 0 : c->offset);
+            iov[i].iov_len  = ch->size - (i ? 0 : c->offset);
+        }
+        // A viewer that went away must not take the process down with SIGPIPE
+        msg.msg_iovlen = c->count;
+        n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return AVERROR(errno);
+        }
+        r->bytes_sent += n;
+        while (n > 0) {
+            LLRelayChunk *ch = &c->queue[c->head];
+            int left = ch->size - c->offset;
+
+            if (n < left) {
+                c->offset += n;
+                break;
+            }
+            n -= left;
+            av_buffer_unref(&ch->buf);
+            c->head = (c->head + 1) % LL_RELAY_QUEUE;
+            c->count--;
+            c->offset = 0;
+        }
+    }
+    set_want_write(r, c, c->count > 0);
+    return 0;
+}
+
+static int enqueue(LLRelayClient *c, AVBufferRef *buf, int size)
+{
+    LLRelayChunk *ch = &c->queue[(c->head + c->count) % LL_RELAY_QUEUE];
+
+    if (!(ch->buf = av_buffer_ref(buf)))
+        return AVERROR(ENOMEM);
+    ch->size = size;
+    c->count++;
+    return 0;
+}
+
+/*
+ * What a framed packet starts with: the length of a parameter sets
+ * message, if any, and whether the frame after it is a keyframe.
+ */
+static void scan_packet(const uint8_t *data, int size, int *params_size, int *keyframe)
+{
+    LLWireHeader hdr;
+    int len;
+
+    *params_size = 0;
+    *keyframe = 0;
+    if ((len = ll_wire_parse_header(data, size, &hdr)) < 0)
+        return;
+    if (hdr.type == LL_WIRE_PARAMS) {
+        *params_size = len + hdr.size;
+        data += *params_size;
+        size -= *params_size;
+        if ((len = ll_wire_parse_header(data, size, &hdr)) < 0)
+            return;
+    }
+    *keyframe = hdr.type == LL_WIRE_FRAME && (hdr.flags & LL_WIRE_FLAG_KEYFRAME);
+}
+
+static void fan_out(LLRelay *r, AVBufferRef *buf)
+{
+    int params_size, keyframe;
+
+    scan_packet(buf->data, buf->size, &params_size, &keyframe);
+    if (params_size) {
+        av_buffer_unref(&r->params);
+        r->params = av_buffer_ref(buf);
+        r->params_size = params_size;
+    }
+
+    for (int i = 0; i < LL_RELAY_MAX_CLIENTS; i++) {
+        LLRelayClient *c = &r->clients[i];
+
+        if (c->fd < 0)
+            continue;
+        if (!c->synced) {
+            if (!keyframe)
+                continue;
+            // Parameter sets first, unless the keyframe brings its own
+            if (!params_size && r->params && enqueue(c, r->params, r->params_size) < 0)
+                continue;
+            c->synced = 1;
+        } else if (c->count == LL_RELAY_QUEUE) {
+            // Too slow: start over at a keyframe rather than fall further behind
+            c->dropped += c->count - (c->offset > 0);
+            r->dropped += c->count - (c->offset > 0);
+            drop_queue(c, 1);
+            c->synced = 0;
+            r->resyncs++;
+            atomic_store(&r->keyframe_request, 1);
+            continue;
+        }
+        if (enqueue(c, buf, buf->size) < 0)
+            continue;
+        c->frames++;
+        if (flush_client(r, c) < 0)
+            close_client(r, c);
+    }
+    av_buffer_unref(&buf);
+}
+
+static void accept_clients(LLRelay *r)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    char host[INET6_ADDRSTRLEN] = "?";
+    int fd, one = 1, i;
+
+    while ((fd = accept4(r->listen_fd, (struct sockaddr *)&addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        LLRelayClient *c = NULL;
+        struct epoll_event ev = { .events = EPOLLIN };
+
+        for (i = 0; i < LL_RELAY_MAX_CLIENTS && !c; i++)
+            if (r->clients[i].fd < 0)
+                c = &r->clients[i];
+        if (!c) {
+            fprintf(stderr, "Relay: too many viewers, refusing one\n");
+            close(fd);
+            addr_len = sizeof(addr);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        if (addr.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, host, sizeof(host));
+        else
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, host, sizeof(host));
+        snprintf(c->name, sizeof(c->name), "%s:%d", host,
+                 ntohs(((struct sockaddr_in *)&addr)->sin_port));
+        ev.data.ptr = c;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            c->fd = -1;
+            continue;
+        }
+        fprintf(stderr, "Relay: viewer %s joined\n", c->name);
+        r->viewers++;
+        // Its first frame is the next keyframe; have one made now
+        atomic_store(&r->keyframe_request, 1);
+        addr_len = sizeof(addr);
+    }
+}
+
+// Viewers send nothing; reading tells when they are gone
+static int poll_client(LLRelayClient *c)
+{
+    char buf[256];
+    ssize_t n;
+
+    while ((n = read(c->fd, buf, sizeof(buf))) > 0)
+        ;
+    return n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ? -1 : 0;
+}
+
+static int count_viewers(LLRelay *r, int *queued)
+{
+    int n = 0, depth = 0;
+
+    *queued = 0;
+    for (int i = 0; i < LL_RELAY_MAX_CLIENTS; i++) {
+        if (r->clients[i].fd >= 0) {
+            n++;
+            *queued += r->clients[i].count;
+            if (r->clients[i].synced)
+                depth = FFMAX(depth, r->clients[i].count);
+        }
+    }
+    atomic_store(&r->queue_depth, depth);
+    return n;
+}
+
+static void *relay_main(void *arg)
+{
+    LLRelay *r = arg;
+    struct epoll_event events[16];
+    AVBufferRef *buf;
+    int64_t deadline = 0;
+    uint64_t val;
+    int n, queued, timeout = -1;
+
+    while (1) {
+        if (atomic_load(&r->stop)) {
+            // Drain what the encoder left, then wait a little for the viewers
+            while ((buf = ll_ring_pop(&r->frames)))
+                fan_out(r, buf);
+            if (!deadline)
+                deadline = ll_time_ns() + DRAIN_TIMEOUT * 1000000LL;
+            count_viewers(r, &queued);
+            if (!queued || ll_time_ns() >= deadline)
+                break;
+            timeout = FFMAX((deadline - ll_time_ns()) / 1000000, 1);
+        }
+
+        n = epoll_wait(r->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            LLRelayClient *c = tag;
+
+            if (tag == &listen_tag) {
+                accept_clients(r);
+            } else if (tag == &event_tag) {
+                if (read(r->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+                    perror("relay");
+                while ((buf = ll_ring_pop(&r->frames)))
+                    fan_out(r, buf);
+            } else if (c->fd >= 0) {
+                if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && poll_client(c) < 0)
+                    close_client(r, c);
+                else if ((events[i].events & EPOLLOUT) && flush_client(r, c) < 0)
+                    close_client(r, c);
+            }
+        }
+        r->max_viewers = FFMAX(r->max_viewers, count_viewers(r, &queued));
+    }
+
+    for (int i = 0; i < LL_RELAY_MAX_CLIENTS; i++)
+        if (r->clients[i].fd >= 0)
+            close_client(r, &r->clients[i]);
+    return NULL;
+}
+
+// [host:]port or [[v6 host]]:port
+static int parse_addr(const char *addr, char *host, int host_size, const char **port)
+{
+    const char *colon = strrchr(addr, ':');
+    int len;
+
+    if (!colon) {
+        host[0] = 0;
+        *port = addr;
+        return 0;
+    }
+    len = colon - addr;
+    if (addr[0] == '[' && len >= 2 && addr[len - 1] == ']') {
+        addr++;
+        len -= 2;
+    }
+    if (len >= host_size || !colon[1])
+        return AVERROR(EINVAL);
+    memcpy(host, addr, len);
+    host[len] = 0;
+    *port = colon + 1;
+    return 0;
+}
+
+static int open_listener(const char *addr)
+{
+    struct addrinfo hints = { 0 }, *res, *ai;
+    char host[256];
+    const char *port;
+    int fd = -1, ret, one = 1;
+
+    if (parse_addr(addr, host, sizeof(host), &port) < 0) {
+        fprintf(stderr, "Bad relay address '%s', expected [host:]port\n", addr);
+        return AVERROR(EINVAL);
+    }
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_family   = host[0] ? AF_UNSPEC : AF_INET;
+    hints.ai_flags    = AI_PASSIVE;
+    if ((ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res))) {
+        fprintf(stderr, "Cannot resolve '%s': %s\n", addr, gai_strerror(ret));
+        return AVERROR(EINVAL);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         ai->ai_protocol)) < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Cannot listen on '%s': %s\n", addr, av_err2str(ret));
+        return ret;
+    }
+    return fd;
+}
+
+int ll_relay_open(LLRelay *r, const char *addr, LLWireCodec codec)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    int ret;
+
+    memset(r, 0, sizeof(*r));
+    r->listen_fd = r->epoll_fd = r->event_fd = -1;
+    for (int i = 0; i < LL_RELAY_MAX_CLIENTS; i++)
+        r->clients[i].fd = -1;
+
+    if ((ret = ll_ring_init(&r->frames, FRAME_QUEUE)) < 0)
+        goto fail;
+    if (!(r->mem = open_memstream(&r->mem_buf, &r->mem_size))) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    ll_wire_writer_init(&r->writer, r->mem, codec);
+
+    if ((r->listen_fd = open_listener(addr)) < 0) {
+        ret = r->listen_fd;
+        goto fail;
+    }
+    if ((r->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (r->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev);
+    ev.data.ptr = &event_tag;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->event_fd, &ev);
+
+    if ((ret = pthread_create(&r->thread, NULL, relay_main, r))) {
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    r->running = 1;
+    return 0;
+
+fail:
+    ll_relay_close(r);
+    return ret;
+}
+
+int ll_relay_write_packet(void *opaque, AVPacket *pkt, const LLFrameInfo *info)
+{
+    LLRelay *r = opaque;
+    AVBufferRef *buf, *lost;
+    uint64_t one = 1;
+    off_t size;
+    int ret;
+
+    // Framed once; every viewer gets a reference to the same bytes
+    rewind(r->mem);
+    if ((ret = ll_wire_write_packet(&r->writer, pkt, info)) < 0)
+        return ret;
+    fflush(r->mem);
+    if ((size = ftello(r->mem)) <= 0)
+        return 0;
+    if (!(buf = av_buffer_alloc(size)))
+        return AVERROR(ENOMEM);
+    memcpy(buf->data, r->mem_buf, size);
+
+    if ((lost = ll_ring_push(&r->frames, buf))) {
+        av_buffer_unref(&lost);
+        atomic_fetch_add(&r->frames_lost, 1);
+    }
+    r->frames_in++;
+    if (write(r->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        return AVERROR(errno);
+    return 0;
+}
+
+void ll_relay_print_stats(LLRelay *r, FILE *f)
+{
+    fprintf(f, "Relay: %llu frames, %llu viewers (%d at once), %.1f MB sent, "
+               "%llu frames dropped for slow viewers in %llu resyncs, %llu lost\n",
+            (unsigned long long)r->frames_in, (unsigned long long)r->viewers, r->max_viewers,
+            r->bytes_sent / 1e6, (unsigned long long)r->dropped,
+            (unsigned long long)r->resyncs, (unsigned long long)atomic_load(&r->frames_lost));
+}
+
+void ll_relay_close(LLRelay *r)
+{
+    AVBufferRef *buf;
+    uint64_t one = 1;
+
+    if (r->running) {
+        atomic_store(&r->stop, 1);
+        if (write(r->event_fd, &one, sizeof(one)) < 0)
+            perror("relay");
+        pthread_join(r->thread, NULL);
+        r->running = 0;
+    }
+    if (r->frames.slots) {
+        while ((buf = ll_ring_pop(&r->frames)))
+            av_buffer_unref(&buf);
+        ll_ring_free(&r->frames);
+    }
+    av_buffer_unref(&r->params);
+    ll_wire_writer_free(&r->writer);
+    if (r->mem)
+        fclose(r->mem);
+    free(r->mem_buf);
+    r->mem = NULL;
+    r->mem_buf = NULL;
+    if (r->listen_fd >= 0)
+        close(r->listen_fd);
+    if (r->epoll_fd >= 0)
+        close(r->epoll_fd);
+    if (r->event_fd >= 0)
+        close(r->event_fd);
+    r->listen_fd = r->epoll_fd = r->event_fd = -1;
+}
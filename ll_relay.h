@@ -0,0 +1,112 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_RELAY_H
+#define LL_RELAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include <libavutil/buffer.h>
+
+#include "ll_ring.h"
+#include "ll_wire.h"
+
+/*
+ * One encoded stream to many viewers over TCP, in the framed format
+ * vaapi_decode reads on stdin. Each packet is framed once into a
+ * refcounted buffer that every client's queue shares. An epoll loop on a
+ * thread of its own accepts viewers and writes to them without blocking,
+ * so a slow or stalled viewer costs the others nothing: when its queue
+ * fills up, what it has queued is dropped and it waits for the next
+ * keyframe, as a new viewer does. Viewers start with the last parameter
+ * sets seen, and joining or falling behind asks the encoder for a
+ * keyframe through keyframe_request.
+ */
+
+#define LL_RELAY_MAX_CLIENTS    64
+#define LL_RELAY_QUEUE          16      // frames queued per viewer
+
+typedef struct LLRelayChunk {
+    AVBufferRef *buf;
+    int size;                   // from the start of buf
+} LLRelayChunk;
+
+typedef struct LLRelayClient {
+    int fd;
+    char name[64];
+    int synced;                 // started at a keyframe, gets every frame
+    int want_write;             // EPOLLOUT set
+    LLRelayChunk queue[LL_RELAY_QUEUE];
+    int head, count;
+    int offset;                 // bytes of the head chunk sent
+    uint64_t frames;
+    uint64_t dropped;
+} LLRelayClient;
+
+typedef struct LLRelay {
+    int listen_fd;
+    int epoll_fd;
+    int event_fd;               // wakes the loop when frames are queued
+    pthread_t thread;
+    int running;
+    _Atomic int stop;
+
+    // Producer side: packets framed into a memory stream, then handed over
+    LLWireWriter writer;
+    FILE *mem;
+    char *mem_buf;
+    size_t mem_size;
+    LLRing frames;
+
+    LLRelayClient clients[LL_RELAY_MAX_CLIENTS];
+    AVBufferRef *params;        // latest parameter sets message
+    int params_size;
+
+    _Atomic int keyframe_request;   // for the encoder, cleared by the caller
+    _Atomic int queue_depth;        // frames queued for the furthest behind viewer
+
+    uint64_t frames_in;
+    _Atomic uint64_t frames_lost;   // relay thread too slow to take them
+    uint64_t viewers;
+    int max_viewers;
+    uint64_t bytes_sent;
+    uint64_t dropped;
+    uint64_t resyncs;           // viewers that fell behind
+} LLRelay;
+
+// addr is [host:]port; listens on every interface without a host
+int ll_relay_open(LLRelay *r, const char *addr, LLWireCodec codec);
+
+// LLPacketCallback fanning pkt out to the viewers of (LLRelay *)opaque
+int ll_relay_write_packet(void *opaque, AVPacket *pkt, const LLFrameInfo *info);
+
+void ll_relay_print_stats(LLRelay *r, FILE *f);
+
+// Gives the viewers a moment to take what is queued, then disconnects them
+void ll_relay_close(LLRelay *r);
+
+#endif
@@ -0,0 +1,147 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "ll_ring.h"
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts, *pts = NULL;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        pts = &ts;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, pts, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+int ll_ring_init(LLRing *r, int depth)
+{
+    uint32_t size = 1;
+
+    while (size < (uint32_t)depth)
+        size <<= 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->seq, 0);
+    atomic_init(&r->waiting, 0);
+    atomic_init(&r->closed, 0);
+    r->mask = size - 1;
+    if (!(r->slots = calloc(size, sizeof(*r->slots))))
+        return -ENOMEM;
+    return 0;
+}
+
+void ll_ring_free(LLRing *r)
+{
+    free(r->slots);
+    r->slots = NULL;
+}
+
+void *ll_ring_push(LLRing *r, void *item)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    void *dropped = NULL;
+
+    while (1) {
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - head <= r->mask)
+            break;
+        // Full: claim the oldest entry unless the consumer just took it
+        dropped = atomic_load_explicit(&r->slots[head & r->mask], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&r->head, &head, head + 1,
+                                                  memory_order_acq_rel,
+                                                  memory_order_relaxed))
+            break;
+        dropped = NULL;
+    }
+
+    atomic_store_explicit(&r->slots[tail & r->mask], item, memory_order_relaxed);
+    // seq_cst pairs with the consumer's store to waiting and load of tail
+    atomic_store(&r->tail, tail + 1);
+    if (atomic_load(&r->waiting)) {
+        atomic_fetch_add(&r->seq, 1);
+        futex_wake(&r->seq);
+    }
+    return dropped;
+}
+
+void *ll_ring_pop(LLRing *r)
+{
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    while (1) {
+        void *item;
+
+        if (head == atomic_load_explicit(&r->tail, memory_order_acquire))
+            return NULL;
+        item = atomic_load_explicit(&r->slots[head & r->mask], memory_order_relaxed);
+        // Fails if the producer dropped this entry meanwhile; head is reloaded
+        if (atomic_compare_exchange_weak_explicit(&r->head, &head, head + 1,
+                                                  memory_order_acq_rel,
+                                                  memory_order_relaxed))
+            return item;
+    }
+}
+
+void *ll_ring_pop_wait(LLRing *r, int timeout_ms)
+{
+    void *item;
+
+    while (!(item = ll_ring_pop(r))) {
+        uint32_t seq = atomic_load(&r->seq);
+        int empty;
+
+        if (atomic_load(&r->closed))
+            return ll_ring_pop(r);
+        atomic_store(&r->waiting, 1);
+        // Re-check after announcing, so a push in between is not missed
+        empty = atomic_load(&r->head) == atomic_load(&r->tail);
+        if (empty && !atomic_load(&r->closed))
+            futex_wait(&r->seq, seq, timeout_ms);
+        atomic_store(&r->waiting, 0);
+        if (empty && timeout_ms >= 0 && atomic_load(&r->seq) == seq)
+            return ll_ring_pop(r);
+    }
+    return item;
+}
+
+void ll_ring_close(LLRing *r)
+{
+    atomic_store(&r->closed, 1);
+    atomic_fetch_add(&r->seq, 1);
+    futex_wake(&r->seq);
+}
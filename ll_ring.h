@@ -0,0 +1,78 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_RING_H
+#define LL_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Bounded single-producer single-consumer queue of pointers. A full ring
+ * drops its oldest entry to make room, which the producer gets back to
+ * recycle; head is the only shared index and is advanced with CAS by the
+ * consumer (pop) and the producer (drop). The consumer can block on an
+ * empty ring through a futex on seq, which is bumped only while it waits.
+ */
+typedef struct LLRing {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiting;
+    _Atomic uint32_t closed;
+    uint32_t mask;
+    _Atomic(void *) *slots;
+} LLRing;
+
+// depth is rounded up to a power of two
+int ll_ring_init(LLRing *r, int depth);
+void ll_ring_free(LLRing *r);
+
+/*
+ * Producer side. Returns the entry dropped to make room, or NULL. item must
+ * not be NULL.
+ */
+void *ll_ring_push(LLRing *r, void *item);
+
+// Consumer side. NULL when empty
+void *ll_ring_pop(LLRing *r);
+
+// Wait up to timeout_ms (-1 forever) for an entry; NULL on timeout or close
+void *ll_ring_pop_wait(LLRing *r, int timeout_ms);
+
+// No more pushes; wakes a waiting consumer once the ring is drained
+void ll_ring_close(LLRing *r);
+
+static inline int ll_ring_closed(LLRing *r)
+{
+    return atomic_load(&r->closed) &&
+           atomic_load(&r->head) == atomic_load(&r->tail);
+}
+
+static inline int ll_ring_count(LLRing *r)
+{
+    return atomic_load(&r->tail) - atomic_load(&r->head);
+}
+
+#endif
@@ -0,0 +1,1158 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/mathematics.h>
+
+#include "ll_common.h"
+#include "ll_nal.h"
+#include "ll_rtp.h"
+
+#define RTP_HEADER_SIZE 12
+#define RTCP_RR         201
+#define RTCP_BYE        203
+#define RTCP_APP        204
+#define RTCP_PSFB       206
+#define PSFB_PLI        1
+#define RR_SIZE         32          // header and one report block
+#define APP_SIZE        28
+#define PLI_SIZE        12
+#define REPORT_INTERVAL 50000000    // ns between receiver reports
+#define PLI_INTERVAL    200000000   // ns between keyframes asked for or sent on request
+#define NAL_STAP_A      24
+#define NAL_FU_A        28
+#define SOCKET_BUFFER   (4 << 20)   // room for a keyframe burst
+
+static const uint8_t start_code[4] = {0x00, 0x00, 0x00, 0x01};
+
+int ll_rtp_is_url(const char *url)
+{
+    return !strncmp(url, "rtp://", 6);
+}
+
+// rtp://host:port or rtp://[v6 host]:port; host may be empty
+static int parse_url(const char *url, char *host, int host_size, char *port, int port_size)
+{
+    const char *p, *colon;
+    int len;
+
+    if (!ll_rtp_is_url(url))
+        return AVERROR(EINVAL);
+    p = url + 6;
+    if (*p == '[') {
+        const char *end = strchr(p, ']');
+        if (!end || end[1] != ':')
+            return AVERROR(EINVAL);
+        p++;
+        len = end - p;
+        colon = end + 1;
+    } else {
+        if (!(colon = strrchr(p, ':')))
+            return AVERROR(EINVAL);
+        len = colon - p;
+    }
+    if (len >= host_size || !colon[1] || strlen(colon + 1) >= (size_t)port_size)
+        return AVERROR(EINVAL);
+    memcpy(host, p, len);
+    host[len] = 0;
+    strcpy(port, colon + 1);
+    return 0;
+}
+
+int ll_rtp_open_socket(const char *url, int passive, int *family)
+{
+    struct addrinfo hints = { 0 }, *res, *ai;
+    char host[256], port[16];
+    int fd = -1, ret, one = 1, bufsize = SOCKET_BUFFER;
+
+    if (parse_url(url, host, sizeof(host), port, sizeof(port)) < 0 || (!passive && !host[0])) {
+        fprintf(stderr, "Bad RTP address '%s', expected rtp://host:port\n", url);
+        return AVERROR(EINVAL);
+    }
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_family   = passive && !host[0] ? AF_INET : AF_UNSPEC;
+    hints.ai_flags    = passive ? AI_PASSIVE : 0;
+    if ((ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &res))) {
+        fprintf(stderr, "Cannot resolve '%s': %s\n", url, gai_strerror(ret));
+        return AVERROR(EINVAL);
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        if (passive) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ret = bind(fd, ai->ai_addr, ai->ai_addrlen);
+        } else
+            ret = connect(fd, ai->ai_addr, ai->ai_addrlen);
+        if (!ret) {
+            *family = ai->ai_family;
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Cannot open '%s': %s\n", url, av_err2str(ret));
+        return ret;
+    }
+    // Capped by net.core.[rw]mem_max
+    setsockopt(fd, SOL_SOCKET, passive ? SO_RCVBUF : SO_SNDBUF, &bufsize, sizeof(bufsize));
+    return fd;
+}
+
+int ll_rtp_sender_open(LLRtpSender *s, const char *url, int mtu, LLWireCodec codec)
+{
+    int family, path_mtu, overhead;
+    socklen_t len = sizeof(path_mtu);
+
+    // RFC 6184 packetization; HEVC and AV1 go over the stream transports
+    if (codec != LL_WIRE_CODEC_H264) {
+        fprintf(stderr, "RTP carries H.264 only\n");
+        return AVERROR(ENOSYS);
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->codec = codec;
+    s->params.codec_id = AV_CODEC_ID_H264;
+    s->params.interval_ns = 1000000000;
+    s->ssrc = ll_realtime_ns() ^ getpid();
+    s->seq  = s->ssrc >> 16;
+    if ((s->fd = ll_rtp_open_socket(url, 0, &family)) < 0)
+        return s->fd;
+
+    if (mtu <= 0)
+        mtu = LL_RTP_DEFAULT_MTU;
+    if (family == AF_INET6) {
+        overhead = 40 + 8;
+        if (!getsockopt(s->fd, IPPROTO_IPV6, IPV6_MTU, &path_mtu, &len) && path_mtu < mtu)
+            mtu = path_mtu;
+    } else {
+        overhead = 20 + 8;
+        if (!getsockopt(s->fd, IPPROTO_IP, IP_MTU, &path_mtu, &len) && path_mtu < mtu)
+            mtu = path_mtu;
+    }
+    s->max_payload = FFMIN(mtu, LL_RTP_MAX_PACKET) - overhead - RTP_HEADER_SIZE;
+    if (s->max_payload < 256) {
+        fprintf(stderr, "MTU %d is too small\n", mtu);
+        ll_rtp_sender_close(s);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+// 1 when sent, 0 when nobody is listening (yet): a live stream just goes on
+static int send_iov(int fd, const uint8_t *hdr, int hdr_size, const uint8_t *payload, int size)
+{
+    struct iovec iov[2] = {
+        { (void *)hdr, hdr_size },
+        { (void *)payload, size },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+    if (sendmsg(fd, &msg, 0) < 0)
+        return errno == ECONNREFUSED ? 0 : AVERROR(errno);
+    return 1;
+}
+
+// Close the FEC group, sending its parity with the timestamp of media_hdr's frame
+static int send_parity(LLRtpSender *s, const uint8_t *media_hdr, int last)
+{
+    uint8_t hdr[RTP_HEADER_SIZE + LL_FEC_HEADER_SIZE];
+    int len, ret;
+
+    if (!(len = ll_fec_finish(&s->fec, hdr + RTP_HEADER_SIZE, last)))
+        return 0;
+    hdr[0] = 0x80;
+    hdr[1] = LL_RTP_FEC_PAYLOAD_TYPE;
+    AV_WB16(hdr + 2, s->fec_seq);
+    memcpy(hdr + 4, media_hdr + 4, 8);
+    s->fec_seq++;
+    ret = send_iov(s->fd, hdr, RTP_HEADER_SIZE + len, s->fec.parity, s->fec.size);
+    return FFMIN(ret, 0);
+}
+
+static int send_datagram(LLRtpSender *s, const uint8_t *hdr, int hdr_size,
+                         const uint8_t *payload, int size)
+{
+    int ret, marker = hdr[1] >> 7;
+
+    if ((ret = send_iov(s->fd, hdr, hdr_size, payload, size)) < 0)
+        return ret;
+    if (ret) {
+        s->stats.packets++;
+        s->stats.bytes += hdr_size + size;
+    }
+    // The marker ends the frame, and with it the frame's last group
+    if (ll_fec_enabled(&s->fec) &&
+        (ll_fec_add(&s->fec, AV_RB16(hdr + 2), hdr, hdr_size, payload, size) || marker))
+        return send_parity(s, hdr, marker);
+    return 0;
+}
+
+/*
+ * Drain the receiver reports queued on the socket: FEC follows their loss,
+ * congestion control their loss, receive rate and delay trend. A PLI asks
+ * for a keyframe, unless one went out just now and may still be in flight.
+ */
+static void read_reports(LLRtpSender *s)
+{
+    uint8_t buf[1500];
+    int len;
+
+    while (1) {
+        LLCcFeedback fb = { .loss = -1 };
+        int have_feedback = 0;
+
+        if ((len = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT)) < 0) {
+            if (errno == EINTR || errno == ECONNREFUSED)
+                continue;
+            return;
+        }
+        for (int off = 0; off + 8 <= len; ) {
+            const uint8_t *p = buf + off;
+            int count = p[0] & 0x1f, size = (AV_RB16(p + 2) + 1) * 4;
+
+            if ((p[0] >> 6) != 2 || size > len - off)
+                break;
+            for (int i = 0; p[1] == RTCP_RR && i < count && 8 + (i + 1) * 24 <= size; i++) {
+                const uint8_t *block = p + 8 + i * 24;
+                if (AV_RB32(block) != s->ssrc)
+                    continue;
+                s->reports++;
+                fb.loss = block[4] / 256.0;
+                ll_fec_update_loss(&s->fec, fb.loss);
+            }
+            if (p[1] == RTCP_APP && size >= APP_SIZE && !memcmp(p + 8, "LLCC", 4) &&
+                AV_RB32(p + 12) == s->ssrc) {
+                fb.receive_rate = AV_RB32(p + 16);
+                fb.trend        = (int32_t)AV_RB32(p + 20) / 1e6;
+                fb.nb_deltas    = AV_RB32(p + 24);
+                have_feedback   = 1;
+            }
+            if (p[1] == RTCP_PSFB && (p[0] & 0x1f) == PSFB_PLI && size >= PLI_SIZE &&
+                AV_RB32(p + 8) == s->ssrc) {
+                s->stats.keyframe_requests++;
+                if (ll_time_ns() - s->keyframe_ns >= PLI_INTERVAL)
+                    s->keyframe_request = 1;
+            }
+            off += size;
+        }
+        if (have_feedback && s->cc)
+            ll_cc_update(s->cc, &fb, ll_time_ns());
+    }
+}
+
+// Bytes the pending wire header extension adds to the next packet
+static int ext_size(const uint8_t *ext, int size)
+{
+    return ext ? FFALIGN(4 + 2 + size, 4) : 0;
+}
+
+static int put_rtp_header(LLRtpSender *s, uint8_t *buf, int marker, uint32_t timestamp,
+                          const uint8_t *ext, int size)
+{
+    int len = RTP_HEADER_SIZE;
+
+    buf[0] = 0x80 | (ext ? 0x10 : 0);
+    buf[1] = (marker ? 0x80 : 0) | LL_RTP_PAYLOAD_TYPE;
+    AV_WB16(buf + 2, s->seq);
+    AV_WB32(buf + 4, timestamp);
+    AV_WB32(buf + 8, s->ssrc);
+    s->seq++;
+    if (ext) {
+        // RFC 8285 two-byte header form, one element
+        int words = (ext_size(ext, size) - 4) / 4;
+
+        AV_WB16(buf + len, 0x1000);
+        AV_WB16(buf + len + 2, words);
+        buf[len + 4] = LL_RTP_EXT_WIRE;
+        buf[len + 5] = size;
+        memcpy(buf + len + 6, ext, size);
+        memset(buf + len + 6 + size, 0, words * 4 - 2 - size);
+        len += 4 + words * 4;
+    }
+    return len;
+}
+
+typedef struct AccessUnit {
+    uint32_t timestamp;
+    const uint8_t *ext;         // wire header, until the first packet is out
+    int ext_size;
+} AccessUnit;
+
+static int send_nal(LLRtpSender *s, AccessUnit *au, const uint8_t *nal, int size, int marker)
+{
+    uint8_t hdr[RTP_HEADER_SIZE + 8 + LL_WIRE_MAX_HEADER_SIZE + 2];
+    int len, ret;
+    uint8_t fu_indicator, type;
+
+    if (size <= s->max_payload - ext_size(au->ext, au->ext_size)) {
+        len = put_rtp_header(s, hdr, marker, au->timestamp, au->ext, au->ext_size);
+        au->ext = NULL;
+        return send_datagram(s, hdr, len, nal, size);
+    }
+
+    // FU-A: the NAL header is split between the indicator and the FU header
+    fu_indicator = (nal[0] & 0xe0) | NAL_FU_A;
+    type = nal[0] & 0x1f;
+    nal++;
+    size--;
+    for (int start = 1; size > 0; start = 0) {
+        int chunk = FFMIN(size, s->max_payload - ext_size(au->ext, au->ext_size) - 2);
+        int last = chunk == size;
+
+        len = put_rtp_header(s, hdr, marker && last, au->timestamp, au->ext, au->ext_size);
+        au->ext = NULL;
+        hdr[len++] = fu_indicator;
+        hdr[len++] = (start ? 0x80 : 0) | (last ? 0x40 : 0) | type;
+        if ((ret = send_datagram(s, hdr, len, nal, chunk)) < 0)
+            return ret;
+        nal  += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+int ll_rtp_write_packet(void *opaque, AVPacket *pkt, const LLFrameInfo *info)
+{
+    LLRtpSender *s = opaque;
+    LLWireHeader hdr = { 0 };
+    uint8_t ext[LL_WIRE_MAX_HEADER_SIZE];
+    AccessUnit au;
+    LLNalIterator it;
+    LLNalUnit nal, prev;
+    int send_params = 0, have_prev = 0, ret;
+
+    read_reports(s);
+    if ((pkt->flags & AV_PKT_FLAG_KEY) || !s->params.data)
+        send_params = ll_param_sets_update(&s->params, pkt) > 0;
+
+    // The size the receiver will reassemble, every NAL behind a start code
+    if (send_params) {
+        ll_nal_iter_init(&it, s->params.data, s->params.size);
+        while (ll_nal_iter_next(&it, &nal))
+            hdr.size += sizeof(start_code) + nal.size;
+    }
+    ll_nal_iter_init(&it, pkt->data, pkt->size);
+    while (ll_nal_iter_next(&it, &nal))
+        if (nal.type != LL_NAL_SPS && nal.type != LL_NAL_PPS)
+            hdr.size += sizeof(start_code) + nal.size;
+
+    hdr.type  = LL_WIRE_FRAME;
+    hdr.codec = s->codec;
+    hdr.flags = (pkt->flags & AV_PKT_FLAG_KEY) ? LL_WIRE_FLAG_KEYFRAME : 0;
+    hdr.seq   = s->frame_seq++;
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+        s->keyframe_ns = ll_time_ns();
+        s->keyframe_request = 0;
+    }
+    hdr.pts   = pkt->pts;
+    memcpy(hdr.stamps, info->stamps, sizeof(hdr.stamps));
+    ll_stamp(hdr.stamps, LL_STAGE_SEND);
+
+    au.ext       = ext;
+    au.ext_size  = ll_wire_put_header(ext, &hdr);
+    au.timestamp = av_rescale(hdr.stamps[LL_STAGE_CAPTURE] ? hdr.stamps[LL_STAGE_CAPTURE]
+                                                           : hdr.stamps[LL_STAGE_SEND],
+                              LL_RTP_CLOCK_RATE, 1000000000);
+
+    if (send_params) {
+        ll_nal_iter_init(&it, s->params.data, s->params.size);
+        while (ll_nal_iter_next(&it, &nal))
+            if ((ret = send_nal(s, &au, nal.data, nal.size, 0)) < 0)
+                return ret;
+    }
+    // One NAL behind, so the last one can carry the marker
+    ll_nal_iter_init(&it, pkt->data, pkt->size);
+    while (ll_nal_iter_next(&it, &nal)) {
+        if (nal.type == LL_NAL_SPS || nal.type == LL_NAL_PPS)
+            continue;
+        if (have_prev && (ret = send_nal(s, &au, prev.data, prev.size, 0)) < 0)
+            return ret;
+        prev = nal;
+        have_prev = 1;
+    }
+    if (have_prev && (ret = send_nal(s, &au, prev.data, prev.size, 1)) < 0)
+        return ret;
+
+    s->stats.frames++;
+    if (s->latency)
+        ll_latency_record(s->latency, hdr.stamps);
+    return 0;
+}
+
+void ll_rtp_sender_close(LLRtpSender *s)
+{
+    if (s->fd >= 0) {
+        uint8_t bye[8];
+
+        bye[0] = 0x81;          // version 2, one SSRC
+        bye[1] = RTCP_BYE;
+        AV_WB16(bye + 2, 1);
+        AV_WB32(bye + 4, s->ssrc);
+        send(s->fd, bye, sizeof(bye), 0);
+        close(s->fd);
+    }
+    s->fd = -1;
+    ll_param_sets_free(&s->params);
+}
+
+typedef struct LLRtpSlot {
+    uint8_t *data;              // the whole datagram
+    unsigned int alloc;
+    int size;
+    int present;
+    int recovered;
+    uint16_t seq;
+    uint32_t timestamp;
+    int marker;
+    int has_header;
+    int offset;                 // payload, past the RTP header and extension
+    int payload_size;
+    int64_t arrival_ns;
+} LLRtpSlot;
+
+typedef struct RtpPacket {
+    int type;
+    int marker;
+    uint16_t seq;
+    uint32_t timestamp;
+    uint32_t ssrc;
+    int offset;
+    int size;
+    int has_header;
+} RtpPacket;
+
+int ll_rtp_receiver_open(LLRtpReceiver *r, const char *url)
+{
+    int family;
+
+    memset(r, 0, sizeof(*r));
+    r->need_keyframe = 1;
+    r->report_ssrc = ll_realtime_ns() ^ getpid();
+    if (!(r->slots = av_calloc(LL_RTP_WINDOW, sizeof(*r->slots))))
+        return AVERROR(ENOMEM);
+    if ((r->fd = ll_rtp_open_socket(url, 1, &family)) < 0) {
+        av_freep(&r->slots);
+        return r->fd;
+    }
+    return 0;
+}
+
+static int au_append(LLRtpReceiver *r, const uint8_t *data, int size, int with_start_code)
+{
+    int need = r->size + (with_start_code ? sizeof(start_code) : 0) + size;
+
+    if (need > LL_WIRE_MAX_PAYLOAD)
+        return AVERROR_INVALIDDATA;
+    if (need + AV_INPUT_BUFFER_PADDING_SIZE > r->buf_size) {
+        uint8_t *buf = av_fast_realloc(r->buf, &r->buf_size, need + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!buf)
+            return AVERROR(ENOMEM);
+        r->buf = buf;
+    }
+    if (with_start_code) {
+        memcpy(r->buf + r->size, start_code, sizeof(start_code));
+        r->size += sizeof(start_code);
+    }
+    memcpy(r->buf + r->size, data, size);
+    r->size += size;
+    memset(r->buf + r->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
+static int depacketize(LLRtpReceiver *r, const uint8_t *p, int len)
+{
+    int type = p[0] & 0x1f, ret;
+
+    if (type >= 1 && type <= 23)
+        return au_append(r, p, len, 1);
+
+    if (type == NAL_STAP_A) {
+        for (p++, len--; len >= 2; ) {
+            int size = AV_RB16(p);
+            if (!size || size > len - 2)
+                return AVERROR_INVALIDDATA;
+            if ((ret = au_append(r, p + 2, size, 1)) < 0)
+                return ret;
+            p   += 2 + size;
+            len -= 2 + size;
+        }
+        return 0;
+    }
+
+    if (type == NAL_FU_A) {
+        if (len < 3)
+            return AVERROR_INVALIDDATA;
+        if (p[1] & 0x80) {
+            uint8_t nal_header = (p[0] & 0xe0) | (p[1] & 0x1f);
+            if ((ret = au_append(r, &nal_header, 1, 1)) < 0)
+                return ret;
+        }
+        return au_append(r, p + 2, len - 2, 0);
+    }
+    return AVERROR_INVALIDDATA;
+}
+
+/*
+ * Parse an RTP packet of len bytes (padding removed). hdr, when given,
+ * gets the wire header carried in the extension, if there is one.
+ */
+static int parse_rtp(const uint8_t *p, int len, RtpPacket *pkt, LLWireHeader *hdr)
+{
+    int hdr_len;
+
+    if (len < RTP_HEADER_SIZE || (p[0] >> 6) != 2)
+        return AVERROR_INVALIDDATA;
+    pkt->type       = p[1] & 0x7f;
+    pkt->marker     = p[1] >> 7;
+    pkt->seq        = AV_RB16(p + 2);
+    pkt->timestamp  = AV_RB32(p + 4);
+    pkt->ssrc       = AV_RB32(p + 8);
+    pkt->has_header = 0;
+    hdr_len = RTP_HEADER_SIZE + 4 * (p[0] & 0x0f);
+    if (p[0] & 0x20) {
+        int padding = p[len - 1];
+        if (!padding || padding > len - hdr_len)
+            return AVERROR_INVALIDDATA;
+        len -= padding;
+    }
+    if (p[0] & 0x10) {
+        int profile, ext_len;
+
+        if (len < hdr_len + 4)
+            return AVERROR_INVALIDDATA;
+        profile = AV_RB16(p + hdr_len);
+        ext_len = AV_RB16(p + hdr_len + 2) * 4;
+        if (len < hdr_len + 4 + ext_len)
+            return AVERROR_INVALIDDATA;
+        // Two-byte header elements: id, length, data; zero bytes are padding
+        if ((profile & 0xfff0) == 0x1000) {
+            const uint8_t *e = p + hdr_len + 4, *end = e + ext_len;
+            LLWireHeader tmp;
+            while (end - e >= 2) {
+                if (!e[0]) {
+                    e++;
+                    continue;
+                }
+                if (e[1] > end - e - 2)
+                    break;
+                if (e[0] == LL_RTP_EXT_WIRE && ll_wire_parse_header(e + 2, e[1], hdr ? hdr : &tmp) >= 0)
+                    pkt->has_header = 1;
+                e += 2 + e[1];
+            }
+        }
+        hdr_len += 4 + ext_len;
+    }
+    if (len <= hdr_len)
+        return AVERROR_INVALIDDATA;
+    pkt->offset = hdr_len;
+    pkt->size   = len - hdr_len;
+    return 0;
+}
+
+static LLRtpSlot *get_slot(LLRtpReceiver *r, uint16_t seq)
+{
+    LLRtpSlot *slot = &r->slots[seq & (LL_RTP_WINDOW - 1)];
+    return slot->present && slot->seq == seq ? slot : NULL;
+}
+
+static int store_packet(LLRtpReceiver *r, const uint8_t *data, int len,
+                        const RtpPacket *pkt, int recovered)
+{
+    LLRtpSlot *slot = &r->slots[pkt->seq & (LL_RTP_WINDOW - 1)];
+
+    if (slot->present)
+        return 0;
+    av_fast_malloc(&slot->data, &slot->alloc, len);
+    if (!slot->data)
+        return AVERROR(ENOMEM);
+    memcpy(slot->data, data, len);
+    slot->size         = len;
+    slot->present      = 1;
+    slot->recovered    = recovered;
+    slot->seq          = pkt->seq;
+    slot->timestamp    = pkt->timestamp;
+    slot->marker       = pkt->marker;
+    slot->has_header   = pkt->has_header;
+    slot->offset       = pkt->offset;
+    slot->payload_size = pkt->size;
+    slot->arrival_ns   = r->arrival_ns;
+    return 1;
+}
+
+// Forget the packets before end
+static void release(LLRtpReceiver *r, uint16_t end)
+{
+    for (; r->next_seq != end; r->next_seq++) {
+        LLRtpSlot *slot = get_slot(r, r->next_seq);
+        if (slot)
+            slot->present = 0;
+    }
+}
+
+static LLRtpBounds *get_bounds(LLRtpReceiver *r, uint32_t timestamp, int create)
+{
+    LLRtpBounds *b;
+
+    for (int i = 0; i < LL_RTP_BOUNDS; i++)
+        if ((r->bounds[i].start_known || r->bounds[i].end_known) &&
+            r->bounds[i].timestamp == timestamp)
+            return &r->bounds[i];
+    if (!create)
+        return NULL;
+    b = &r->bounds[r->next_bounds++ % LL_RTP_BOUNDS];
+    memset(b, 0, sizeof(*b));
+    b->timestamp = timestamp;
+    return b;
+}
+
+// Queueing shows as the frames' first packets arriving later and later
+static void update_trend(LLRtpReceiver *r, int64_t arrival_ns)
+{
+    if (r->hdr.stamps[LL_STAGE_SEND])
+        ll_delay_trend_update(&r->trend, r->hdr.stamps[LL_STAGE_SEND], arrival_ns);
+}
+
+static int assemble(LLRtpReceiver *r, uint16_t start, uint16_t end)
+{
+    LLRtpSlot *slot = get_slot(r, start);
+    int64_t arrival_ns = slot->arrival_ns;
+    RtpPacket pkt;
+    int ret;
+
+    if (!slot->has_header || parse_rtp(slot->data, slot->size, &pkt, &r->hdr) < 0)
+        return AVERROR_INVALIDDATA;
+    r->size = 0;
+    for (uint16_t seq = start; ; seq++) {
+        slot = get_slot(r, seq);
+        if ((ret = depacketize(r, slot->data + slot->offset, slot->payload_size)) < 0)
+            return ret;
+        if (seq == end)
+            break;
+    }
+    if (r->size != (int)r->hdr.size)
+        return AVERROR_INVALIDDATA;
+    update_trend(r, arrival_ns);
+    return 0;
+}
+
+static void drop_frame(LLRtpReceiver *r, uint16_t end, int missing)
+{
+    r->stats.lost += missing;
+    r->stats.dropped++;
+    r->stats.frames_lost++;
+    r->need_keyframe = 1;
+    r->aborted |= r->partial;
+    r->partial = 0;
+    release(r, end);
+}
+
+// 1 if the packet completes a NAL unit, i.e. is not a leading or middle FU-A fragment
+static int ends_nal(const LLRtpSlot *slot)
+{
+    const uint8_t *p = slot->data + slot->offset;
+
+    return (p[0] & 0x1f) != NAL_FU_A || (slot->payload_size >= 2 && (p[1] & 0x40));
+}
+
+/*
+ * Slice mode: hand out the NAL units at the head of the frame at
+ * r->next_seq as soon as all their packets are in, instead of waiting
+ * for the whole frame. The packets stay in the window for the parity.
+ * 1 when r->buf holds a part of the frame, 0 when there is nothing new.
+ */
+static int next_slices(LLRtpReceiver *r, uint32_t timestamp)
+{
+    uint16_t start = r->partial ? r->partial_seq : r->next_seq, seq, end = start;
+    int handed_out = r->partial ? r->partial_size : 0, last = 0, recovered = 0, ret = 0;
+    LLRtpSlot *slot, *first;
+    RtpPacket pkt;
+
+    // The run of packets we have from start, up to its last complete NAL unit
+    for (seq = start; (slot = get_slot(r, seq)) && slot->timestamp == timestamp; seq++) {
+        if (ends_nal(slot)) {
+            end  = seq + 1;
+            last = slot->marker;
+        }
+        if (slot->marker)
+            break;
+    }
+    if (end == start)
+        return 0;
+
+    if (!r->partial) {
+        // The frame's header rides on its first packet; without it, or while
+        // waiting for a keyframe, the frame goes the whole-frame way
+        first = get_slot(r, r->next_seq);
+        if (!first->has_header || parse_rtp(first->data, first->size, &pkt, &r->hdr) < 0 ||
+            (r->need_keyframe && !(r->hdr.flags & LL_WIRE_FLAG_KEYFRAME)))
+            return 0;
+        update_trend(r, first->arrival_ns);
+        r->hdr.flags |= LL_WIRE_FLAG_SLICE;
+        r->partial      = 1;
+        r->partial_size = 0;
+    }
+
+    r->size = 0;
+    for (seq = start; seq != end && ret >= 0; seq++) {
+        slot = get_slot(r, seq);
+        ret  = depacketize(r, slot->data + slot->offset, slot->payload_size);
+    }
+    r->partial_seq   = end;
+    r->partial_size += r->size;
+    if (ret >= 0 && !last)
+        return 1;
+
+    // The marker ends the frame; it was whole if it added up to the header's size
+    for (seq = r->next_seq; seq != end; seq++)
+        recovered += get_slot(r, seq)->recovered;
+    release(r, end);
+    r->partial = 0;
+    if (ret < 0 || r->partial_size != (int)r->hdr.size) {
+        r->aborted = handed_out > 0;
+        r->stats.dropped++;
+        r->stats.frames_lost++;
+        r->need_keyframe = 1;
+        return ret == AVERROR(ENOMEM) ? ret : 0;
+    }
+    r->hdr.flags |= LL_WIRE_FLAG_END;
+    if (r->hdr.flags & LL_WIRE_FLAG_KEYFRAME)
+        r->want_keyframe = 0;
+    r->need_keyframe = 0;
+    r->stats.frames++;
+    r->stats.frames_recovered += recovered > 0;
+    return 1;
+}
+
+/*
+ * Deliver or drop the oldest frame in the window once its fate is known.
+ * A frame is delivered as soon as it is whole; one with holes waits until
+ * nothing can fill them: the parity ending the frame has been used, or a
+ * later frame has started (its parity went out before the next frame).
+ * 1 when r->buf holds a frame, 0 when more packets are needed.
+ */
+static int next_frame(LLRtpReceiver *r)
+{
+    while (1) {
+        LLRtpSlot *slot = NULL;
+        LLRtpBounds *b;
+        uint16_t seq, last = r->max_seq, end = r->max_seq + 1, stop;
+        int missing = 0, end_known = 0, finished = 0, recovered = 0, ret;
+        uint32_t timestamp;
+
+        // Parts of a frame went out before the rest of it was lost
+        if (r->aborted) {
+            r->aborted = 0;
+            return AVERROR_INVALIDDATA;
+        }
+        if (!r->have_seq || (int16_t)(r->max_seq - r->next_seq) < 0)
+            break;
+
+        // The frame is that of the oldest packet we have
+        for (seq = r->next_seq; !(slot = get_slot(r, seq)) && seq != last; seq++)
+            ;
+        if (!slot)
+            break;
+        timestamp = slot->timestamp;
+
+        if (r->slices && (ret = next_slices(r, timestamp)))
+            return ret;
+
+        if ((b = get_bounds(r, timestamp, 0)) && b->start_known &&
+            (int16_t)(b->start - r->next_seq) > 0 && (int16_t)(b->start - seq) <= 0) {
+            // What comes before its first packet belonged to frames lost whole
+            drop_frame(r, b->start, (uint16_t)(b->start - r->next_seq));
+            continue;
+        }
+        if (b && b->end_known && (int16_t)(b->end - r->next_seq) >= 0) {
+            end = b->end;
+            end_known = 1;
+            if ((int16_t)(last - end) > 0)
+                last = end;
+        }
+
+        stop = last + 1;
+        for (seq = r->next_seq; seq != stop; seq++) {
+            if (!(slot = get_slot(r, seq))) {
+                missing++;
+                continue;
+            }
+            if (slot->timestamp != timestamp) {
+                // A later frame has started; the holes before it were ours
+                if (!end_known)
+                    end = seq - 1;
+                finished = 1;
+                break;
+            }
+            recovered += slot->recovered;
+            if (slot->marker) {
+                end = seq;
+                end_known = 1;
+                break;
+            }
+        }
+        if (end_known && (int16_t)(r->max_seq - end) > 0)
+            finished = 1;
+        if (end_known && (int16_t)(end - last) > 0)
+            missing += (uint16_t)(end - last);
+        if ((uint16_t)(r->max_seq - r->next_seq) >= LL_RTP_WINDOW / 2)
+            finished = 1;
+
+        if (end_known && !missing && !r->partial) {
+            ret = assemble(r, r->next_seq, end);
+            release(r, end + 1);
+            if (ret == AVERROR(ENOMEM))
+                return ret;
+            if (ret < 0) {
+                r->stats.dropped++;
+                r->stats.frames_lost++;
+                r->need_keyframe = 1;
+                continue;
+            }
+            if (r->need_keyframe && !(r->hdr.flags & LL_WIRE_FLAG_KEYFRAME)) {
+                r->stats.dropped++;
+                continue;
+            }
+            if (r->hdr.flags & LL_WIRE_FLAG_KEYFRAME)
+                r->want_keyframe = 0;
+            r->need_keyframe = 0;
+            r->stats.frames++;
+            r->stats.frames_recovered += recovered > 0;
+            return 1;
+        }
+        // A whole frame that slice mode could not finish is broken
+        if (!finished && !(end_known && !missing))
+            return 0;
+        if (!end_known && !(slot && slot->timestamp != timestamp))
+            end = r->max_seq;
+        drop_frame(r, end + 1, missing);
+    }
+    return 0;
+}
+
+static void update_max_seq(LLRtpReceiver *r, uint16_t seq)
+{
+    if ((int16_t)(seq - r->max_seq) > 0) {
+        if (seq < r->max_seq)
+            r->cycles += 1 << 16;
+        r->max_seq = seq;
+    }
+}
+
+/*
+ * Rebuild the one missing packet of a parity group, if one is missing.
+ * 1 when the oldest frame may be ready to deliver or drop.
+ */
+static int handle_parity(LLRtpReceiver *r, const uint8_t *p, int len)
+{
+    const uint8_t *pkts[255];
+    int sizes[255], nb = 0, size, ret;
+    uint16_t lost = 0;
+    LLFecHeader fec;
+    LLRtpBounds *b;
+    RtpPacket pkt;
+
+    if (parse_rtp(p, len, &pkt, NULL) < 0 || !r->have_seq || pkt.ssrc != r->ssrc ||
+        ll_fec_parse_header(p + pkt.offset, pkt.size, &fec) < 0)
+        return 0;
+
+    if (fec.flags & (LL_FEC_FLAG_FIRST | LL_FEC_FLAG_LAST)) {
+        if (!(b = get_bounds(r, pkt.timestamp, 1)))
+            return 0;
+        if (fec.flags & LL_FEC_FLAG_FIRST) {
+            b->start = fec.base_seq;
+            b->start_known = 1;
+        }
+        if (fec.flags & LL_FEC_FLAG_LAST) {
+            b->end = fec.base_seq + fec.count - 1;
+            b->end_known = 1;
+        }
+    }
+    // Already delivered, or too far ahead to hold
+    if ((int16_t)(fec.base_seq - r->next_seq) < 0 ||
+        (uint16_t)(fec.base_seq + fec.count - 1 - r->next_seq) >= LL_RTP_WINDOW)
+        return 1;
+
+    for (int i = 0; i < fec.count; i++) {
+        uint16_t seq = fec.base_seq + i;
+        LLRtpSlot *slot = get_slot(r, seq);
+        if (!slot) {
+            if (nb < i)
+                return 1;           // two missing, nothing to do
+            lost = seq;
+            continue;
+        }
+        pkts[nb]  = slot->data;
+        sizes[nb] = slot->size;
+        nb++;
+    }
+    if (nb == fec.count)
+        return !!fec.flags;
+
+    size = ll_fec_recover(&fec, p + pkt.offset + LL_FEC_HEADER_SIZE,
+                          pkt.size - LL_FEC_HEADER_SIZE, pkts, sizes, nb, r->rebuilt);
+    if (size < 0 || parse_rtp(r->rebuilt, size, &pkt, NULL) < 0 || pkt.seq != lost ||
+        pkt.type != LL_RTP_PAYLOAD_TYPE)
+        return 0;
+    if ((ret = store_packet(r, r->rebuilt, size, &pkt, 1)) < 0)
+        return ret;
+    r->stats.recovered++;
+    // The group may end past the newest packet seen when its last one is lost
+    update_max_seq(r, pkt.seq);
+    return 1;
+}
+
+// RFC 3550 receiver report, and an APP packet with the congestion control feedback
+static void send_report(LLRtpReceiver *r, int64_t now)
+{
+    uint8_t rr[RR_SIZE + APP_SIZE], *app = rr + RR_SIZE;
+    int64_t rate = r->report_ns ? r->interval_bytes * 8 * 1000000000LL / FFMAX(now - r->report_ns, 1) : 0;
+    uint32_t ext_max = r->cycles + r->max_seq;
+    uint32_t expected = ext_max - r->base_seq + 1;
+    uint32_t expected_interval = expected - r->expected_prior;
+    uint32_t received_interval = r->received - r->received_prior;
+    int64_t lost_interval = (int64_t)expected_interval - received_interval;
+    int64_t lost = (int64_t)expected - r->received;
+    int fraction = 0;
+
+    if (expected_interval && lost_interval > 0)
+        fraction = FFMIN((lost_interval << 8) / expected_interval, 255);
+    r->expected_prior = expected;
+    r->received_prior = r->received;
+
+    rr[0] = 0x81;               // version 2, one report block
+    rr[1] = RTCP_RR;
+    AV_WB16(rr + 2, RR_SIZE / 4 - 1);
+    AV_WB32(rr + 4, r->report_ssrc);
+    AV_WB32(rr + 8, r->ssrc);
+    rr[12] = fraction;
+    AV_WB24(rr + 13, (uint32_t)FFMAX(FFMIN(lost, 0x7fffff), -0x800000) & 0xffffff);
+    AV_WB32(rr + 16, ext_max);
+    AV_WB32(rr + 20, lrint(r->jitter));
+    AV_WB32(rr + 24, 0);        // no sender reports to echo
+    AV_WB32(rr + 28, 0);
+
+    app[0] = 0x80;              // subtype 0
+    app[1] = RTCP_APP;
+    AV_WB16(app + 2, APP_SIZE / 4 - 1);
+    AV_WB32(app + 4, r->report_ssrc);
+    memcpy(app + 8, "LLCC", 4);
+    AV_WB32(app + 12, r->ssrc);
+    AV_WB32(app + 16, FFMIN(rate, UINT32_MAX));
+    AV_WB32(app + 20, (uint32_t)(int32_t)av_clipd(r->trend.slope * 1e6, INT32_MIN, INT32_MAX));
+    AV_WB32(app + 24, r->trend.nb_deltas);
+    r->interval_bytes = 0;
+    r->report_ns = now;
+    sendto(r->fd, rr, sizeof(rr), 0, (struct sockaddr *)&r->peer, r->peer_len);
+}
+
+// RFC 4585 picture loss indication
+static void send_pli(LLRtpReceiver *r, int64_t now)
+{
+    uint8_t pli[PLI_SIZE];
+
+    pli[0] = 0x80 | PSFB_PLI;
+    pli[1] = RTCP_PSFB;
+    AV_WB16(pli + 2, PLI_SIZE / 4 - 1);
+    AV_WB32(pli + 4, r->report_ssrc);
+    AV_WB32(pli + 8, r->ssrc);
+    r->pli_ns = now;
+    r->stats.keyframe_requests++;
+    sendto(r->fd, pli, sizeof(pli), 0, (struct sockaddr *)&r->peer, r->peer_len);
+}
+
+// Start over on the first packet or a new sender
+static void resync(LLRtpReceiver *r, const RtpPacket *pkt)
+{
+    if (r->have_seq)
+        release(r, r->max_seq + 1);
+    r->aborted |= r->partial;
+    r->partial = 0;
+    memset(r->bounds, 0, sizeof(r->bounds));
+    r->have_seq       = 1;
+    r->ssrc           = pkt->ssrc;
+    r->next_seq       = pkt->seq;
+    r->max_seq        = pkt->seq;
+    r->base_seq       = pkt->seq;
+    r->cycles         = 0;
+    r->received       = 0;
+    r->expected_prior = 0;
+    r->received_prior = 0;
+    r->jitter         = 0;
+    r->need_keyframe  = 1;
+    memset(&r->trend, 0, sizeof(r->trend));
+}
+
+// 1 when the oldest frame may be ready to deliver or drop, AVERROR_EOF on BYE
+static int handle_packet(LLRtpReceiver *r, int len)
+{
+    const uint8_t *p = r->packet;
+    RtpPacket pkt;
+    int64_t transit;
+    int ret;
+
+    if (len < 4 || (p[0] >> 6) != 2)
+        return 0;
+    if (p[1] >= 200 && p[1] <= 204) {
+        // RTCP; walk a compound packet looking for the BYE
+        for (int off = 0; off + 4 <= len; off += (AV_RB16(p + off + 2) + 1) * 4)
+            if (p[off + 1] == RTCP_BYE)
+                return AVERROR_EOF;
+        return 0;
+    }
+    if (len >= 2 && (p[1] & 0x7f) == LL_RTP_FEC_PAYLOAD_TYPE)
+        return handle_parity(r, p, len);
+    if (parse_rtp(p, len, &pkt, NULL) < 0 || pkt.type != LL_RTP_PAYLOAD_TYPE)
+        return 0;
+
+    if (!r->have_seq || pkt.ssrc != r->ssrc)
+        resync(r, &pkt);
+    if ((int16_t)(pkt.seq - r->next_seq) < 0) {
+        r->stats.late++;
+        return 0;
+    }
+    if ((uint16_t)(pkt.seq - r->next_seq) >= LL_RTP_WINDOW) {
+        // Too far ahead to wait for the rest: give up on what we hold
+        drop_frame(r, r->max_seq + 1, (uint16_t)(pkt.seq - r->max_seq - 1));
+        r->next_seq = pkt.seq;
+    }
+    if (!(ret = store_packet(r, p, len, &pkt, 0))) {
+        r->stats.late++;
+        return 0;
+    }
+    if (ret < 0)
+        return ret;
+    r->stats.packets++;
+    r->stats.bytes += len;
+
+    r->interval_bytes += len;
+    r->received++;
+    update_max_seq(r, pkt.seq);
+    // RFC 3550 A.8 interarrival jitter, in RTP clock units
+    transit = (int32_t)(av_rescale(ll_realtime_ns(), LL_RTP_CLOCK_RATE, 1000000000) - pkt.timestamp);
+    if (r->received > 1)
+        r->jitter += (fabs((double)(transit - r->transit)) - r->jitter) / 16;
+    r->transit = transit;
+
+    // Frames end on a marker or where the next one starts; slices with their NAL units
+    ret = pkt.marker || pkt.timestamp != r->timestamp ||
+          (r->slices && ends_nal(get_slot(r, pkt.seq)));
+    r->timestamp = pkt.timestamp;
+    return ret;
+}
+
+int ll_rtp_receive(LLRtpReceiver *r, LLWireHeader *hdr, uint8_t **data, int *size,
+                   int timeout_ms)
+{
+    int64_t deadline = ll_time_ns() + timeout_ms * 1000000LL;
+    int ret = 1;
+
+    while (1) {
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+        int wait = timeout_ms < 0 ? -1 : FFMAX(0, (deadline - ll_time_ns()) / 1000000);
+        int len;
+
+        if ((ret || r->aborted) && (ret = next_frame(r)) < 0)
+            return ret;
+        if (ret) {
+            *hdr  = r->hdr;
+            *data = r->buf;
+            *size = r->size;
+            return 0;
+        }
+        if (r->peer_len && ll_time_ns() - r->report_ns >= REPORT_INTERVAL)
+            send_report(r, ll_time_ns());
+        if (r->peer_len && r->have_seq && (r->need_keyframe || r->want_keyframe) &&
+            ll_time_ns() - r->pli_ns >= PLI_INTERVAL)
+            send_pli(r, ll_time_ns());
+
+        if ((ret = poll(&pfd, 1, wait)) < 0) {
+            ret = 0;
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        if (!ret)
+            return AVERROR(EAGAIN);
+        r->peer_len = sizeof(r->peer);
+        if ((len = recvfrom(r->fd, r->packet, sizeof(r->packet), 0,
+                            (struct sockaddr *)&r->peer, &r->peer_len)) < 0) {
+            r->peer_len = 0;
+            ret = 0;
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return AVERROR(errno);
+        }
+        r->arrival_ns = ll_realtime_ns();
+        if ((ret = handle_packet(r, len)) < 0)
+            return ret;
+    }
+}
+
+void ll_rtp_request_keyframe(LLRtpReceiver *r)
+{
+    r->want_keyframe = 1;
+}
+
+void ll_rtp_receiver_close(LLRtpReceiver *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    if (r->slots)
+        for (int i = 0; i < LL_RTP_WINDOW; i++)
+            av_freep(&r->slots[i].data);
+    av_freep(&r->slots);
+    av_freep(&r->buf);
+    r->buf_size = 0;
+}
+
+void ll_rtp_print_stats(const LLRtpStats *st, const char *name, FILE *f)
+{
+    fprintf(f, "%s: %llu packets, %.1f MB, %llu frames, %llu lost, %llu late, %llu frames dropped\n",
+            name, (unsigned long long)st->packets, st->bytes / 1e6, (unsigned long long)st->frames,
+            (unsigned long long)st->lost, (unsigned long long)st->late,
+            (unsigned long long)st->dropped);
+    if (st->recovered || st->frames_lost)
+        fprintf(f, "%s FEC: %llu packets recovered, %llu frames recovered, %llu frames unrecoverable\n",
+                name, (unsigned long long)st->recovered, (unsigned long long)st->frames_recovered,
+                (unsigned long long)st->frames_lost);
+    if (st->keyframe_requests)
+        fprintf(f, "%s: %llu keyframe requests\n", name, (unsigned long long)st->keyframe_requests);
+}
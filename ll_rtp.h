@@ -0,0 +1,214 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_RTP_H
+#define LL_RTP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "ll_cc.h"
+#include "ll_encoder.h"
+#include "ll_fec.h"
+#include "ll_wire.h"
+
+/*
+ * UDP transport: RTP with RFC 6184 H.264 packetization. NAL units that fit
+ * in the MTU go out as single NAL unit packets, larger ones as FU-A
+ * fragments; parameter sets are sent in-band ahead of the keyframes they
+ * belong to, and the marker bit ends each access unit.
+ *
+ * The first packet of every access unit carries the ll_wire.h header of
+ * the frame (sequence number, PTS, keyframe flag, codec and the sender's
+ * stamps) as an RFC 8285 two-byte header extension element, so the
+ * receiver gets the same metadata as on the stream transport. The sender
+ * ends the stream with an RTCP BYE on the same port (RFC 5761 muxing).
+ *
+ * With FEC on, ll_fec.h parity packets follow the media under their own
+ * payload type and sequence numbers. The receiver holds packets in a
+ * window until their frame is complete, rebuilds what the parity allows,
+ * and sends RTCP receiver reports back to the sender's address; their
+ * loss fraction drives adaptive FEC overhead. An RTCP APP packet ("LLCC")
+ * rides along with each report, carrying the receive rate and the ll_cc.h
+ * delay trend for the sender's congestion control.
+ *
+ * While the receiver waits for a keyframe (after a loss, on joining, or
+ * when the decoder asks) it sends RTCP picture loss indications (RFC 4585
+ * PLI); the sender raises keyframe_request for the encoder to act on.
+ *
+ * URLs are rtp://host:port; a receiver may leave out the host to listen on
+ * every interface.
+ */
+
+#define LL_RTP_PAYLOAD_TYPE     96
+#define LL_RTP_FEC_PAYLOAD_TYPE 97
+#define LL_RTP_CLOCK_RATE       90000
+#define LL_RTP_DEFAULT_MTU      1500
+#define LL_RTP_MAX_PACKET       LL_FEC_MAX_PACKET   // jumbo frames
+#define LL_RTP_WINDOW           4096    // packets held by the receiver, a power of two
+#define LL_RTP_BOUNDS           8
+#define LL_RTP_EXT_WIRE         1       // extension element id of the wire header
+
+typedef struct LLRtpStats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t lost;              // sequence numbers neither seen nor rebuilt
+    uint64_t late;              // duplicate or behind the expected sequence
+    uint64_t frames;            // access units sent / delivered
+    uint64_t dropped;           // receiver: incomplete, or waiting for a keyframe
+    uint64_t recovered;         // packets rebuilt from parity
+    uint64_t frames_recovered;  // frames delivered thanks to parity
+    uint64_t frames_lost;       // frames dropped for missing packets
+    uint64_t keyframe_requests; // PLIs sent / received
+} LLRtpStats;
+
+typedef struct LLRtpSender {
+    int fd;
+    int max_payload;            // RTP payload bytes per datagram, from the MTU
+    uint16_t seq;
+    uint32_t ssrc;
+    uint32_t frame_seq;
+    uint16_t fec_seq;
+    LLWireCodec codec;
+    LLParamSets params;
+    LLFecEncoder fec;           // set up with ll_fec_encoder_init after opening
+    uint64_t reports;           // receiver reports read
+    int keyframe_request;       // set on a PLI, for the caller to clear
+    int64_t keyframe_ns;        // last keyframe sent
+
+    LLLatencyStats *latency;    // optional, records sender-side stages
+    LLCongestionControl *cc;    // optional, fed from the receiver reports
+    LLRtpStats stats;
+} LLRtpSender;
+
+typedef struct LLRtpBounds {
+    uint32_t timestamp;
+    int start_known;
+    int end_known;
+    uint16_t start;
+    uint16_t end;
+} LLRtpBounds;
+
+typedef struct LLRtpReceiver {
+    int fd;
+    uint8_t packet[LL_RTP_MAX_PACKET];
+    uint8_t rebuilt[LL_RTP_MAX_PACKET];
+
+    struct sockaddr_storage peer;   // the sender, for receiver reports
+    socklen_t peer_len;
+
+    struct LLRtpSlot *slots;    // LL_RTP_WINDOW packets by sequence number
+    int have_seq;
+    uint32_t ssrc;
+    uint16_t next_seq;          // oldest packet not delivered or dropped yet
+    uint16_t max_seq;           // newest packet seen
+    uint32_t timestamp;         // of the newest packet
+    LLRtpBounds bounds[LL_RTP_BOUNDS];  // frame boundaries learned from parity
+    int next_bounds;
+    int need_keyframe;
+    int want_keyframe;          // the decoder asked for one
+    int64_t pli_ns;
+    LLWireHeader hdr;
+
+    uint8_t *buf;               // access unit being reassembled, Annex-B
+    unsigned int buf_size;
+    int size;
+
+    int slices;                 // deliver NAL units as they complete, see ll_rtp_receive
+    int partial;                // the oldest frame is partly delivered
+    uint16_t partial_seq;       // its first packet not delivered yet
+    int partial_size;
+    int aborted;                // the rest of a partly delivered frame was lost
+
+    // RFC 3550 receiver report state
+    uint32_t report_ssrc;
+    uint32_t base_seq;
+    uint32_t cycles;
+    uint32_t received;
+    uint32_t expected_prior;
+    uint32_t received_prior;
+    int64_t transit;
+    double jitter;
+    int64_t report_ns;
+    int64_t arrival_ns;         // of the packet being handled
+    int64_t interval_bytes;     // received since the last report
+    LLDelayTrend trend;
+
+    LLRtpStats stats;
+} LLRtpReceiver;
+
+// 1 if url starts with rtp://
+int ll_rtp_is_url(const char *url);
+
+/*
+ * UDP socket for url: bound when passive, else connected. family gets the
+ * address family used.
+ */
+int ll_rtp_open_socket(const char *url, int passive, int *family);
+
+/*
+ * mtu is the link MTU; the path MTU is used instead if the kernel knows a
+ * smaller one. codec must be LL_WIRE_CODEC_H264.
+ */
+int ll_rtp_sender_open(LLRtpSender *s, const char *url, int mtu, LLWireCodec codec);
+
+// LLPacketCallback sending pkt to the LLRtpSender in opaque
+int ll_rtp_write_packet(void *opaque, AVPacket *pkt, const LLFrameInfo *info);
+
+// Sends the BYE and closes the socket
+void ll_rtp_sender_close(LLRtpSender *s);
+
+int ll_rtp_receiver_open(LLRtpReceiver *r, const char *url);
+
+/*
+ * Wait up to timeout_ms (-1 forever) for the next complete access unit.
+ * *data (padded for libavcodec) stays valid until the next call; hdr gets
+ * the sender's frame header. Frames still missing packets once parity
+ * can no longer help are dropped, and so is everything after them up to
+ * the next keyframe. Returns 0, AVERROR(EAGAIN) on timeout or
+ * AVERROR_EOF once the sender said BYE.
+ *
+ * With r->slices set, the NAL units at the head of a frame are returned
+ * as soon as their packets are in, flagged LL_WIRE_FLAG_SLICE, the last
+ * part also LL_WIRE_FLAG_END; a decoder can work on the first slices
+ * while the others are still on the wire. If the rest of a frame is then
+ * lost, AVERROR_INVALIDDATA tells the caller to throw away what it got.
+ */
+int ll_rtp_receive(LLRtpReceiver *r, LLWireHeader *hdr, uint8_t **data, int *size,
+                   int timeout_ms);
+
+/*
+ * Ask the sender for a keyframe, e.g. when the decoder hit corrupt data;
+ * frames keep being delivered meanwhile.
+ */
+void ll_rtp_request_keyframe(LLRtpReceiver *r);
+
+void ll_rtp_receiver_close(LLRtpReceiver *r);
+
+void ll_rtp_print_stats(const LLRtpStats *st, const char *name, FILE *f);
+
+#endif
@@ -0,0 +1,320 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "ll_common.h"
+#include "ll_shm.h"
+
+#define SHM_PAGE 4096
+
+// Shared between processes, so no FUTEX_PRIVATE_FLAG
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts, *pts = NULL;
+
+    if (timeout_ms >= 0) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        pts = &ts;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, pts, NULL, 0);
+}
+
+static void futex_wake_all(_Atomic uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint32_t shm_fourcc(enum AVPixelFormat format)
+{
+    switch (format) {
+    case AV_PIX_FMT_NV12:    return LL_SHM_FOURCC_NV12;
+    case AV_PIX_FMT_YUV420P: return LL_SHM_FOURCC_I420;
+    default:                 return 0;
+    }
+}
+
+// Plane layout of one slot, after the LLShmFrame header; returns the slot size
+static int slot_layout(LLShmFrame *f, enum AVPixelFormat format, int width, int height)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int linesize[4], row_bytes[4];
+    uint8_t *data[4] = { NULL };
+    int nb_planes, size, ret;
+
+    if (!desc || !shm_fourcc(format))
+        return AVERROR(ENOSYS);
+    if ((ret = av_image_fill_linesizes(row_bytes, format, width)) < 0 ||
+        (ret = av_image_fill_linesizes(linesize, format, FFALIGN(width, LL_SHM_ALIGN))) < 0)
+        return ret;
+    for (int i = 0; i < 4; i++)
+        linesize[i] = FFALIGN(linesize[i], LL_SHM_ALIGN);
+    if ((size = av_image_fill_pointers(data, format, height, NULL, linesize)) < 0)
+        return size;
+
+    nb_planes = av_pix_fmt_count_planes(format);
+    f->fourcc    = shm_fourcc(format);
+    f->width     = width;
+    f->height    = height;
+    f->nb_planes = nb_planes;
+    for (int i = 0; i < nb_planes; i++) {
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+
+        f->offset[i]       = FFALIGN(sizeof(LLShmFrame), LL_SHM_ALIGN) + (data[i] - data[0]);
+        f->linesize[i]     = linesize[i];
+        f->row_bytes[i]    = row_bytes[i];
+        f->plane_height[i] = (height + (1 << shift) - 1) >> shift;
+    }
+    return FFALIGN(FFALIGN(sizeof(LLShmFrame), LL_SHM_ALIGN) + size, SHM_PAGE);
+}
+
+int ll_shm_frame_size(enum AVPixelFormat format, int width, int height)
+{
+    LLShmFrame f;
+
+    return slot_layout(&f, format, width, height);
+}
+
+static int shm_map(LLShmRing *r, const char *name, int flags)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    snprintf(r->name, sizeof(r->name), "/%s", name);
+    if ((r->fd = shm_open(r->name, flags, 0600)) < 0)
+        return AVERROR(errno);
+    return 0;
+}
+
+int ll_shm_create(LLShmRing *r, const char *name, int nb_slots, int slot_size)
+{
+    LLShmHeader *hdr;
+    int ret;
+
+    if (nb_slots < 2 || slot_size <= 0)
+        return AVERROR(EINVAL);
+    // A previous writer's ring stays mapped by its consumers until they reopen
+    snprintf(r->name, sizeof(r->name), "/%s", name);
+    shm_unlink(r->name);
+    if ((ret = shm_map(r, name, O_RDWR | O_CREAT | O_EXCL)) < 0)
+        return ret;
+    r->owner    = 1;
+    r->map_size = SHM_PAGE + (size_t)nb_slots * slot_size;
+    if (ftruncate(r->fd, r->map_size) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (hdr == MAP_FAILED) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    r->hdr = hdr;
+    hdr->version      = LL_SHM_VERSION;
+    hdr->nb_slots     = nb_slots;
+    hdr->slot_size    = slot_size;
+    hdr->slots_offset = SHM_PAGE;
+    r->next_seq = 1;
+    // Readers check the magic first, so it goes in last
+    atomic_thread_fence(memory_order_release);
+    hdr->magic = LL_SHM_MAGIC;
+    return 0;
+
+fail:
+    ll_shm_close(r);
+    return ret;
+}
+
+static void noop_free(void *opaque, uint8_t *data)
+{
+}
+
+int ll_shm_begin(LLShmRing *r, AVFrame *frame, enum AVPixelFormat format,
+                 int width, int height)
+{
+    LLShmFrame *f = ll_shm_slot(r, r->next_seq);
+    LLShmFrame layout;
+    int size;
+
+    if ((size = slot_layout(&layout, format, width, height)) < 0)
+        return size;
+    if ((uint32_t)size > r->hdr->slot_size)
+        return AVERROR(ENOSPC);
+
+    atomic_store_explicit(&f->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    f->fourcc    = layout.fourcc;
+    f->width     = layout.width;
+    f->height    = layout.height;
+    f->nb_planes = layout.nb_planes;
+    memcpy(f->offset, layout.offset, sizeof(f->offset));
+    memcpy(f->linesize, layout.linesize, sizeof(f->linesize));
+    memcpy(f->row_bytes, layout.row_bytes, sizeof(f->row_bytes));
+    memcpy(f->plane_height, layout.plane_height, sizeof(f->plane_height));
+
+    // The slot is not ours to free; the reference only marks the frame
+    // as already having memory
+    frame->buf[0] = av_buffer_create((uint8_t *)f, r->hdr->slot_size, noop_free, NULL, 0);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+    frame->format = format;
+    frame->width  = width;
+    frame->height = height;
+    for (int i = 0; i < (int)f->nb_planes; i++) {
+        frame->data[i]     = ll_shm_plane(f, i);
+        frame->linesize[i] = f->linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+void ll_shm_publish(LLShmRing *r, int64_t pts, int64_t capture_ns)
+{
+    LLShmHeader *hdr = r->hdr;
+    LLShmFrame *f = ll_shm_slot(r, r->next_seq);
+
+    f->pts        = pts;
+    f->capture_ns = capture_ns;
+    f->publish_ns = ll_realtime_ns();
+    atomic_store_explicit(&f->seq, r->next_seq, memory_order_release);
+    atomic_store(&hdr->seq, r->next_seq);
+    r->next_seq++;
+
+    atomic_fetch_add(&hdr->notify, 1);
+    if (atomic_load(&hdr->waiters))
+        futex_wake_all(&hdr->notify);
+}
+
+int ll_shm_open(LLShmRing *r, const char *name)
+{
+    LLShmHeader *hdr;
+    struct stat st;
+    size_t size;
+    int ret;
+
+    if ((ret = shm_map(r, name, O_RDWR)) < 0)
+        return ret;
+    if (fstat(r->fd, &st) < 0) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    ret = AVERROR(EAGAIN);
+    if (st.st_size < SHM_PAGE)
+        goto fail;
+    hdr = mmap(NULL, SHM_PAGE, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (hdr == MAP_FAILED) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    r->hdr = hdr;
+    r->map_size = SHM_PAGE;
+    if (hdr->magic != LL_SHM_MAGIC)
+        goto fail;
+    atomic_thread_fence(memory_order_acquire);
+    if (hdr->version != LL_SHM_VERSION) {
+        ret = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    size = hdr->slots_offset + (size_t)hdr->nb_slots * hdr->slot_size;
+    munmap(hdr, SHM_PAGE);
+    r->hdr = NULL;
+    if (st.st_size < size)
+        goto fail;
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (hdr == MAP_FAILED) {
+        ret = AVERROR(errno);
+        goto fail;
+    }
+    r->hdr = hdr;
+    r->map_size = size;
+    return 0;
+
+fail:
+    ll_shm_close(r);
+    return ret;
+}
+
+LLShmFrame *ll_shm_wait(LLShmRing *r, uint32_t last_seq, uint32_t *pseq, int timeout_ms)
+{
+    LLShmHeader *hdr = r->hdr;
+
+    while (1) {
+        uint32_t notify = atomic_load(&hdr->notify);
+        uint32_t seq = atomic_load(&hdr->seq);
+
+        if (seq != last_seq) {
+            LLShmFrame *f = ll_shm_slot(r, seq);
+            // The newest slot is only rewritten nb_slots frames later; if
+            // that already happened, hdr->seq has moved on too
+            if (atomic_load_explicit(&f->seq, memory_order_acquire) == seq) {
+                *pseq = seq;
+                return f;
+            }
+            continue;
+        }
+        if (atomic_load(&hdr->closed))
+            return NULL;
+
+        atomic_fetch_add(&hdr->waiters, 1);
+        if (atomic_load(&hdr->notify) == notify)
+            futex_wait(&hdr->notify, notify, timeout_ms);
+        atomic_fetch_sub(&hdr->waiters, 1);
+        if (timeout_ms >= 0 && atomic_load(&hdr->notify) == notify)
+            return NULL;
+    }
+}
+
+void ll_shm_close(LLShmRing *r)
+{
+    if (r->hdr && r->owner) {
+        atomic_store(&r->hdr->closed, 1);
+        atomic_fetch_add(&r->hdr->notify, 1);
+        futex_wake_all(&r->hdr->notify);
+    }
+    if (r->hdr)
+        munmap(r->hdr, r->map_size);
+    if (r->fd >= 0)
+        close(r->fd);
+    if (r->owner)
+        shm_unlink(r->name);
+    r->hdr = NULL;
+    r->fd = -1;
+    r->owner = 0;
+}
@@ -0,0 +1,140 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_SHM_H
+#define LL_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+/*
+ * Decoded frames shared with a local consumer through a POSIX shared
+ * memory object (/dev/shm/<name>) instead of a pipe. The object holds a
+ * header followed by nb_slots fixed-size slots; the writer fills the
+ * slots round-robin, downloading straight into them, and publishes each
+ * frame by bumping hdr->seq. Consumers block on a futex in the header.
+ *
+ * There is no back-pressure: a consumer that falls more than nb_slots - 1
+ * frames behind sees the slot reused, which ll_shm_frame_valid() reports.
+ * All fields are host-endian; the consumer runs on the same machine.
+ */
+
+#define LL_SHM_MAGIC        0x48534c4c      // "LLSH"
+#define LL_SHM_VERSION      1
+#define LL_SHM_MAX_PLANES   4
+#define LL_SHM_ALIGN        64
+
+#define LL_SHM_FOURCC(a, b, c, d) ((a) | ((b) << 8) | ((c) << 16) | ((uint32_t)(d) << 24))
+#define LL_SHM_FOURCC_NV12  LL_SHM_FOURCC('N', 'V', '1', '2')
+#define LL_SHM_FOURCC_I420  LL_SHM_FOURCC('I', '4', '2', '0')
+
+// At the start of every slot, followed by the planes
+typedef struct LLShmFrame {
+    _Atomic uint32_t seq;       // 0 while being written, then the frame's seq
+    uint32_t fourcc;
+    uint32_t width, height;
+    uint32_t nb_planes;
+    uint32_t offset[LL_SHM_MAX_PLANES];     // from the start of the slot
+    uint32_t linesize[LL_SHM_MAX_PLANES];
+    uint32_t row_bytes[LL_SHM_MAX_PLANES];  // image bytes in each row
+    uint32_t plane_height[LL_SHM_MAX_PLANES];
+    int64_t pts;
+    int64_t capture_ns;         // CLOCK_REALTIME, 0 if unknown
+    int64_t publish_ns;         // CLOCK_REALTIME
+} LLShmFrame;
+
+typedef struct LLShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nb_slots;
+    uint32_t slot_size;
+    uint32_t slots_offset;
+    _Atomic uint32_t seq;       // last published frame, starting at 1
+    _Atomic uint32_t notify;    // futex word, bumped on publish and close
+    _Atomic uint32_t waiters;
+    _Atomic uint32_t closed;
+} LLShmHeader;
+
+typedef struct LLShmRing {
+    char name[64];
+    int fd;
+    int owner;                  // created it, so unlinks it on close
+    LLShmHeader *hdr;
+    size_t map_size;
+    uint32_t next_seq;          // writer: frame being written
+} LLShmRing;
+
+static inline LLShmFrame *ll_shm_slot(LLShmRing *r, uint32_t seq)
+{
+    return (LLShmFrame *)((uint8_t *)r->hdr + r->hdr->slots_offset +
+                          (size_t)(seq % r->hdr->nb_slots) * r->hdr->slot_size);
+}
+
+static inline uint8_t *ll_shm_plane(LLShmFrame *f, int plane)
+{
+    return (uint8_t *)f + f->offset[plane];
+}
+
+// Slot size needed for a width x height frame in format, or < 0
+int ll_shm_frame_size(enum AVPixelFormat format, int width, int height);
+
+// Writer: create (or replace) /dev/shm/<name> with nb_slots (>= 2) slots
+int ll_shm_create(LLShmRing *r, const char *name, int nb_slots, int slot_size);
+
+/*
+ * Point frame at the next slot, laid out for format/width/height, without
+ * allocating image memory. frame must be blank; it gets a buffer reference
+ * so av_hwframe_transfer_data() writes into the slot in place.
+ */
+int ll_shm_begin(LLShmRing *r, AVFrame *frame, enum AVPixelFormat format,
+                 int width, int height);
+
+// Make the slot filled since ll_shm_begin() visible and wake consumers
+void ll_shm_publish(LLShmRing *r, int64_t pts, int64_t capture_ns);
+
+// Reader: map an existing ring; AVERROR(EAGAIN) while it is being set up
+int ll_shm_open(LLShmRing *r, const char *name);
+
+/*
+ * Wait up to timeout_ms (-1 forever) for a frame newer than last_seq and
+ * return the newest one, or NULL on timeout or once the writer has closed
+ * the ring. *seq is set to its sequence number.
+ */
+LLShmFrame *ll_shm_wait(LLShmRing *r, uint32_t last_seq, uint32_t *seq, int timeout_ms);
+
+// After reading a frame: 0 if the writer reused its slot meanwhile
+static inline int ll_shm_frame_valid(LLShmFrame *f, uint32_t seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&f->seq, memory_order_relaxed) == seq;
+}
+
+// Unmaps; the writer also marks the ring closed and unlinks it
+void ll_shm_close(LLShmRing *r);
+
+#endif
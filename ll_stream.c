@@ -0,0 +1,325 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "ll_common.h"
+#include "ll_nal.h"
+#include "ll_stream.h"
+
+#define READ_SIZE       (64 << 10)  // at most this much per read
+#define PADDING         AV_INPUT_BUFFER_PADDING_SIZE
+#define PROBE_SIZE      (256 << 10) // to find where a stream joined mid-way picks up
+
+void ll_arrival_log_add(LLArrivalLog *l, uint64_t end, int64_t ns)
+{
+    l->end[l->count % LL_ARRIVAL_LOG_SIZE] = end;
+    l->ns[l->count % LL_ARRIVAL_LOG_SIZE]  = ns;
+    l->count++;
+}
+
+int64_t ll_arrival_log_find(const LLArrivalLog *l, uint64_t offset)
+{
+    int64_t ns = 0;
+
+    if (!l->count)
+        return 0;
+    // Newest first, back to the first read that did not reach offset
+    for (unsigned int i = l->count; i-- > 0 && l->count - i <= LL_ARRIVAL_LOG_SIZE;) {
+        if (l->end[i % LL_ARRIVAL_LOG_SIZE] <= offset)
+            break;
+        ns = l->ns[i % LL_ARRIVAL_LOG_SIZE];
+    }
+    return ns ? ns : l->ns[(l->count - 1) % LL_ARRIVAL_LOG_SIZE];
+}
+
+int ll_stream_open(LLStreamReader *r, int fd)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    if ((r->fd_flags = fcntl(fd, F_GETFL)) < 0 ||
+        fcntl(fd, F_SETFL, r->fd_flags | O_NONBLOCK) < 0) {
+        int err = errno;
+        fprintf(stderr, "Cannot make the input nonblocking: %s\n", strerror(err));
+        return AVERROR(err);
+    }
+    return 0;
+}
+
+// Read what is there into the buffer, waiting until deadline for something
+static int fill(LLStreamReader *r, int timeout_ms, int64_t deadline)
+{
+    size_t len = r->end - r->start;
+    ssize_t n;
+
+    // Move the unread tail to the front rather than grow
+    if (r->start && r->alloc - r->end < READ_SIZE + PADDING) {
+        memmove(r->buf, r->buf + r->start, len);
+        r->pos  += r->start;
+        r->scan -= r->start;
+        r->start = 0;
+        r->end   = len;
+    }
+    if (r->alloc - r->end < READ_SIZE + PADDING) {
+        size_t alloc = FFMAX(2 * r->alloc, r->end + READ_SIZE + PADDING);
+        uint8_t *buf = av_realloc(r->buf, alloc);
+        if (!buf)
+            return AVERROR(ENOMEM);
+        r->buf   = buf;
+        r->alloc = alloc;
+    }
+
+    while ((n = read(r->fd, r->buf + r->end, READ_SIZE)) < 0) {
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+        int wait = timeout_ms < 0 ? -1 : FFMAX(0, (deadline - ll_time_ns()) / 1000000);
+        int ret;
+
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            return AVERROR(errno);
+        if ((ret = poll(&pfd, 1, wait)) < 0 && errno != EINTR)
+            return AVERROR(errno);
+        if (!ret)
+            return AVERROR(EAGAIN);
+    }
+    if (!n) {
+        r->eof = 1;
+        return 0;
+    }
+    r->end += n;
+    memset(r->buf + r->end, 0, PADDING);
+    r->reads++;
+    r->bytes += n;
+    ll_arrival_log_add(&r->arrivals, r->pos + r->end, ll_realtime_ns());
+    return 0;
+}
+
+static void skip(LLStreamReader *r, size_t n)
+{
+    r->start  += n;
+    r->skipped += n;
+    r->scan    = FFMAX(r->scan, r->start);
+}
+
+/*
+ * The first offset in [p, end) where a valid wire header starts, or where
+ * one might once more data is in; end if there is none.
+ */
+static const uint8_t *find_wire_header(const uint8_t *p, const uint8_t *end)
+{
+    LLWireHeader hdr;
+
+    while (p < end && (p = memchr(p, 'L', end - p))) {
+        if (end - p < LL_WIRE_HEADER_SIZE || ll_wire_parse_header(p, LL_WIRE_HEADER_SIZE, &hdr) >= 0)
+            return p;
+        p++;
+    }
+    return end;
+}
+
+/*
+ * A stream normally starts with a wire header or a start code. One joined
+ * mid-way starts anywhere: look for either further in, preferring the
+ * framing since a framed payload is Annex-B itself.
+ */
+static int probe(LLStreamReader *r)
+{
+    const uint8_t *p = r->buf + r->start, *end = r->buf + r->end, *q;
+    size_t len = r->end - r->start;
+
+    if (len < LL_WIRE_HEADER_SIZE && !r->eof)
+        return 0;
+    if (!len)
+        return AVERROR_EOF;
+    if (len >= 4 && !p[0] && !p[1] && (p[2] == 1 || (!p[2] && p[3] == 1))) {
+        r->format = LL_STREAM_ANNEXB;
+    } else if ((q = find_wire_header(p, end)) + LL_WIRE_HEADER_SIZE <= end) {
+        r->format = LL_STREAM_WIRE;
+        skip(r, q - p);
+    } else if (len >= PROBE_SIZE || r->eof) {
+        if ((q = ll_find_start_code(p, end)) == end) {
+            fprintf(stderr, "Input is neither the wire framing nor Annex-B\n");
+            return AVERROR_INVALIDDATA;
+        }
+        r->format = LL_STREAM_ANNEXB;
+        skip(r, q - p);
+    } else
+        return 0;
+    r->scan = r->start;
+    if (r->skipped) {
+        r->resyncs++;
+        fprintf(stderr, "Joined the stream mid-way, %zu bytes skipped\n", r->skipped);
+    }
+    return 0;
+}
+
+// 1 with the message at start in hdr, 0 if it is not all in yet
+static int next_wire(LLStreamReader *r, LLWireHeader *hdr, size_t *len)
+{
+    const uint8_t *p = r->buf + r->start;
+    size_t avail = r->end - r->start;
+    int ret;
+
+    if (avail < LL_WIRE_HEADER_SIZE)
+        return r->eof ? AVERROR_EOF : 0;
+    if ((ret = ll_wire_parse_header(p, LL_WIRE_HEADER_SIZE, hdr)) < 0) {
+        // Damaged, or not where the last size pointed: find the next one
+        if (!r->lost) {
+            fprintf(stderr, "Bad wire header, looking for the next one\n");
+            r->lost = 1;
+            r->resyncs++;
+        }
+        skip(r, find_wire_header(p + 1, r->buf + r->end) - p);
+        return 0;
+    }
+    r->lost = 0;
+    if (avail < (size_t)hdr->header_size + hdr->size)
+        return r->eof ? AVERROR_EOF : 0;
+    ll_wire_parse_header(p, FFMIN(hdr->header_size, LL_WIRE_MAX_HEADER_SIZE), hdr);
+    *len = hdr->header_size + hdr->size;
+    return 1;
+}
+
+// NAL units that may only come first in an access unit, before its slices
+static int starts_access_unit(const uint8_t *nal)
+{
+    int type = nal[0] & 0x1f;
+
+    if (type == LL_NAL_SLICE || type == LL_NAL_IDR)
+        return nal[1] & 0x80;   // first_mb_in_slice == 0, ue(v) '1'
+    return (type >= LL_NAL_SEI && type <= LL_NAL_AUD) || (type >= 14 && type <= 18);
+}
+
+static void make_header(LLStreamReader *r, LLWireHeader *hdr, uint32_t size)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = LL_WIRE_VERSION;
+    hdr->type    = LL_WIRE_FRAME;
+    hdr->codec   = LL_WIRE_CODEC_H264;
+    hdr->flags   = r->keyframe ? LL_WIRE_FLAG_KEYFRAME : 0;
+    hdr->size    = size;
+    hdr->seq     = r->pts;
+    hdr->pts     = r->pts++;
+    r->seen_vcl  = 0;
+    r->keyframe  = 0;
+}
+
+// 1 with the access unit at start in hdr, 0 if the next one has not begun
+static int next_access_unit(LLStreamReader *r, LLWireHeader *hdr, size_t *len)
+{
+    const uint8_t *end = r->buf + r->end;
+    const uint8_t *p = r->buf + r->scan;
+
+    // A start code needs two more bytes to tell what it begins
+    while ((p = ll_find_start_code(p, end)) + 4 < end) {
+        if (r->seen_vcl && starts_access_unit(p + 3)) {
+            size_t au_end = p - r->buf;
+
+            // The zeros before belong to the next start code
+            while (au_end > r->start && !r->buf[au_end - 1])
+                au_end--;
+            r->scan = p - r->buf;
+            *len = au_end - r->start;
+            make_header(r, hdr, *len);
+            return 1;
+        }
+        if ((p[3] & 0x1f) == LL_NAL_SLICE || (p[3] & 0x1f) == LL_NAL_IDR)
+            r->seen_vcl = 1;
+        if ((p[3] & 0x1f) == LL_NAL_IDR)
+            r->keyframe = 1;
+        p += 3;
+    }
+    // Come back to a start code cut short by the end of the data
+    r->scan = p < end ? (size_t)(p - r->buf) : FFMAX(r->scan, r->end - FFMIN(r->end, 2));
+
+    if (!r->eof)
+        return 0;
+    if (r->start == r->end)
+        return AVERROR_EOF;
+    *len = r->end - r->start;
+    r->scan = r->end;
+    make_header(r, hdr, *len);
+    return 1;
+}
+
+int ll_stream_read(LLStreamReader *r, LLWireHeader *hdr, const uint8_t **data, int *size,
+                   int timeout_ms)
+{
+    int64_t deadline = ll_time_ns() + timeout_ms * 1000000LL;
+    size_t len;
+    int ret;
+
+    while (1) {
+        if (r->format == LL_STREAM_UNKNOWN) {
+            if ((ret = probe(r)) < 0)
+                return ret;
+            if (r->format != LL_STREAM_UNKNOWN)
+                continue;
+        } else if (r->format == LL_STREAM_WIRE)
+            ret = next_wire(r, hdr, &len);
+        else
+            ret = next_access_unit(r, hdr, &len);
+        if (ret < 0)
+            return ret;
+        if (ret)
+            break;
+        if ((ret = fill(r, timeout_ms, deadline)) < 0)
+            return ret;
+    }
+
+    *data = r->buf + r->start + (r->format == LL_STREAM_WIRE ? hdr->header_size : 0);
+    *size = hdr->size;
+    r->start += len;
+    r->messages++;
+    hdr->stamps[LL_STAGE_RECEIVE] = ll_arrival_log_find(&r->arrivals, r->pos + r->start - 1);
+    return 0;
+}
+
+void ll_stream_print_stats(const LLStreamReader *r, FILE *f)
+{
+    fprintf(f, "Stream: %s, %llu messages, %llu bytes in %llu reads, %.1f KiB per read, "
+               "%u resyncs skipping %zu bytes\n",
+            r->format == LL_STREAM_WIRE ? "wire" : r->format == LL_STREAM_ANNEXB ? "Annex-B" : "unknown",
+            (unsigned long long)r->messages, (unsigned long long)r->bytes,
+            (unsigned long long)r->reads, r->bytes / 1024.0 / FFMAX(r->reads, 1),
+            r->resyncs, r->skipped);
+}
+
+void ll_stream_close(LLStreamReader *r)
+{
+    if (r->fd >= 0)
+        fcntl(r->fd, F_SETFL, r->fd_flags);
+    r->fd = -1;
+    av_freep(&r->buf);
+    r->alloc = r->start = r->end = 0;
+}
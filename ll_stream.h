@@ -0,0 +1,118 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_STREAM_H
+#define LL_STREAM_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ll_wire.h"
+
+/*
+ * Receive side of a byte stream (a pipe, socket or file), without a
+ * demuxer. The fd is made nonblocking and read as data comes in; each
+ * read takes whatever is there. A message is handed out as soon as its
+ * last byte is in the buffer:
+ *
+ *  - wire framing (see ll_wire.h): when header.size payload bytes follow
+ *    the header.
+ *  - raw H.264 Annex-B: split into access units by the NAL types, a new
+ *    one starting at an AUD, SEI or parameter set, or a slice with
+ *    first_mb_in_slice 0, after the slices of the previous. Without
+ *    framing an access unit is only known to be whole when the next one
+ *    starts (or at EOF). Parameter sets stay in-band; the header is made
+ *    up, with a running pts and LL_WIRE_FLAG_KEYFRAME on IDR.
+ *
+ * The format is detected from the first bytes. A stream joined mid-way
+ * is picked up at the first wire header or start code; a damaged wire
+ * header, at the next valid one. Either counts in resyncs, and what came
+ * before is lost: the decoder has to wait for a keyframe.
+ */
+
+// When byte offsets of the stream came in, for the last few reads
+#define LL_ARRIVAL_LOG_SIZE 32
+
+typedef struct LLArrivalLog {
+    uint64_t end[LL_ARRIVAL_LOG_SIZE];  // stream offset after the read
+    int64_t ns[LL_ARRIVAL_LOG_SIZE];    // CLOCK_REALTIME, as the stamps
+    unsigned int count;
+} LLArrivalLog;
+
+void ll_arrival_log_add(LLArrivalLog *l, uint64_t end, int64_t ns);
+
+// When the byte at offset came in; the oldest read kept if it is older
+int64_t ll_arrival_log_find(const LLArrivalLog *l, uint64_t offset);
+
+typedef enum LLStreamFormat {
+    LL_STREAM_UNKNOWN,
+    LL_STREAM_WIRE,
+    LL_STREAM_ANNEXB,
+} LLStreamFormat;
+
+typedef struct LLStreamReader {
+    int fd;
+    int fd_flags;               // restored on close
+    LLStreamFormat format;
+    int eof;
+
+    uint8_t *buf;               // [start, end) is unread, padded for libavcodec
+    size_t alloc;
+    size_t start, end;
+    uint64_t pos;               // stream offset of buf[0]
+    LLArrivalLog arrivals;
+
+    // Annex-B splitting of the access unit at start
+    size_t scan;                // next offset to look for a start code
+    int seen_vcl;
+    int keyframe;
+    int64_t pts;
+
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t messages;
+    int lost;                   // looking for the next wire header
+    unsigned int resyncs;       // times the stream was picked up mid-way
+    size_t skipped;             // bytes dropped to do so
+} LLStreamReader;
+
+// The caller keeps ownership of fd
+int ll_stream_open(LLStreamReader *r, int fd);
+
+/*
+ * Next message, waiting up to timeout_ms for it (-1 for ever). *data
+ * stays valid until the next call and is followed by padding bytes, not
+ * necessarily zero. hdr->stamps[LL_STAGE_RECEIVE] is when its last byte
+ * came in. Returns 0, AVERROR(EAGAIN) on timeout, AVERROR_EOF or
+ * AVERROR_INVALIDDATA.
+ */
+int ll_stream_read(LLStreamReader *r, LLWireHeader *hdr, const uint8_t **data, int *size,
+                   int timeout_ms);
+
+void ll_stream_print_stats(const LLStreamReader *r, FILE *f);
+
+void ll_stream_close(LLStreamReader *r);
+
+#endif
@@ -0,0 +1,322 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/intreadwrite.h>
+
+#include "ll_nal.h"
+#include "ll_wire.h"
+
+static const uint8_t wire_magic[3] = {'L', 'L', 'S'};
+static const uint8_t start_code[4] = {0x00, 0x00, 0x00, 0x01};
+
+static uint32_t stamp_offset(const LLWireHeader *hdr, int stage)
+{
+    int64_t d = hdr->stamps[stage] - hdr->stamps[LL_STAGE_CAPTURE];
+
+    if (!hdr->stamps[stage] || d <= 0)
+        return 0;
+    return d > UINT32_MAX ? UINT32_MAX : d;
+}
+
+int ll_wire_put_header(uint8_t *buf, const LLWireHeader *hdr)
+{
+    int size = LL_WIRE_HEADER_SIZE;
+    int flags = hdr->flags & ~LL_WIRE_FLAG_STAMPS;
+
+    if (hdr->stamps[LL_STAGE_CAPTURE]) {
+        flags |= LL_WIRE_FLAG_STAMPS;
+        size  += LL_WIRE_STAMPS_SIZE;
+        for (int i = LL_STAGE_CONVERT; i <= LL_STAGE_SEND; i++)
+            AV_WB32(buf + LL_WIRE_HEADER_SIZE + 4 * (i - LL_STAGE_CONVERT),
+                    stamp_offset(hdr, i));
+    }
+
+    memcpy(buf, wire_magic, sizeof(wire_magic));
+    buf[3] = LL_WIRE_VERSION;
+    buf[4] = hdr->type;
+    buf[5] = hdr->codec;
+    AV_WB16(buf + 6, flags);
+    AV_WB16(buf + 8, size);
+    AV_WB16(buf + 10, 0);
+    AV_WB32(buf + 12, hdr->size);
+    AV_WB32(buf + 16, hdr->seq);
+    AV_WB64(buf + 20, hdr->pts);
+    AV_WB64(buf + 28, hdr->stamps[LL_STAGE_CAPTURE]);
+    return size;
+}
+
+int ll_wire_probe(const uint8_t *buf, int size)
+{
+    return size >= 4 && !memcmp(buf, wire_magic, sizeof(wire_magic)) &&
+           buf[3] == LL_WIRE_VERSION;
+}
+
+int ll_wire_parse_header(const uint8_t *buf, int size, LLWireHeader *hdr)
+{
+    if (size < LL_WIRE_HEADER_SIZE || !ll_wire_probe(buf, size))
+        return AVERROR_INVALIDDATA;
+
+    hdr->version     = buf[3];
+    hdr->type        = buf[4];
+    hdr->codec       = buf[5];
+    hdr->flags       = AV_RB16(buf + 6);
+    hdr->header_size = AV_RB16(buf + 8);
+    hdr->size        = AV_RB32(buf + 12);
+    hdr->seq         = AV_RB32(buf + 16);
+    hdr->pts         = AV_RB64(buf + 20);
+
+    if (hdr->header_size < LL_WIRE_HEADER_SIZE || hdr->size > LL_WIRE_MAX_PAYLOAD)
+        return AVERROR_INVALIDDATA;
+
+    memset(hdr->stamps, 0, sizeof(hdr->stamps));
+    hdr->stamps[LL_STAGE_CAPTURE] = AV_RB64(buf + 28);
+    if ((hdr->flags & LL_WIRE_FLAG_STAMPS) &&
+        hdr->header_size >= LL_WIRE_MAX_HEADER_SIZE && size >= LL_WIRE_MAX_HEADER_SIZE) {
+        for (int i = LL_STAGE_CONVERT; i <= LL_STAGE_SEND; i++) {
+            uint32_t d = AV_RB32(buf + LL_WIRE_HEADER_SIZE + 4 * (i - LL_STAGE_CONVERT));
+            hdr->stamps[i] = d ? hdr->stamps[LL_STAGE_CAPTURE] + d : 0;
+        }
+    }
+    return hdr->header_size;
+}
+
+int ll_wire_read(FILE *fin, LLWireHeader *hdr, uint8_t **buf, unsigned int *buf_size)
+{
+    uint8_t header[LL_WIRE_MAX_HEADER_SIZE];
+    int ret, len;
+
+    if (fread(header, 1, LL_WIRE_HEADER_SIZE, fin) != LL_WIRE_HEADER_SIZE)
+        return AVERROR_EOF;
+    if ((ret = ll_wire_parse_header(header, LL_WIRE_HEADER_SIZE, hdr)) < 0) {
+        fprintf(stderr, "Bad wire header.\n");
+        return ret;
+    }
+    len = FFMIN(hdr->header_size, LL_WIRE_MAX_HEADER_SIZE);
+    if (fread(header + LL_WIRE_HEADER_SIZE, 1, len - LL_WIRE_HEADER_SIZE, fin) != len - LL_WIRE_HEADER_SIZE)
+        return AVERROR_EOF;
+    ll_wire_parse_header(header, len, hdr);
+    // Extensions from newer senders
+    for (int skip = hdr->header_size - len; skip > 0; skip--)
+        if (fgetc(fin) == EOF)
+            return AVERROR_EOF;
+
+    av_fast_padded_malloc(buf, buf_size, hdr->size);
+    if (!*buf)
+        return AVERROR(ENOMEM);
+    if (fread(*buf, 1, hdr->size, fin) != hdr->size)
+        return AVERROR_EOF;
+    return 0;
+}
+
+void ll_wire_writer_init(LLWireWriter *w, FILE *fout, LLWireCodec codec)
+{
+    memset(w, 0, sizeof(*w));
+    w->fout = fout;
+    w->codec = codec;
+    w->params.codec_id = ll_wire_codec_id(codec);
+    w->params.interval_ns = 1000000000;
+}
+
+static int write_message(LLWireWriter *w, LLWireHeader *hdr)
+{
+    uint8_t header[LL_WIRE_MAX_HEADER_SIZE];
+    int size;
+
+    hdr->codec = w->codec;
+    size = ll_wire_put_header(header, hdr);
+    if (fwrite(header, 1, size, w->fout) != (size_t)size)
+        return AVERROR(EIO);
+    return 0;
+}
+
+int ll_param_sets_update(LLParamSets *ps, const AVPacket *pkt)
+{
+    unsigned char *params = NULL;
+    int params_size, changed;
+    int64_t now = ll_time_ns();
+
+    if ((params_size = ll_get_param_sets(ps->codec_id, pkt->data, pkt->size, &params)) < 0)
+        return 0;
+
+    changed = params_size != ps->size || memcmp(params, ps->data, params_size);
+    if (!changed && now - ps->sent_ns < ps->interval_ns) {
+        free(params);
+        return 0;
+    }
+
+    free(ps->data);
+    ps->data    = params;
+    ps->size    = params_size;
+    ps->sent_ns = now;
+    return 1;
+}
+
+void ll_param_sets_free(LLParamSets *ps)
+{
+    free(ps->data);
+    ps->data = NULL;
+    ps->size = 0;
+}
+
+static int write_params(LLWireWriter *w, const AVPacket *pkt, const LLFrameInfo *info)
+{
+    LLWireHeader hdr = { 0 };
+    int ret;
+
+    if (ll_param_sets_update(&w->params, pkt) <= 0)
+        return 0;
+
+    hdr.type = LL_WIRE_PARAMS;
+    hdr.size = w->params.size;
+    hdr.seq  = w->seq;
+    hdr.pts  = pkt->pts;
+    hdr.stamps[LL_STAGE_CAPTURE] = info->stamps[LL_STAGE_CAPTURE];
+    if ((ret = write_message(w, &hdr)) < 0)
+        return ret;
+    if (fwrite(w->params.data, 1, w->params.size, w->fout) != (size_t)w->params.size)
+        return AVERROR(EIO);
+    return 0;
+}
+
+static int write_nal(LLWireWriter *w, LLWireHeader *hdr, const LLNalUnit *nal)
+{
+    int ret;
+
+    hdr->size = sizeof(start_code) + nal->size;
+    if ((ret = write_message(w, hdr)) < 0)
+        return ret;
+    fwrite(start_code, 1, sizeof(start_code), w->fout);
+    fwrite(nal->data, 1, nal->size, w->fout);
+    fflush(w->fout);
+    return ferror(w->fout) ? AVERROR(EIO) : 0;
+}
+
+// Slice mode: each NAL unit goes out, and can be decoded, on its own
+static int write_slices(LLWireWriter *w, LLWireHeader *hdr, const AVPacket *pkt)
+{
+    LLNalIterator it;
+    LLNalUnit nal, prev;
+    int have_prev = 0, ret;
+
+    hdr->flags |= LL_WIRE_FLAG_SLICE;
+    // One NAL behind, so the last one can carry the end flag
+    ll_nal_iter_init(&it, pkt->data, pkt->size);
+    while (ll_nal_iter_next(&it, &nal)) {
+        if (ll_nal_is_param_set(w->params.codec_id, &nal))
+            continue;
+        if (have_prev && (ret = write_nal(w, hdr, &prev)) < 0)
+            return ret;
+        prev = nal;
+        have_prev = 1;
+    }
+    hdr->flags |= LL_WIRE_FLAG_END;
+    return have_prev ? write_nal(w, hdr, &prev) : 0;
+}
+
+int ll_wire_write_packet(void *opaque, AVPacket *pkt, const LLFrameInfo *info)
+{
+    LLWireWriter *w = opaque;
+    LLWireHeader hdr = { 0 };
+    LLNalIterator it;
+    LLNalUnit nal;
+    // AV1 is not Annex-B: its temporal units go out as they are
+    int av1 = w->params.codec_id == AV_CODEC_ID_AV1;
+    int ret;
+
+    if ((pkt->flags & AV_PKT_FLAG_KEY) || !w->params.data) {
+        if ((ret = write_params(w, pkt, info)) < 0)
+            return ret;
+    }
+
+    // Parameter sets are carried separately; count what is left
+    if (av1) {
+        hdr.size = pkt->size;
+    } else {
+        ll_nal_iter_init(&it, pkt->data, pkt->size);
+        while (ll_nal_iter_next(&it, &nal))
+            if (!ll_nal_is_param_set(w->params.codec_id, &nal))
+                hdr.size += sizeof(start_code) + nal.size;
+    }
+
+    hdr.type  = LL_WIRE_FRAME;
+    hdr.flags = (pkt->flags & AV_PKT_FLAG_KEY) ? LL_WIRE_FLAG_KEYFRAME : 0;
+    hdr.seq   = w->seq++;
+    hdr.pts   = pkt->pts;
+
+    memcpy(hdr.stamps, info->stamps, sizeof(hdr.stamps));
+    ll_stamp(hdr.stamps, LL_STAGE_SEND);
+    if (av1) {
+        if ((ret = write_message(w, &hdr)) < 0)
+            return ret;
+        fwrite(pkt->data, 1, pkt->size, w->fout);
+        fflush(w->fout);
+    } else if (w->slices) {
+        if ((ret = write_slices(w, &hdr, pkt)) < 0)
+            return ret;
+    } else {
+        if ((ret = write_message(w, &hdr)) < 0)
+            return ret;
+        ll_nal_iter_init(&it, pkt->data, pkt->size);
+        while (ll_nal_iter_next(&it, &nal)) {
+            if (ll_nal_is_param_set(w->params.codec_id, &nal))
+                continue;
+            fwrite(start_code, 1, sizeof(start_code), w->fout);
+            fwrite(nal.data, 1, nal.size, w->fout);
+        }
+        fflush(w->fout);
+    }
+    if (w->latency)
+        ll_latency_record(w->latency, hdr.stamps);
+    return ferror(w->fout) ? AVERROR(EIO) : 0;
+}
+
+void ll_wire_writer_free(LLWireWriter *w)
+{
+    ll_param_sets_free(&w->params);
+}
+
+enum AVCodecID ll_wire_codec_id(int codec)
+{
+    switch (codec) {
+    case LL_WIRE_CODEC_H264: return AV_CODEC_ID_H264;
+    case LL_WIRE_CODEC_HEVC: return AV_CODEC_ID_HEVC;
+    case LL_WIRE_CODEC_AV1:  return AV_CODEC_ID_AV1;
+    default:                 return AV_CODEC_ID_NONE;
+    }
+}
+
+LLWireCodec ll_wire_codec_from_id(enum AVCodecID codec_id)
+{
+    switch (codec_id) {
+    case AV_CODEC_ID_H264: return LL_WIRE_CODEC_H264;
+    case AV_CODEC_ID_HEVC: return LL_WIRE_CODEC_HEVC;
+    case AV_CODEC_ID_AV1:  return LL_WIRE_CODEC_AV1;
+    default:               return 0;
+    }
+}
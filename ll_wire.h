@@ -0,0 +1,157 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LL_WIRE_H
+#define LL_WIRE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "ll_encoder.h"
+#include "ll_latency.h"
+
+/*
+ * Framing between sc_vaapi_encode and vaapi_decode. Every message is a
+ * fixed big-endian header followed by header.size bytes of payload:
+ *
+ *   0  'L' 'L' 'S' version
+ *   4  u8  type             LL_WIRE_FRAME or LL_WIRE_PARAMS
+ *   5  u8  codec            LLWireCodec
+ *   6  u16 flags            LL_WIRE_FLAG_*
+ *   8  u16 header_size      bytes up to the payload; readers skip unknown tail
+ *  10  u16 reserved
+ *  12  u32 size             payload length
+ *  16  u32 seq              frame sequence number
+ *  20  i64 pts
+ *  28  i64 capture_ns       CLOCK_REALTIME at capture
+ *
+ * With LL_WIRE_FLAG_STAMPS the header continues with the sender's stage
+ * stamps (see ll_latency.h) as u32 nanoseconds after capture_ns, 0 when a
+ * stage was skipped:
+ *
+ *  36  u32 convert, upload, encode, send
+ *
+ * The codec byte tells the receiver which decoder to open. H.264 and HEVC
+ * frame payloads are Annex-B access units without parameter sets; those
+ * travel in LL_WIRE_PARAMS messages, sent when they change and repeated on
+ * keyframes so that a receiver can start decoding. AV1 payloads are whole
+ * temporal units, whose sequence header has to follow the temporal
+ * delimiter and so stays in-band; LL_WIRE_PARAMS carries a copy for
+ * relays and receivers to notice changes. A writer in slice mode sends
+ * each NAL unit of an H.264 or HEVC frame as a message of its own, all
+ * with the frame's header and LL_WIRE_FLAG_SLICE, the last also
+ * LL_WIRE_FLAG_END.
+ */
+#define LL_WIRE_VERSION         1
+#define LL_WIRE_HEADER_SIZE     36
+#define LL_WIRE_STAMPS_SIZE     16
+#define LL_WIRE_MAX_HEADER_SIZE (LL_WIRE_HEADER_SIZE + LL_WIRE_STAMPS_SIZE)
+#define LL_WIRE_MAX_PAYLOAD     (64 << 20)
+
+enum {
+    LL_WIRE_FRAME   = 0,
+    LL_WIRE_PARAMS  = 1,
+};
+
+typedef enum LLWireCodec {
+    LL_WIRE_CODEC_H264 = 1,
+    LL_WIRE_CODEC_HEVC = 2,
+    LL_WIRE_CODEC_AV1  = 3,
+} LLWireCodec;
+
+#define LL_WIRE_FLAG_KEYFRAME   0x0001
+#define LL_WIRE_FLAG_STAMPS     0x0002
+#define LL_WIRE_FLAG_SLICE      0x0004  // payload is part of frame seq: whole slices
+#define LL_WIRE_FLAG_END        0x0008  // with LL_WIRE_FLAG_SLICE, the last part
+
+typedef struct LLWireHeader {
+    int version;
+    int type;
+    int codec;
+    int flags;
+    int header_size;
+    uint32_t size;
+    uint32_t seq;
+    int64_t pts;
+    int64_t stamps[LL_STAGE_NB];        // capture to send are carried
+} LLWireHeader;
+
+/*
+ * Parameter sets last sent, shared by the transports: they go out when
+ * they change, and again with a keyframe once interval_ns has passed.
+ */
+typedef struct LLParamSets {
+    enum AVCodecID codec_id;
+    unsigned char *data;        // as from ll_get_param_sets
+    int size;
+    int64_t sent_ns;
+    int64_t interval_ns;
+} LLParamSets;
+
+// 1 if the parameter sets in pkt are due now (then kept in ps->data)
+int ll_param_sets_update(LLParamSets *ps, const AVPacket *pkt);
+void ll_param_sets_free(LLParamSets *ps);
+
+typedef struct LLWireWriter {
+    FILE *fout;
+    LLWireCodec codec;
+    uint32_t seq;
+    LLParamSets params;
+    int slices;                 // one message per NAL unit, H.264 and HEVC only
+
+    LLLatencyStats *latency;    // optional, records sender-side stages
+} LLWireWriter;
+
+// buf must hold LL_WIRE_MAX_HEADER_SIZE bytes; returns the header size
+int ll_wire_put_header(uint8_t *buf, const LLWireHeader *hdr);
+
+/*
+ * Returns the header size, or AVERROR_INVALIDDATA on a bad magic/version.
+ * Stamps are parsed only if size covers the whole header.
+ */
+int ll_wire_parse_header(const uint8_t *buf, int size, LLWireHeader *hdr);
+
+int ll_wire_probe(const uint8_t *buf, int size);
+
+/*
+ * Read one message into *buf (grown as needed, with padding for
+ * libavcodec). Returns 0, AVERROR_EOF or AVERROR_INVALIDDATA.
+ */
+int ll_wire_read(FILE *fin, LLWireHeader *hdr, uint8_t **buf, unsigned int *buf_size);
+
+void ll_wire_writer_init(LLWireWriter *w, FILE *fout, LLWireCodec codec);
+
+// LLPacketCallback writing pkt to ((LLWireWriter *)opaque)->fout
+int ll_wire_write_packet(void *opaque, AVPacket *pkt, const LLFrameInfo *info);
+
+void ll_wire_writer_free(LLWireWriter *w);
+
+enum AVCodecID ll_wire_codec_id(int codec);
+
+// The LLWireCodec for a libavcodec codec, 0 if the wire cannot carry it
+LLWireCodec ll_wire_codec_from_id(enum AVCodecID codec_id);
+
+#endif
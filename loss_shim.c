@@ -0,0 +1,256 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Network emulation for testing the RTP transport on one machine: forwards
+ * datagrams from the sender to the receiver, dropping RTP packets with a
+ * Gilbert-Elliott model (average loss, mean burst length), and passes RTCP
+ * both ways untouched so BYE and receiver reports get through.
+ *
+ * -c limits the forward direction to a link of that many kbit/s with a
+ * drop-tail queue of -q ms; -C changes the capacity once, after a number
+ * of seconds, to see how the sender copes.
+ *
+ *   ./loss_shim -l 2 -b 1 rtp://:9500 rtp://127.0.0.1:9000
+ *   ./loss_shim -c 8000 -C 10:4000 rtp://:9500 rtp://127.0.0.1:9000
+ *   ./vaapi_decode rtp://:9000 out.yuv
+ *   ./sc_vaapi_encode -f auto -o rtp://127.0.0.1:9500 1280 720 30
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <libavutil/avutil.h>
+
+#include "ll_common.h"
+#include "ll_rtp.h"
+
+#define QUEUE_SIZE 8192     // packets, a power of two
+
+typedef struct QueuedPacket {
+    uint8_t *data;
+    int size;
+    int64_t depart_ns;
+} QueuedPacket;
+
+typedef struct Link {
+    int64_t capacity;           // bits/s, 0 for unlimited
+    int64_t max_delay_ns;
+    int64_t free_ns;            // when the last queued packet is through
+    QueuedPacket queue[QUEUE_SIZE];
+    unsigned head, tail;
+
+    uint64_t forwarded;
+    uint64_t dropped;           // by the loss model
+    uint64_t overflows;         // by the full queue
+    uint64_t bursts;
+    uint64_t reports;
+    int64_t max_queue_ns;
+} Link;
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static int is_rtcp(const uint8_t *p, int len)
+{
+    return len >= 2 && p[1] >= 200 && p[1] <= 204;
+}
+
+static void print_stats(const Link *l)
+{
+    uint64_t total = l->forwarded + l->dropped + l->overflows;
+
+    fprintf(stderr, "%llu forwarded, %llu dropped (%.2f%%) in %llu bursts, %llu queue overflows, "
+                    "max queue %.1f ms, %llu reports back\n",
+            (unsigned long long)l->forwarded, (unsigned long long)l->dropped,
+            total ? 100.0 * l->dropped / total : 0.0, (unsigned long long)l->bursts,
+            (unsigned long long)l->overflows, l->max_queue_ns / 1e6,
+            (unsigned long long)l->reports);
+}
+
+// Queue a packet behind the ones still on the link; 0 when it does not fit
+static int enqueue(Link *l, const uint8_t *data, int size, int64_t now)
+{
+    QueuedPacket *q;
+    int64_t start = FFMAX(now, l->free_ns);
+
+    if (l->tail - l->head == QUEUE_SIZE || start - now > l->max_delay_ns)
+        return 0;
+    q = &l->queue[l->tail & (QUEUE_SIZE - 1)];
+    if (!q->data && !(q->data = malloc(LL_RTP_MAX_PACKET)))
+        return 0;
+    memcpy(q->data, data, size);
+    q->size      = size;
+    q->depart_ns = start + size * 8 * 1000000000LL / l->capacity;
+    l->free_ns   = q->depart_ns;
+    l->max_queue_ns = FFMAX(l->max_queue_ns, q->depart_ns - now);
+    l->tail++;
+    return 1;
+}
+
+// Send what has made it through the link; ms until the next packet does
+static int dequeue(Link *l, int fd, int64_t now)
+{
+    while (l->head != l->tail) {
+        QueuedPacket *q = &l->queue[l->head & (QUEUE_SIZE - 1)];
+        if (q->depart_ns > now)
+            return (q->depart_ns - now + 999999) / 1000000;
+        if (send(fd, q->data, q->size, 0) == q->size || errno == ECONNREFUSED)
+            l->forwarded++;
+        l->head++;
+    }
+    return 1000;
+}
+
+int main(int argc, char *argv[])
+{
+    static Link link;
+    struct sockaddr_storage sender;
+    socklen_t sender_len = 0;
+    uint8_t buf[LL_RTP_MAX_PACKET];
+    double loss = 0, burst = 1, p_bad, p_good;
+    int64_t last_report, start, interval = 5, change_after = -1, change_to = 0;
+    int in_fd, out_fd, family, bad = 0, wait = 1000, opt;
+    unsigned int seed = 1;
+
+    link.max_delay_ns = 500000000;
+    while ((opt = getopt(argc, argv, "l:b:s:r:c:C:q:")) != -1) {
+        switch (opt) {
+        case 'l':
+            loss = atof(optarg) / 100;
+            break;
+        case 'b':
+            burst = atof(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            interval = atoi(optarg);
+            break;
+        case 'c':
+            link.capacity = atoll(optarg) * 1000;
+            break;
+        case 'C':
+            if (sscanf(optarg, "%"SCNd64":%"SCNd64, &change_after, &change_to) != 2)
+                goto usage;
+            change_to *= 1000;
+            break;
+        case 'q':
+            link.max_delay_ns = atoll(optarg) * 1000000;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind < 2 || loss < 0 || loss >= 1 || burst < 1 ||
+        (change_after >= 0 && (!link.capacity || change_to <= 0))) {
+usage:
+        fprintf(stderr, "Usage: %s [-l loss %%] [-b mean burst length] [-s seed] [-r report seconds] "
+                        "[-c capacity kbps] [-C seconds:kbps] [-q max queue ms] "
+                        "<rtp://[host]:port to listen on> <rtp://host:port to forward to>\n", argv[0]);
+        return -1;
+    }
+    // Good to bad at a rate giving the average loss, bad to good after burst packets
+    p_good = 1 / burst;
+    p_bad  = loss * p_good / (1 - loss);
+    srand(seed);
+
+    if ((in_fd = ll_rtp_open_socket(argv[optind], 1, &family)) < 0 ||
+        (out_fd = ll_rtp_open_socket(argv[optind + 1], 0, &family)) < 0)
+        return -1;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    start = last_report = ll_time_ns();
+
+    while (!quit) {
+        struct pollfd pfd[2] = {
+            { .fd = in_fd,  .events = POLLIN },
+            { .fd = out_fd, .events = POLLIN },
+        };
+        int64_t now;
+        int len;
+
+        if (poll(pfd, 2, wait) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        now = ll_time_ns();
+        if (change_after >= 0 && now - start >= change_after * 1000000000LL) {
+            fprintf(stderr, "Capacity %lld -> %lld kbps\n",
+                    (long long)link.capacity / 1000, (long long)change_to / 1000);
+            link.capacity = change_to;
+            change_after  = -1;
+        }
+        if (pfd[0].revents & POLLIN) {
+            sender_len = sizeof(sender);
+            if ((len = recvfrom(in_fd, buf, sizeof(buf), 0, (struct sockaddr *)&sender, &sender_len)) > 0) {
+                int drop = 0;
+
+                if (!is_rtcp(buf, len)) {
+                    drop = (double)rand() / RAND_MAX < (bad ? 1 - p_good : p_bad);
+                    link.bursts += drop && !bad;
+                    bad = drop;
+                }
+                if (drop)
+                    link.dropped++;
+                else if (link.capacity) {
+                    if (!enqueue(&link, buf, len, now))
+                        link.overflows++;
+                } else if (send(out_fd, buf, len, 0) == len || errno == ECONNREFUSED)
+                    link.forwarded++;
+            }
+        }
+        wait = link.capacity ? dequeue(&link, out_fd, now) : 1000;
+
+        // Receiver reports, back to whoever sent last
+        if ((pfd[1].revents & POLLIN) &&
+            (len = recv(out_fd, buf, sizeof(buf), 0)) > 0 && sender_len) {
+            sendto(in_fd, buf, len, 0, (struct sockaddr *)&sender, sender_len);
+            link.reports++;
+        }
+        if (interval > 0 && now - last_report >= interval * 1000000000LL) {
+            print_stats(&link);
+            last_report = now;
+        }
+    }
+
+    print_stats(&link);
+    for (int i = 0; i < QUEUE_SIZE; i++)
+        free(link.queue[i].data);
+    close(in_fd);
+    close(out_fd);
+    return 0;
+}
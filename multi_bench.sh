@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Aggregate encode throughput with N sessions in one multi_encode process,
+# sharing a VAAPI device, against N separate sc_vaapi_encode processes.
+# Frames come from the pattern source at a rate no encoder keeps up with,
+# so each run goes as fast as it can; the figure is total frames per
+# second across all sessions.
+
+height=1280
+width=720
+frames=600
+fps=1000
+encoder=${1:-vaapi}
+
+now() { date +%s.%N; }
+
+printf "%8s %14s %14s\n" sessions "one process" "processes"
+for n in 1 2 4 8; do
+    sessions=""
+    for i in $(seq ${n}); do
+        sessions="${sessions} -s size=${height}x${width},fps=${fps},capture=pattern"
+    done
+    start=$(now)
+    ./multi_encode -e ${encoder} -n ${frames} ${sessions} 2> /dev/null
+    single=$(echo "$(now) ${start}" | awk -v f=$((n * frames)) '{ printf "%.1f", f / ($1 - $2) }')
+
+    start=$(now)
+    for i in $(seq ${n}); do
+        ./sc_vaapi_encode -c pattern -e ${encoder} -n ${frames} -o /dev/null ${height} ${width} ${fps} 2> /dev/null &
+    done
+    wait
+    multi=$(echo "$(now) ${start}" | awk -v f=$((n * frames)) '{ printf "%.1f", f / ($1 - $2) }')
+
+    printf "%8d %14s %14s\n" ${n} ${single} ${multi}
+done
@@ -0,0 +1,437 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Several capture/encode sessions in one process, e.g. one per monitor or
+ * screen region, each with its own size, frame rate and output. The VAAPI
+ * device is opened once and shared; every session still has a surface
+ * pool of its own, sized for its resolution. Sessions are run by a pool of
+ * worker threads: a free worker takes the session whose next frame is due
+ * first and carries that frame through capture, conversion, upload and
+ * encoding, so a session's frames stay in order while different sessions
+ * encode in parallel.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/common.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+#include "ll_capture.h"
+#include "ll_convert.h"
+#include "ll_encoder.h"
+#include "ll_latency.h"
+#include "ll_pool.h"
+#include "ll_rtp.h"
+#include "ll_wire.h"
+
+#define MAX_SESSIONS    32
+#define MAX_THREADS     64
+
+typedef struct Session {
+    int index;
+    LLCaptureConfig capture;
+    LLEncoderConfig cfg;
+    const char *output;
+    int64_t max_frames;         // 0 to capture until the source ends
+
+    LLCapture *cap;
+    LLConvert convert;
+    int use_convert;            // else sws_scale
+    struct SwsContext *sws_ctx;
+    LLFramePool sw_pool;
+    AVFrame *frame, *sw_frame, *hw_frame;
+    LLEncoder *enc;
+
+    LLPacketCallback write_packet;
+    void *write_opaque;
+    FILE *fout;
+    LLWireWriter writer;
+    LLRtpSender rtp;
+    LLLatencyStats latency;     // capture to send
+
+    // Owned by the worker running the session while busy, else by the pool lock
+    int busy;
+    int done;
+    int error;
+    int64_t nb_frames;
+    int64_t busy_ns;
+    int64_t start_ns, end_ns;   // first frame captured, last one done
+} Session;
+
+static Session sessions[MAX_SESSIONS];
+static int nb_sessions;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+
+static int64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// size=WxH,fps=N,x=N,y=N,capture=backend,source=display|file,out=file|rtp://host:port
+static int parse_session(Session *s, char *spec)
+{
+    char *save, *tok, *val;
+
+    for (tok = strtok_r(spec, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (!(val = strchr(tok, '=')))
+            return AVERROR(EINVAL);
+        *val++ = 0;
+        if (!strcmp(tok, "size")) {
+            if (sscanf(val, "%dx%d", &s->capture.width, &s->capture.height) != 2)
+                return AVERROR(EINVAL);
+        } else if (!strcmp(tok, "fps")) {
+            s->capture.fps = atoi(val);
+        } else if (!strcmp(tok, "x")) {
+            s->capture.x = atoi(val);
+        } else if (!strcmp(tok, "y")) {
+            s->capture.y = atoi(val);
+        } else if (!strcmp(tok, "capture")) {
+            s->capture.backend = val;
+        } else if (!strcmp(tok, "source")) {
+            s->capture.source = val;
+        } else if (!strcmp(tok, "out")) {
+            s->output = val;
+        } else {
+            fprintf(stderr, "Unknown session option '%s'\n", tok);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (s->capture.width <= 0 || s->capture.height <= 0 || s->capture.fps <= 0)
+        return AVERROR(EINVAL);
+    return 0;
+}
+
+static int session_open(Session *s, const char *backend, AVBufferRef *hw_device_ctx)
+{
+    const char *name;
+    int ret;
+
+    if (!s->output)
+        s->output = "/dev/null";
+    if (ll_rtp_is_url(s->output)) {
+        if ((ret = ll_rtp_sender_open(&s->rtp, s->output, 0, LL_WIRE_CODEC_H264)) < 0)
+            return ret;
+        s->write_packet = ll_rtp_write_packet;
+        s->write_opaque = &s->rtp;
+    } else {
+        name = strcmp(s->output, "-") ? s->output : "/dev/stdout";
+        if (!(s->fout = fopen(name, "w+b"))) {
+            fprintf(stderr, "Cannot open output file '%s': %s\n", name, strerror(errno));
+            return AVERROR(errno);
+        }
+        s->write_packet = ll_wire_write_packet;
+        s->write_opaque = &s->writer;
+    }
+    ll_wire_writer_init(&s->writer, s->fout, LL_WIRE_CODEC_H264);
+    ll_latency_init(&s->latency, 0);
+    s->writer.latency = &s->latency;
+    s->rtp.latency = &s->latency;
+
+    s->capture.format = AV_PIX_FMT_NONE;
+    if ((ret = ll_capture_open(&s->cap, &s->capture)) < 0) {
+        fprintf(stderr, "Session %d: error opening capture\n", s->index);
+        return ret;
+    }
+
+    s->cfg.backend   = backend;
+    s->cfg.width     = s->capture.width;
+    s->cfg.height    = s->capture.height;
+    s->cfg.fps       = s->capture.fps;
+    s->cfg.gop_size  = 1;
+    // One frame in flight per session, plus what the encoder holds
+    s->cfg.pool_size = 1 + 4;
+    s->cfg.hw_device_ctx = hw_device_ctx;
+    if ((ret = ll_encoder_open(&s->enc, &s->cfg)) < 0) {
+        fprintf(stderr, "Session %d: failed to open encoder\n", s->index);
+        return ret;
+    }
+
+    // The workers already run sessions in parallel: one band per frame
+    if (s->cap->width == s->cfg.width && s->cap->height == s->cfg.height &&
+        s->enc->backend->sw_format == AV_PIX_FMT_NV12 &&
+        ll_convert_init(&s->convert, s->cap->format, s->cfg.width, s->cfg.height, 0, 1) >= 0)
+        s->use_convert = 1;
+    else if (!(s->sws_ctx = sws_getContext(s->cap->width, s->cap->height, s->cap->format,
+                                           s->cfg.width, s->cfg.height,
+                                           s->enc->backend->sw_format, 0, NULL, NULL, NULL)))
+        return AVERROR(ENOMEM);
+    if (!(s->frame = av_frame_alloc()) || !(s->sw_frame = av_frame_alloc()) ||
+        !(s->hw_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    return ll_frame_pool_init(&s->sw_pool, s->enc->backend->sw_format, s->cfg.width,
+                              s->cfg.height, 1 + LL_ENCODER_MAX_DELAY);
+}
+
+// One frame from capture to the output
+static int session_step(Session *s)
+{
+    LLFrameInfo info = { 0 };
+    int ret;
+
+    if (s->max_frames && s->nb_frames >= s->max_frames)
+        return AVERROR_EOF;
+    if ((ret = ll_capture_read(s->cap, s->frame)) < 0)
+        return ret;
+    ll_stamp(info.stamps, LL_STAGE_CAPTURE);
+    s->nb_frames++;
+
+    if ((ret = ll_frame_pool_get_buffer(&s->sw_pool, s->sw_frame)) < 0)
+        goto end;
+    if (s->use_convert)
+        ret = ll_convert_frame(&s->convert, s->frame, s->sw_frame);
+    else
+        sws_scale(s->sws_ctx, (const uint8_t * const *)s->frame->data, s->frame->linesize, 0,
+                  s->frame->height, s->sw_frame->data, s->sw_frame->linesize);
+    av_frame_unref(s->frame);
+    if (ret < 0)
+        goto end;
+    ll_stamp(info.stamps, LL_STAGE_CONVERT);
+
+    if ((ret = ll_encoder_upload(s->enc, s->sw_frame, s->hw_frame)) < 0)
+        goto end;
+    ll_stamp(info.stamps, LL_STAGE_UPLOAD);
+    av_frame_unref(s->sw_frame);
+
+    if (s->rtp.keyframe_request) {
+        ll_encoder_request_keyframe(s->enc);
+        s->rtp.keyframe_request = 0;
+    }
+    ret = ll_encoder_encode(s->enc, s->hw_frame, &info, s->write_packet, s->write_opaque);
+
+end:
+    av_frame_unref(s->frame);
+    av_frame_unref(s->sw_frame);
+    av_frame_unref(s->hw_frame);
+    return ret;
+}
+
+static void session_close(Session *s)
+{
+    if (s->enc)
+        ll_encoder_encode(s->enc, NULL, NULL, s->write_packet, s->write_opaque);
+    sws_freeContext(s->sws_ctx);
+    ll_convert_free(&s->convert);
+    av_frame_free(&s->frame);
+    av_frame_free(&s->sw_frame);
+    av_frame_free(&s->hw_frame);
+    ll_frame_pool_uninit(&s->sw_pool);
+    ll_capture_close(&s->cap);
+    ll_encoder_close(&s->enc);
+    ll_wire_writer_free(&s->writer);
+    if (s->write_packet == ll_rtp_write_packet)
+        ll_rtp_sender_close(&s->rtp);
+    if (s->fout)
+        fclose(s->fout);
+}
+
+/*
+ * Take the idle session whose frame is due first, waiting for it to be
+ * due; NULL once every session is done.
+ */
+static Session *next_session(void)
+{
+    struct timespec ts;
+    Session *s;
+    int64_t due;
+    int active;
+
+    while (1) {
+        s = NULL;
+        due = INT64_MAX;
+        active = 0;
+        for (int i = 0; i < nb_sessions; i++) {
+            Session *t = &sessions[i];
+            if (t->done)
+                continue;
+            active++;
+            /* next_ns is the next tick of the session's frame clock, from
+             * the first frame on; paced sources keep it at 0, always due */
+            if (!t->busy && t->cap->next_ns < due) {
+                due = t->cap->next_ns;
+                s = t;
+            }
+        }
+        if (!active)
+            return NULL;
+        if (!s) {
+            pthread_cond_wait(&cond, &lock);
+        } else if (due > ll_time_ns()) {
+            ts.tv_sec  = due / 1000000000;
+            ts.tv_nsec = due % 1000000000;
+            pthread_cond_timedwait(&cond, &lock, &ts);
+        } else {
+            s->busy = 1;
+            return s;
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    Session *s;
+    int64_t t0;
+    int ret;
+
+    pthread_mutex_lock(&lock);
+    while ((s = next_session())) {
+        pthread_mutex_unlock(&lock);
+        t0 = ll_time_ns();
+        ret = session_step(s);
+        s->busy_ns += ll_time_ns() - t0;
+        if (!s->start_ns)
+            s->start_ns = t0;
+        if (ret >= 0)
+            s->end_ns = ll_time_ns();
+        pthread_mutex_lock(&lock);
+        s->busy = 0;
+        if (ret < 0) {
+            if (ret != AVERROR_EOF) {
+                fprintf(stderr, "Session %d: %s\n", s->index, av_err2str(ret));
+                s->error = ret;
+            }
+            s->done = 1;
+        }
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    AVBufferRef *hw_device_ctx = NULL;
+    pthread_t threads[MAX_THREADS];
+    pthread_condattr_t attr;
+    const char *backend = NULL;
+    int nb_threads = 0, started = 0;
+    int64_t max_frames = 0, t0, c0, total = 0;
+    double seconds;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "s:e:t:n:")) != -1) {
+        switch (opt) {
+        case 's':
+            if (nb_sessions == MAX_SESSIONS) {
+                fprintf(stderr, "At most %d sessions\n", MAX_SESSIONS);
+                return 1;
+            }
+            sessions[nb_sessions].index = nb_sessions;
+            if (parse_session(&sessions[nb_sessions], optarg) < 0) {
+                fprintf(stderr, "Bad session '%s'\n", optarg);
+                goto usage;
+            }
+            nb_sessions++;
+            break;
+        case 'e':
+            backend = optarg;
+            break;
+        case 't':
+            nb_threads = atoi(optarg);
+            break;
+        case 'n':
+            max_frames = atoll(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (!nb_sessions || nb_threads < 0) {
+usage:
+        fprintf(stderr, "Usage: %s [-e vaapi|x264|openh264|auto] [-t threads] [-n frames per session] "
+                        "-s size=WxH,fps=N[,x=N,y=N][,capture=backend][,source=display|file]"
+                        "[,out=file|rtp://host:port] [-s ...]\n", argv[0]);
+        return 1;
+    }
+    if (!nb_threads)
+        nb_threads = FFMIN(sysconf(_SC_NPROCESSORS_ONLN), nb_sessions);
+    nb_threads = av_clip(nb_threads, 1, MAX_THREADS);
+
+    // One device for every session; the software encoders do without
+    if ((!backend || !strcmp(backend, "auto") || !strcmp(backend, "vaapi")) &&
+        (ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0)) < 0) {
+        fprintf(stderr, "Failed to create a VAAPI device: %s\n", av_err2str(ret));
+        if (backend && !strcmp(backend, "vaapi"))
+            return 1;
+    }
+
+    for (int i = 0; i < nb_sessions; i++) {
+        sessions[i].max_frames = max_frames;
+        if ((ret = session_open(&sessions[i], backend, hw_device_ctx)) < 0)
+            goto end;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    t0 = ll_time_ns();
+    c0 = cpu_ns();
+    for (started = 0; started < nb_threads; started++)
+        if ((ret = pthread_create(&threads[started], NULL, worker_main, NULL))) {
+            ret = AVERROR(ret);
+            break;
+        }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    seconds = (ll_time_ns() - t0) / 1e9;
+
+    for (int i = 0; i < nb_sessions; i++) {
+        Session *s = &sessions[i];
+
+        fprintf(stderr, "Session %d: %dx%d@%d on %s to %s, %lld frames, %.1f fps, "
+                        "%.2f ms per frame\n", i, s->cfg.width, s->cfg.height, s->cfg.fps,
+                s->enc->backend->name, s->output, (long long)s->nb_frames,
+                s->nb_frames * 1e9 / FFMAX(s->end_ns - s->start_ns, 1), s->busy_ns / 1e6 / FFMAX(s->nb_frames, 1));
+        ll_capture_print_stats(s->cap, stderr);
+        ll_latency_print(&s->latency, stderr);
+        total += s->nb_frames;
+        if (s->error && ret >= 0)
+            ret = s->error;
+    }
+    fprintf(stderr, "%d sessions on %d threads: %lld frames in %.2f s, %.1f fps in total, "
+                    "%.2f ms CPU per frame\n", nb_sessions, nb_threads, (long long)total, seconds,
+            total / seconds, (cpu_ns() - c0) / 1e6 / FFMAX(total, 1));
+
+end:
+    for (int i = 0; i < nb_sessions; i++)
+        session_close(&sessions[i]);
+    av_buffer_unref(&hw_device_ctx);
+    return ret < 0;
+}
@@ -0,0 +1,194 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Microbenchmark for the Annex-B start code scanners in ll_nal.c.
+ *
+ * Packets are either synthesised (random slice data with emulation
+ * prevention applied, so start codes only appear at NAL boundaries) or cut
+ * from a real Annex-B dump given on the command line, e.g. the output of
+ * vaapi_encode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ll_common.h"
+#include "ll_nal.h"
+
+typedef struct Packet {
+    const char *name;
+    size_t size;
+    uint8_t *data;
+} Packet;
+
+static const char *impls[] = { "memcmp", "scalar", "sse2", "avx2" };
+
+// The loop get_sps_pps used to run, bounded so that it can be timed
+static const uint8_t *find_start_code_memcmp(const uint8_t *p, const uint8_t *end)
+{
+    static const uint8_t NALU_header[3] = {0x00, 0x00, 0x01};
+
+    for (; end - p >= 3; p++)
+        if (!memcmp(p, NALU_header, 3))
+            return p;
+    return end;
+}
+
+static size_t put_nal(uint8_t *buf, size_t cap, int type, size_t size)
+{
+    size_t n = 0, zeros = 0;
+
+    if (cap < 5 + size + size / 2)
+        return 0;
+    buf[n++] = 0; buf[n++] = 0; buf[n++] = 0; buf[n++] = 1;
+    buf[n++] = 0x60 | type;
+    while (size--) {
+        // Zero-heavy like real CABAC output, with emulation prevention
+        uint8_t b = (rand() & 3) ? rand() : 0;
+        if (zeros >= 2 && b <= 3) {
+            buf[n++] = 0x03;
+            zeros = 0;
+        }
+        buf[n++] = b;
+        zeros = b ? 0 : zeros + 1;
+    }
+    if (!buf[n - 1])
+        buf[n - 1] = 0x80;
+    return n;
+}
+
+static void make_packet(Packet *pkt, size_t size, int slices, const uint8_t *src, size_t src_size)
+{
+    size_t cap = size * 2, n = 0;
+
+    pkt->data = malloc(cap);
+    if (src) {
+        // Cut from the real stream, wrapping around when it is short
+        size_t off = 0;
+        while (n < size) {
+            size_t len = size - n < src_size - off ? size - n : src_size - off;
+            memcpy(pkt->data + n, src + off, len);
+            n += len;
+            off = (off + len) % src_size;
+        }
+    } else {
+        n += put_nal(pkt->data + n, cap - n, LL_NAL_SPS, 20);
+        n += put_nal(pkt->data + n, cap - n, LL_NAL_PPS, 4);
+        for (int i = 0; i < slices; i++)
+            n += put_nal(pkt->data + n, cap - n, LL_NAL_IDR, (size - n) / (slices - i));
+    }
+    pkt->size = n;
+}
+
+static int count_units(LLStartCodeFn fn, const uint8_t *p, const uint8_t *end, size_t *sum)
+{
+    int n = 0;
+
+    while ((p = fn(p, end)) != end) {
+        *sum += p - (const uint8_t *)0;
+        p += 3;
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, iterations = 2000;
+    uint8_t *src = NULL;
+    size_t src_size = 0;
+    Packet packets[] = {
+        { "1080p", 128 << 10 },
+        { "4K",    512 << 10 },
+    };
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [annexb file]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind < argc) {
+        FILE *fin = fopen(argv[optind], "rb");
+        if (!fin) {
+            fprintf(stderr, "Cannot open %s\n", argv[optind]);
+            return -1;
+        }
+        fseek(fin, 0, SEEK_END);
+        src_size = ftell(fin);
+        fseek(fin, 0, SEEK_SET);
+        src = malloc(src_size);
+        if (!src_size || fread(src, 1, src_size, fin) != src_size) {
+            fprintf(stderr, "Cannot read %s\n", argv[optind]);
+            return -1;
+        }
+        fclose(fin);
+    }
+
+    srand(1);
+    for (int i = 0; i < (int)(sizeof(packets) / sizeof(packets[0])); i++) {
+        Packet *pkt = &packets[i];
+        size_t ref_sum = 0;
+        int ref_units = -1;
+
+        make_packet(pkt, pkt->size, 4, src, src_size);
+        for (int j = 0; j < (int)(sizeof(impls) / sizeof(impls[0])); j++) {
+            LLStartCodeFn fn = j ? ll_start_code_impl(impls[j]) : find_start_code_memcmp;
+            size_t sum = 0;
+            int units = 0;
+            int64_t t0;
+            double ns;
+
+            if (!fn) {
+                printf("%-6s %-7s unsupported on this CPU\n", pkt->name, impls[j]);
+                continue;
+            }
+            t0 = ll_time_ns();
+            for (int k = 0; k < iterations; k++)
+                units = count_units(fn, pkt->data, pkt->data + pkt->size, &sum);
+            ns = (double)(ll_time_ns() - t0) / iterations;
+
+            if (ref_units < 0) {
+                ref_units = units;
+                ref_sum = sum;
+            } else if (units != ref_units || sum != ref_sum) {
+                fprintf(stderr, "%s: %s disagrees with memcmp\n", pkt->name, impls[j]);
+                return 1;
+            }
+            printf("%-6s %-7s %7zu bytes %4d units %10.1f us/packet %7.2f GB/s\n",
+                   pkt->name, impls[j], pkt->size, units, ns / 1e3, pkt->size / ns);
+        }
+        free(pkt->data);
+    }
+    free(src);
+    return 0;
+}
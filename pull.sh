@@ -1,12 +1,11 @@
 #!/bin/bash
 
 # Puling side of live streaming
-# IP is the ipv4 address of push side
+# Listens for the RTP stream from the push side on port 9000
 # Parameters (fps. resolution) should be consistent with the pushing side
 
-IP=192.168.1.103
 height=1280
 width=720
 fps=60
 
-nc $IP 9000 | ./vaapi_decode - - | mplayer -benchmark - -demuxer rawvideo -rawvideo w=${height}:h=${width}:fps=${fps}:format=nv12
+./vaapi_decode rtp://:9000 - | mplayer -benchmark - -demuxer rawvideo -rawvideo w=${height}:h=${width}:fps=${fps}:format=nv12
@@ -1,10 +1,12 @@
 #!/bin/bash
 
 # Pushing side of live streaming
+# IP is the ipv4 address of pull side; frames are sent to it over RTP/UDP
 # Parameters (fps. resolution) should be consistent with the pulling side
 
+IP=192.168.1.104
 height=1280
 width=720
 fps=60
 
-./sc_vaapi_encode ${height} ${width} ${fps} | nc -lp 9000
+./sc_vaapi_encode -o rtp://${IP}:9000 ${height} ${width} ${fps}
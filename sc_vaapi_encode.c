@@ -23,337 +23,507 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/hwcontext.h>
-#include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
-#include <libavdevice/avdevice.h>
 #include <libavutil/imgutils.h>
 
+#include "ll_capture.h"
+#include "ll_convert.h"
+#include "ll_damage.h"
+#include "ll_encoder.h"
+#include "ll_ladder.h"
+#include "ll_pipeline.h"
+#include "ll_pool.h"
+#include "ll_relay.h"
+#include "ll_rtp.h"
+#include "ll_wire.h"
+
 static int width, height, fps;
-static AVBufferRef *hw_device_ctx = NULL;
-static int metadata_sent = 0;
-static unsigned char *metadata = NULL;
-static int data_length = -1;
-
-static int init_x11grab(AVFormatContext *pFormatCtx, AVCodecContext **pCodecCtx, AVCodec **pCodec){
-	int i, videoindex = -1;
-    if(avformat_find_stream_info(pFormatCtx, NULL)<0){
-		printf("Couldn't find stream information.\n");
-		return -1;
-	}
-
-	for(i = 0; i < pFormatCtx->nb_streams; i++) 
-		if(pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
-			videoindex = i;
-			break;
-		}
-
-	if(videoindex == -1){
-		fprintf(stderr, "Didn't find a video stream.\n");
-		return -1;
-	}
-	
-    *pCodec = avcodec_find_decoder(pFormatCtx->streams[videoindex]->codecpar->codec_id);
-    *pCodecCtx = avcodec_alloc_context3(*pCodec);
-    avcodec_parameters_to_context(*pCodecCtx, pFormatCtx->streams[videoindex]->codecpar);
-	
-    if(*pCodec==NULL){
-		fprintf(stderr, "Codec not found.\n");
-		return -1;
-	}
-
-	if(avcodec_open2(*pCodecCtx, *pCodec, NULL)<0){
-		fprintf(stderr, "Could not open codec.\n");
-		return -1;
-	}
 
-    return 0;
-}
+// State shared by the pipeline stages; each field is used by one stage only
+typedef struct PushContext {
+    LLCapture           *cap;           // capture
+    LLPipeline          *pipe;
+    int64_t             nb_frames;
+    int64_t             max_frames;     // 0 to capture until stopped
+    int                 use_damage;
+    LLDamage            damage;
+    int                 idle;           // unchanged captures skipped in a row
+    LLConvert           convert;        // convert
+    int                 use_convert;    // else sws_scale
+    struct SwsContext   *sws_ctx;
+    struct SwsContext   *scalers[LL_LADDER_MAX_RUNGS];  // to the smaller rungs, set up on first use
+    enum AVColorSpace   colorspace;
+    _Atomic int         rung;           // set by encode, followed by convert
+    LLFramePool         sw_pool;
+    AVFrame             *sw_frame;
+    LLEncoder           *enc;           // upload, encode
+    AVFrame             *hw_frame;      // upload
+    LLPacketCallback    write_packet;   // encode: writer, rtp or relay
+    void                *write_opaque;
+    LLWireWriter        writer;
+    LLRtpSender         rtp;
+    LLRelay             relay;
+    LLCongestionControl *cc;            // encode: NULL unless rate controlled over RTP
+    LLLadder            ladder;
+} PushContext;
+
+// Source to encoder format; flags 0 leaves the filter to swscale
+static struct SwsContext *open_scaler(const LLCapture *cap, int width, int height,
+                                      enum AVPixelFormat format, enum AVColorSpace colorspace,
+                                      int flags)
+{
+    struct SwsContext *sws;
 
-static int get_sps_pps(void* packet_data, unsigned char** metadata){
-    // This functon assumes that sps apperars before pps header
-    char* buffer = (char*) packet_data;
-    int data_length= -1;
-    int idx = 0;
-    int sps_begin = -1, sps_end = -1;
-    int pps_begin = -1, pps_end = -1;
-    char NALU_header[4] = {0x00, 0x00, 0x00, 0x01};
-    while(1){
-        if (!memcmp(buffer + idx, NALU_header, 4)){ // Find NALU Header
-            idx += 4;
-            if (*(buffer + idx) == 0x67){ // sps
-                sps_begin = idx - 4;
-                while (memcmp(buffer + idx, NALU_header, 4)) idx++; // Iterate until next NALU Header
-                sps_end = idx;
-            } else if (*(buffer + idx) == 0x68){// pps
-                pps_begin = idx - 4;
-                while (memcmp(buffer + idx, NALU_header, 4)) idx++; // Iterate until next NALU Header
-                pps_end = idx;
-                break;
-            }
-        }
-        else idx++;
+    if ((sws = sws_getContext(cap->width, cap->height, cap->format, width, height,
+                              format, flags, NULL, NULL, NULL)) &&
+        colorspace == AVCOL_SPC_BT709) {
+        sws_setColorspaceDetails(sws, sws_getCoefficients(SWS_CS_DEFAULT), 0,
+                                 sws_getCoefficients(SWS_CS_ITU709), 0, 0, 1 << 16, 1 << 16);
     }
-    data_length = sps_end - sps_begin + pps_end - pps_begin;
-    *metadata = malloc(data_length);
-    memcpy(*metadata, buffer + sps_begin, sps_end - sps_begin);
-    memcpy(*metadata + sps_end - sps_begin, buffer + pps_begin, pps_end - pps_begin);
-    return data_length;
+    return sws;
 }
 
-static int set_hwframe_ctx(AVCodecContext *ctx, AVBufferRef *hw_device_ctx)
+// ROI hints follow the picture down the ladder
+static void scale_roi(AVFrameSideData *roi, const AVFrame *src, const AVFrame *dst)
 {
-    AVBufferRef *hw_frames_ref;
-    AVHWFramesContext *frames_ctx = NULL;
-    int err = 0;
+    AVRegionOfInterest *r = (AVRegionOfInterest *)roi->data;
 
-    if (!(hw_frames_ref = av_hwframe_ctx_alloc(hw_device_ctx))) {
-        fprintf(stderr, "Failed to create VAAPI frame context.\n");
-        return -1;
-    }
-    frames_ctx = (AVHWFramesContext *)(hw_frames_ref->data);
-    frames_ctx->format    = AV_PIX_FMT_VAAPI;
-    frames_ctx->sw_format = AV_PIX_FMT_NV12;
-    frames_ctx->width     = width;
-    frames_ctx->height    = height;
-    frames_ctx->initial_pool_size = 20;
-    if ((err = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
-        fprintf(stderr, "Failed to initialize VAAPI frame context."
-                "Error code: %s\n",av_err2str(err));
-        av_buffer_unref(&hw_frames_ref);
-        return err;
+    for (size_t i = 0; r->self_size && i + r->self_size <= (size_t)roi->size; i += r->self_size) {
+        AVRegionOfInterest *rect = (AVRegionOfInterest *)(roi->data + i);
+
+        rect->top    = (int64_t)rect->top    * dst->height / src->height;
+        rect->bottom = (int64_t)rect->bottom * dst->height / src->height;
+        rect->left   = (int64_t)rect->left   * dst->width  / src->width;
+        rect->right  = (int64_t)rect->right  * dst->width  / src->width;
     }
-    ctx->hw_frames_ctx = av_buffer_ref(hw_frames_ref);
-    if (!ctx->hw_frames_ctx)
-        err = AVERROR(ENOMEM);
+}
 
-    av_buffer_unref(&hw_frames_ref);
-    return err;
+// Frames waiting to be sent: in the relay's queues, or in the socket or pipe buffer
+static int send_queue(PushContext *ctx)
+{
+    double frame_bytes = ctx->enc->n_packets ? (double)ctx->enc->n_bytes / ctx->enc->n_packets : 0;
+    int rtp = ctx->write_packet == ll_rtp_write_packet, bytes = 0;
+
+    if (ctx->write_packet == ll_relay_write_packet)
+        return atomic_load(&ctx->relay.queue_depth);
+    // Bytes not taken yet: SIOCOUTQ on a socket, FIONREAD on a pipe (0 for a file)
+    if (frame_bytes <= 0 ||
+        ioctl(rtp ? ctx->rtp.fd : fileno(ctx->writer.fout), rtp ? SIOCOUTQ : FIONREAD, &bytes) < 0)
+        return 0;
+    return bytes / frame_bytes;
 }
 
-static int encode_write(AVCodecContext *avctx, AVFrame *frame, FILE *fout)
+/*
+ * 1 if the capture should go on down the pipeline: it changed, or it is
+ * the one a second that keeps an idle stream alive, so that receivers
+ * asking for a keyframe and the rate controller still hear from us.
+ * Changed tiles become ROI hints for the encoder.
+ */
+static int check_damage(PushContext *ctx, AVFrame *frame)
 {
-    int ret = 0;
-    AVPacket enc_pkt;
+    int ret;
+
+    if (!ctx->damage.ref &&
+        (ret = ll_damage_init(&ctx->damage, frame->format, frame->width, frame->height)) < 0) {
+        fprintf(stderr, "No damage detection for %s: %s\n",
+                av_get_pix_fmt_name(frame->format), av_err2str(ret));
+        ctx->use_damage = 0;
+        return 1;
+    }
+    if (!ll_damage_update(&ctx->damage, frame->data[0], frame->linesize[0]) &&
+        ++ctx->idle < fps)
+        return 0;
+    ctx->idle = 0;
+    // Spend the bits where the screen changed
+    if ((ret = ll_damage_set_roi(&ctx->damage, frame, (AVRational){ -1, 10 })) < 0)
+        return ret;
+    return 1;
+}
 
-    av_init_packet(&enc_pkt);
-    enc_pkt.data = NULL;
-    enc_pkt.size = 0;
+static int capture_stage(void *opaque, LLPipeItem *in, LLPipeItem **out)
+{
+    PushContext *ctx = opaque;
+    LLPipeItem *item;
+    int ret;
+
+    if (ctx->max_frames && ctx->nb_frames >= ctx->max_frames)
+        return AVERROR_EOF;
+    if (!(item = ll_pipe_item_alloc(ctx->pipe)))
+        return AVERROR(ENOMEM);
+    if ((ret = ll_capture_read(ctx->cap, item->frame)) < 0) {
+        if (ret != AVERROR_EOF)
+            fprintf(stderr, "Capture error: %s\n", av_err2str(ret));
+        ll_pipe_item_free(&item);
+        return ret;
+    }
+    ll_stamp(item->info.stamps, LL_STAGE_CAPTURE);
+    ctx->nb_frames++;
+    // Nothing changed: no conversion, upload or encode for this one
+    if (ctx->use_damage && (ret = check_damage(ctx, item->frame)) <= 0) {
+        ll_pipe_item_free(&item);
+        return ret;
+    }
+    *out = item;
+    return 0;
+}
 
-    if ((ret = avcodec_send_frame(avctx, frame)) < 0) {
-        fprintf(stderr, "Error code: %s\n", av_err2str(ret));
-        goto end;
+static int convert_stage(void *opaque, LLPipeItem *in, LLPipeItem **out)
+{
+    PushContext *ctx = opaque;
+    AVFrame *dst = ctx->sw_frame;
+    AVFrameSideData *sd, *roi;
+    struct SwsContext **sws;
+    int rung = atomic_load(&ctx->rung);
+    int ret;
+
+    if (!in)
+        return AVERROR_EOF;
+    if ((ret = ll_frame_pool_get_buffer(&ctx->sw_pool, dst)) < 0) {
+        ll_pipe_item_free(&in);
+        return ret;
+    }
+    // Buffers have the configured size; a lower rung uses the top left of one
+    dst->width  = ctx->ladder.rungs[rung].width;
+    dst->height = ctx->ladder.rungs[rung].height;
+
+    // Straight into the buffer the upload stage hands to the GPU
+    sws = rung ? &ctx->scalers[rung] : &ctx->sws_ctx;
+    if (!rung && ctx->use_convert)
+        ret = ll_convert_frame(&ctx->convert, in->frame, dst);
+    else if (!*sws && !(*sws = open_scaler(ctx->cap, dst->width, dst->height, dst->format,
+                                            ctx->colorspace, SWS_FAST_BILINEAR)))
+        ret = AVERROR(ENOMEM);
+    else
+        sws_scale(*sws, (const unsigned char* const*)in->frame->data, in->frame->linesize, 0, in->frame->height, dst->data, dst->linesize);
+    if (ret < 0) {
+        av_frame_unref(dst);
+        ll_pipe_item_free(&in);
+        return ret;
+    }
+    ll_stamp(in->info.stamps, LL_STAGE_CONVERT);
+    if ((sd = av_frame_get_side_data(in->frame, AV_FRAME_DATA_REGIONS_OF_INTEREST)) &&
+        (roi = av_frame_new_side_data(dst, AV_FRAME_DATA_REGIONS_OF_INTEREST, sd->size))) {
+        memcpy(roi->data, sd->data, sd->size);
+        if (rung)
+            scale_roi(roi, in->frame, dst);
     }
-    while (1) {
-        ret = avcodec_receive_packet(avctx, &enc_pkt);
-        if (ret)
-            break;
 
-        enc_pkt.stream_index = 0;
-        if (!metadata_sent){
-            data_length = get_sps_pps(enc_pkt.data, &metadata);
-            ret = fwrite(&data_length, sizeof(data_length), 1, fout);
-            ret = fwrite(metadata, sizeof(char), data_length, fout);
-            fflush(fout);
-            metadata_sent = 1;
-            ret = fwrite(enc_pkt.data, sizeof(char), data_length, fout);
-        }
-        usleep(1e2);
-        ret = fwrite(enc_pkt.data + data_length, 1, enc_pkt.size - data_length, fout);
-        ret = fwrite(metadata, sizeof(char), data_length, fout);
-        av_packet_unref(&enc_pkt);
-        fflush(fout);
+    av_frame_unref(in->frame);
+    av_frame_move_ref(in->frame, dst);
+    *out = in;
+    return 0;
+}
+
+static int upload_stage(void *opaque, LLPipeItem *in, LLPipeItem **out)
+{
+    PushContext *ctx = opaque;
+    AVFrame *hw_frame = ctx->hw_frame;
+    int ret;
+
+    if (!in)
+        return AVERROR_EOF;
+    if ((ret = ll_encoder_upload(ctx->enc, in->frame, hw_frame)) < 0) {
+        av_frame_unref(hw_frame);
+        ll_pipe_item_free(&in);
+        return ret;
     }
+    ll_stamp(in->info.stamps, LL_STAGE_UPLOAD);
 
-end:
-    ret = ((ret == AVERROR(EAGAIN)) ? 0 : -1);
-    return ret;
+    // The software buffer goes back to the pool here
+    av_frame_unref(in->frame);
+    av_frame_move_ref(in->frame, hw_frame);
+    *out = in;
+    return 0;
+}
+
+static int encode_stage(void *opaque, LLPipeItem *in, LLPipeItem **out)
+{
+    PushContext *ctx = opaque;
+    int64_t t0 = ll_time_ns();
+    int ret;
+
+    if (!in) {
+        /* flush encoder */
+        ret = ll_encoder_encode(ctx->enc, NULL, NULL, ctx->write_packet, ctx->write_opaque);
+        return ret < 0 ? ret : AVERROR_EOF;
+    }
+    // Receiver reports are read while sending, on this thread
+    if (ctx->cc)
+        ll_encoder_set_bitrate(ctx->enc, ctx->cc->target);
+    if (ctx->rtp.keyframe_request) {
+        ll_encoder_request_keyframe(ctx->enc);
+        ctx->rtp.keyframe_request = 0;
+    }
+    // A viewer joined or fell behind the relay
+    if (ctx->write_packet == ll_relay_write_packet && atomic_exchange(&ctx->relay.keyframe_request, 0))
+        ll_encoder_request_keyframe(ctx->enc);
+    ret = ll_encoder_encode(ctx->enc, in->frame, &in->info, ctx->write_packet, ctx->write_opaque);
+    ll_pipe_item_free(&in);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to encode.\n");
+        return ret;
+    }
+    // The next frames to be converted take the new size; the encoder follows them
+    if (ll_ladder_update(&ctx->ladder, ll_time_ns() - t0, send_queue(ctx), ctx->enc->bitrate, ll_time_ns()))
+        atomic_store(&ctx->rung, ctx->ladder.rung);
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
     int             err;
-    FILE            *fin = NULL, *fout = NULL;
-    AVFrame         *hw_frame = NULL;
-    AVCodecContext  *avctx = NULL;
-    AVCodec         *codec  = NULL;
-    const char      *enc_name = "h264_vaapi";
-
-    AVFormatContext	*pFormatCtx;
-	AVCodecContext	*pCodecCtx;
-	AVCodec			*pCodec;
-
-    if (argc < 4) {
-        fprintf(stderr, "Usage: %s <width> <height> <fps>\n", argv[0]);
+    FILE            *fout = NULL;
+    PushContext     ctx = { 0 };
+    LLEncoderConfig cfg = { 0 };
+    LLCaptureConfig capture = { .format = AV_PIX_FMT_NONE };
+    LLLatencyStats  latency;
+    LLPipeline      pipe;
+    LLCongestionControl cc;
+    const AVCodecDescriptor *desc;
+    LLWireCodec     codec = LL_WIRE_CODEC_H264;
+    int             depth = 2;
+    const char      *output = "-";
+    const char      *relay = NULL;
+    int             mtu = 0;
+    int             fec = 0, fec_adaptive = 0;
+    int64_t         bitrate = 0;
+    int             gop_size = 1;
+    int             rungs = 1;
+    int             threads = FFMIN(sysconf(_SC_NPROCESSORS_ONLN), 4);
+    int             opt;
+
+    while ((opt = getopt(argc, argv, "c:i:p:lT:C:v:e:q:o:L:m:f:b:n:g:S:dR:")) != -1) {
+        switch (opt) {
+        case 'c':
+            capture.backend = optarg;
+            break;
+        case 'i':
+            capture.source = optarg;
+            break;
+        case 'p':
+            if ((capture.format = av_get_pix_fmt(optarg)) == AV_PIX_FMT_NONE) {
+                fprintf(stderr, "Unknown pixel format: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'l':
+            capture.loop = 1;
+            break;
+        case 'T':
+            threads = atoi(optarg);
+            break;
+        case 'C':
+            cfg.colorspace = atoi(optarg) == 709 ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+            break;
+        case 'v':
+            if (!(desc = avcodec_descriptor_get_by_name(optarg)) ||
+                !(codec = ll_wire_codec_from_id(desc->id))) {
+                fprintf(stderr, "Unsupported codec: %s\n", optarg);
+                return -1;
+            }
+            cfg.codec_id = desc->id;
+            break;
+        case 'e':
+            cfg.backend = optarg;
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'L':
+            relay = optarg;
+            break;
+        case 'm':
+            mtu = atoi(optarg);
+            break;
+        case 'f':
+            fec_adaptive = !strcmp(optarg, "auto");
+            fec = fec_adaptive ? 0 : atoi(optarg);
+            break;
+        case 'b':
+            bitrate = atoll(optarg) * 1000;
+            break;
+        case 'n':
+            ctx.max_frames = atoll(optarg);
+            break;
+        case 'g':
+            gop_size = FFMAX(atoi(optarg), 1);
+            break;
+        case 'S':
+            cfg.slices = atoi(optarg);
+            break;
+        case 'd':
+            ctx.use_damage = 1;
+            break;
+        case 'R':
+            rungs = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind < 3) {
+usage:
+        fprintf(stderr, "Usage: %s [-c xshm|x11grab|file|pattern|auto] [-i display|file] [-p raw pix_fmt] [-l] [-T convert threads] [-C 601|709] [-v h264|hevc|av1] [-e vaapi|x264|openh264|x265|svtav1|auto] [-q queue depth] [-o output|rtp://host:port] [-L [host:]port] [-m mtu] [-f fec overhead %%|auto] [-b kbps] [-n frames] [-g refresh period] [-S slices] [-d] [-R rungs] <width> <height> <fps>\n", argv[0]);
         return -1;
     }
 
-    char *infilename = "/dev/stdin", *outfilename = "/dev/stdout";
-    width  = atoi(argv[1]);
-    height = atoi(argv[2]);
-    fps = atoi(argv[3]);
+    const char *outfilename = strcmp(output, "-") ? output : "/dev/stdout";
+    width  = atoi(argv[optind]);
+    height = atoi(argv[optind + 1]);
+    fps = atoi(argv[optind + 2]);
+    ll_ladder_init(&ctx.ladder, width, height, fps, rungs);
 
-    if (!(fin = fopen(infilename, "r"))) {
-        fprintf(stderr, "Fail to open input file : %s\n", strerror(errno));
-        return -1;
-    }
-    if (!(fout = fopen(outfilename, "w+b"))) {
+    if (relay) {
+        if (ll_relay_open(&ctx.relay, relay, codec) < 0)
+            return -1;
+        ctx.write_packet = ll_relay_write_packet;
+        ctx.write_opaque = &ctx.relay;
+    } else if (ll_rtp_is_url(output)) {
+        if (ll_rtp_sender_open(&ctx.rtp, output, mtu, codec) < 0)
+            return -1;
+        ll_fec_encoder_init(&ctx.rtp.fec, fec, fec_adaptive);
+        // Start at the ceiling and let the receiver's reports pull it down
+        if (bitrate) {
+            ll_cc_init(&cc, bitrate, bitrate / 10, bitrate);
+            ctx.rtp.cc = ctx.cc = &cc;
+        }
+        ctx.write_packet = ll_rtp_write_packet;
+        ctx.write_opaque = &ctx.rtp;
+    } else if (!(fout = fopen(outfilename, "w+b"))) {
         fprintf(stderr, "Fail to open output file : %s\n", strerror(errno));
-        err = -1;
-        goto close;
-    }
-    
-    // Deprecated
-    // av_register_all();
-	pFormatCtx = avformat_alloc_context();
-    avdevice_register_all();
-
-	AVDictionary* options = NULL;
-	//Set some options
-	//grabbing frame rate
-	av_dict_set(&options, "framerate", argv[3], 0);
-	//av_dict_set(&options,"follow_mouse","centered",0);
-	//Video frame size. The default is to capture the full screen
-    char resolution[10] = {0};
-    sprintf(resolution, "%d*%d", width, height);
-	av_dict_set(&options, "video_size", resolution, 0);
-	AVInputFormat *ifmt = av_find_input_format("x11grab");
-
-    // Open x11
-    //Grab at position 10,20
-	if(avformat_open_input(&pFormatCtx,":0.0", ifmt, &options) !=0){
-		printf("Couldn't open input stream.\n");
-		return -1;
-	}
-
-    if (init_x11grab(pFormatCtx, &pCodecCtx, &pCodec) < 0) {
-        fprintf(stderr, "Error initialize X11\n");
         return -1;
+    } else {
+        ctx.write_packet = ll_wire_write_packet;
+        ctx.write_opaque = &ctx.writer;
     }
 
-    // Create HW encoder ctx
-    err = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI,
-                                 NULL, NULL, 0);
-    if (err < 0) {
-        fprintf(stderr, "Failed to create a VAAPI device. Error code: %s\n", av_err2str(err));
-        goto close;
+    capture.width  = width;
+    capture.height = height;
+    capture.fps    = fps;
+    if (ll_capture_open(&ctx.cap, &capture) < 0) {
+        fprintf(stderr, "Error opening capture\n");
+        return -1;
     }
 
-    if (!(codec = avcodec_find_encoder_by_name(enc_name))) {
-        fprintf(stderr, "Could not find encoder.\n");
-        err = -1;
+    ll_pipeline_init(&pipe, depth);
+    ctx.pipe = &pipe;
+
+    cfg.width    = width;
+    cfg.height   = height;
+    cfg.fps      = fps;
+    cfg.gop_size = gop_size;
+    cfg.intra_refresh = gop_size > 1;
+    cfg.roi      = ctx.use_damage;
+    cfg.bitrate  = bitrate;
+    // Surfaces in flight: a full upload->encode queue, one in each of those
+    // stages, and the few the encoder holds while it works
+    cfg.pool_size = pipe.depth + 2 + 4;
+    if ((err = ll_encoder_open(&ctx.enc, &cfg)) < 0) {
+        fprintf(stderr, "Failed to open encoder.\n");
         goto close;
     }
-
-    if (!(avctx = avcodec_alloc_context3(codec))) {
+    ll_wire_writer_init(&ctx.writer, fout, codec);
+    ctx.writer.slices = cfg.slices > 1;
+    ll_latency_init(&latency, 0);
+    ctx.writer.latency = &latency;
+    ctx.relay.writer.slices = ctx.writer.slices;
+    ctx.relay.writer.latency = &latency;
+    ctx.rtp.latency = &latency;
+
+    // The converter only does packed RGB to NV12 at the same size
+    if (ctx.cap->width == width && ctx.cap->height == height &&
+        ctx.enc->backend->sw_format == AV_PIX_FMT_NV12 &&
+        ll_convert_init(&ctx.convert, ctx.cap->format, width, height, cfg.colorspace, threads) >= 0) {
+        ctx.use_convert = 1;
+    } else {
+        ctx.sws_ctx = open_scaler(ctx.cap, width, height, ctx.enc->backend->sw_format, cfg.colorspace, 0);
+    }
+    ctx.colorspace = cfg.colorspace;
+    if ((!ctx.use_convert && !ctx.sws_ctx) ||
+        !(ctx.sw_frame = av_frame_alloc()) || !(ctx.hw_frame = av_frame_alloc())) {
         err = AVERROR(ENOMEM);
         goto close;
     }
-
-    avctx->width     = width;
-    avctx->height    = height;
-    avctx->time_base = (AVRational){1, fps};
-    avctx->framerate = (AVRational){fps, 1};
-    avctx->sample_aspect_ratio = (AVRational){1, 1};
-    avctx->pix_fmt   = AV_PIX_FMT_VAAPI;
-    avctx->max_b_frames = 0;
-    avctx->gop_size = 1;
-    avctx->level = 20;
-    avctx->qmin = 10;
-    avctx->qmax = 30;
-    avctx->global_quality = 35;
-
-    /* set hw_frames_ctx for encoder's AVCodecContext */
-    if ((err = set_hwframe_ctx(avctx, hw_device_ctx)) < 0) {
-        fprintf(stderr, "Failed to set hwframe context.\n");
+    // Converted frames live in the convert->upload queue, in both stages,
+    // and (for software encoders) inside the encoder until it is done
+    if ((err = ll_frame_pool_init(&ctx.sw_pool, ctx.enc->backend->sw_format, width, height,
+                                  pipe.depth + 2 + LL_ENCODER_MAX_DELAY)) < 0) {
+        fprintf(stderr, "Failed to allocate frame pool.\n");
         goto close;
     }
 
-    if ((err = avcodec_open2(avctx, codec, NULL)) < 0) {
-        fprintf(stderr, "Cannot open video encoder codec. Error code: %s\n", av_err2str(err));
+    // Each stage runs on its own thread, so per-frame latency is still the
+    // sum of the stages but throughput is bounded by the slowest one
+    ll_pipeline_add_stage(&pipe, "capture", capture_stage, &ctx);
+    ll_pipeline_add_stage(&pipe, "convert", convert_stage, &ctx);
+    ll_pipeline_add_stage(&pipe, "upload",  upload_stage,  &ctx);
+    ll_pipeline_add_stage(&pipe, "encode",  encode_stage,  &ctx);
+    if ((err = ll_pipeline_start(&pipe)) < 0) {
+        fprintf(stderr, "Failed to start pipeline: %s\n", av_err2str(err));
+        ll_pipeline_join(&pipe);
         goto close;
     }
-    // End of hw encoder init
-
-    AVFrame	*pFrame,*pFrameNV12;
-	pFrame = av_frame_alloc();
-	pFrameNV12 = av_frame_alloc();
-	unsigned char *out_buffer = (unsigned char *)av_malloc(av_image_get_buffer_size(AV_PIX_FMT_NV12, pCodecCtx->width, pCodecCtx->height, 1));
-
-	av_image_fill_arrays(pFrameNV12->data, pFrameNV12->linesize, out_buffer, AV_PIX_FMT_NV12, pCodecCtx->width, pCodecCtx->height, 1);
-
-    struct SwsContext *img_convert_ctx;
-	img_convert_ctx = sws_getContext(pCodecCtx->width, pCodecCtx->height, pCodecCtx->pix_fmt, pCodecCtx->width, pCodecCtx->height, AV_PIX_FMT_NV12, 0, NULL, NULL, NULL); 
-
-    AVPacket *packet = (AVPacket *)av_malloc(sizeof(AVPacket));
-    int ret, got_picture;
-
-    while (1) {
-        if(av_read_frame(pFormatCtx, packet) < 0)
-            break;
-        ret = avcodec_send_packet(pCodecCtx, packet);
-        if(ret < 0){
-            printf("Decode Error.\n");
-            return -1;
-        }
-        got_picture = avcodec_receive_frame(pCodecCtx, pFrame);
-        if(got_picture) continue;
-
-        sws_scale(img_convert_ctx, (const unsigned char* const*)pFrame->data, pFrame->linesize, 0, pCodecCtx->height, pFrameNV12->data, pFrameNV12->linesize);
-        pFrameNV12->width = width;
-        pFrameNV12->height = height;
-        pFrameNV12->format = AV_PIX_FMT_NV12;
-
-        if (!(hw_frame = av_frame_alloc())) {
-            err = AVERROR(ENOMEM);
-            goto close;
-        }
-        if ((err = av_hwframe_get_buffer(avctx->hw_frames_ctx, hw_frame, 0)) < 0) {
-            fprintf(stderr, "Error code: %s.\n", av_err2str(err));
-            goto close;
-        }
-        if (!hw_frame->hw_frames_ctx) {
-            err = AVERROR(ENOMEM);
-            goto close;
-        }
-        if ((err = av_hwframe_transfer_data(hw_frame, pFrameNV12, 0)) < 0) {
-            fprintf(stderr, "Error while transferring frame data to surface."
-                    "Error code: %s.\n", av_err2str(err));
-            goto close;
-        }
-        if ((err = (encode_write(avctx, hw_frame, fout))) < 0) {
-            fprintf(stderr, "Failed to encode.\n");
-            goto close;
-        }
-
-        av_frame_free(&hw_frame);
-        av_packet_unref(packet);
-
+    while (!ll_pipeline_wait(&pipe, 5000)) {
+        fprintf(stderr, "Pipeline:\n");
+        ll_pipeline_print_stats(&pipe, stderr);
+    }
+    err = ll_pipeline_join(&pipe);
+
+    ll_capture_print_stats(ctx.cap, stderr);
+    ll_encoder_print_stats(ctx.enc, stderr);
+    if (ctx.use_convert)
+        ll_convert_print_stats(&ctx.convert, stderr);
+    ll_frame_pool_print_stats(&ctx.sw_pool, "Convert", stderr);
+    if (ctx.damage.ref)
+        ll_damage_print_stats(&ctx.damage, stderr);
+    if (ctx.ladder.nb_rungs > 1)
+        ll_ladder_print_stats(&ctx.ladder, stderr);
+    if (ctx.write_packet == ll_rtp_write_packet) {
+        ll_rtp_print_stats(&ctx.rtp.stats, "RTP", stderr);
+        ll_fec_print_stats(&ctx.rtp.fec, ctx.rtp.stats.packets, stderr);
+        if (ctx.cc)
+            ll_cc_print_stats(ctx.cc, stderr);
+    }
+    if (ctx.write_packet == ll_relay_write_packet) {
+        ll_relay_close(&ctx.relay);
+        ll_relay_print_stats(&ctx.relay, stderr);
     }
-    /* flush encoder */
-    err = encode_write(avctx, NULL, fout);
-    if (err == AVERROR_EOF)
-        err = 0;
+    ll_latency_print(&latency, stderr);
 
 close:
-    if (fin)
-        fclose(fin);
+    ll_pipeline_free(&pipe);
     if (fout){
         fclose(fout);
     }
-    av_frame_free(&pFrame);
-    av_frame_free(&pFrameNV12);
-    av_frame_free(&hw_frame);
-    avcodec_free_context(&avctx);
-    av_buffer_unref(&hw_device_ctx);
-    free(metadata);
+    sws_freeContext(ctx.sws_ctx);
+    for (int i = 0; i < LL_LADDER_MAX_RUNGS; i++)
+        sws_freeContext(ctx.scalers[i]);
+    ll_convert_free(&ctx.convert);
+    av_frame_free(&ctx.sw_frame);
+    av_frame_free(&ctx.hw_frame);
+    ll_frame_pool_uninit(&ctx.sw_pool);
+    ll_damage_free(&ctx.damage);
+    ll_capture_close(&ctx.cap);
+    ll_encoder_close(&ctx.enc);
+    ll_wire_writer_free(&ctx.writer);
+    if (ctx.write_packet == ll_rtp_write_packet)
+        ll_rtp_sender_close(&ctx.rtp);
+    if (ctx.write_packet == ll_relay_write_packet)
+        ll_relay_close(&ctx.relay);
 
     return err;
 }
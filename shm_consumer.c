@@ -0,0 +1,197 @@
+/*  
+ * MIT License
+ *
+ * Copyright (c) 2019 Jingyuan Zhu
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Reference consumer for the shared-memory output of vaapi_decode -s.
+ *
+ * It maps the ring, waits on its futex for new frames and takes the newest
+ * one each time, so a slow consumer skips frames rather than falling
+ * behind. Frames are read in place; -o copies them out row by row, e.g. to
+ * a pipe into a player, which is exactly the copy the ring avoids. The
+ * copy is written only if the slot was not reused while it was taken.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/avutil.h>
+#include <libavutil/mem.h>
+
+#include "ll_common.h"
+#include "ll_latency.h"
+#include "ll_shm.h"
+
+/*
+ * Copy the image out of the slot, rows packed, into *buf. The geometry
+ * comes from hdr, a snapshot of the slot's header that may be torn, so it
+ * is checked against the slot before anything is read. Returns the size,
+ * AVERROR_INVALIDDATA for geometry outside the slot, or AVERROR(ENOMEM).
+ */
+static int copy_frame(const LLShmRing *ring, const LLShmFrame *slot, const LLShmFrame *hdr,
+                      uint8_t **buf, unsigned int *buf_size)
+{
+    uint64_t size = 0;
+    uint8_t *dst;
+
+    if (hdr->nb_planes > LL_SHM_MAX_PLANES)
+        return AVERROR_INVALIDDATA;
+    for (uint32_t i = 0; i < hdr->nb_planes; i++) {
+        if (hdr->plane_height[i] &&
+            hdr->offset[i] + (uint64_t)hdr->linesize[i] * (hdr->plane_height[i] - 1) +
+            hdr->row_bytes[i] > ring->hdr->slot_size)
+            return AVERROR_INVALIDDATA;
+        size += (uint64_t)hdr->row_bytes[i] * hdr->plane_height[i];
+    }
+    if (size > ring->hdr->slot_size)
+        return AVERROR_INVALIDDATA;
+    av_fast_malloc(buf, buf_size, size);
+    if (!*buf)
+        return AVERROR(ENOMEM);
+
+    dst = *buf;
+    for (uint32_t i = 0; i < hdr->nb_planes; i++) {
+        const uint8_t *src = (const uint8_t *)slot + hdr->offset[i];
+        for (uint32_t y = 0; y < hdr->plane_height[i]; y++) {
+            memcpy(dst, src + (size_t)y * hdr->linesize[i], hdr->row_bytes[i]);
+            dst += hdr->row_bytes[i];
+        }
+    }
+    return size;
+}
+
+int main(int argc, char *argv[])
+{
+    LLShmRing ring = { .fd = -1 };
+    LLHistogram publish_lat, total_lat;
+    FILE *fout = NULL;
+    const char *out_name = NULL;
+    uint8_t *buf = NULL;
+    unsigned int buf_size = 0;
+    uint64_t frames = 0, skipped = 0, torn = 0, limit = 0;
+    uint64_t last_frames = 0;
+    uint32_t last_seq = 0;
+    int64_t last_report;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "o:n:")) != -1) {
+        switch (opt) {
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'n':
+            limit = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind < 1) {
+usage:
+        fprintf(stderr, "Usage: %s [-o output file] [-n frames] <shm name>\n", argv[0]);
+        return -1;
+    }
+    if (out_name && !(fout = fopen(strcmp(out_name, "-") ? out_name : "/dev/stdout", "wb"))) {
+        fprintf(stderr, "Fail to open output file : %s\n", strerror(errno));
+        return -1;
+    }
+
+    ll_histogram_reset(&publish_lat);
+    ll_histogram_reset(&total_lat);
+    last_report = ll_time_ns();
+
+    while (!limit || frames < limit) {
+        LLShmFrame *slot, frame;
+        uint32_t seq;
+        int size = 0;
+
+        // The decoder creates the ring on its first frame and replaces it
+        // when the frame size grows, so (re)attach whenever it goes away
+        if (!ring.hdr || atomic_load(&ring.hdr->closed)) {
+            if (ring.hdr)
+                ll_shm_close(&ring);
+            while ((ret = ll_shm_open(&ring, argv[optind])) < 0) {
+                if (ret != AVERROR(ENOENT) && ret != AVERROR(EAGAIN)) {
+                    fprintf(stderr, "Cannot open shm ring '%s': %s\n", argv[optind], av_err2str(ret));
+                    return -1;
+                }
+                usleep(100000);
+            }
+            last_seq = atomic_load(&ring.hdr->seq);
+            fprintf(stderr, "Attached to '%s': %u slots of %u bytes\n",
+                    argv[optind], ring.hdr->nb_slots, ring.hdr->slot_size);
+        }
+
+        if (!(slot = ll_shm_wait(&ring, last_seq, &seq, 1000)))
+            continue;
+        if (last_seq && seq - last_seq > 1)
+            skipped += seq - last_seq - 1;
+        last_seq = seq;
+
+        /* Take everything out of the slot, then check that the decoder did
+         * not reuse it meanwhile: a torn frame never reaches the output */
+        memcpy(&frame, slot, sizeof(frame));
+        if (fout && (size = copy_frame(&ring, slot, &frame, &buf, &buf_size)) == AVERROR(ENOMEM))
+            break;
+        if (!ll_shm_frame_valid(slot, seq) || size < 0) {
+            torn++;
+            continue;
+        }
+        if (fout && fwrite(buf, 1, size, fout) != (size_t)size) {
+            fprintf(stderr, "Failed to write frame.\n");
+            break;
+        }
+        frames++;
+        ll_histogram_record(&publish_lat, (ll_realtime_ns() - frame.publish_ns) / 1000);
+        if (frame.capture_ns)
+            ll_histogram_record(&total_lat, (ll_realtime_ns() - frame.capture_ns) / 1000);
+
+        if (ll_time_ns() - last_report >= 5000000000LL) {
+            int64_t now = ll_time_ns();
+
+            fprintf(stderr, "%ux%u %.1f fps, %llu skipped, %llu torn, publish->read p50 %.3f p99 %.3f ms",
+                    frame.width, frame.height, (frames - last_frames) * 1e9 / (now - last_report),
+                    (unsigned long long)skipped, (unsigned long long)torn,
+                    ll_histogram_percentile(&publish_lat, 50) / 1e3,
+                    ll_histogram_percentile(&publish_lat, 99) / 1e3);
+            if (total_lat.count)
+                fprintf(stderr, ", capture->read p50 %.3f p99 %.3f ms",
+                        ll_histogram_percentile(&total_lat, 50) / 1e3,
+                        ll_histogram_percentile(&total_lat, 99) / 1e3);
+            fprintf(stderr, "\n");
+            last_frames = frames;
+            last_report = now;
+        }
+    }
+
+    fprintf(stderr, "%llu frames, %llu skipped, %llu torn\n", (unsigned long long)frames,
+            (unsigned long long)skipped, (unsigned long long)torn);
+    ll_shm_close(&ring);
+    av_free(buf);
+    if (fout)
+        fclose(fout);
+    return 0;
+}
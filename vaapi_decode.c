@@ -22,8 +22,15 @@
  * SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -32,271 +39,846 @@
 #include <libavutil/opt.h>
 #include <libavutil/avassert.h>
 #include <libavutil/imgutils.h>
+#include <libswscale/swscale.h>
 
+#include "ll_jitter.h"
+#include "ll_mailbox.h"
+#include "ll_nal.h"
+#include "ll_pool.h"
+#include "ll_rtp.h"
+#include "ll_shm.h"
+#include "ll_stream.h"
+#include "ll_wire.h"
+
+
+#define STAMP_RING 16
 
 static AVBufferRef *hw_device_ctx = NULL;
 static FILE *output_file = NULL;
-static unsigned int data_size = -1;
-static unsigned char* sps_pps = NULL; // = {0, 0, 0, 0x1, 0x67, 0x64, 0x1c, 0x14, 0xac, 0x2c, 0xb0, 0x14, 0x1, 0x6e, 0xc0, 0x44, 0, 0, 0x3, 0, 0x4, 0, 0, 0x3, 0, 0xca, 0x3c, 0x20, 0x10, 0xa8, 0, 0, 0, 0x1, 0x68, 0xee, 0x6, 0xe2, 0xc0};
-
-static int get_video_extradata(AVFormatContext *s, int video_index)
-{ 
-    AVCodecParameters *codecpar = s->streams[video_index]->codecpar;
-    codecpar->extradata_size = data_size;
-    codecpar->extradata = (uint8_t*)av_malloc(data_size + AV_INPUT_BUFFER_PADDING_SIZE);
-    if (codecpar->extradata == NULL) {
-        printf("could not av_malloc the video params extradata!\n");
-        return -1;
+static LLLatencyStats latency;
+static int64_t frame_stamps[STAMP_RING][LL_STAGE_NB]; // indexed by pts
+static LLHistogram submit_delay;      // last byte received to avcodec_send_packet, us
+
+/*
+ * A stream joined mid-way, or one that lost frames, cannot be decoded
+ * before the next keyframe. From then until a frame is written out is
+ * the time a viewer sees nothing.
+ */
+static int64_t join_ns;             // when the stream was (re)joined, 0 once a frame is out
+static int joins;
+static LLHistogram join_time;       // to the first frame out, us
+
+static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
+{
+    int err = 0;
+
+    if (!hw_device_ctx && (err = av_hwdevice_ctx_create(&hw_device_ctx, type,
+                                                        NULL, NULL, 0)) < 0) {
+        fprintf(stderr, "Failed to create specified HW device.\n");
+        return err;
     }
-    memcpy(codecpar->extradata, sps_pps, data_size);
-   return 0;
+    ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+
+    return err;
 }
 
-int init_decode(AVFormatContext *s)
+
+/*
+ * Per-frame state reused across calls, so a running decoder does no
+ * frame-sized allocations: the downloaded frame comes from a pool that is
+ * rebuilt when the stream's size or format changes, and the output buffer
+ * only grows.
+ */
+static AVFrame *frame, *sw_frame;
+static LLFramePool out_pool;
+static uint8_t *out_buf;
+static unsigned int out_buf_size;
+static int64_t corrupt_frames;      // decoded with errors concealed
+
+/*
+ * The sender may step its resolution down and back up under load. The
+ * output keeps one size, that of the first frame or -z, and smaller
+ * frames are scaled back up to it, so whoever reads it never sees the
+ * geometry change.
+ */
+static int out_width, out_height;
+static LLFramePool scale_pool;
+static struct SwsContext *scaler;
+static AVFrame *scaled_frame;
+static int64_t scaled_frames;
+
+// With -s, frames go to a shared-memory ring instead of the output file
+static const char *shm_name;
+static int shm_slots = 4;
+static LLShmRing shm = { .fd = -1 };
+
+static int slices;                  // -S: RTP hands out slices as they complete
+static int jitter_budget;           // -J: ms the jitter buffer may hold RTP frames back, 0 for none
+static int demux;                   // -M: raw Annex-B through the h264 demuxer, as before ll_stream
+
+/*
+ * A reader on a pipe that falls behind must not hold up decoding: frames
+ * then go through a mailbox to an output thread that writes the newest
+ * one and skips the rest. Regular files, and -A, get every frame.
+ */
+static int write_all;
+static int use_mailbox;
+static LLMailbox mailbox;
+static pthread_t output_thread;
+static _Atomic int output_error;
+
+static int get_pool_buffer(LLFramePool *pool, const char *name, AVFrame *dst,
+                           enum AVPixelFormat format, int width, int height)
 {
-     s->iformat = av_find_input_format("h264");
-     int video_index = -1;
-     int ret = -1;
-
-     if (!s)
-          return ret;
-    
-    video_index = 0;
-
-    //Init the video codec(H264).
-     s->streams[video_index]->codecpar->codec_id = AV_CODEC_ID_H264;
-     ret = get_video_extradata(s, video_index);
-
-     /*Update the AVFormatContext Info*/
-     s->nb_streams = 1;
-    
-     return 0;
+    int ret;
+
+    if (pool->format != format || pool->width != width ||
+        pool->height != height || !pool->pool) {
+        if (pool->pool)
+            ll_frame_pool_print_stats(pool, name, stderr);
+        ll_frame_pool_uninit(pool);
+        if ((ret = ll_frame_pool_init(pool, format, width, height, 1)) < 0)
+            return ret;
+    }
+    return ll_frame_pool_get_buffer(pool, dst);
 }
 
-static int get_sps_pps(void* packet_data, unsigned char** metadata){
-    // This functon assumes that sps apperars before pps header
-    // Assume we can find sps pps 
-    char* buffer = (char*) packet_data;
-    int idx = 0;
-    int sps_begin = -1, sps_end = -1;
-    int pps_begin = -1, pps_end = -1;
-    char NALU_header[4] = {0x00, 0x00, 0x00, 0x01};
-    while(1){
-        if (!memcmp(buffer + idx, NALU_header, 4)){ // Find NALU Header
-            idx += 4;
-            if (*buffer == 0x67){ // sps
-                sps_begin = idx - 4;
-                while (memcmp(buffer + idx, NALU_header, 4)) idx++; // Iterate until next NALU Header
-                sps_end = idx;
-            } else if (*buffer == 0x68){// pps
-                pps_begin = idx - 4;
-                while (memcmp(buffer + idx, NALU_header, 4)) idx++; // Iterate until next NALU Header
-                pps_end = idx;
-                break;
-            }
-        } else idx++;
+// Point dst at the next ring slot; the ring is created on the first frame
+// and recreated, larger, if a frame no longer fits
+static int get_shm_buffer(AVFrame *dst, enum AVPixelFormat format, int width, int height)
+{
+    int size, ret;
+
+    if ((size = ll_shm_frame_size(format, width, height)) < 0) {
+        fprintf(stderr, "Cannot share %s frames\n", av_get_pix_fmt_name(format));
+        return size;
+    }
+    if (!shm.hdr || (uint32_t)size > shm.hdr->slot_size) {
+        ll_shm_close(&shm);
+        if ((ret = ll_shm_create(&shm, shm_name, shm_slots, size)) < 0) {
+            fprintf(stderr, "Failed to create shared memory '%s': %s\n", shm_name, av_err2str(ret));
+            return ret;
+        }
     }
-    int data_size = sps_end - sps_begin + pps_end - pps_begin;
-    *metadata = malloc(data_size);
-    memcpy(*metadata, buffer + sps_begin, sps_end - sps_begin);
-    memcpy(*metadata + sps_end - sps_begin, buffer + pps_begin, pps_end - pps_begin);
-    return data_size;
+    return ll_shm_begin(&shm, dst, format, width, height);
 }
 
-static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
+// Scale src up (or down) to the output size, into the ring with -s
+static int scale_frame(AVFrame *src, AVFrame **dst)
 {
-    int err = 0;
-
-    if ((err = av_hwdevice_ctx_create(&hw_device_ctx, type,
-                                      NULL, NULL, 0)) < 0) {
-        fprintf(stderr, "Failed to create specified HW device.\n");
-        return err;
+    int ret;
+
+    if (!(scaler = sws_getCachedContext(scaler, src->width, src->height, src->format,
+                                        out_width, out_height, src->format,
+                                        SWS_BILINEAR, NULL, NULL, NULL))) {
+        fprintf(stderr, "Cannot scale %dx%d %s frames\n", src->width, src->height,
+                av_get_pix_fmt_name(src->format));
+        return AVERROR(EINVAL);
     }
-    ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+    if (!scaled_frame && !(scaled_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    av_frame_unref(scaled_frame);
+    ret = shm_name ? get_shm_buffer(scaled_frame, src->format, out_width, out_height)
+                   : get_pool_buffer(&scale_pool, "Scale", scaled_frame, src->format, out_width, out_height);
+    if (ret < 0)
+        return ret;
+    sws_scale(scaler, (const uint8_t * const *)src->data, src->linesize, 0, src->height,
+              scaled_frame->data, scaled_frame->linesize);
+    scaled_frame->best_effort_timestamp = src->best_effort_timestamp;
+    scaled_frames++;
+    *dst = scaled_frame;
+    return 0;
+}
 
-    return err;
+static void *output_main(void *arg)
+{
+    LLMailboxSlot *s;
+
+    while ((s = ll_mailbox_take(&mailbox))) {
+        if (output_error)
+            continue;
+        if (fwrite(s->data, 1, s->size, output_file) != (size_t)s->size || fflush(output_file)) {
+            fprintf(stderr, "Failed to dump raw data.\n");
+            output_error = AVERROR(EIO);
+            continue;
+        }
+        ll_stamp(s->stamps, LL_STAGE_OUTPUT);
+        ll_latency_record(&latency, s->stamps);
+        ll_latency_tick(&latency);
+    }
+    return NULL;
 }
 
+// Write the frame out, or with the mailbox post it with its stamps
+static int write_frame(AVFrame *tmp_frame, const int64_t *stamps)
+{
+    LLMailboxSlot *slot = NULL;
+    uint8_t *buf;
+    int size, ret;
+
+    if (output_error)
+        return output_error;
+    size = av_image_get_buffer_size(tmp_frame->format, tmp_frame->width,
+                                    tmp_frame->height, 1);
+    if (use_mailbox) {
+        slot = ll_mailbox_back(&mailbox, size);
+        buf = slot ? slot->data : NULL;
+    } else {
+        av_fast_malloc(&out_buf, &out_buf_size, size);
+        buf = out_buf;
+    }
+    if (!buf) {
+        fprintf(stderr, "Can not alloc buffer\n");
+        return AVERROR(ENOMEM);
+    }
+    ret = av_image_copy_to_buffer(buf, size,
+                                  (const uint8_t * const *)tmp_frame->data,
+                                  (const int *)tmp_frame->linesize, tmp_frame->format,
+                                  tmp_frame->width, tmp_frame->height, 1);
+    if (ret < 0) {
+        fprintf(stderr, "Can not copy image to buffer\n");
+        return ret;
+    }
+    if (slot) {
+        slot->pts = tmp_frame->best_effort_timestamp;
+        memcpy(slot->stamps, stamps, sizeof(slot->stamps));
+        ll_mailbox_post(&mailbox);
+        return 0;
+    }
+
+    if ((ret = fwrite(out_buf, 1, size, output_file)) < 0) {
+        fprintf(stderr, "Failed to dump raw data.\n");
+        return ret;
+    }
+    fflush(output_file);
+    return 0;
+}
 
 static int decode_write(AVCodecContext *avctx, AVPacket *packet)
 {
-    AVFrame *frame = NULL, *sw_frame = NULL;
     AVFrame *tmp_frame = NULL;
-    uint8_t *buffer = NULL;
-    int size;
-    int ret = 0;
+    int64_t *stamps, receive_ns;
+    int scale, ret = 0;
 
+    if (packet->size) {
+        receive_ns = frame_stamps[packet->pts & (STAMP_RING - 1)][LL_STAGE_RECEIVE];
+        if (receive_ns)
+            ll_histogram_record(&submit_delay, (ll_realtime_ns() - receive_ns) / 1000);
+    }
     ret = avcodec_send_packet(avctx, packet);
     if (ret < 0) {
         fprintf(stderr, "Error during decoding\n");
         return ret;
     }
 
+    if ((!frame && !(frame = av_frame_alloc())) ||
+        (!sw_frame && !(sw_frame = av_frame_alloc()))) {
+        fprintf(stderr, "Can not alloc frame\n");
+        return AVERROR(ENOMEM);
+    }
+
     while (1) {
-        if (!(frame = av_frame_alloc()) || !(sw_frame = av_frame_alloc())) {
-            fprintf(stderr, "Can not alloc frame\n");
-            ret = AVERROR(ENOMEM);
-            goto fail;
-        }
+        av_frame_unref(frame);
+        av_frame_unref(sw_frame);
 
         ret = avcodec_receive_frame(avctx, frame);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            av_frame_free(&frame);
-            av_frame_free(&sw_frame);
             return 0;
         } else if (ret < 0) {
             fprintf(stderr, "Error while decoding\n");
-            goto fail;
+            return ret;
         }
+        stamps = frame_stamps[frame->best_effort_timestamp & (STAMP_RING - 1)];
+        ll_stamp(stamps, LL_STAGE_DECODE);
+        if ((frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags)
+            corrupt_frames++;
+        if (!out_width) {
+            out_width  = frame->width;
+            out_height = frame->height;
+        }
+        scale = frame->width != out_width || frame->height != out_height;
 
         if (frame->format == AV_PIX_FMT_VAAPI) {
-            /* retrieve data from GPU to CPU */
+            enum AVPixelFormat format = ((AVHWFramesContext *)frame->hw_frames_ctx->data)->sw_format;
+
+            /* retrieve data from GPU to CPU, straight into the ring with -s */
+            ret = shm_name && !scale ? get_shm_buffer(sw_frame, format, frame->width, frame->height)
+                                     : get_pool_buffer(&out_pool, "Download", sw_frame, format,
+                                                       frame->width, frame->height);
+            if (ret < 0) {
+                fprintf(stderr, "Can not alloc frame\n");
+                return ret;
+            }
             if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0) {
                 fprintf(stderr, "Error transferring the data to system memory\n");
-                goto fail;
+                return ret;
             }
+            ll_stamp(stamps, LL_STAGE_DOWNLOAD);
+            tmp_frame = sw_frame;
+        } else if (shm_name && !scale) {
+            if ((ret = get_shm_buffer(sw_frame, frame->format, frame->width, frame->height)) < 0 ||
+                (ret = av_frame_copy(sw_frame, frame)) < 0)
+                return ret;
             tmp_frame = sw_frame;
         } else
             tmp_frame = frame;
+        if (scale && (ret = scale_frame(tmp_frame, &tmp_frame)) < 0)
+            return ret;
 
-        size = av_image_get_buffer_size(tmp_frame->format, tmp_frame->width,
-                                        tmp_frame->height, 1);
-        buffer = av_malloc(size);
-        if (!buffer) {
-            fprintf(stderr, "Can not alloc buffer\n");
-            ret = AVERROR(ENOMEM);
-            goto fail;
-        }
-        ret = av_image_copy_to_buffer(buffer, size,
-                                      (const uint8_t * const *)tmp_frame->data,
-                                      (const int *)tmp_frame->linesize, tmp_frame->format,
-                                      tmp_frame->width, tmp_frame->height, 1);
-        if (ret < 0) {
-            fprintf(stderr, "Can not copy image to buffer\n");
-            goto fail;
+        if (shm_name)
+            ll_shm_publish(&shm, frame->best_effort_timestamp, stamps[LL_STAGE_CAPTURE]);
+        else if ((ret = write_frame(tmp_frame, stamps)) < 0)
+            return ret;
+        // With the mailbox, the output thread records the frames it writes
+        if (!use_mailbox) {
+            ll_stamp(stamps, LL_STAGE_OUTPUT);
+            ll_latency_record(&latency, stamps);
+            ll_latency_tick(&latency);
         }
+        memset(stamps, 0, sizeof(frame_stamps[0]));
 
-        if ((ret = fwrite(buffer, 1, size, output_file)) < 0) {
-            fprintf(stderr, "Failed to dump raw data.\n");
-            goto fail;
+        if (join_ns) {
+            int64_t t = ll_realtime_ns() - join_ns;
+
+            ll_histogram_record(&join_time, t / 1000);
+            fprintf(stderr, "%s: first frame %dx%d after %.1f ms\n", joins++ ? "Resynchronised" : "Joined",
+                    frame->width, frame->height, t / 1e6);
+            join_ns = 0;
         }
-        fflush(output_file);
-    fail:
-        av_frame_free(&frame);
-        av_frame_free(&sw_frame);
-        av_freep(&buffer);
-        if (ret < 0)
-            return ret;
     }
 }
 
-int main(int argc, char *argv[])
+// chunks: packets may hold part of a frame, as whole slices
+static int open_decoder(AVCodecContext **pctx, int codec, int chunks)
 {
     AVCodec *decoder = NULL;
+    int ret;
+
+    if (!(decoder = avcodec_find_decoder(ll_wire_codec_id(codec)))) {
+        fprintf(stderr, "Unsupported codec %d in stream\n", codec);
+        return AVERROR_DECODER_NOT_FOUND;
+    }
+    if (!(*pctx = avcodec_alloc_context3(decoder)))
+        return AVERROR(ENOMEM);
+
+    if ((ret = hw_decoder_init(*pctx, AV_HWDEVICE_TYPE_VAAPI)) < 0)
+        return ret;
+    // Output each frame as soon as it is decoded, without reorder delay
+    (*pctx)->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    if (chunks)
+        (*pctx)->flags2 |= AV_CODEC_FLAG2_CHUNKS;
+
+    if ((ret = avcodec_open2(*pctx, decoder, NULL)) < 0) {
+        fprintf(stderr, "Failed to open codec %s\n", decoder->name);
+        return ret;
+    }
+    return 0;
+}
+
+// Keep a copy of the latest parameter sets; 1 if they differ from the last ones
+static int set_params(uint8_t **params, unsigned int *alloc, int *size, const uint8_t *data, int len)
+{
+    if (*size == len && !memcmp(*params, data, len))
+        return 0;
+    av_fast_malloc(params, alloc, len);
+    if (!*params)
+        return AVERROR(ENOMEM);
+    memcpy(*params, data, len);
+    *size = len;
+    return 1;
+}
+
+/*
+ * Decode a byte stream from fd: the framed stream written by the
+ * encoders, or raw Annex-B. ll_stream splits it into frames without a
+ * demuxer or probing, and each one goes to the decoder as soon as its
+ * last byte is read. The wire header names the codec (H.264, HEVC or
+ * AV1) to decode; raw streams are H.264. Wire parameter sets are
+ * prepended to the frame that follows them unless it carries its own, as
+ * raw streams and AV1 do.
+ *
+ * Decoding starts at the first keyframe once parameter sets are known,
+ * wherever the stream was joined, and starts over at the next keyframe
+ * when frames went missing (a gap in the sequence numbers, a damaged
+ * header or a frame the decoder rejects). New parameter sets drain the
+ * decoder before the keyframe that uses them, which then reconfigures it
+ * in place, or replaces it when the codec changed; the output buffers
+ * follow the new frame size.
+ */
+static int decode_stream(int fd)
+{
     AVCodecContext *decoder_ctx = NULL;
-    AVFormatContext *input_ctx = NULL;
-    int video_stream, ret;
-    AVStream *video = NULL;
     AVPacket packet;
+    LLStreamReader reader;
+    LLWireHeader hdr;
+    const uint8_t *data;
+    uint8_t *pkt_buf = NULL, *params = NULL, *in_band_params = NULL;
+    unsigned int pkt_buf_size = 0, params_alloc = 0;
+    int size, params_size = 0, params_pending = 0, params_changed = 0;
+    int in_band, configured = 0, synced = 0, lost = 0, changes = 0;
+    unsigned int resyncs = 0;
+    uint32_t seq = 0;
+    uint64_t skipped = 0;
+    int ret;
+
+    if ((ret = ll_stream_open(&reader, fd)) < 0)
+        return ret;
 
-    AVDictionary *AV_Dict = NULL;
-    AVInputFormat *AV_in = NULL;
+    while ((ret = ll_stream_read(&reader, &hdr, &data, &size, -1)) >= 0) {
+        if (!synced && !join_ns)
+            join_ns = hdr.stamps[LL_STAGE_RECEIVE];
+        if (synced && (reader.resyncs != resyncs ||
+                       (hdr.type == LL_WIRE_FRAME && hdr.seq != seq && hdr.seq != seq + 1))) {
+            fprintf(stderr, "Lost frames before %u, waiting for a keyframe\n", hdr.seq);
+            synced = 0;
+            lost++;
+            join_ns = hdr.stamps[LL_STAGE_RECEIVE];
+        }
+        resyncs = reader.resyncs;
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
-        return -1;
-    }
+        if (hdr.type == LL_WIRE_PARAMS) {
+            if ((ret = set_params(&params, &params_alloc, &params_size, data, size)) < 0)
+                break;
+            params_changed |= ret;
+            params_pending = 1;
+            continue;
+        }
+        if (hdr.type != LL_WIRE_FRAME)
+            continue;
+        seq = hdr.seq;
+
+        // Raw streams and AV1 frames carry them in-band, ahead of keyframes
+        in_band = -1;
+        if ((hdr.flags & LL_WIRE_FLAG_KEYFRAME) &&
+            (in_band = ll_get_param_sets(ll_wire_codec_id(hdr.codec), data, size,
+                                         &in_band_params)) >= 0) {
+            ret = set_params(&params, &params_alloc, &params_size, in_band_params, in_band);
+            free(in_band_params);
+            in_band_params = NULL;
+            if (ret < 0)
+                break;
+            params_changed |= ret;
+        }
 
-    char *infilename = malloc(strlen(argv[1]) + 15), *outfilename = malloc(strlen(argv[2]) + 15);
+        if (!synced) {
+            // Nothing is decodable before a keyframe and the parameter sets it refers to
+            if (!(hdr.flags & LL_WIRE_FLAG_KEYFRAME) || !params_size) {
+                skipped++;
+                continue;
+            }
+            if (!decoder_ctx && (ret = open_decoder(&decoder_ctx, hdr.codec,
+                                                    hdr.flags & LL_WIRE_FLAG_SLICE)) < 0)
+                break;
+            // After a loss they may not come again before this keyframe: repeat them
+            params_pending = 1;
+            synced = 1;
+        }
+        // A frame with its own needs no copy ahead of it
+        if (in_band >= 0)
+            params_pending = 0;
+        if (params_changed && (hdr.flags & LL_WIRE_FLAG_KEYFRAME)) {
+            // Out with the frames of the old configuration first
+            if (configured) {
+                fprintf(stderr, "Parameter sets changed, reconfiguring the decoder\n");
+                av_init_packet(&packet);
+                packet.data = NULL;
+                packet.size = 0;
+                decode_write(decoder_ctx, &packet);
+                avcodec_flush_buffers(decoder_ctx);
+                changes++;
+                // The sender switched codecs: that takes another decoder
+                if (decoder_ctx->codec_id != ll_wire_codec_id(hdr.codec)) {
+                    avcodec_free_context(&decoder_ctx);
+                    if ((ret = open_decoder(&decoder_ctx, hdr.codec,
+                                            hdr.flags & LL_WIRE_FLAG_SLICE)) < 0)
+                        break;
+                }
+            }
+            configured = 1;
+            params_changed = 0;
+        }
 
-    ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to create a VAAPI device. Error code: %s\n", av_err2str(ret));
-        return -1;
+        av_init_packet(&packet);
+        if (params_pending) {
+            av_fast_padded_malloc(&pkt_buf, &pkt_buf_size, params_size + size);
+            if (!pkt_buf) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            memcpy(pkt_buf, params, params_size);
+            memcpy(pkt_buf + params_size, data, size);
+            packet.data = pkt_buf;
+            packet.size = params_size + size;
+            params_pending = 0;
+        } else {
+            packet.data = (uint8_t *)data;
+            packet.size = size;
+        }
+        packet.pts = packet.dts = hdr.pts;
+        packet.flags = (hdr.flags & LL_WIRE_FLAG_KEYFRAME) ? AV_PKT_FLAG_KEY : 0;
+        memcpy(frame_stamps[hdr.pts & (STAMP_RING - 1)], hdr.stamps, sizeof(hdr.stamps));
+
+        if ((ret = decode_write(decoder_ctx, &packet)) == AVERROR_INVALIDDATA) {
+            fprintf(stderr, "Frame %u rejected, waiting for a keyframe\n", hdr.seq);
+            avcodec_flush_buffers(decoder_ctx);
+            synced = 0;
+            lost++;
+            join_ns = ll_realtime_ns();
+        } else if (ret < 0)
+            break;
     }
 
-    if (!strcmp(argv[1], "-")){
-        strcpy(infilename, "/dev/stdin");
-        fread(&data_size, sizeof(data_size), 1, stdin);
-        sps_pps =  malloc(data_size);
-        fread(sps_pps, sizeof(char), data_size, stdin);
-        AV_in = av_find_input_format("h264");
-        // Buffer has the right size in stdin
-    }
-    else{
-        strcpy(infilename, argv[1]);
-        // TODO Find sps pps mannually
-        FILE* fin;
-        fin = fopen(infilename, "r");
-        unsigned char buffer[300];
-        fread(buffer, 300, 1, fin);
-        data_size = get_sps_pps(buffer, &sps_pps);
-        fclose(fin);
+    /* flush the decoder */
+    if (decoder_ctx) {
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+        decode_write(decoder_ctx, &packet);
     }
 
-    av_dict_set(&AV_Dict, "format_probesize", "0", 0);
+    ll_stream_print_stats(&reader, stderr);
+    fprintf(stderr, "Sync: %d losses, %d parameter set changes, %llu frames skipped before keyframes",
+            lost, changes, (unsigned long long)skipped);
+    if (join_time.count)
+        fprintf(stderr, ", first frame after p50 %.1f max %.1f ms",
+                ll_histogram_percentile(&join_time, 50) / 1e3, join_time.max / 1e3);
+    fprintf(stderr, "\n");
+    ll_stream_close(&reader);
+    avcodec_free_context(&decoder_ctx);
+    av_free(pkt_buf);
+    av_free(params);
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+/*
+ * -M: the earlier path for raw Annex-B, kept to compare against. The h264
+ * demuxer and its parser read through a blocking AVIO callback that only
+ * logs when bytes come in, so that the receive stamp means the same as
+ * with ll_stream.
+ */
+#define DEMUX_IO_SIZE 32768
+
+typedef struct DemuxInput {
+    int fd;
+    uint64_t pos;
+    LLArrivalLog arrivals;
+} DemuxInput;
 
-    /* open the input file */
-    if (avformat_open_input(&input_ctx, infilename, AV_in, &AV_Dict) != 0) {
-        fprintf(stderr, "Cannot open input file '%s'\n", infilename);
-        return -1;
+static int demux_read(void *opaque, uint8_t *buf, int size)
+{
+    DemuxInput *in = opaque;
+    ssize_t n;
+
+    while ((n = read(in->fd, buf, size)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return AVERROR(errno);
+    if (!n)
+        return AVERROR_EOF;
+    in->pos += n;
+    ll_arrival_log_add(&in->arrivals, in->pos, ll_realtime_ns());
+    return n;
+}
+
+static int decode_demux(int fd)
+{
+    AVFormatContext *input_ctx = NULL;
+    AVCodecContext *decoder_ctx = NULL;
+    AVIOContext *pb = NULL;
+    DemuxInput in = { .fd = fd };
+    AVPacket packet;
+    uint8_t *io_buf;
+    int64_t pts = 0, *stamps;
+    int ret;
+
+    if (!(io_buf = av_malloc(DEMUX_IO_SIZE)))
+        return AVERROR(ENOMEM);
+    if (!(pb = avio_alloc_context(io_buf, DEMUX_IO_SIZE, 0, &in, demux_read, NULL, NULL))) {
+        av_free(io_buf);
+        return AVERROR(ENOMEM);
     }
-    // input_ctx->flags = AVFMT_FLAG_AUTO_BSF + AVFMT_FLAG_NONBLOCK;
-    if (init_decode(input_ctx) < 0) {
-        fprintf(stderr, "Cannot find input stream information.\n");
-        return -1;
+    if (!(input_ctx = avformat_alloc_context())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    input_ctx->pb = pb;
+    if ((ret = avformat_open_input(&input_ctx, NULL, av_find_input_format("h264"), NULL)) < 0) {
+        fprintf(stderr, "Cannot open the input: %s\n", av_err2str(ret));
+        goto end;
+    }
+    if ((ret = open_decoder(&decoder_ctx, LL_WIRE_CODEC_H264, 0)) < 0)
+        goto end;
+
+    while ((ret = av_read_frame(input_ctx, &packet)) >= 0) {
+        stamps = frame_stamps[pts & (STAMP_RING - 1)];
+        stamps[LL_STAGE_RECEIVE] = ll_arrival_log_find(&in.arrivals, packet.pos >= 0 ?
+                                                       packet.pos + packet.size - 1 : in.pos - 1);
+        packet.pts = packet.dts = pts++;
+        ret = decode_write(decoder_ctx, &packet);
+        av_packet_unref(&packet);
+        if (ret < 0)
+            break;
     }
 
-    /* find the video stream information */
-    ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Cannot find a video stream in the input file\n");
-        return -1;
+    /* flush the decoder */
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    decode_write(decoder_ctx, &packet);
+
+end:
+    avcodec_free_context(&decoder_ctx);
+    avformat_close_input(&input_ctx);
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Decode one frame from RTP, asking for a keyframe when it is damaged
+static int decode_rtp_frame(AVCodecContext *decoder_ctx, LLRtpReceiver *rtp,
+                            const LLWireHeader *hdr, uint8_t *data, int size)
+{
+    AVPacket packet;
+    int64_t corrupt;
+    int ret;
+
+    av_init_packet(&packet);
+    packet.data = data;
+    packet.size = size;
+    packet.pts = packet.dts = hdr->pts;
+    packet.flags = (hdr->flags & LL_WIRE_FLAG_KEYFRAME) ? AV_PKT_FLAG_KEY : 0;
+    memcpy(frame_stamps[hdr->pts & (STAMP_RING - 1)], hdr->stamps, sizeof(hdr->stamps));
+
+    // Past what the decoder can conceal: have the sender start over
+    corrupt = corrupt_frames;
+    if ((ret = decode_write(decoder_ctx, &packet)) == AVERROR_INVALIDDATA ||
+        corrupt_frames != corrupt) {
+        ll_rtp_request_keyframe(rtp);
+        return 0;
     }
-    video_stream = 0;
+    return ret;
+}
 
-    if (!(decoder_ctx = avcodec_alloc_context3(decoder)))
-        return AVERROR(ENOMEM);
+/*
+ * Receive RTP over UDP. Access units arrive whole, with in-band parameter
+ * sets, and only once a keyframe has been seen; frames damaged by packet
+ * loss are dropped by the receiver instead of stalling the stream. With
+ * -S, slices are decoded as they arrive. With -J, whole frames go through
+ * a jitter buffer that evens out the network delay, and skips ahead when
+ * the output falls more than the budget behind.
+ */
+static int decode_rtp(const char *url)
+{
+    AVCodecContext *decoder_ctx = NULL;
+    AVPacket packet;
+    LLRtpReceiver rtp;
+    LLJitterBuffer jb;
+    LLJitterFrame *f;
+    LLWireHeader hdr;
+    uint8_t *data;
+    int64_t wait;
+    int size, timeout, ret;
+
+    if ((ret = ll_rtp_receiver_open(&rtp, url)) < 0)
+        return ret;
 
-    video = input_ctx->streams[video_stream];
-    if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
-        return -1;
+    rtp.slices = slices;
+    ll_jitter_init(&jb, jitter_budget * 1000000LL);
+    while (1) {
+        timeout = -1;
+        if (jitter_budget) {
+            ret = 0;
+            while ((f = ll_jitter_get(&jb, ll_realtime_ns(), &wait)) &&
+                   (ret = decode_rtp_frame(decoder_ctx, &rtp, &f->hdr, f->data, f->size)) >= 0)
+                ;
+            if (ret < 0)
+                break;
+            if (jb.need_keyframe) {
+                ll_rtp_request_keyframe(&rtp);
+                jb.need_keyframe = 0;
+            }
+            if (wait >= 0)
+                timeout = (wait + 999999) / 1000000;
+        }
+
+        ret = ll_rtp_receive(&rtp, &hdr, &data, &size, timeout);
+        if (ret == AVERROR(EAGAIN))
+            continue;
+        if (ret == AVERROR_INVALIDDATA) {
+            // The rest of a frame we started decoding was lost
+            if (decoder_ctx)
+                avcodec_flush_buffers(decoder_ctx);
+            continue;
+        }
+        if (ret < 0)
+            break;
+        ll_stamp(hdr.stamps, LL_STAGE_RECEIVE);
+        if (!decoder_ctx && (ret = open_decoder(&decoder_ctx, hdr.codec, slices)) < 0)
+            break;
+
+        if (jitter_budget)
+            ret = ll_jitter_put(&jb, &hdr, data, size, hdr.stamps[LL_STAGE_RECEIVE]);
+        else
+            ret = decode_rtp_frame(decoder_ctx, &rtp, &hdr, data, size);
+        if (ret < 0)
+            break;
+    }
 
+    /* drain the jitter buffer and flush the decoder */
+    if (decoder_ctx) {
+        while (ret == AVERROR_EOF && (f = ll_jitter_pop(&jb)))
+            decode_rtp_frame(decoder_ctx, &rtp, &f->hdr, f->data, f->size);
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+        decode_write(decoder_ctx, &packet);
+    }
 
-    if (hw_decoder_init(decoder_ctx, AV_HWDEVICE_TYPE_VAAPI) < 0)
+    if (jitter_budget)
+        ll_jitter_print_stats(&jb, stderr);
+    ll_jitter_free(&jb);
+    ll_rtp_print_stats(&rtp.stats, "RTP", stderr);
+    ll_rtp_receiver_close(&rtp);
+    avcodec_free_context(&decoder_ctx);
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int fd, ret;
+    double report_interval = 5;
+    const char *export_name = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:j:s:n:SJ:AMz:")) != -1) {
+        switch (opt) {
+        case 'r':
+            report_interval = atof(optarg);
+            break;
+        case 'j':
+            export_name = optarg;
+            break;
+        case 's':
+            shm_name = optarg;
+            break;
+        case 'n':
+            shm_slots = atoi(optarg);
+            break;
+        case 'S':
+            slices = 1;
+            break;
+        case 'J':
+            jitter_budget = atoi(optarg);
+            break;
+        case 'A':
+            write_all = 1;
+            break;
+        case 'M':
+            demux = 1;
+            break;
+        case 'z':
+            if (sscanf(optarg, "%dx%d", &out_width, &out_height) != 2 ||
+                out_width <= 0 || out_height <= 0)
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    // The output file is not needed when frames go to shared memory
+    if (argc < (shm_name ? 2 : 3) || shm_slots < 2 || jitter_budget < 0 || (jitter_budget && slices)) {
+usage:
+        fprintf(stderr, "Usage: %s [-r report seconds] [-j latency.json] [-S|-J budget ms] [-A] [-M] [-z WxH] <input file|-|rtp://[host]:port> <output file>\n"
+                        "       %s [-r report seconds] [-j latency.json] [-S|-J budget ms] [-M] [-z WxH] -s shm name [-n slots] <input file|-|rtp://[host]:port>\n",
+                argv[0], argv[0]);
         return -1;
+    }
 
-    if ((ret = avcodec_open2(decoder_ctx, decoder, NULL)) < 0) {
-        fprintf(stderr, "Failed to open codec for stream #%u\n", video_stream);
+    ll_latency_init(&latency, report_interval * 1e9);
+    ll_histogram_reset(&submit_delay);
+    ll_histogram_reset(&join_time);
+    if (export_name && !(latency.export = fopen(export_name, "a"))) {
+        fprintf(stderr, "Cannot open '%s'\n", export_name);
         return -1;
     }
 
-    if (!strcmp(argv[2], "-")) strcpy(outfilename, "/dev/stdout");
-    else strcpy(outfilename, argv[2]);
-    /* open the file to dump raw data */
-    output_file = fopen(outfilename, "w+");
+    char *outfilename = NULL;
 
-    /* actual decoding and dump the raw data */
-    while (ret >= 0) {
-        if ((ret = av_read_frame(input_ctx, &packet)) < 0)
-            break;
-        if (video_stream == packet.stream_index)
-            ret = decode_write(decoder_ctx, &packet);
-        av_packet_unref(&packet);
+    ret = av_hwdevice_ctx_create(&hw_device_ctx, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to create a VAAPI device. Error code: %s\n", av_err2str(ret));
+        return -1;
     }
 
-    /* flush the decoder */
-    packet.data = NULL;
-    packet.size = 0;
-    ret = decode_write(decoder_ctx, &packet);
-    av_packet_unref(&packet);
+    if (!shm_name) {
+        outfilename = malloc(strlen(argv[2]) + 15);
+        if (!strcmp(argv[2], "-")) strcpy(outfilename, "/dev/stdout");
+        else strcpy(outfilename, argv[2]);
+        /* open the file to dump raw data */
+        if (!(output_file = fopen(outfilename, "w+"))) {
+            fprintf(stderr, "Cannot open output file '%s'\n", outfilename);
+            return -1;
+        }
+        struct stat st;
+        if (!write_all && !fstat(fileno(output_file), &st) && !S_ISREG(st.st_mode)) {
+            if ((ret = ll_mailbox_init(&mailbox)) < 0 ||
+                (ret = pthread_create(&output_thread, NULL, output_main, NULL))) {
+                fprintf(stderr, "Failed to start the output thread\n");
+                return -1;
+            }
+            use_mailbox = 1;
+        }
+    }
 
+    if (ll_rtp_is_url(argv[1])) {
+        ret = decode_rtp(argv[1]);
+    } else {
+        // stdin, framed files and raw Annex-B are all read alike
+        if (!strcmp(argv[1], "-"))
+            fd = STDIN_FILENO;
+        else if ((fd = open(argv[1], O_RDONLY)) < 0) {
+            fprintf(stderr, "Cannot open input file '%s'\n", argv[1]);
+            return -1;
+        }
+        ret = demux ? decode_demux(fd) : decode_stream(fd);
+        if (fd != STDIN_FILENO)
+            close(fd);
+    }
+    if (ret < 0)
+        fprintf(stderr, "Decoding failed: %s\n", av_err2str(ret));
+
+    if (use_mailbox) {
+        ll_mailbox_close(&mailbox);
+        pthread_join(output_thread, NULL);
+        ll_mailbox_print_stats(&mailbox, "Output", stderr);
+        ll_mailbox_free(&mailbox);
+    }
+    ll_frame_pool_print_stats(&out_pool, "Download", stderr);
+    if (scaled_frames)
+        fprintf(stderr, "Scaled %lld frames to %dx%d\n", (long long)scaled_frames, out_width, out_height);
+    ll_latency_print(&latency, stderr);
+    if (submit_delay.count)
+        fprintf(stderr, "Receive to submit: %llu packets, p50 %.3f p99 %.3f max %.3f ms\n",
+                (unsigned long long)submit_delay.count,
+                ll_histogram_percentile(&submit_delay, 50) / 1e3,
+                ll_histogram_percentile(&submit_delay, 99) / 1e3, submit_delay.max / 1e3);
+    if (latency.export) {
+        ll_latency_export(&latency, latency.export);
+        fclose(latency.export);
+    }
     if (output_file)
         fclose(output_file);
-    avcodec_free_context(&decoder_ctx);
-    avformat_close_input(&input_ctx);
+    av_frame_free(&frame);
+    av_frame_free(&sw_frame);
+    ll_frame_pool_uninit(&out_pool);
+    ll_frame_pool_uninit(&scale_pool);
+    av_frame_free(&scaled_frame);
+    sws_freeContext(scaler);
+    av_freep(&out_buf);
+    ll_shm_close(&shm);
     av_buffer_unref(&hw_device_ctx);
-    free(infilename);
     free(outfilename);
 
     return 0;